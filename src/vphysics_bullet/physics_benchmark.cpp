@@ -0,0 +1,1244 @@
+// Copyright Valve Corporation, All rights reserved.
+// Bullet integration by Triang3l, derivative work, in public domain if detached from Valve's work.
+
+#include "physics_internal.h"
+#include "physics_collide.h"
+#include "physics_material.h"
+#include "physics_threads.h"
+#include "vphysics/constraints.h"
+#include "vphysics/vehicles.h"
+#include "filesystem.h"
+#include "tier0/fasttimer.h"
+#include "tier1/convar.h"
+#include "tier1/interface.h"
+#include "tier1/strtools.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/utlvector.h"
+
+// Canned scene stepped in a separate environment for measuring simulation performance without game entities.
+class CPhysicsBenchmark {
+public:
+	enum Scene_t {
+		SCENE_STACKS,
+		SCENE_PILE,
+		SCENE_CHAINS,
+		SCENE_VEHICLES,
+
+		SCENE_COUNT
+	};
+	static const char * const s_SceneNames[SCENE_COUNT];
+
+	CPhysicsBenchmark(IPhysics *physics, Scene_t scene);
+	~CPhysicsBenchmark();
+
+	// Prints the results as a JSON object.
+	void Run(int tickCount);
+
+private:
+	IPhysics *m_Physics;
+	IPhysicsEnvironment *m_Environment;
+	Scene_t m_Scene;
+	int m_MaterialIndex;
+	int m_SetupAllocationCount;
+
+	CUtlVector<CPhysCollide *> m_Collides;
+	CUtlVector<IPhysicsVehicleController *> m_Vehicles;
+
+	CPhysCollide *CreateBox(const Vector &halfExtents);
+	IPhysicsObject *CreateObject(CPhysCollide *collide, float mass, const Vector &position);
+
+	void CreateGround();
+	void CreateStacks();
+	void CreatePile();
+	void CreateChains();
+	void CreateVehicles();
+};
+
+const char * const CPhysicsBenchmark::s_SceneNames[SCENE_COUNT] = {
+	"stacks",
+	"pile",
+	"chains",
+	"vehicles"
+};
+
+CPhysicsBenchmark::CPhysicsBenchmark(IPhysics *physics, Scene_t scene) :
+		m_Physics(physics), m_Scene(scene) {
+	BeginPhysicsAllocationCounting();
+	int allocationCount = g_PhysicsAllocationCount;
+
+	m_Environment = physics->CreateEnvironment();
+	m_Environment->SetGravity(Vector(0.0f, 0.0f, -600.0f));
+	m_MaterialIndex = MAX(g_pPhysSurfaceProps->GetSurfaceIndex("default"), 0);
+
+	CreateGround();
+	switch (scene) {
+	case SCENE_STACKS:
+		CreateStacks();
+		break;
+	case SCENE_PILE:
+		CreatePile();
+		break;
+	case SCENE_CHAINS:
+		CreateChains();
+		break;
+	case SCENE_VEHICLES:
+		CreateVehicles();
+		break;
+	}
+
+	m_SetupAllocationCount = g_PhysicsAllocationCount - allocationCount;
+}
+
+CPhysicsBenchmark::~CPhysicsBenchmark() {
+	for (int vehicleIndex = 0; vehicleIndex < m_Vehicles.Count(); ++vehicleIndex) {
+		m_Environment->DestroyVehicleController(m_Vehicles[vehicleIndex]);
+	}
+	m_Physics->DestroyEnvironment(m_Environment);
+	for (int collideIndex = 0; collideIndex < m_Collides.Count(); ++collideIndex) {
+		g_pPhysCollision->DestroyCollide(m_Collides[collideIndex]);
+	}
+	EndPhysicsAllocationCounting();
+}
+
+CPhysCollide *CPhysicsBenchmark::CreateBox(const Vector &halfExtents) {
+	CPhysCollide *collide = g_pPhysCollision->BBoxToCollide(-halfExtents, halfExtents);
+	m_Collides.AddToTail(collide);
+	return collide;
+}
+
+IPhysicsObject *CPhysicsBenchmark::CreateObject(CPhysCollide *collide, float mass, const Vector &position) {
+	objectparams_t params;
+	memset(&params, 0, sizeof(params));
+	params.mass = mass;
+	params.inertia = 1.0f;
+	params.rotInertiaLimit = 0.05f;
+	params.pName = "Benchmark";
+	params.volume = g_pPhysCollision->CollideVolume(collide);
+	params.dragCoefficient = 1.0f;
+	params.enableCollisions = true;
+	IPhysicsObject *object;
+	if (mass > 0.0f) {
+		object = m_Environment->CreatePolyObject(collide, m_MaterialIndex, position, vec3_angle, &params);
+		object->Wake();
+	} else {
+		object = m_Environment->CreatePolyObjectStatic(collide, m_MaterialIndex, position, vec3_angle, &params);
+	}
+	return object;
+}
+
+void CPhysicsBenchmark::CreateGround() {
+	CreateObject(CreateBox(Vector(4096.0f, 4096.0f, 64.0f)), 0.0f, Vector(0.0f, 0.0f, -64.0f));
+}
+
+void CPhysicsBenchmark::CreateStacks() {
+	CPhysCollide *box = CreateBox(Vector(8.0f, 8.0f, 8.0f));
+	for (int stackIndex = 0; stackIndex < 16; ++stackIndex) {
+		Vector base((float) (stackIndex & 3) * 64.0f, (float) (stackIndex >> 2) * 64.0f, 8.0f);
+		for (int boxIndex = 0; boxIndex < 16; ++boxIndex) {
+			CreateObject(box, 20.0f, base + Vector(0.0f, 0.0f, (float) boxIndex * 16.0f));
+		}
+	}
+}
+
+void CPhysicsBenchmark::CreatePile() {
+	CPhysCollide *boxes[3] = {
+		CreateBox(Vector(6.0f, 6.0f, 6.0f)),
+		CreateBox(Vector(12.0f, 8.0f, 4.0f)),
+		CreateBox(Vector(4.0f, 4.0f, 16.0f))
+	};
+	// 5000 props dropped in layers, each layer slightly shifted so they don't land exactly on top of each other.
+	int propIndex = 0;
+	for (int layer = 0; layer < 10; ++layer) {
+		float layerShift = (float) (layer & 1) * 9.0f;
+		for (int row = 0; row < 20; ++row) {
+			for (int column = 0; column < 25; ++column, ++propIndex) {
+				Vector position((float) column * 36.0f + layerShift, (float) row * 36.0f + layerShift,
+						24.0f + (float) layer * 36.0f);
+				CreateObject(boxes[propIndex % 3], 10.0f + (float) (propIndex % 7) * 5.0f, position);
+			}
+		}
+	}
+}
+
+void CPhysicsBenchmark::CreateChains() {
+	CPhysCollide *anchorBox = CreateBox(Vector(4.0f, 4.0f, 4.0f));
+	CPhysCollide *linkBox = CreateBox(Vector(3.0f, 3.0f, 6.0f));
+	for (int chainIndex = 0; chainIndex < 40; ++chainIndex) {
+		Vector top((float) (chainIndex % 8) * 48.0f, (float) (chainIndex / 8) * 48.0f, 400.0f);
+		IPhysicsObject *previous = CreateObject(anchorBox, 0.0f, top);
+		for (int linkIndex = 0; linkIndex < 25; ++linkIndex) {
+			// Horizontal so the chain swings down.
+			Vector jointPosition = top + Vector((float) linkIndex * 12.0f + 4.0f, 0.0f, 0.0f);
+			IPhysicsObject *link = CreateObject(linkBox, 5.0f, jointPosition + Vector(6.0f, 0.0f, 0.0f));
+			// Ragdoll-like alternation of joint types.
+			if (linkIndex & 1) {
+				constraint_hingeparams_t hinge;
+				hinge.Defaults();
+				hinge.worldPosition = jointPosition;
+				hinge.worldAxisDirection.Init(0.0f, 1.0f, 0.0f);
+				m_Environment->CreateHingeConstraint(previous, link, nullptr, hinge);
+			} else {
+				constraint_ballsocketparams_t ballsocket;
+				ballsocket.Defaults();
+				ballsocket.InitWithCurrentObjectState(previous, link, jointPosition);
+				m_Environment->CreateBallsocketConstraint(previous, link, nullptr, ballsocket);
+			}
+			previous = link;
+		}
+	}
+}
+
+void CPhysicsBenchmark::CreateVehicles() {
+	CPhysCollide *body = CreateBox(Vector(36.0f, 60.0f, 16.0f));
+
+	vehicleparams_t params;
+	memset(&params, 0, sizeof(params));
+	params.axleCount = 2;
+	params.wheelsPerAxle = 2;
+	params.body.maxAngularVelocity = 720.0f;
+	for (int axleIndex = 0; axleIndex < 2; ++axleIndex) {
+		vehicle_axleparams_t &axle = params.axles[axleIndex];
+		axle.offset.Init(0.0f, axleIndex ? -44.0f : 44.0f, -12.0f);
+		axle.wheelOffset.Init(36.0f, 0.0f, 0.0f);
+		axle.wheels.radius = 16.0f;
+		axle.wheels.mass = 50.0f;
+		axle.wheels.inertia = 0.5f;
+		axle.wheels.frictionScale = 1.5f;
+		axle.wheels.materialIndex = m_MaterialIndex;
+		axle.wheels.brakeMaterialIndex = m_MaterialIndex;
+		axle.wheels.skidMaterialIndex = m_MaterialIndex;
+		axle.suspension.springConstant = 80.0f;
+		axle.suspension.springDamping = 0.5f;
+		axle.suspension.springDampingCompression = 0.5f;
+		axle.suspension.maxBodyForce = 200.0f;
+		axle.torqueFactor = 0.5f;
+		axle.brakeFactor = 0.5f;
+	}
+
+	for (int vehicleIndex = 0; vehicleIndex < 32; ++vehicleIndex) {
+		Vector position((float) (vehicleIndex & 7) * 160.0f, (float) (vehicleIndex >> 3) * 200.0f, 48.0f);
+		IPhysicsObject *bodyObject = CreateObject(body, 1500.0f, position);
+		IPhysicsVehicleController *vehicle = m_Environment->CreateVehicleController(
+				bodyObject, params, VEHICLE_TYPE_CAR_WHEELS, nullptr);
+		if (vehicle != nullptr) {
+			m_Vehicles.AddToTail(vehicle);
+		}
+	}
+}
+
+static int BenchmarkFloatCompare(const float *a, const float *b) {
+	return (*a > *b) - (*a < *b);
+}
+
+void CPhysicsBenchmark::Run(int tickCount) {
+	float timeStep = m_Environment->GetSimulationTimestep();
+	CUtlVector<float> tickTimes;
+	tickTimes.EnsureCapacity(tickCount);
+	int activeObjectTotal = 0, activeObjectMax = 0;
+
+	int allocationCount = g_PhysicsAllocationCount;
+	for (int tick = 0; tick < tickCount; ++tick) {
+		CFastTimer timer;
+		timer.Start();
+		m_Environment->Simulate(timeStep);
+		timer.End();
+		tickTimes.AddToTail((float) timer.GetDuration().GetMillisecondsF());
+		int activeObjectCount = m_Environment->GetActiveObjectCount();
+		activeObjectTotal += activeObjectCount;
+		activeObjectMax = MAX(activeObjectMax, activeObjectCount);
+	}
+	allocationCount = g_PhysicsAllocationCount - allocationCount;
+	int objectCount;
+	m_Environment->GetObjectList(&objectCount);
+
+	float timeTotal = 0.0f;
+	for (int tick = 0; tick < tickCount; ++tick) {
+		timeTotal += tickTimes[tick];
+	}
+	tickTimes.Sort(BenchmarkFloatCompare);
+	float percentiles[3];
+	static const float percentileFractions[3] = { 0.5f, 0.9f, 0.99f };
+	for (int percentileIndex = 0; percentileIndex < 3; ++percentileIndex) {
+		percentiles[percentileIndex] =
+				tickTimes[(int) (percentileFractions[percentileIndex] * (float) (tickCount - 1) + 0.5f)];
+	}
+
+	Msg("{\"scene\":\"%s\",\"objects\":%d,\"ticks\":%d,"
+			"\"ms_per_tick\":{\"avg\":%.4f,\"min\":%.4f,\"p50\":%.4f,\"p90\":%.4f,\"p99\":%.4f,\"max\":%.4f},"
+			"\"active_objects\":{\"avg\":%.1f,\"max\":%d,\"final\":%d},"
+			"\"allocations\":{\"setup\":%d,\"simulation\":%d,\"per_tick\":%.2f}}\n",
+			s_SceneNames[m_Scene], objectCount, tickCount,
+			timeTotal / (float) tickCount, tickTimes[0], percentiles[0], percentiles[1], percentiles[2],
+			tickTimes[tickCount - 1],
+			(float) activeObjectTotal / (float) tickCount, activeObjectMax, m_Environment->GetActiveObjectCount(),
+			m_SetupAllocationCount, allocationCount, (float) allocationCount / (float) tickCount);
+}
+
+// The argument at the index if it's present, otherwise the default. Prints why the count is invalid if it's not positive.
+static bool GetCountArgument(const CCommand &args, int argIndex, int defaultCount, const char *countName, int &count) {
+	count = (args.ArgC() > argIndex ? V_atoi(args[argIndex]) : defaultCount);
+	if (count <= 0) {
+		Warning("%s: the %s must be a positive number.\n", args[0], countName);
+		return false;
+	}
+	return true;
+}
+
+// Prints one line saying whether the check has passed, with what has failed if it hasn't.
+static void ReportCheckResult(const CCommand &args, int failureCount, const char *failureDescription) {
+	if (failureCount == 0) {
+		Msg("%s: PASSED\n", args[0]);
+	} else {
+		Warning("%s: FAILED - %d %s.\n", args[0], failureCount, failureDescription);
+	}
+}
+
+CON_COMMAND(physics_bullet_benchmark, "Simulate a canned scene in a new environment and print the timings as JSON. "
+		"Usage: physics_bullet_benchmark <stacks|pile|chains|vehicles|all> [ticks, 600 by default].") {
+	if (args.ArgC() < 2) {
+		Msg("Usage: physics_bullet_benchmark <stacks|pile|chains|vehicles|all> [ticks]\n");
+		return;
+	}
+	int tickCount;
+	if (!GetCountArgument(args, 2, 600, "tick count", tickCount)) {
+		return;
+	}
+	IPhysics *physics = reinterpret_cast<IPhysics *>(Sys_GetFactoryThis()(VPHYSICS_INTERFACE_VERSION, nullptr));
+	bool all = (V_stricmp(args[1], "all") == 0);
+	bool found = false;
+	for (int scene = 0; scene < CPhysicsBenchmark::SCENE_COUNT; ++scene) {
+		if (!all && V_stricmp(args[1], CPhysicsBenchmark::s_SceneNames[scene]) != 0) {
+			continue;
+		}
+		found = true;
+		CPhysicsBenchmark benchmark(physics, (CPhysicsBenchmark::Scene_t) scene);
+		benchmark.Run(tickCount);
+	}
+	if (!found) {
+		Warning("Unknown scene %s.\n", args[1]);
+	}
+}
+
+/*********************************
+ * Collision query microbenchmarks
+ *********************************/
+
+// Times individual calls of frequently used queries, with deterministic pseudorandom inputs.
+class CPhysicsMicrobenchmark {
+public:
+	CPhysicsMicrobenchmark();
+	~CPhysicsMicrobenchmark();
+
+	// Prints one JSON object per case. The model is loaded from a .phy file in the game file system if the path is not null.
+	// Returns the number of allocations done by the traces and the contact tests after warming up, which must be 0.
+	int Run(int iterationCount, const char *modelPath);
+
+	// Does the queries concurrently on all physics threads, each with its own thread context,
+	// and returns the number of results different from the ones done serially.
+	int RunThreadStress(int iterationCount);
+
+	// Compares the traces and the box-cone tests done analytically with the generic ones,
+	// and returns the number of results hitting differently.
+	int RunAnalyticCheck();
+
+	// Writes the collideables in the Bullet format, loads them back and returns the number of properties
+	// different from the originals. The model is loaded from a .phy file in the game file system if the path is not null,
+	// and not being able to load it is also a failure.
+	int RunCollideRoundTrip(const char *modelPath);
+
+private:
+	enum {
+		INPUT_COUNT = 1024 // Power of 2.
+	};
+
+	typedef void (*Case_t)(CPhysicsMicrobenchmark *benchmark, int iteration);
+	// Returns the number of allocations done in the timed iterations.
+	int RunCase(const char *name, Case_t function, int iterationCount,
+			int operationsPerIteration = 1, bool warmUp = true);
+
+	CPhysCollide *m_Box, *m_Hull, *m_Compound;
+	Vector m_RayStarts[INPUT_COUNT], m_RayEnds[INPUT_COUNT];
+	QAngle m_Angles[INPUT_COUNT];
+	truncatedcone_t m_Cones[INPUT_COUNT];
+	trace_t m_Trace;
+	unsigned int m_RandomState;
+	float RandomFloat(float minValue, float maxValue);
+
+	IPhysicsObjectPairHash *m_PairHash;
+	static void *GetPairHashObject(int iteration, int object);
+
+	// The model in the vcollide_t format.
+	CUtlVector<char> m_ModelData;
+	int m_ModelSolidCount;
+	bool LoadModel(const char *path);
+	// The model in the vcollide_t format with the solids converted to the Bullet format.
+	CUtlVector<char> m_BulletModelData;
+	bool ConvertModelToBullet();
+
+	static void TraceRay(CPhysicsMicrobenchmark *benchmark, int iteration);
+	static void TraceRayHull(CPhysicsMicrobenchmark *benchmark, int iteration);
+	static void TraceBoxSwept(CPhysicsMicrobenchmark *benchmark, int iteration);
+	static void TraceBoxUnswept(CPhysicsMicrobenchmark *benchmark, int iteration);
+	static void TraceBoxCompound(CPhysicsMicrobenchmark *benchmark, int iteration);
+	static void TraceCollide(CPhysicsMicrobenchmark *benchmark, int iteration);
+	static void TraceCollideCompound(CPhysicsMicrobenchmark *benchmark, int iteration);
+	static void TraceCollideUnswept(CPhysicsMicrobenchmark *benchmark, int iteration);
+	static void IsBoxIntersectingCone(CPhysicsMicrobenchmark *benchmark, int iteration);
+	static void CollideGetAABB(CPhysicsMicrobenchmark *benchmark, int iteration);
+	static void BBoxToCollide(CPhysicsMicrobenchmark *benchmark, int iteration);
+	static void CreateCachedSphereCollide(CPhysicsMicrobenchmark *benchmark, int iteration);
+	static void VCollideLoad(CPhysicsMicrobenchmark *benchmark, int iteration);
+	static void VCollideLoadBullet(CPhysicsMicrobenchmark *benchmark, int iteration);
+	static void PairHashAdd(CPhysicsMicrobenchmark *benchmark, int iteration);
+	static void PairHashFind(CPhysicsMicrobenchmark *benchmark, int iteration);
+	static void PairHashRemove(CPhysicsMicrobenchmark *benchmark, int iteration);
+
+	struct StressResult_t {
+		float m_Fractions[3];
+		bool m_StartSolid[3];
+		Vector m_Normals[3];
+		bool m_ConeHit;
+		// Exact environment overlap tests, done with the trace context of the calling thread.
+		bool m_BoxOverlap, m_SphereOverlap;
+
+		bool operator==(const StressResult_t &other) const;
+	};
+	void DoStressQueries(IPhysicsCollision *collision, int inputIndex, StressResult_t &result) const;
+	// The compound at the origin for the overlap tests.
+	btCollisionObject m_OverlapObject;
+
+	// The checks return the number of mismatches, which are failures, while the errors are only printed.
+	typedef void (*AnalyticCase_t)(CPhysicsMicrobenchmark *benchmark, int inputIndex, trace_t *trace);
+	int CheckAnalyticCase(const char *name, AnalyticCase_t function);
+	// Random boxes against the cones with physics_bullet_cone_analytic enabled and disabled.
+	int CheckAnalyticCones();
+	static void AnalyticRayBox(CPhysicsMicrobenchmark *benchmark, int inputIndex, trace_t *trace);
+	static void AnalyticRayHull(CPhysicsMicrobenchmark *benchmark, int inputIndex, trace_t *trace);
+	static void AnalyticRaySphere(CPhysicsMicrobenchmark *benchmark, int inputIndex, trace_t *trace);
+	static void AnalyticBoxSweptBox(CPhysicsMicrobenchmark *benchmark, int inputIndex, trace_t *trace);
+	static void AnalyticBoxUnsweptBox(CPhysicsMicrobenchmark *benchmark, int inputIndex, trace_t *trace);
+	CPhysCollide *m_Sphere;
+	StressResult_t m_StressReferences[INPUT_COUNT];
+	struct StressJob_t {
+		CPhysicsMicrobenchmark *m_Benchmark;
+		IPhysicsCollision **m_Contexts;
+		int m_IterationCount;
+		CInterlockedInt m_MismatchCount;
+	};
+	static void StressRange(void *context, int begin, int end);
+};
+
+CPhysicsMicrobenchmark::CPhysicsMicrobenchmark() :
+		m_RandomState(1), m_ModelSolidCount(0) {
+	BeginPhysicsAllocationCounting();
+	m_Box = g_pPhysCollision->BBoxToCollide(Vector(-16.0f, -16.0f, -16.0f), Vector(16.0f, 16.0f, 16.0f));
+
+	// Octahedron-like hull with beveled tips, so it's not handled as a box.
+	Vector hullPoints[10] = {
+		Vector(24.0f, 0.0f, 0.0f), Vector(-24.0f, 0.0f, 0.0f),
+		Vector(0.0f, 24.0f, 0.0f), Vector(0.0f, -24.0f, 0.0f),
+		Vector(4.0f, 4.0f, 20.0f), Vector(-4.0f, -4.0f, 20.0f),
+		Vector(4.0f, -4.0f, -20.0f), Vector(-4.0f, 4.0f, -20.0f),
+		Vector(12.0f, 12.0f, 8.0f), Vector(-12.0f, -12.0f, -8.0f)
+	};
+	Vector *hullPointPointers[10];
+	for (int pointIndex = 0; pointIndex < 10; ++pointIndex) {
+		hullPointPointers[pointIndex] = &hullPoints[pointIndex];
+	}
+	CPhysConvex *hullConvex = g_pPhysCollision->ConvexFromVerts(hullPointPointers, 10);
+	m_Hull = g_pPhysCollision->ConvertConvexToCollide(&hullConvex, 1);
+
+	// Row of boxes, like a typical multi-solid prop.
+	CPhysConvex *compoundConvexes[8];
+	for (int convexIndex = 0; convexIndex < 8; ++convexIndex) {
+		Vector center((float) (convexIndex - 4) * 12.0f + 6.0f, 0.0f, (float) (convexIndex & 1) * 4.0f);
+		compoundConvexes[convexIndex] = g_pPhysCollision->BBoxToConvex(
+				center - Vector(5.0f, 8.0f, 8.0f), center + Vector(5.0f, 8.0f, 8.0f));
+	}
+	m_Compound = g_pPhysCollision->ConvertConvexToCollide(compoundConvexes, 8);
+	m_OverlapObject.setCollisionShape(m_Compound->GetShape());
+	m_OverlapObject.getWorldTransform().setIdentity();
+	m_OverlapObject.getWorldTransform().setOrigin(m_Compound->GetMassCenter());
+
+	// Owned by the sphere cache.
+	m_Sphere = g_pPhysCollision->CreateCachedSphereCollide(HL2BULLET(24.0f));
+
+	// Rays from a sphere around the shapes towards the area near the center, about half of them hitting.
+	for (int inputIndex = 0; inputIndex < INPUT_COUNT; ++inputIndex) {
+		Vector direction(RandomFloat(-1.0f, 1.0f), RandomFloat(-1.0f, 1.0f), RandomFloat(-1.0f, 1.0f));
+		if (VectorNormalize(direction) < 1e-3f) {
+			direction.Init(1.0f, 0.0f, 0.0f);
+		}
+		m_RayStarts[inputIndex] = direction * 128.0f;
+		m_RayEnds[inputIndex].Init(RandomFloat(-40.0f, 40.0f), RandomFloat(-40.0f, 40.0f), RandomFloat(-40.0f, 40.0f));
+		m_Angles[inputIndex].Init(RandomFloat(-180.0f, 180.0f), RandomFloat(-180.0f, 180.0f), RandomFloat(-180.0f, 180.0f));
+		truncatedcone_t &cone = m_Cones[inputIndex];
+		cone.origin = m_RayStarts[inputIndex];
+		cone.normal = -direction;
+		cone.h = RandomFloat(32.0f, 256.0f);
+		cone.theta = RandomFloat(5.0f, 60.0f);
+	}
+
+	IPhysics *physics = reinterpret_cast<IPhysics *>(Sys_GetFactoryThis()(VPHYSICS_INTERFACE_VERSION, nullptr));
+	m_PairHash = physics->CreateObjectPairHash();
+}
+
+CPhysicsMicrobenchmark::~CPhysicsMicrobenchmark() {
+	IPhysics *physics = reinterpret_cast<IPhysics *>(Sys_GetFactoryThis()(VPHYSICS_INTERFACE_VERSION, nullptr));
+	physics->DestroyObjectPairHash(m_PairHash);
+	g_pPhysCollision->DestroyCollide(m_Box);
+	g_pPhysCollision->DestroyCollide(m_Hull);
+	g_pPhysCollision->DestroyCollide(m_Compound);
+	EndPhysicsAllocationCounting();
+}
+
+float CPhysicsMicrobenchmark::RandomFloat(float minValue, float maxValue) {
+	// Own generator so the inputs are the same on every run regardless of the game's random state.
+	m_RandomState = m_RandomState * 1664525u + 1013904223u;
+	return minValue + (maxValue - minValue) * ((float) (m_RandomState >> 8) * (1.0f / 16777216.0f));
+}
+
+bool CPhysicsMicrobenchmark::LoadModel(const char *path) {
+	// Header of studio model .phy files, followed by the data in the vcollide_t format.
+	struct PhyHeader_t {
+		int m_Size;
+		int m_ID;
+		int m_SolidCount;
+		int m_Checksum;
+	};
+
+	CUtlBuffer file;
+	if (g_pFullFileSystem == nullptr || !g_pFullFileSystem->ReadFile(path, nullptr, file)) {
+		Warning("Couldn't read %s.\n", path);
+		return false;
+	}
+	int fileSize = file.TellPut();
+	PhyHeader_t header;
+	if (fileSize < (int) sizeof(header) || !file.Get(&header, sizeof(header)) ||
+			header.m_Size < (int) sizeof(header) || header.m_Size > fileSize || header.m_SolidCount <= 0) {
+		Warning("%s is not a valid .phy file.\n", path);
+		return false;
+	}
+	m_ModelSolidCount = header.m_SolidCount;
+	m_ModelData.CopyArray(reinterpret_cast<const char *>(file.Base()) + header.m_Size, fileSize - header.m_Size);
+	return true;
+}
+
+int CPhysicsMicrobenchmark::RunCase(const char *name, Case_t function,
+		int iterationCount, int operationsPerIteration, bool warmUp) {
+	// Warm up caches and lazily created data.
+	int warmupCount = (warmUp ? MIN(iterationCount, (int) INPUT_COUNT) : 0);
+	for (int iteration = 0; iteration < warmupCount; ++iteration) {
+		function(this, iteration);
+	}
+
+	int allocationCount = g_PhysicsAllocationCount;
+	CFastTimer timer;
+	timer.Start();
+	for (int iteration = 0; iteration < iterationCount; ++iteration) {
+		function(this, iteration);
+	}
+	timer.End();
+	allocationCount = g_PhysicsAllocationCount - allocationCount;
+
+	int operationCount = iterationCount * operationsPerIteration;
+	Msg("{\"name\":\"%s\",\"operations\":%d,\"ns_per_op\":%.1f,\"allocs_per_op\":%.3f}\n",
+			name, operationCount, timer.GetDuration().GetMicrosecondsF() * 1000.0 / (double) operationCount,
+			(float) allocationCount / (float) operationCount);
+	return allocationCount;
+}
+
+void CPhysicsMicrobenchmark::TraceRay(CPhysicsMicrobenchmark *benchmark, int iteration) {
+	int inputIndex = iteration & (INPUT_COUNT - 1);
+	Ray_t ray;
+	ray.Init(benchmark->m_RayStarts[inputIndex], benchmark->m_RayEnds[inputIndex]);
+	g_pPhysCollision->TraceBox(ray, benchmark->m_Box, vec3_origin, benchmark->m_Angles[inputIndex], &benchmark->m_Trace);
+}
+
+void CPhysicsMicrobenchmark::TraceRayHull(CPhysicsMicrobenchmark *benchmark, int iteration) {
+	int inputIndex = iteration & (INPUT_COUNT - 1);
+	Ray_t ray;
+	ray.Init(benchmark->m_RayStarts[inputIndex], benchmark->m_RayEnds[inputIndex]);
+	g_pPhysCollision->TraceBox(ray, benchmark->m_Hull, vec3_origin, benchmark->m_Angles[inputIndex], &benchmark->m_Trace);
+}
+
+void CPhysicsMicrobenchmark::TraceBoxSwept(CPhysicsMicrobenchmark *benchmark, int iteration) {
+	int inputIndex = iteration & (INPUT_COUNT - 1);
+	Ray_t ray;
+	ray.Init(benchmark->m_RayStarts[inputIndex], benchmark->m_RayEnds[inputIndex],
+			Vector(-8.0f, -8.0f, -8.0f), Vector(8.0f, 8.0f, 8.0f));
+	g_pPhysCollision->TraceBox(ray, benchmark->m_Hull, vec3_origin, benchmark->m_Angles[inputIndex], &benchmark->m_Trace);
+}
+
+void CPhysicsMicrobenchmark::TraceBoxUnswept(CPhysicsMicrobenchmark *benchmark, int iteration) {
+	int inputIndex = iteration & (INPUT_COUNT - 1);
+	Ray_t ray;
+	// Points near the hull, about half of them intersecting it.
+	ray.Init(benchmark->m_RayEnds[inputIndex], benchmark->m_RayEnds[inputIndex],
+			Vector(-8.0f, -8.0f, -8.0f), Vector(8.0f, 8.0f, 8.0f));
+	g_pPhysCollision->TraceBox(ray, benchmark->m_Hull, vec3_origin, benchmark->m_Angles[inputIndex], &benchmark->m_Trace);
+}
+
+void CPhysicsMicrobenchmark::TraceBoxCompound(CPhysicsMicrobenchmark *benchmark, int iteration) {
+	int inputIndex = iteration & (INPUT_COUNT - 1);
+	Ray_t ray;
+	ray.Init(benchmark->m_RayStarts[inputIndex], benchmark->m_RayEnds[inputIndex],
+			Vector(-8.0f, -8.0f, -8.0f), Vector(8.0f, 8.0f, 8.0f));
+	g_pPhysCollision->TraceBox(ray, benchmark->m_Compound, vec3_origin, benchmark->m_Angles[inputIndex],
+			&benchmark->m_Trace);
+}
+
+void CPhysicsMicrobenchmark::TraceCollide(CPhysicsMicrobenchmark *benchmark, int iteration) {
+	int inputIndex = iteration & (INPUT_COUNT - 1);
+	g_pPhysCollision->TraceCollide(benchmark->m_RayStarts[inputIndex], benchmark->m_RayEnds[inputIndex],
+			benchmark->m_Hull, benchmark->m_Angles[inputIndex],
+			benchmark->m_Compound, vec3_origin, benchmark->m_Angles[(inputIndex + 1) & (INPUT_COUNT - 1)],
+			&benchmark->m_Trace);
+}
+
+void CPhysicsMicrobenchmark::TraceCollideCompound(CPhysicsMicrobenchmark *benchmark, int iteration) {
+	int inputIndex = iteration & (INPUT_COUNT - 1);
+	g_pPhysCollision->TraceCollide(benchmark->m_RayStarts[inputIndex], benchmark->m_RayEnds[inputIndex],
+			benchmark->m_Compound, benchmark->m_Angles[inputIndex],
+			benchmark->m_Compound, vec3_origin, benchmark->m_Angles[(inputIndex + 1) & (INPUT_COUNT - 1)],
+			&benchmark->m_Trace);
+}
+
+void CPhysicsMicrobenchmark::TraceCollideUnswept(CPhysicsMicrobenchmark *benchmark, int iteration) {
+	int inputIndex = iteration & (INPUT_COUNT - 1);
+	g_pPhysCollision->TraceCollide(benchmark->m_RayStarts[inputIndex], benchmark->m_RayStarts[inputIndex],
+			benchmark->m_Compound, benchmark->m_Angles[inputIndex],
+			benchmark->m_Compound, vec3_origin, benchmark->m_Angles[(inputIndex + 1) & (INPUT_COUNT - 1)],
+			&benchmark->m_Trace);
+}
+
+void CPhysicsMicrobenchmark::IsBoxIntersectingCone(CPhysicsMicrobenchmark *benchmark, int iteration) {
+	int inputIndex = iteration & (INPUT_COUNT - 1);
+	const Vector &center = benchmark->m_RayEnds[inputIndex];
+	g_pPhysCollision->IsBoxIntersectingCone(center - Vector(16.0f, 16.0f, 16.0f), center + Vector(16.0f, 16.0f, 16.0f),
+			benchmark->m_Cones[inputIndex]);
+}
+
+void CPhysicsMicrobenchmark::CollideGetAABB(CPhysicsMicrobenchmark *benchmark, int iteration) {
+	int inputIndex = iteration & (INPUT_COUNT - 1);
+	Vector mins, maxs;
+	g_pPhysCollision->CollideGetAABB(&mins, &maxs, benchmark->m_Compound,
+			benchmark->m_RayEnds[inputIndex], benchmark->m_Angles[inputIndex]);
+}
+
+// 64 different sizes, all cached after warming up.
+
+void CPhysicsMicrobenchmark::BBoxToCollide(CPhysicsMicrobenchmark *benchmark, int iteration) {
+	Vector halfExtents(4.0f + (float) (iteration & 63), 16.0f, 16.0f);
+	g_pPhysCollision->BBoxToCollide(-halfExtents, halfExtents);
+}
+
+void CPhysicsMicrobenchmark::CreateCachedSphereCollide(CPhysicsMicrobenchmark *benchmark, int iteration) {
+	g_pPhysCollision->CreateCachedSphereCollide(HL2BULLET(4.0f + (float) (iteration & 63)));
+}
+
+void CPhysicsMicrobenchmark::VCollideLoad(CPhysicsMicrobenchmark *benchmark, int iteration) {
+	vcollide_t collide;
+	g_pPhysCollision->VCollideLoad(&collide, benchmark->m_ModelSolidCount,
+			benchmark->m_ModelData.Base(), benchmark->m_ModelData.Count(), false);
+	g_pPhysCollision->VCollideUnload(&collide);
+}
+
+void CPhysicsMicrobenchmark::VCollideLoadBullet(CPhysicsMicrobenchmark *benchmark, int iteration) {
+	vcollide_t collide;
+	g_pPhysCollision->VCollideLoad(&collide, benchmark->m_ModelSolidCount,
+			benchmark->m_BulletModelData.Base(), benchmark->m_BulletModelData.Count(), false);
+	g_pPhysCollision->VCollideUnload(&collide);
+}
+
+// The pair hash cases operate on all pairs of a new group of 16 objects (120 pairs) per iteration.
+// Objects in the hash don't need to be physics objects and are never dereferenced, so fake addresses are used.
+
+FORCEINLINE void *CPhysicsMicrobenchmark::GetPairHashObject(int iteration, int object) {
+	return reinterpret_cast<void *>((size_t) ((iteration * 16 + object + 1) * 64));
+}
+
+void CPhysicsMicrobenchmark::PairHashAdd(CPhysicsMicrobenchmark *benchmark, int iteration) {
+	for (int object0 = 0; object0 < 16; ++object0) {
+		for (int object1 = object0 + 1; object1 < 16; ++object1) {
+			benchmark->m_PairHash->AddObjectPair(
+					GetPairHashObject(iteration, object0), GetPairHashObject(iteration, object1));
+		}
+	}
+}
+
+void CPhysicsMicrobenchmark::PairHashFind(CPhysicsMicrobenchmark *benchmark, int iteration) {
+	for (int object0 = 0; object0 < 16; ++object0) {
+		for (int object1 = object0 + 1; object1 < 16; ++object1) {
+			benchmark->m_PairHash->IsObjectPairInHash(
+					GetPairHashObject(iteration, object1), GetPairHashObject(iteration, object0));
+		}
+	}
+}
+
+void CPhysicsMicrobenchmark::PairHashRemove(CPhysicsMicrobenchmark *benchmark, int iteration) {
+	for (int object0 = 0; object0 < 16; ++object0) {
+		for (int object1 = object0 + 1; object1 < 16; ++object1) {
+			benchmark->m_PairHash->RemoveObjectPair(
+					GetPairHashObject(iteration, object0), GetPairHashObject(iteration, object1));
+		}
+	}
+}
+
+int CPhysicsMicrobenchmark::Run(int iterationCount, const char *modelPath) {
+	// Traces and contact tests, must not allocate memory after warming up.
+	int traceAllocationCount = RunCase("TraceBox_ray_box", TraceRay, iterationCount);
+	traceAllocationCount += RunCase("TraceBox_ray_hull", TraceRayHull, iterationCount);
+	traceAllocationCount += RunCase("TraceBox_box_swept_hull", TraceBoxSwept, iterationCount);
+	traceAllocationCount += RunCase("TraceBox_box_unswept_hull", TraceBoxUnswept, iterationCount);
+	traceAllocationCount += RunCase("TraceBox_box_swept_compound", TraceBoxCompound, iterationCount);
+	traceAllocationCount += RunCase("TraceCollide_hull_compound", TraceCollide, iterationCount);
+	traceAllocationCount += RunCase("TraceCollide_compound_compound", TraceCollideCompound, iterationCount);
+	traceAllocationCount += RunCase("TraceCollide_unswept_compound_compound", TraceCollideUnswept, iterationCount);
+	traceAllocationCount += RunCase("IsBoxIntersectingCone", IsBoxIntersectingCone, iterationCount);
+
+	RunCase("CollideGetAABB_compound", CollideGetAABB, iterationCount);
+	RunCase("BBoxToCollide_cached", BBoxToCollide, iterationCount);
+	RunCase("CreateCachedSphereCollide_cached", CreateCachedSphereCollide, iterationCount);
+
+	// Not warmed up since adding and removing change the state - each case works on the pairs left by the previous.
+	int pairIterationCount = MAX(iterationCount / 120, 1);
+	RunCase("PairHash_add", PairHashAdd, pairIterationCount, 120, false);
+	RunCase("PairHash_find", PairHashFind, pairIterationCount, 120, false);
+	RunCase("PairHash_remove", PairHashRemove, pairIterationCount, 120, false);
+
+	if (modelPath != nullptr && LoadModel(modelPath)) {
+		ConVarRef parallelLoad("physics_bullet_parallelvcollideload"), lazyLoad("physics_bullet_lazyvcollideload");
+		bool parallelLoadEnabled = parallelLoad.GetBool(), lazyLoadEnabled = lazyLoad.GetBool();
+		lazyLoad.SetValue(false);
+		parallelLoad.SetValue(false);
+		RunCase("VCollideLoad_serial", VCollideLoad, MAX(iterationCount / 100, 1));
+		parallelLoad.SetValue(true);
+		RunCase("VCollideLoad", VCollideLoad, MAX(iterationCount / 100, 1));
+		lazyLoad.SetValue(true);
+		RunCase("VCollideLoad_lazy", VCollideLoad, MAX(iterationCount / 100, 1));
+		lazyLoad.SetValue(false);
+		// With another copy loaded, all the hulls are taken from the hull cache.
+		vcollide_t cachedCollide;
+		g_pPhysCollision->VCollideLoad(&cachedCollide, m_ModelSolidCount,
+				m_ModelData.Base(), m_ModelData.Count(), false);
+		RunCase("VCollideLoad_cached", VCollideLoad, MAX(iterationCount / 100, 1));
+		g_pPhysCollision->VCollideUnload(&cachedCollide);
+		parallelLoad.SetValue(parallelLoadEnabled);
+		lazyLoad.SetValue(lazyLoadEnabled);
+		if (ConvertModelToBullet()) {
+			RunCase("VCollideLoad_bullet", VCollideLoadBullet, MAX(iterationCount / 100, 1));
+		}
+	}
+
+	return traceAllocationCount;
+}
+
+bool CPhysicsMicrobenchmark::StressResult_t::operator==(const StressResult_t &other) const {
+	for (int traceIndex = 0; traceIndex < 3; ++traceIndex) {
+		if (m_Fractions[traceIndex] != other.m_Fractions[traceIndex] ||
+				m_StartSolid[traceIndex] != other.m_StartSolid[traceIndex] ||
+				m_Normals[traceIndex] != other.m_Normals[traceIndex]) {
+			return false;
+		}
+	}
+	return m_ConeHit == other.m_ConeHit &&
+			m_BoxOverlap == other.m_BoxOverlap && m_SphereOverlap == other.m_SphereOverlap;
+}
+
+void CPhysicsMicrobenchmark::DoStressQueries(IPhysicsCollision *collision,
+		int inputIndex, StressResult_t &result) const {
+	trace_t traces[3];
+	Ray_t ray;
+	ray.Init(m_RayStarts[inputIndex], m_RayEnds[inputIndex]);
+	collision->TraceBox(ray, m_Compound, vec3_origin, m_Angles[inputIndex], &traces[0]);
+	ray.Init(m_RayEnds[inputIndex], m_RayEnds[inputIndex], Vector(-8.0f, -8.0f, -8.0f), Vector(8.0f, 8.0f, 8.0f));
+	collision->TraceBox(ray, m_Hull, vec3_origin, m_Angles[inputIndex], &traces[1]);
+	collision->TraceCollide(m_RayStarts[inputIndex], m_RayEnds[inputIndex], m_Hull, m_Angles[inputIndex],
+			m_Compound, vec3_origin, m_Angles[(inputIndex + 1) & (INPUT_COUNT - 1)], &traces[2]);
+	for (int traceIndex = 0; traceIndex < 3; ++traceIndex) {
+		result.m_Fractions[traceIndex] = traces[traceIndex].fraction;
+		result.m_StartSolid[traceIndex] = traces[traceIndex].startsolid;
+		result.m_Normals[traceIndex] = traces[traceIndex].plane.normal;
+	}
+	const Vector &center = m_RayEnds[inputIndex];
+	result.m_ConeHit = collision->IsBoxIntersectingCone(
+			center - Vector(16.0f, 16.0f, 16.0f), center + Vector(16.0f, 16.0f, 16.0f), m_Cones[inputIndex]);
+	btVector3 overlapCenter;
+	ConvertPositionToBullet(center, overlapCenter);
+	CPhysicsThreadTraceContextScope overlapContextScope(*g_pPhysCollision);
+	CPhysicsTraceContext &overlapContext = overlapContextScope.Get();
+	result.m_BoxOverlap = overlapContext.IsBoxIntersectingObject(
+			overlapCenter, btVector3(1.0f, 1.0f, 1.0f) * HL2BULLET(16.0f), &m_OverlapObject);
+	result.m_SphereOverlap = overlapContext.IsSphereIntersectingObject(
+			overlapCenter, HL2BULLET(16.0f), &m_OverlapObject);
+}
+
+void CPhysicsMicrobenchmark::StressRange(void *context, int begin, int end) {
+	StressJob_t *job = reinterpret_cast<StressJob_t *>(context);
+	const CPhysicsMicrobenchmark *benchmark = job->m_Benchmark;
+	for (int contextIndex = begin; contextIndex < end; ++contextIndex) {
+		IPhysicsCollision *collision = job->m_Contexts[contextIndex];
+		for (int iteration = 0; iteration < job->m_IterationCount; ++iteration) {
+			// Different inputs in different threads at the same time.
+			int inputIndex = (iteration + contextIndex * (INPUT_COUNT / 8)) & (INPUT_COUNT - 1);
+			StressResult_t result;
+			benchmark->DoStressQueries(collision, inputIndex, result);
+			if (!(result == benchmark->m_StressReferences[inputIndex])) {
+				++job->m_MismatchCount;
+			}
+		}
+	}
+}
+
+int CPhysicsMicrobenchmark::RunThreadStress(int iterationCount) {
+	for (int inputIndex = 0; inputIndex < INPUT_COUNT; ++inputIndex) {
+		DoStressQueries(g_pPhysCollision, inputIndex, m_StressReferences[inputIndex]);
+	}
+
+	// One context per thread, each chunk being one context.
+	int threadCount = g_PhysicsThreadPool.GetThreadCount();
+	if (threadCount < 2) {
+		Warning("Only 1 physics thread, set physics_bullet_threads for the queries to be concurrent.\n");
+	}
+	CUtlVector<IPhysicsCollision *> contexts;
+	for (int contextIndex = 0; contextIndex < threadCount; ++contextIndex) {
+		contexts.AddToTail(g_pPhysCollision->ThreadContextCreate());
+	}
+	StressJob_t job;
+	job.m_Benchmark = this;
+	job.m_Contexts = contexts.Base();
+	job.m_IterationCount = iterationCount;
+	job.m_MismatchCount = 0;
+	CFastTimer timer;
+	timer.Start();
+	g_PhysicsThreadPool.ParallelFor(threadCount, 1, StressRange, &job);
+	timer.End();
+	for (int contextIndex = 0; contextIndex < threadCount; ++contextIndex) {
+		g_pPhysCollision->ThreadContextDestroy(contexts[contextIndex]);
+	}
+
+	int mismatchCount = job.m_MismatchCount;
+	Msg("{\"name\":\"thread_stress\",\"threads\":%d,\"operations\":%d,\"ms\":%.1f,\"mismatches\":%d}\n",
+			threadCount, threadCount * iterationCount * 6, timer.GetDuration().GetMillisecondsF(), mismatchCount);
+	return mismatchCount;
+}
+
+void CPhysicsMicrobenchmark::AnalyticRayBox(CPhysicsMicrobenchmark *benchmark, int inputIndex, trace_t *trace) {
+	Ray_t ray;
+	ray.Init(benchmark->m_RayStarts[inputIndex], benchmark->m_RayEnds[inputIndex]);
+	g_pPhysCollision->TraceBox(ray, benchmark->m_Box, vec3_origin, benchmark->m_Angles[inputIndex], trace);
+}
+
+void CPhysicsMicrobenchmark::AnalyticRayHull(CPhysicsMicrobenchmark *benchmark, int inputIndex, trace_t *trace) {
+	Ray_t ray;
+	ray.Init(benchmark->m_RayStarts[inputIndex], benchmark->m_RayEnds[inputIndex]);
+	g_pPhysCollision->TraceBox(ray, benchmark->m_Hull, vec3_origin, benchmark->m_Angles[inputIndex], trace);
+}
+
+void CPhysicsMicrobenchmark::AnalyticRaySphere(CPhysicsMicrobenchmark *benchmark, int inputIndex, trace_t *trace) {
+	Ray_t ray;
+	ray.Init(benchmark->m_RayStarts[inputIndex], benchmark->m_RayEnds[inputIndex]);
+	g_pPhysCollision->TraceBox(ray, benchmark->m_Sphere, vec3_origin, vec3_angle, trace);
+}
+
+void CPhysicsMicrobenchmark::AnalyticBoxSweptBox(CPhysicsMicrobenchmark *benchmark, int inputIndex, trace_t *trace) {
+	Ray_t ray;
+	ray.Init(benchmark->m_RayStarts[inputIndex], benchmark->m_RayEnds[inputIndex],
+			Vector(-8.0f, -8.0f, -8.0f), Vector(8.0f, 8.0f, 8.0f));
+	g_pPhysCollision->TraceBox(ray, benchmark->m_Box, vec3_origin, vec3_angle, trace);
+}
+
+void CPhysicsMicrobenchmark::AnalyticBoxUnsweptBox(CPhysicsMicrobenchmark *benchmark, int inputIndex, trace_t *trace) {
+	Ray_t ray;
+	ray.Init(benchmark->m_RayEnds[inputIndex], benchmark->m_RayEnds[inputIndex],
+			Vector(-8.0f, -8.0f, -8.0f), Vector(8.0f, 8.0f, 8.0f));
+	g_pPhysCollision->TraceBox(ray, benchmark->m_Box, vec3_origin, vec3_angle, trace);
+}
+
+int CPhysicsMicrobenchmark::CheckAnalyticCase(const char *name, AnalyticCase_t function) {
+	ConVarRef analytic("physics_bullet_trace_analytic");
+	float maxFractionError = 0.0f, maxNormalError = 0.0f;
+	int hitMismatches = 0, startSolidMismatches = 0;
+	for (int inputIndex = 0; inputIndex < INPUT_COUNT; ++inputIndex) {
+		trace_t genericTrace, analyticTrace;
+		analytic.SetValue(false);
+		function(this, inputIndex, &genericTrace);
+		analytic.SetValue(true);
+		function(this, inputIndex, &analyticTrace);
+		if (genericTrace.startsolid != analyticTrace.startsolid) {
+			++startSolidMismatches;
+			continue;
+		}
+		if ((genericTrace.fraction < 1.0f) != (analyticTrace.fraction < 1.0f)) {
+			++hitMismatches;
+			continue;
+		}
+		if (genericTrace.startsolid || genericTrace.fraction >= 1.0f) {
+			continue;
+		}
+		maxFractionError = MAX(maxFractionError, fabsf(genericTrace.fraction - analyticTrace.fraction));
+		maxNormalError = MAX(maxNormalError, 1.0f - DotProduct(genericTrace.plane.normal, analyticTrace.plane.normal));
+	}
+	Msg("{\"name\":\"%s\",\"traces\":%d,\"max_fraction_error\":%g,\"max_normal_error\":%g,"
+			"\"hit_mismatches\":%d,\"startsolid_mismatches\":%d}\n",
+			name, (int) INPUT_COUNT, maxFractionError, maxNormalError, hitMismatches, startSolidMismatches);
+	return hitMismatches + startSolidMismatches;
+}
+
+int CPhysicsMicrobenchmark::CheckAnalyticCones() {
+	ConVarRef analytic("physics_bullet_cone_analytic");
+	bool analyticEnabled = analytic.GetBool();
+	// Boxes that the generic test classifies differently when grown or shrunk slightly are almost touching the cone,
+	// and margins and precision decide there, so only the mismatches outside that band are errors.
+	const float boundaryTolerance = 0.125f;
+	int testCount = 0, mismatches = 0, boundaryMismatches = 0;
+	for (int inputIndex = 0; inputIndex < INPUT_COUNT; ++inputIndex) {
+		for (int boxIndex = 0; boxIndex < 4; ++boxIndex) {
+			Vector halfExtents(RandomFloat(1.0f, 48.0f), RandomFloat(1.0f, 48.0f), RandomFloat(1.0f, 48.0f));
+			Vector center = m_RayEnds[(inputIndex + boxIndex) & (INPUT_COUNT - 1)];
+			const truncatedcone_t &cone = m_Cones[inputIndex];
+			analytic.SetValue(true);
+			bool analyticResult = g_pPhysCollision->IsBoxIntersectingCone(
+					center - halfExtents, center + halfExtents, cone);
+			analytic.SetValue(false);
+			bool genericResult = g_pPhysCollision->IsBoxIntersectingCone(
+					center - halfExtents, center + halfExtents, cone);
+			++testCount;
+			if (analyticResult == genericResult) {
+				continue;
+			}
+			Vector tolerance(boundaryTolerance, boundaryTolerance, boundaryTolerance);
+			bool grownResult = g_pPhysCollision->IsBoxIntersectingCone(
+					center - halfExtents - tolerance, center + halfExtents + tolerance, cone);
+			bool shrunkResult = g_pPhysCollision->IsBoxIntersectingCone(
+					center - halfExtents + tolerance, center + halfExtents - tolerance, cone);
+			if (grownResult != shrunkResult) {
+				++boundaryMismatches;
+			} else {
+				++mismatches;
+			}
+		}
+	}
+	analytic.SetValue(analyticEnabled);
+	Msg("{\"name\":\"box_cone\",\"tests\":%d,\"mismatches\":%d,\"boundary_mismatches\":%d}\n",
+			testCount, mismatches, boundaryMismatches);
+	return mismatches;
+}
+
+int CPhysicsMicrobenchmark::RunAnalyticCheck() {
+	ConVarRef analytic("physics_bullet_trace_analytic");
+	bool analyticEnabled = analytic.GetBool();
+	int mismatches = 0;
+	mismatches += CheckAnalyticCase("ray_box", AnalyticRayBox);
+	mismatches += CheckAnalyticCase("ray_hull", AnalyticRayHull);
+	mismatches += CheckAnalyticCase("ray_sphere", AnalyticRaySphere);
+	mismatches += CheckAnalyticCase("box_swept_box", AnalyticBoxSweptBox);
+	mismatches += CheckAnalyticCase("box_unswept_box", AnalyticBoxUnsweptBox);
+	analytic.SetValue(analyticEnabled);
+	mismatches += CheckAnalyticCones();
+	return mismatches;
+}
+
+bool CPhysicsMicrobenchmark::ConvertModelToBullet() {
+	vcollide_t collide;
+	g_pPhysCollision->VCollideLoad(&collide, m_ModelSolidCount, m_ModelData.Base(), m_ModelData.Count(), false);
+	m_BulletModelData.RemoveAll();
+	bool converted = true;
+	for (int solidIndex = 0; solidIndex < collide.solidCount; ++solidIndex) {
+		CPhysCollide *solid = collide.solids[solidIndex];
+		int solidSize = (solid != nullptr ? g_pPhysCollision->CollideSize(solid) : 0);
+		if (solidSize <= 0) {
+			converted = false;
+			break;
+		}
+		int position = m_BulletModelData.AddMultipleToTail(sizeof(int) + solidSize);
+		memcpy(&m_BulletModelData[position], &solidSize, sizeof(int));
+		g_pPhysCollision->CollideWrite(&m_BulletModelData[position + sizeof(int)], solid, false);
+	}
+	if (converted && collide.pKeyValues != nullptr) {
+		m_BulletModelData.AddMultipleToTail(V_strlen(collide.pKeyValues) + 1, collide.pKeyValues);
+	}
+	g_pPhysCollision->VCollideUnload(&collide);
+	if (!converted) {
+		Warning("Couldn't write the model in the Bullet format.\n");
+	}
+	return converted;
+}
+
+static int CompareRoundTripVectors(const char *name, const btVector3 &original, const btVector3 &loaded) {
+	// Exact, as the values are stored rather than recalculated.
+	if (original.x() == loaded.x() && original.y() == loaded.y() && original.z() == loaded.z()) {
+		return 0;
+	}
+	Msg("%s: (%g, %g, %g) became (%g, %g, %g).\n", name, original.x(), original.y(), original.z(),
+			loaded.x(), loaded.y(), loaded.z());
+	return 1;
+}
+
+static int CompareRoundTripScalars(const char *name, btScalar original, btScalar loaded) {
+	if (original == loaded) {
+		return 0;
+	}
+	Msg("%s: %g became %g.\n", name, original, loaded);
+	return 1;
+}
+
+static int CompareRoundTripConvexes(const CPhysConvex *original, const CPhysConvex *loaded) {
+	const btCollisionShape *originalShape = original->GetShape(), *loadedShape = loaded->GetShape();
+	if (originalShape->getShapeType() != loadedShape->getShapeType()) {
+		Msg("Convex shape type: %d became %d.\n", originalShape->getShapeType(), loadedShape->getShapeType());
+		return 1;
+	}
+	int mismatches = 0;
+	mismatches += CompareRoundTripScalars("Convex user index",
+			(btScalar) originalShape->getUserIndex(), (btScalar) loadedShape->getUserIndex());
+	mismatches += CompareRoundTripScalars("Convex volume", original->GetVolume(), loaded->GetVolume());
+	mismatches += CompareRoundTripScalars("Convex surface area", original->GetSurfaceArea(), loaded->GetSurfaceArea());
+	mismatches += CompareRoundTripVectors("Convex mass center", original->GetMassCenter(), loaded->GetMassCenter());
+	mismatches += CompareRoundTripVectors("Convex inertia", original->GetInertia(), loaded->GetInertia());
+	mismatches += CompareRoundTripVectors("Convex origin in compound",
+			original->GetOriginInCompound(), loaded->GetOriginInCompound());
+	mismatches += CompareRoundTripScalars("Convex margin", originalShape->getMargin(), loadedShape->getMargin());
+	int triangleCount = original->GetTriangleCount();
+	if (CompareRoundTripScalars("Convex triangle count", (btScalar) triangleCount,
+			(btScalar) loaded->GetTriangleCount()) != 0) {
+		return mismatches + 1;
+	}
+	for (int triangleIndex = 0; triangleIndex < triangleCount; ++triangleIndex) {
+		btVector3 originalVertices[3], loadedVertices[3];
+		original->GetTriangleVertices(triangleIndex, originalVertices);
+		loaded->GetTriangleVertices(triangleIndex, loadedVertices);
+		for (int vertexIndex = 0; vertexIndex < 3; ++vertexIndex) {
+			mismatches += CompareRoundTripVectors("Convex triangle vertex",
+					originalVertices[vertexIndex], loadedVertices[vertexIndex]);
+		}
+		mismatches += CompareRoundTripScalars("Convex triangle material",
+				(btScalar) original->GetTriangleMaterialIndex(triangleIndex),
+				(btScalar) loaded->GetTriangleMaterialIndex(triangleIndex));
+	}
+	if (CPhysConvex_Hull::IsHull(original)) {
+		const CPhysConvex_Hull *originalHull = static_cast<const CPhysConvex_Hull *>(original);
+		const CPhysConvex_Hull *loadedHull = static_cast<const CPhysConvex_Hull *>(loaded);
+		int facePlaneCount = originalHull->GetFacePlaneCount();
+		if (CompareRoundTripScalars("Hull face plane count", (btScalar) facePlaneCount,
+				(btScalar) loadedHull->GetFacePlaneCount()) != 0) {
+			return mismatches + 1;
+		}
+		for (int planeIndex = 0; planeIndex < facePlaneCount; ++planeIndex) {
+			const btVector4 &originalPlane = originalHull->GetFacePlanes()[planeIndex];
+			const btVector4 &loadedPlane = loadedHull->GetFacePlanes()[planeIndex];
+			mismatches += CompareRoundTripVectors("Hull face plane normal", originalPlane, loadedPlane);
+			mismatches += CompareRoundTripScalars("Hull face plane distance", originalPlane.w(), loadedPlane.w());
+		}
+	}
+	return mismatches;
+}
+
+static int CompareRoundTripCollides(const CPhysCollide *original, const CPhysCollide *loaded) {
+	if (loaded == nullptr) {
+		Msg("Couldn't load the written collideable.\n");
+		return 1;
+	}
+	original->EnsureLoaded();
+	loaded->EnsureLoaded();
+	const btCollisionShape *originalShape = original->GetShape(), *loadedShape = loaded->GetShape();
+	if (originalShape->getShapeType() != loadedShape->getShapeType()) {
+		Msg("Shape type: %d became %d.\n", originalShape->getShapeType(), loadedShape->getShapeType());
+		return 1;
+	}
+	int mismatches = 0;
+	mismatches += CompareRoundTripScalars("Volume", original->GetVolume(), loaded->GetVolume());
+	mismatches += CompareRoundTripScalars("Surface area", original->GetSurfaceArea(), loaded->GetSurfaceArea());
+	mismatches += CompareRoundTripVectors("Mass center", original->GetMassCenter(), loaded->GetMassCenter());
+	mismatches += CompareRoundTripVectors("Inertia", original->GetInertia(), loaded->GetInertia());
+	mismatches += CompareRoundTripVectors("Orthographic areas",
+			original->GetOrthographicAreas(), loaded->GetOrthographicAreas());
+	btVector3 originalAabbMin, originalAabbMax, loadedAabbMin, loadedAabbMax;
+	originalShape->getAabb(btTransform::getIdentity(), originalAabbMin, originalAabbMax);
+	loadedShape->getAabb(btTransform::getIdentity(), loadedAabbMin, loadedAabbMax);
+	mismatches += CompareRoundTripVectors("AABB minimum", originalAabbMin, loadedAabbMin);
+	mismatches += CompareRoundTripVectors("AABB maximum", originalAabbMax, loadedAabbMax);
+
+	if (CPhysCollide_Sphere::IsSphere(original)) {
+		mismatches += CompareRoundTripScalars("Sphere radius",
+				static_cast<const CPhysCollide_Sphere *>(original)->GetRadius(),
+				static_cast<const CPhysCollide_Sphere *>(loaded)->GetRadius());
+	} else if (CPhysCollide_Compound::IsCompound(original)) {
+		const btCompoundShape *originalCompound = static_cast<const CPhysCollide_Compound *>(original)->GetCompoundShape();
+		const btCompoundShape *loadedCompound = static_cast<const CPhysCollide_Compound *>(loaded)->GetCompoundShape();
+		int childCount = originalCompound->getNumChildShapes();
+		if (CompareRoundTripScalars("Child count", (btScalar) childCount,
+				(btScalar) loadedCompound->getNumChildShapes()) != 0) {
+			return mismatches + 1;
+		}
+		for (int childIndex = 0; childIndex < childCount; ++childIndex) {
+			const btTransform &originalTransform = originalCompound->getChildTransform(childIndex);
+			const btTransform &loadedTransform = loadedCompound->getChildTransform(childIndex);
+			mismatches += CompareRoundTripVectors("Child origin", originalTransform.getOrigin(), loadedTransform.getOrigin());
+			for (int row = 0; row < 3; ++row) {
+				mismatches += CompareRoundTripVectors("Child basis",
+						originalTransform.getBasis()[row], loadedTransform.getBasis()[row]);
+			}
+			mismatches += CompareRoundTripConvexes(
+					reinterpret_cast<const CPhysConvex *>(originalCompound->getChildShape(childIndex)->getUserPointer()),
+					reinterpret_cast<const CPhysConvex *>(loadedCompound->getChildShape(childIndex)->getUserPointer()));
+		}
+	}
+	return mismatches;
+}
+
+static int RoundTripCollide(CPhysCollide *original, int &collideCount, int &byteCount) {
+	int size = g_pPhysCollision->CollideSize(original);
+	if (size <= 0) {
+		Msg("Couldn't write a collideable.\n");
+		return 1;
+	}
+	CUtlVector<char> data;
+	data.SetCount(size);
+	if (g_pPhysCollision->CollideWrite(data.Base(), original, false) != size) {
+		Msg("Written collideable size is different from CollideSize.\n");
+		return 1;
+	}
+	CPhysCollide *loaded = g_pPhysCollision->UnserializeCollide(data.Base(), size, 0);
+	int mismatches = CompareRoundTripCollides(original, loaded);
+	if (loaded != nullptr) {
+		g_pPhysCollision->DestroyCollide(loaded);
+	}
+	++collideCount;
+	byteCount += size;
+	return mismatches;
+}
+
+int CPhysicsMicrobenchmark::RunCollideRoundTrip(const char *modelPath) {
+	int collideCount = 0, byteCount = 0, mismatches = 0;
+	mismatches += RoundTripCollide(m_Box, collideCount, byteCount);
+	mismatches += RoundTripCollide(m_Hull, collideCount, byteCount);
+	mismatches += RoundTripCollide(m_Compound, collideCount, byteCount);
+	mismatches += RoundTripCollide(m_Sphere, collideCount, byteCount);
+	bool modelLoaded = (modelPath != nullptr && LoadModel(modelPath));
+	if (modelPath != nullptr && !modelLoaded) {
+		++mismatches; // The model requested to be checked hasn't been.
+	}
+	if (modelLoaded) {
+		// Converted from IVP, with the values read from the file and calculated on load.
+		vcollide_t collide;
+		g_pPhysCollision->VCollideLoad(&collide, m_ModelSolidCount, m_ModelData.Base(), m_ModelData.Count(), false);
+		for (int solidIndex = 0; solidIndex < collide.solidCount; ++solidIndex) {
+			if (collide.solids[solidIndex] != nullptr) {
+				mismatches += RoundTripCollide(collide.solids[solidIndex], collideCount, byteCount);
+			}
+		}
+		g_pPhysCollision->VCollideUnload(&collide);
+
+		// The ledges converted on multiple threads, on first use or taken from the hull cache
+		// must form the same collideables.
+		ConVarRef parallelLoad("physics_bullet_parallelvcollideload"), lazyLoad("physics_bullet_lazyvcollideload");
+		ConVarRef dedupeHulls("physics_bullet_dedupehulls");
+		bool parallelLoadEnabled = parallelLoad.GetBool(), lazyLoadEnabled = lazyLoad.GetBool();
+		bool dedupeHullsEnabled = dedupeHulls.GetBool();
+		vcollide_t serialCollide, parallelCollide, lazyCollide;
+		lazyLoad.SetValue(false);
+		parallelLoad.SetValue(false);
+		dedupeHulls.SetValue(false);
+		g_pPhysCollision->VCollideLoad(&serialCollide, m_ModelSolidCount,
+				m_ModelData.Base(), m_ModelData.Count(), false);
+		parallelLoad.SetValue(true);
+		dedupeHulls.SetValue(true);
+		g_pPhysCollision->VCollideLoad(&parallelCollide, m_ModelSolidCount,
+				m_ModelData.Base(), m_ModelData.Count(), false);
+		lazyLoad.SetValue(true);
+		g_pPhysCollision->VCollideLoad(&lazyCollide, m_ModelSolidCount, m_ModelData.Base(), m_ModelData.Count(), false);
+		parallelLoad.SetValue(parallelLoadEnabled);
+		lazyLoad.SetValue(lazyLoadEnabled);
+		dedupeHulls.SetValue(dedupeHullsEnabled);
+		for (int solidIndex = 0; solidIndex < serialCollide.solidCount; ++solidIndex) {
+			const CPhysCollide *serialSolid = serialCollide.solids[solidIndex];
+			if (serialSolid == nullptr) {
+				continue;
+			}
+			mismatches += CompareRoundTripCollides(serialSolid, parallelCollide.solids[solidIndex]);
+			const CPhysCollide *lazySolid = lazyCollide.solids[solidIndex];
+			if (lazySolid != nullptr) {
+				// Available without loading.
+				mismatches += CompareRoundTripVectors("Lazy mass center", serialSolid->GetMassCenter(), lazySolid->GetMassCenter());
+				mismatches += CompareRoundTripVectors("Lazy inertia", serialSolid->GetInertia(), lazySolid->GetInertia());
+			}
+			mismatches += CompareRoundTripCollides(serialSolid, lazySolid);
+
+			// The parallel and the lazy solids share the hulls, modifying one must not change the other.
+			CPhysCollide *parallelSolid = parallelCollide.solids[solidIndex];
+			if (parallelSolid == nullptr || lazySolid == nullptr) {
+				continue;
+			}
+			ICollisionQuery *query = g_pPhysCollision->CreateQueryModel(parallelSolid);
+			for (int convexIndex = 0; convexIndex < query->ConvexCount(); ++convexIndex) {
+				if (query->TriangleCount(convexIndex) > 0) {
+					query->SetTriangleMaterialIndex(convexIndex, 0,
+							(query->GetTriangleMaterialIndex(convexIndex, 0) + 1) & 127);
+				}
+			}
+			g_pPhysCollision->DestroyQueryModel(query);
+			CPhysConvex *convexes[64];
+			int convexCount = g_pPhysCollision->GetConvexesUsedInCollideable(parallelSolid, convexes, 64);
+			for (int convexIndex = 0; convexIndex < convexCount; ++convexIndex) {
+				g_pPhysCollision->SetConvexGameData(convexes[convexIndex],
+						(unsigned int) convexes[convexIndex]->GetShape()->getUserIndex() + 1);
+			}
+			int sharedMismatches = CompareRoundTripCollides(serialSolid, lazySolid);
+			if (sharedMismatches != 0) {
+				Msg("Modifying solid %d has changed another model sharing its hulls.\n", solidIndex);
+				mismatches += sharedMismatches;
+			}
+		}
+		g_pPhysCollision->VCollideUnload(&serialCollide);
+		g_pPhysCollision->VCollideUnload(&parallelCollide);
+		g_pPhysCollision->VCollideUnload(&lazyCollide);
+	}
+	Msg("{\"name\":\"collide_round_trip\",\"collides\":%d,\"bytes\":%d,\"mismatches\":%d}\n",
+			collideCount, byteCount, mismatches);
+	return mismatches;
+}
+
+CON_COMMAND(physics_bullet_trace_analytic_check, "Compare the traces done with physics_bullet_trace_analytic "
+		"and the box-cone tests done with physics_bullet_cone_analytic with the generic ones, "
+		"print the largest differences as JSON, and fail if any hit or start in a solid differently.") {
+	CPhysicsMicrobenchmark benchmark;
+	ReportCheckResult(args, benchmark.RunAnalyticCheck(),
+			"analytic traces or box-cone tests hit differently from the generic ones");
+}
+
+CON_COMMAND(physics_bullet_collide_roundtrip_check, "Write collideables in the Bullet format, load them back "
+		"and check that the properties of the loaded ones are identical to the originals. "
+		"With a model, also checks that loading it with physics_bullet_parallelvcollideload, "
+		"physics_bullet_lazyvcollideload and physics_bullet_dedupehulls gives the same solids, "
+		"and that modifying a solid doesn't change the others sharing its hulls. "
+		"Usage: physics_bullet_collide_roundtrip_check [.phy file path to check the solids of].") {
+	CPhysicsMicrobenchmark benchmark;
+	ReportCheckResult(args, benchmark.RunCollideRoundTrip(args.ArgC() >= 2 ? args[1] : nullptr),
+			"properties of loaded collideables are different from the originals, or the model couldn't be loaded");
+}
+
+CON_COMMAND(physics_bullet_trace_stress, "Do collision queries and exact overlap tests from all physics threads "
+		"at once with separate thread contexts, and check that the results match ones done on a single thread. "
+		"Usage: physics_bullet_trace_stress [iterations per thread, 10000 by default].") {
+	int iterationCount;
+	if (!GetCountArgument(args, 1, 10000, "iteration count", iterationCount)) {
+		return;
+	}
+	CPhysicsMicrobenchmark benchmark;
+	ReportCheckResult(args, benchmark.RunThreadStress(iterationCount),
+			"concurrent query results are different from the single-threaded ones");
+}
+
+CON_COMMAND(physics_bullet_microbenchmark, "Time collision queries and print the time and allocations per call as JSON, "
+		"failing if traces or contact tests allocate memory after warming up. "
+		"Usage: physics_bullet_microbenchmark [iterations, 100000 by default] [.phy file path for VCollideLoad].") {
+	int iterationCount;
+	if (!GetCountArgument(args, 1, 100000, "iteration count", iterationCount)) {
+		return;
+	}
+	CPhysicsMicrobenchmark benchmark;
+	ReportCheckResult(args, benchmark.Run(iterationCount, args.ArgC() >= 3 ? args[2] : nullptr),
+			"allocations done by traces and contact tests after warming up");
+}
@@ -4,10 +4,15 @@
 #include "physics_collide.h"
 #include "physics_parse.h"
 #include "physics_object.h"
+#include "physics_threads.h"
+#include <BulletCollision/BroadphaseCollision/btDbvt.h>
+#include <LinearMath/btAabbUtil2.h>
 #include <LinearMath/btGeometryUtil.h>
 #include "mathlib/polyhedron.h"
 #include "mathlib/vplane.h"
 #include "tier0/dbg.h"
+#include "tier1/convar.h"
+#include "tier1/strtools.h"
 
 static CPhysicsCollision s_PhysCollision;
 CPhysicsCollision *g_pPhysCollision = &s_PhysCollision;
@@ -15,29 +20,17 @@ EXPOSE_SINGLE_INTERFACE_GLOBALVAR(CPhysicsCollision, IPhysicsCollision,
 		VPHYSICS_COLLISION_INTERFACE_VERSION, s_PhysCollision);
 
 CPhysicsCollision::CPhysicsCollision() :
-		m_InContactTest(false),
-		m_TraceBoxShape(btVector3(1.0f, 1.0f, 1.0f)),
-		m_TracePointShape(VPHYSICS_CONVEX_DISTANCE_MARGIN),
-		m_TraceConeShape(1.0f, 1.0f) {
-	m_TraceBoxShape.setMargin(VPHYSICS_CONVEX_DISTANCE_MARGIN);
-	m_TraceConeShape.setMargin(VPHYSICS_CONVEX_DISTANCE_MARGIN);
-
-	m_ContactTestCollisionConfiguration = VPhysicsNew(btDefaultCollisionConfiguration);
-	m_ContactTestDispatcher = VPhysicsNew(btCollisionDispatcher, m_ContactTestCollisionConfiguration);
-	m_ContactTestBroadphase = VPhysicsNew(btSimpleBroadphase, 2); // 0 is dangerous as it's array size.
-	m_ContactTestCollisionWorld = VPhysicsNew(btCollisionWorld,
-			m_ContactTestDispatcher, m_ContactTestBroadphase, m_ContactTestCollisionConfiguration);
+		m_BBoxCacheHits(0), m_BBoxCacheMisses(0),
+		m_FirstFreeHullCacheEntry(-1),
+		m_HullCacheHits(0), m_HullCacheMisses(0),
+		m_SphereCacheHits(0), m_SphereCacheMisses(0) {
+	memset(m_ThreadTraceContexts, 0, sizeof(m_ThreadTraceContexts));
 }
 
 CPhysicsCollision::~CPhysicsCollision() {
-	VPhysicsDelete(btCollisionWorld, m_ContactTestCollisionWorld);
-	VPhysicsDelete(btSimpleBroadphase, m_ContactTestBroadphase);
-	VPhysicsDelete(btCollisionDispatcher, m_ContactTestDispatcher);
-	VPhysicsDelete(btDefaultCollisionConfiguration, m_ContactTestCollisionConfiguration);
-
-	int sphereCount = m_SphereCache.Count();
+	int sphereCount = m_SphereCache.size();
 	for (int sphereIndex = 0; sphereIndex < sphereCount; ++sphereIndex) {
-		CPhysCollide_Sphere *sphere = m_SphereCache[sphereIndex];
+		CPhysCollide_Sphere *sphere = *m_SphereCache.getAtIndex(sphereIndex);
 		Assert(sphere->GetObjectReferenceList() == nullptr);
 		if (sphere->GetObjectReferenceList() != nullptr) {
 			DevMsg("Freed sphere collision model while in use!!!\n");
@@ -46,9 +39,9 @@ CPhysicsCollision::~CPhysicsCollision() {
 		sphere->Release();
 	}
 
-	int bboxCount = m_BBoxCache.Count();
+	int bboxCount = m_BBoxCache.size();
 	for (int bboxIndex = 0; bboxIndex < bboxCount; ++bboxIndex) {
-		CPhysCollide_Compound *bboxCompound = m_BBoxCache[bboxIndex];
+		CPhysCollide_Compound *bboxCompound = *m_BBoxCache.getAtIndex(bboxIndex);
 		Assert(bboxCompound->GetObjectReferenceList() == nullptr);
 		if (bboxCompound->GetObjectReferenceList() != nullptr) {
 			DevMsg("Freed bounding box collision model while in use!!!\n");
@@ -60,16 +53,57 @@ CPhysicsCollision::~CPhysicsCollision() {
 		bboxCompound->Release();
 		bboxConvex->Release();
 	}
+
+	for (int threadIndex = 0; threadIndex < BT_MAX_THREAD_COUNT; ++threadIndex) {
+		if (m_ThreadTraceContexts[threadIndex] != nullptr) {
+			VPhysicsDelete(CPhysicsTraceContext, m_ThreadTraceContexts[threadIndex]);
+		}
+	}
 }
 
 IPhysicsCollision *CPhysicsCollision::ThreadContextCreate() {
 	// IVP VPhysics v29 used to create a new CPhysicsCollision, but v31 returns this.
-	// Due to g_pPhysCollision references, and because object reference lists are thread-unsafe,
-	// this VPhysics implementation has to be single-threaded.
-	return this;
+	// Here, only the trace scratch objects are per-thread, as object reference lists are thread-unsafe.
+	return VPhysicsNew(CPhysicsCollisionThreadContext, this);
+}
+
+void CPhysicsCollision::ThreadContextDestroy(IPhysicsCollision *pThreadContext) {
+	if (pThreadContext == nullptr || pThreadContext == this) {
+		return;
+	}
+	VPhysicsDelete(CPhysicsCollisionThreadContext, pThreadContext);
+}
+
+CPhysicsTraceContext *CPhysicsCollision::GetThreadTraceContext() {
+	// Expected callers are the game's main thread and the physics thread pool workers, which get the low indices,
+	// but any engine or game thread doing environment queries may end up here.
+	// Indices are handed out again after btResetThreadIndexCounter when the pool is restarted,
+	// so the contexts of exited threads are reused by new ones rather than accumulating.
+	unsigned int threadIndex = btGetCurrentThreadIndex();
+	if (threadIndex >= BT_MAX_THREAD_COUNT) {
+		return nullptr;
+	}
+	// Only written by the thread owning the index, so no locking needed.
+	CPhysicsTraceContext *&context = m_ThreadTraceContexts[threadIndex];
+	if (context == nullptr) {
+		context = VPhysicsNew(CPhysicsTraceContext);
+	}
+	return context;
+}
+
+CPhysicsThreadTraceContextScope::CPhysicsThreadTraceContextScope(CPhysicsCollision &collision) {
+	m_Context = collision.GetThreadTraceContext();
+	m_Temporary = (m_Context == nullptr);
+	if (m_Temporary) {
+		m_Context = VPhysicsNew(CPhysicsTraceContext);
+	}
 }
 
-void CPhysicsCollision::ThreadContextDestroy(IPhysicsCollision *pThreadContext) {}
+CPhysicsThreadTraceContextScope::~CPhysicsThreadTraceContextScope() {
+	if (m_Temporary) {
+		VPhysicsDelete(CPhysicsTraceContext, m_Context);
+	}
+}
 
 /***************************
  * Serialization structures
@@ -85,6 +119,10 @@ void CPhysicsCollision::ThreadContextDestroy(IPhysicsCollision *pThreadContext)
 // To completely prevent loading Bullet collideables in IVP and
 // other VPhysics implementations, and also to version separately.
 #define VCOLLIDE_VERSION_BULLET 0x3b00
+#define VCOLLIDE_MODEL_TYPE_BULLET_COMPOUND 0
+#define VCOLLIDE_MODEL_TYPE_BULLET_SPHERE 1
+#define VCOLLIDE_BULLET_CONVEX_HULL 0
+#define VCOLLIDE_BULLET_CONVEX_BOX 1
 
 BEGIN_BYTESWAP_DATADESC(VCollide_SurfaceHeader)
 	DEFINE_FIELD(vphysicsID, FIELD_INTEGER),
@@ -133,6 +171,92 @@ BEGIN_BYTESWAP_DATADESC(VCollide_IVP_Compact_Surface)
 	DEFINE_ARRAY(dummy, FIELD_INTEGER, 3),
 END_BYTESWAP_DATADESC();
 
+BEGIN_BYTESWAP_DATADESC(VCollide_Bullet_Compound)
+	DEFINE_ARRAY(massCenter, FIELD_FLOAT, 3),
+	DEFINE_ARRAY(inertia, FIELD_FLOAT, 3),
+	DEFINE_FIELD(volume, FIELD_FLOAT),
+	DEFINE_FIELD(childCount, FIELD_INTEGER),
+END_BYTESWAP_DATADESC();
+
+BEGIN_BYTESWAP_DATADESC(VCollide_Bullet_Convex)
+	DEFINE_FIELD(convexType, FIELD_INTEGER),
+	DEFINE_FIELD(userIndex, FIELD_INTEGER),
+	DEFINE_ARRAY(origin, FIELD_FLOAT, 3),
+	DEFINE_FIELD(size, FIELD_INTEGER),
+END_BYTESWAP_DATADESC();
+
+BEGIN_BYTESWAP_DATADESC(VCollide_Bullet_Hull)
+	DEFINE_ARRAY(massCenter, FIELD_FLOAT, 3),
+	DEFINE_ARRAY(inertia, FIELD_FLOAT, 3),
+	DEFINE_FIELD(volume, FIELD_FLOAT),
+	DEFINE_FIELD(pointCount, FIELD_INTEGER),
+	DEFINE_FIELD(triangleCount, FIELD_INTEGER),
+	DEFINE_FIELD(facePlaneCount, FIELD_INTEGER),
+	DEFINE_FIELD(hasTriangleMaterials, FIELD_INTEGER),
+END_BYTESWAP_DATADESC();
+
+BEGIN_BYTESWAP_DATADESC(VCollide_Bullet_Box)
+	DEFINE_ARRAY(halfExtents, FIELD_FLOAT, 3),
+	DEFINE_ARRAY(originInCompound, FIELD_FLOAT, 3),
+END_BYTESWAP_DATADESC();
+
+BEGIN_BYTESWAP_DATADESC(VCollide_Bullet_Sphere)
+	DEFINE_FIELD(radius, FIELD_FLOAT),
+END_BYTESWAP_DATADESC();
+
+// Writing of Bullet collideables - if dest is null, only advances the position to calculate the size.
+
+template<typename T> static void WriteBulletCollideStruct(char *dest, int &position, CByteswap &byteswap, const T &data) {
+	if (dest != nullptr) {
+		byteswap.SwapFieldsToTargetEndian(reinterpret_cast<T *>(dest + position), const_cast<T *>(&data));
+	}
+	position += sizeof(T);
+}
+
+template<typename T> static void WriteBulletCollideArray(char *dest, int &position, CByteswap &byteswap,
+		const T *data, int count) {
+	if (dest != nullptr && count > 0) {
+		byteswap.SwapBufferToTargetEndian(reinterpret_cast<T *>(dest + position), const_cast<T *>(data), count);
+	}
+	position += count * sizeof(T);
+}
+
+// Positions are written with 0 as W, as btVector3 W may be uninitialized.
+static void WriteBulletCollideVectors(char *dest, int &position, CByteswap &byteswap,
+		const btVector3 *vectors, int count, bool writeW) {
+	for (int vectorIndex = 0; vectorIndex < count; ++vectorIndex) {
+		const btScalar *vector = vectors[vectorIndex];
+		float components[4] = {
+			(float) vector[0], (float) vector[1], (float) vector[2], writeW ? (float) vector[3] : 0.0f
+		};
+		WriteBulletCollideArray(dest, position, byteswap, components, 4);
+	}
+}
+
+// Reads btVector3 or btVector4 elements, with a plain copy if the layout is the same.
+template<typename VectorType> static const char *ReadBulletCollideVectors(const char *data, CByteswap &byteswap,
+		VectorType *vectors, int count) {
+	static_assert(sizeof(VectorType) == 4 * sizeof(btScalar), "Vectors must consist of 4 scalars.");
+#ifndef BT_USE_DOUBLE_PRECISION
+	if (!byteswap.IsSwappingBytes()) {
+		memcpy(vectors, data, count * 4 * sizeof(float));
+		return data + count * 4 * sizeof(float);
+	}
+#endif
+	for (int vectorIndex = 0; vectorIndex < count; ++vectorIndex) {
+		float components[4];
+		byteswap.SwapBufferToTargetEndian(components,
+				reinterpret_cast<float *>(const_cast<char *>(data)), 4);
+		data += sizeof(components);
+		btScalar *vector = vectors[vectorIndex];
+		vector[0] = components[0];
+		vector[1] = components[1];
+		vector[2] = components[2];
+		vector[3] = components[3];
+	}
+	return data;
+}
+
 /****************************************
  * Utility for convexes and collideables
  ****************************************/
@@ -168,6 +292,8 @@ float CPhysicsCollision::ConvexSurfaceArea(CPhysConvex *pConvex) {
 }
 
 void CPhysicsCollision::SetConvexGameData(CPhysConvex *pConvex, unsigned int gameData) {
+	// GetConvexesUsedInCollideable unshares the convexes it returns.
+	Assert(pConvex->GetOwner() != CPhysConvex::OWNER_SHARED);
 	pConvex->GetShape()->setUserIndex((int) gameData);
 }
 
@@ -188,6 +314,8 @@ void CPhysConvex_Hull::Initialize() {
 	m_MassCenter.setZero();
 	m_Inertia.setValue(1.0f, 1.0f, 1.0f);
 	m_Shape.setMargin(VPHYSICS_CONVEX_DISTANCE_MARGIN);
+	m_HullCacheEntry = -1;
+	m_FacePlanesCalculated = false;
 }
 
 CPhysConvex_Hull::CPhysConvex_Hull(const btVector3 *points, int pointCount,
@@ -267,6 +395,72 @@ CPhysConvex_Hull::CPhysConvex_Hull(
 	}
 }
 
+CPhysConvex_Hull::CPhysConvex_Hull(const btVector3 *points, const VCollide_Bullet_Hull &swappedHull,
+		const char *serializedArrays, CByteswap &byteswap) :
+		m_Shape(&points[0][0], swappedHull.pointCount) {
+	Initialize();
+	int triangleCount = swappedHull.triangleCount;
+	int indexCount = triangleCount * 3;
+	m_TriangleIndices.resizeNoInitialize(indexCount);
+	byteswap.SwapBufferToTargetEndian(&m_TriangleIndices[0],
+			reinterpret_cast<unsigned int *>(const_cast<char *>(serializedArrays)), indexCount);
+	serializedArrays += indexCount * sizeof(unsigned int);
+	if (swappedHull.facePlaneCount > 0) {
+		m_FacePlanes.resizeNoInitialize(swappedHull.facePlaneCount);
+		serializedArrays = ReadBulletCollideVectors(serializedArrays, byteswap,
+				&m_FacePlanes[0], swappedHull.facePlaneCount);
+	}
+	// Always calculated before serializing.
+	m_FacePlanesCalculated = true;
+	if (swappedHull.hasTriangleMaterials) {
+		m_TrianglePlanes.resizeNoInitialize(triangleCount);
+		serializedArrays = ReadBulletCollideVectors(serializedArrays, byteswap, &m_TrianglePlanes[0], triangleCount);
+		m_TriangleMaterials.resizeNoInitialize(triangleCount);
+		memcpy(&m_TriangleMaterials[0], serializedArrays, triangleCount * sizeof(m_TriangleMaterials[0]));
+	}
+	m_Volume = swappedHull.volume;
+	m_MassCenter.setValue(swappedHull.massCenter[0], swappedHull.massCenter[1], swappedHull.massCenter[2]);
+	m_Inertia.setValue(swappedHull.inertia[0], swappedHull.inertia[1], swappedHull.inertia[2]);
+}
+
+CPhysConvex_Hull *CPhysConvex_Hull::CreateFromSerialized(const btVector3 *points,
+		const VCollide_Bullet_Hull &swappedHull, const char *serializedArrays, int serializedArraysSize,
+		CByteswap &byteswap) {
+	if (swappedHull.pointCount <= 0 || swappedHull.triangleCount <= 0 || swappedHull.facePlaneCount < 0 ||
+			GetSerializedArraysSize(swappedHull) != serializedArraysSize) {
+		return nullptr;
+	}
+	// The indices are the first array.
+	unsigned int pointCount = (unsigned int) swappedHull.pointCount;
+	const unsigned int *indices = reinterpret_cast<const unsigned int *>(serializedArrays);
+	int indexCount = swappedHull.triangleCount * 3;
+	for (int indexIndex = 0; indexIndex < indexCount; ++indexIndex) {
+		unsigned int index;
+		byteswap.SwapBufferToTargetEndian(&index, const_cast<unsigned int *>(&indices[indexIndex]));
+		if (index >= pointCount) {
+			return nullptr;
+		}
+	}
+	return VPhysicsNew(CPhysConvex_Hull, points, swappedHull, serializedArrays, byteswap);
+}
+
+CPhysConvex_Hull::CPhysConvex_Hull(const CPhysConvex_Hull &other) :
+		m_Shape(&other.m_Shape.getUnscaledPoints()[0][0], other.m_Shape.getNumPoints()) {
+	Initialize();
+	m_Shape.setUserIndex(other.m_Shape.getUserIndex());
+	m_TriangleIndices = other.m_TriangleIndices;
+	m_TrianglePlanes = other.m_TrianglePlanes;
+	m_TriangleMaterials = other.m_TriangleMaterials;
+	// Calculated for the copy on first use if not calculated for the original yet.
+	if (other.m_FacePlanesCalculated) {
+		m_FacePlanes = other.m_FacePlanes;
+		m_FacePlanesCalculated = true;
+	}
+	m_Volume = other.m_Volume;
+	m_MassCenter = other.m_MassCenter;
+	m_Inertia = other.m_Inertia;
+}
+
 CPhysConvex_Hull *CPhysConvex_Hull::CreateFromBulletPoints(
 		HullLibrary &hullLibrary, const btVector3 *points, int pointCount) {
 	if (pointCount < 3) {
@@ -283,8 +477,23 @@ CPhysConvex_Hull *CPhysConvex_Hull::CreateFromBulletPoints(
 			&hull.m_Indices[0], hull.mNumFaces);
 }
 
+static FORCEINLINE const VCollide_IVP_Compact_Ledgetree_Node *GetIVPLedgetreeRoot(
+		const void *surface, int rootOffset) {
+	return reinterpret_cast<const VCollide_IVP_Compact_Ledgetree_Node *>(
+			reinterpret_cast<const byte *>(surface) + rootOffset);
+}
+
+static ConVar physics_bullet_dedupehulls("physics_bullet_dedupehulls", "1", 0,
+		"Share one hull between all identical ledges of IVP collision models.");
+
+bool CPhysicsCollision::IsIVPCompactLedgeConvertible(const VCollide_IVP_Compact_Ledge *ledge, CByteswap &byteswap) {
+	VCollide_IVP_Compact_Ledge swappedLedge;
+	byteswap.SwapBufferToTargetEndian(&swappedLedge, const_cast<VCollide_IVP_Compact_Ledge *>(ledge));
+	return swappedLedge.n_triangles > 0;
+}
+
 CPhysConvex_Hull *CPhysicsCollision::CreateConvexHullFromIVPCompactLedge(
-		const VCollide_IVP_Compact_Ledge *ledge, CByteswap &byteswap) {
+		const VCollide_IVP_Compact_Ledge *ledge, CByteswap &byteswap, IVPLedgeScratch_t &scratch) {
 	// IVP surfaces have a common array of points for all ledges, need to include only points referenced by triangles.
 
 	// Byte swapping triangles.
@@ -292,58 +501,269 @@ CPhysConvex_Hull *CPhysicsCollision::CreateConvexHullFromIVPCompactLedge(
 	byteswap.SwapBufferToTargetEndian(&swappedLedge, const_cast<VCollide_IVP_Compact_Ledge *>(ledge));
 	int triangleCount = swappedLedge.n_triangles;
 	if (triangleCount <= 0) {
-		return nullptr;
+		return nullptr; // Must match IsIVPCompactLedgeConvertible.
 	}
 	const VCollide_IVP_Compact_Triangle *triangles =
 			reinterpret_cast<const VCollide_IVP_Compact_Triangle *>(ledge + 1);
-	m_SwappedAndRemappedIVPTriangles.EnsureCount(triangleCount);
-	byteswap.SwapBufferToTargetEndian(&m_SwappedAndRemappedIVPTriangles[0],
+	CUtlVector<VCollide_IVP_Compact_Triangle> &swappedAndRemappedTriangles = scratch.m_SwappedAndRemappedTriangles;
+	swappedAndRemappedTriangles.EnsureCount(triangleCount);
+	byteswap.SwapBufferToTargetEndian(&swappedAndRemappedTriangles[0],
 			const_cast<VCollide_IVP_Compact_Triangle *>(triangles), triangleCount);
 
 	// Finding the first and the last points (for map size).
 	int pointFirst = INT_MAX, pointLast = 0;
 	for (int triangleIndex = 0; triangleIndex < triangleCount; ++triangleIndex) {
-		const VCollide_IVP_Compact_Triangle &triangle = m_SwappedAndRemappedIVPTriangles[triangleIndex];
+		const VCollide_IVP_Compact_Triangle &triangle = swappedAndRemappedTriangles[triangleIndex];
 		for (int vertexIndex = 0; vertexIndex < 3; ++vertexIndex) {
 			int pointIndex = (int) triangle.c_three_edges[vertexIndex].start_point_index;
 			pointFirst = MIN(pointIndex, pointFirst);
 			pointLast = MAX(pointIndex, pointLast);
 		}
 	}
-	m_IVPPointMap.EnsureCount(pointLast - pointFirst + 1);
-	memset(&m_IVPPointMap[0], 0xff, m_IVPPointMap.Count() * sizeof(m_IVPPointMap[0]));
+	CUtlVector<int> &pointMap = scratch.m_PointMap;
+	pointMap.EnsureCount(pointLast - pointFirst + 1);
+	memset(&pointMap[0], 0xff, pointMap.Count() * sizeof(pointMap[0]));
 
 	// Remapping the points that are actually used.
 	const VCollide_IVP_U_Float_Point *ivpPoints = reinterpret_cast<const VCollide_IVP_U_Float_Point *>(
 			reinterpret_cast<const byte *>(ledge) + swappedLedge.c_point_offset);
-	btAlignedObjectArray<btVector3> &points = GetHullCreationPointArray();
+	btAlignedObjectArray<btVector3> &points = scratch.m_Points;
 	points.resizeNoInitialize(0);
 	points.reserve(swappedLedge.get_n_points());
 	for (int triangleIndex = 0; triangleIndex < triangleCount; ++triangleIndex) {
-		VCollide_IVP_Compact_Triangle &triangle = m_SwappedAndRemappedIVPTriangles[triangleIndex];
+		VCollide_IVP_Compact_Triangle &triangle = swappedAndRemappedTriangles[triangleIndex];
 		for (int vertexIndex = 0; vertexIndex < 3; ++vertexIndex) {
 			VCollide_IVP_Compact_Edge &edge = triangle.c_three_edges[vertexIndex];
 			int pointIndexInMap = edge.start_point_index - pointFirst;
-			int pointRemappedIndex = m_IVPPointMap[pointIndexInMap];
+			int pointRemappedIndex = pointMap[pointIndexInMap];
 			if (pointRemappedIndex < 0) {
 				VCollide_IVP_U_Float_Point swappedPoint;
 				byteswap.SwapBufferToTargetEndian(&swappedPoint, const_cast<VCollide_IVP_U_Float_Point *>(&ivpPoints[edge.start_point_index]));
 				pointRemappedIndex = points.size();
 				points.push_back(btVector3(swappedPoint.k[0], -swappedPoint.k[1], -swappedPoint.k[2]));
-				m_IVPPointMap[pointIndexInMap] = pointRemappedIndex;
+				pointMap[pointIndexInMap] = pointRemappedIndex;
 			}
 			edge.start_point_index = pointRemappedIndex;
 		}
 	}
 
-	m_IVPPointMap.RemoveAll();
+	pointMap.RemoveAll();
+
+	// Props often share identical ledges, such as the pieces of crates and LODs.
+	bool dedupe = physics_bullet_dedupehulls.GetBool();
+	HullCacheKey_t key;
+	if (dedupe) {
+		key.m_Points = &points[0];
+		key.m_PointCount = points.size();
+		key.m_Triangles = &swappedAndRemappedTriangles[0];
+		key.m_TriangleCount = triangleCount;
+		key.m_UserIndex = swappedLedge.client_data;
+		key.m_Hash = HashHullCacheKey(key);
+		CPhysConvex_Hull *cachedHull = g_pPhysCollision->FindCachedHull(key);
+		if (cachedHull != nullptr) {
+			swappedAndRemappedTriangles.RemoveAll();
+			return cachedHull;
+		}
+	}
 
-	CPhysConvex_Hull *hull = VPhysicsNew(CPhysConvex_Hull, &m_SwappedAndRemappedIVPTriangles[0], triangleCount,
+	CPhysConvex_Hull *hull = VPhysicsNew(CPhysConvex_Hull, &swappedAndRemappedTriangles[0], triangleCount,
 			&points[0], points.size(), swappedLedge.client_data);
-	m_SwappedAndRemappedIVPTriangles.RemoveAll();
+	if (dedupe) {
+		hull = g_pPhysCollision->AddCachedHull(hull, key);
+	}
+	swappedAndRemappedTriangles.RemoveAll();
+	return hull;
+}
+
+/*************
+ * Hull cache
+ *************/
+
+// Only used for hashing, sharing requires the points to be exactly the same.
+#define HULL_CACHE_HASH_QUANTIZATION (1.0f / HL2BULLET(0.125f))
+
+static FORCEINLINE unsigned int HashCacheWord(unsigned int hash, unsigned int word) {
+	// FNV-1a on whole words.
+	return (hash ^ word) * 16777619u;
+}
+
+unsigned int CPhysicsCollision::HashHullCacheKey(const HullCacheKey_t &key) {
+	unsigned int hash = 2166136261u;
+	hash = HashCacheWord(hash, (unsigned int) key.m_PointCount);
+	hash = HashCacheWord(hash, (unsigned int) key.m_TriangleCount);
+	hash = HashCacheWord(hash, (unsigned int) key.m_UserIndex);
+	for (int pointIndex = 0; pointIndex < key.m_PointCount; ++pointIndex) {
+		const btVector3 &point = key.m_Points[pointIndex];
+		for (int axis = 0; axis < 3; ++axis) {
+			hash = HashCacheWord(hash, (unsigned int) (int) btFloor(point[axis] * HULL_CACHE_HASH_QUANTIZATION + 0.5f));
+		}
+	}
+	for (int triangleIndex = 0; triangleIndex < key.m_TriangleCount; ++triangleIndex) {
+		const VCollide_IVP_Compact_Triangle &triangle = key.m_Triangles[triangleIndex];
+		for (int vertexIndex = 0; vertexIndex < 3; ++vertexIndex) {
+			hash = HashCacheWord(hash, triangle.c_three_edges[vertexIndex].start_point_index);
+		}
+		hash = HashCacheWord(hash, triangle.material_index);
+	}
+	return hash;
+}
+
+bool CPhysicsCollision::HullMatchesCacheKey(const CPhysConvex_Hull *hull, const HullCacheKey_t &key) {
+	const btConvexHullShape *shape = hull->GetConvexHullShape();
+	if (shape->getNumPoints() != key.m_PointCount || hull->GetTriangleCount() != key.m_TriangleCount ||
+			shape->getUserIndex() != key.m_UserIndex) {
+		return false;
+	}
+	if (memcmp(shape->getUnscaledPoints(), key.m_Points, key.m_PointCount * sizeof(btVector3)) != 0) {
+		return false;
+	}
+	const unsigned int *indices = hull->GetTriangleIndices();
+	for (int triangleIndex = 0; triangleIndex < key.m_TriangleCount; ++triangleIndex) {
+		const VCollide_IVP_Compact_Triangle &triangle = key.m_Triangles[triangleIndex];
+		const unsigned int *triangleIndices = &indices[triangleIndex * 3];
+		if (triangleIndices[0] != triangle.c_three_edges[0].start_point_index ||
+				triangleIndices[1] != triangle.c_three_edges[1].start_point_index ||
+				triangleIndices[2] != triangle.c_three_edges[2].start_point_index ||
+				hull->GetTriangleMaterialIndex(triangleIndex) != (int) triangle.material_index) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int CPhysicsCollision::FindHullCacheEntry(const HullCacheKey_t &key) const {
+	const int *bucket = m_HullCacheBuckets.find((int) key.m_Hash);
+	if (bucket == nullptr) {
+		return -1;
+	}
+	int entryIndex = *bucket;
+	while (entryIndex >= 0) {
+		const HullCacheEntry_t &entry = m_HullCacheEntries[entryIndex];
+		if (entry.m_Hash == key.m_Hash && HullMatchesCacheKey(entry.m_Hull, key)) {
+			break;
+		}
+		entryIndex = entry.m_Next;
+	}
+	return entryIndex;
+}
+
+CPhysConvex_Hull *CPhysicsCollision::FindCachedHull(const HullCacheKey_t &key) {
+	AUTO_LOCK(m_HullCacheMutex);
+	int entryIndex = FindHullCacheEntry(key);
+	if (entryIndex < 0) {
+		return nullptr;
+	}
+	HullCacheEntry_t &entry = m_HullCacheEntries[entryIndex];
+	++entry.m_References;
+	++m_HullCacheHits;
+	return entry.m_Hull;
+}
+
+CPhysConvex_Hull *CPhysicsCollision::AddCachedHull(CPhysConvex_Hull *hull, const HullCacheKey_t &key) {
+	AUTO_LOCK(m_HullCacheMutex);
+	int entryIndex = FindHullCacheEntry(key);
+	if (entryIndex >= 0) {
+		// Converted on another thread at the same time.
+		hull->Release();
+		HullCacheEntry_t &entry = m_HullCacheEntries[entryIndex];
+		++entry.m_References;
+		++m_HullCacheHits;
+		return entry.m_Hull;
+	}
+	if (m_FirstFreeHullCacheEntry >= 0) {
+		entryIndex = m_FirstFreeHullCacheEntry;
+		m_FirstFreeHullCacheEntry = m_HullCacheEntries[entryIndex].m_Next;
+	} else {
+		entryIndex = m_HullCacheEntries.AddToTail();
+	}
+	HullCacheEntry_t &entry = m_HullCacheEntries[entryIndex];
+	entry.m_Hull = hull;
+	entry.m_Hash = key.m_Hash;
+	entry.m_References = 1;
+	const int *bucket = m_HullCacheBuckets.find((int) key.m_Hash);
+	entry.m_Next = (bucket != nullptr ? *bucket : -1);
+	m_HullCacheBuckets.insert((int) key.m_Hash, entryIndex);
+	hull->SetOwner(CPhysConvex::OWNER_SHARED);
+	hull->SetHullCacheEntry(entryIndex);
+	++m_HullCacheMisses;
 	return hull;
 }
 
+void CPhysicsCollision::AddCachedHullReference(CPhysConvex_Hull *hull) {
+	AUTO_LOCK(m_HullCacheMutex);
+	++m_HullCacheEntries[hull->GetHullCacheEntry()].m_References;
+}
+
+void CPhysicsCollision::ReleaseCachedHull(CPhysConvex_Hull *hull) {
+	AUTO_LOCK(m_HullCacheMutex);
+	int entryIndex = hull->GetHullCacheEntry();
+	HullCacheEntry_t &entry = m_HullCacheEntries[entryIndex];
+	Assert(entry.m_Hull == hull && entry.m_References > 0);
+	if (--entry.m_References > 0) {
+		return;
+	}
+
+	// Unlinking from the bucket.
+	int *bucket = m_HullCacheBuckets.find((int) entry.m_Hash);
+	if (*bucket == entryIndex) {
+		if (entry.m_Next >= 0) {
+			*bucket = entry.m_Next;
+		} else {
+			m_HullCacheBuckets.remove((int) entry.m_Hash);
+		}
+	} else {
+		int previousIndex = *bucket;
+		while (m_HullCacheEntries[previousIndex].m_Next != entryIndex) {
+			previousIndex = m_HullCacheEntries[previousIndex].m_Next;
+		}
+		m_HullCacheEntries[previousIndex].m_Next = entry.m_Next;
+	}
+
+	entry.m_Hull = nullptr;
+	entry.m_Next = m_FirstFreeHullCacheEntry;
+	m_FirstFreeHullCacheEntry = entryIndex;
+	m_CompoundConvexDeleteQueue.AddToTail(hull);
+}
+
+void CPhysicsCollision::PrintHullCacheStats() {
+	AUTO_LOCK(m_HullCacheMutex);
+	int hullCount = 0, referenceCount = 0, uniqueBytes = 0, savedBytes = 0;
+	for (int entryIndex = 0; entryIndex < m_HullCacheEntries.Count(); ++entryIndex) {
+		const HullCacheEntry_t &entry = m_HullCacheEntries[entryIndex];
+		if (entry.m_Hull == nullptr) {
+			continue;
+		}
+		int hullBytes = entry.m_Hull->GetMemorySize();
+		++hullCount;
+		referenceCount += entry.m_References;
+		uniqueBytes += hullBytes;
+		savedBytes += (entry.m_References - 1) * hullBytes;
+	}
+	unsigned int lookupCount = m_HullCacheHits + m_HullCacheMisses;
+	Msg("Hull cache: %d hulls, %d references, %d bytes, %d bytes saved.\n",
+			hullCount, referenceCount, uniqueBytes, savedBytes);
+	Msg("Since reset: %u hits, %u misses, %.1f%% hit rate.\n", m_HullCacheHits, m_HullCacheMisses,
+			lookupCount != 0 ? 100.0f * (float) m_HullCacheHits / (float) lookupCount : 0.0f);
+	if (!physics_bullet_dedupehulls.GetBool()) {
+		Msg("physics_bullet_dedupehulls is off, not deduplicating.\n");
+	}
+}
+
+void CPhysicsCollision::ResetHullCacheStats() {
+	AUTO_LOCK(m_HullCacheMutex);
+	m_HullCacheHits = 0;
+	m_HullCacheMisses = 0;
+}
+
+CON_COMMAND(physics_bullet_hullcache, "Print the number of hulls shared between IVP collision models "
+		"and the memory saved by sharing them. Use \"physics_bullet_hullcache reset\" to clear the hit rate.") {
+	if (args.ArgC() >= 2 && V_stricmp(args[1], "reset") == 0) {
+		g_pPhysCollision->ResetHullCacheStats();
+	} else {
+		g_pPhysCollision->PrintHullCacheStats();
+	}
+}
+
 void CPhysConvex_Hull::CalculateVolumeProperties() {
 	if (m_Volume >= 0.0f) {
 		return;
@@ -665,6 +1085,108 @@ void CPhysConvex_Hull::CalculateTrianglePlanes() {
 	}
 }
 
+// Only locked while calculating, which is done once per hull.
+static CThreadFastMutex s_FacePlaneCalculationMutex;
+
+void CPhysConvex_Hull::CalculateFacePlanes() const {
+	AUTO_LOCK(s_FacePlaneCalculationMutex);
+	if (m_FacePlanesCalculated) {
+		return; // Calculated on another thread while waiting.
+	}
+	CPhysConvex_Hull *hull = const_cast<CPhysConvex_Hull *>(this);
+	btAlignedObjectArray<btVector4> &facePlanes = hull->m_FacePlanes;
+	int pointCount = m_Shape.getNumPoints();
+	int triangleCount = m_TriangleIndices.size() / 3;
+	if (pointCount == 0 || triangleCount == 0) {
+		ThreadMemoryBarrier();
+		hull->m_FacePlanesCalculated = true;
+		return;
+	}
+	const btVector3 *points = &m_Shape.getPoints()[0];
+	// The average of the points is inside the hull, so the windings don't matter.
+	btVector3 center(0.0f, 0.0f, 0.0f);
+	for (int pointIndex = 0; pointIndex < pointCount; ++pointIndex) {
+		center += points[pointIndex];
+	}
+	center /= (btScalar) pointCount;
+	const unsigned int *indices = &m_TriangleIndices[0];
+	for (int triangleIndex = 0; triangleIndex < triangleCount; ++triangleIndex) {
+		int indexIndex = triangleIndex * 3;
+		const btVector3 &v1 = points[indices[indexIndex]];
+		btVector3 normal = (points[indices[indexIndex + 1]] - v1).cross(points[indices[indexIndex + 2]] - v1);
+		btScalar normalLength = normal.length();
+		if (normalLength < 1e-9f) {
+			continue;
+		}
+		normal /= normalLength;
+		btScalar dist = normal.dot(v1);
+		if (normal.dot(center) > dist) {
+			normal = -normal;
+			dist = -dist;
+		}
+		int planeCount = facePlanes.size();
+		int planeIndex;
+		for (planeIndex = 0; planeIndex < planeCount; ++planeIndex) {
+			const btVector4 &plane = facePlanes[planeIndex];
+			if (normal.dot(plane) > 0.99999f && btFabs(dist - plane.getW()) < 1e-4f) {
+				break;
+			}
+		}
+		if (planeIndex == planeCount) {
+			facePlanes.push_back(btVector4(normal.getX(), normal.getY(), normal.getZ(), dist));
+		}
+	}
+	// The planes must be complete before other threads see that they're calculated.
+	ThreadMemoryBarrier();
+	hull->m_FacePlanesCalculated = true;
+}
+
+int CPhysConvex_Hull::Serialize(char *dest, CByteswap &byteswap) const {
+	VCollide_Bullet_Hull hull;
+	btVector3 massCenter = GetMassCenter(), inertia = GetInertia();
+	for (int axis = 0; axis < 3; ++axis) {
+		hull.massCenter[axis] = massCenter[axis];
+		hull.inertia[axis] = inertia[axis];
+	}
+	hull.volume = GetVolume();
+	hull.pointCount = m_Shape.getNumPoints();
+	hull.triangleCount = m_TriangleIndices.size() / 3;
+	hull.facePlaneCount = GetFacePlaneCount();
+	hull.hasTriangleMaterials = (HasPerTriangleMaterials() ? 1 : 0);
+
+	int position = 0;
+	WriteBulletCollideStruct(dest, position, byteswap, hull);
+	WriteBulletCollideVectors(dest, position, byteswap, m_Shape.getPoints(), hull.pointCount, false);
+	WriteBulletCollideArray(dest, position, byteswap, &m_TriangleIndices[0], m_TriangleIndices.size());
+	if (hull.facePlaneCount > 0) {
+		WriteBulletCollideVectors(dest, position, byteswap, &m_FacePlanes[0], hull.facePlaneCount, true);
+	}
+	if (hull.hasTriangleMaterials) {
+		// Calculated along with the materials.
+		WriteBulletCollideVectors(dest, position, byteswap, &m_TrianglePlanes[0], hull.triangleCount, true);
+		WriteBulletCollideArray(dest, position, byteswap, &m_TriangleMaterials[0], hull.triangleCount);
+		static const unsigned char padding[3] = { 0, 0, 0 };
+		WriteBulletCollideArray(dest, position, byteswap, padding, ((hull.triangleCount + 3) & ~3) - hull.triangleCount);
+	}
+	return position;
+}
+
+int64 CPhysConvex_Hull::GetSerializedArraysSize(const VCollide_Bullet_Hull &swappedHull) {
+	int64 triangleCount = swappedHull.triangleCount;
+	int64 size = triangleCount * 3 * sizeof(unsigned int) + (int64) swappedHull.facePlaneCount * 4 * sizeof(float);
+	if (swappedHull.hasTriangleMaterials) {
+		size += triangleCount * 4 * sizeof(float) + ((triangleCount + 3) & ~3);
+	}
+	return size;
+}
+
+int CPhysConvex_Hull::GetMemorySize() const {
+	return (int) sizeof(*this) + m_Shape.getNumPoints() * (int) sizeof(btVector3) +
+			m_TriangleIndices.size() * (int) sizeof(unsigned int) +
+			m_TrianglePlanes.size() * (int) sizeof(btVector4) + m_TriangleMaterials.size() +
+			m_FacePlanes.size() * (int) sizeof(btVector4);
+}
+
 void CPhysConvex_Hull::Release() {
 	VPhysicsDelete(CPhysConvex_Hull, this);
 }
@@ -774,6 +1296,18 @@ void CPhysConvex_Box::GetTriangleVertices(int triangleIndex, btVector3 vertices[
 	}
 }
 
+int CPhysConvex_Box::Serialize(char *dest, CByteswap &byteswap) const {
+	VCollide_Bullet_Box box;
+	const btVector3 &halfExtents = m_Shape.getHalfExtentsWithoutMargin();
+	for (int axis = 0; axis < 3; ++axis) {
+		box.halfExtents[axis] = halfExtents[axis];
+		box.originInCompound[axis] = m_Origin[axis];
+	}
+	int position = 0;
+	WriteBulletCollideStruct(dest, position, byteswap, box);
+	return position;
+}
+
 void CPhysConvex_Box::Release() {
 	VPhysicsDelete(CPhysConvex_Box, this);
 }
@@ -793,6 +1327,22 @@ const unsigned int CPhysConvex_Box::s_BoxTriangleIndices[36] = {
 	5, 6, 7
 };
 
+// Cached bounding boxes with sizes rounded to the same multiple of this are shared.
+// Spheres are shared if their radii differ by less than this, like with the old linear search.
+#define COLLIDE_CACHE_QUANTUM HL2BULLET(0.1f)
+
+static FORCEINLINE int QuantizeCachedCollideSize(btScalar size) {
+	return (int) btFloor(size * (1.0f / COLLIDE_CACHE_QUANTUM) + 0.5f);
+}
+
+unsigned int CPhysicsCollision::BBoxCacheKey_t::getHash() const {
+	unsigned int hash = 2166136261u;
+	for (int valueIndex = 0; valueIndex < 6; ++valueIndex) {
+		hash = HashCacheWord(hash, (unsigned int) m_Values[valueIndex]);
+	}
+	return hash;
+}
+
 CPhysCollide_Compound *CPhysicsCollision::CreateBBox(const Vector &mins, const Vector &maxs) {
 	if (mins == maxs) {
 		return nullptr;
@@ -804,35 +1354,33 @@ CPhysCollide_Compound *CPhysicsCollision::CreateBBox(const Vector &mins, const V
 	btVector3 halfExtents = (bulletMaxs - bulletMins).absolute() * 0.5f;
 	btVector3 origin = (bulletMins + bulletMaxs) * 0.5f;
 
-	const btScalar threshold = HL2BULLET(0.1f);
-
-	for (int bboxIndex = m_BBoxCache.Count() - 1; bboxIndex >= 0; --bboxIndex) {
-		CPhysCollide_Compound *cacheCompound = m_BBoxCache[bboxIndex];
-		const CPhysConvex_Box *cacheBox = static_cast<const CPhysConvex_Box *>(
-				reinterpret_cast<const CPhysConvex *>(
-						cacheCompound->GetCompoundShape()->getChildShape(0)->getUserPointer()));
-		const btVector3 &cacheHalfExtents = cacheBox->GetBoxShape()->getHalfExtentsWithoutMargin();
-		const btVector3 &cacheOrigin = cacheBox->GetOriginInCompound();
-		for (int component = 0; component < 3; ++component) {
-			if (btFabs(cacheHalfExtents[component] - halfExtents[component]) > threshold ||
-					btFabs(cacheOrigin[component] - origin[component]) > threshold) {
-				cacheCompound = nullptr;
-				break;
-			}
-		}
-		if (cacheCompound != nullptr) {
-			return cacheCompound;
-		}
+	BBoxCacheKey_t key;
+	for (int component = 0; component < 3; ++component) {
+		key.m_Values[component] = QuantizeCachedCollideSize(halfExtents[component]);
+		key.m_Values[3 + component] = QuantizeCachedCollideSize(origin[component]);
 	}
+	CPhysCollide_Compound **cacheCompound = m_BBoxCache.find(key);
+	if (cacheCompound != nullptr) {
+		++m_BBoxCacheHits;
+		return *cacheCompound;
+	}
+	++m_BBoxCacheMisses;
 
 	CPhysConvex *box = VPhysicsNew(CPhysConvex_Box, halfExtents, origin);
 	box->SetOwner(CPhysConvex::OWNER_INTERNAL);
 	CPhysCollide_Compound *compound = VPhysicsNew(CPhysCollide_Compound, &box, 1);
 	compound->SetOwner(CPhysCollide::OWNER_INTERNAL);
-	m_BBoxCache.AddToTail(compound);
+	m_BBoxCache.insert(key, compound);
 	return compound;
 }
 
+bool CPhysicsCollision::GetBBoxCacheSize(int *pCachedSize, int *pCachedCount) {
+	int bboxCount = m_BBoxCache.size();
+	*pCachedSize = bboxCount * (int) (sizeof(CPhysCollide_Compound) + sizeof(CPhysConvex_Box));
+	*pCachedCount = bboxCount;
+	return true;
+}
+
 CPhysConvex *CPhysicsCollision::BBoxToConvex(const Vector &mins, const Vector &maxs) {
 	CPhysCollide_Compound *compound = CreateBBox(mins, maxs);
 	if (compound == nullptr) {
@@ -855,6 +1403,9 @@ void CPhysCollide::RemoveObjectReference(IPhysicsObject *object) {
 		m_ObjectReferenceList = static_cast<CPhysicsObject *>(object)->GetNextCollideObject();
 		if (m_ObjectReferenceList == object) {
 			m_ObjectReferenceList = nullptr;
+			if (GetOwner() == OWNER_INTERNAL && CPhysCollide_Sphere::IsSphere(this)) {
+				g_pPhysCollision->AddFreeCachedSphere(static_cast<CPhysCollide_Sphere *>(this));
+			}
 		}
 	}
 }
@@ -886,6 +1437,7 @@ void CPhysicsCollision::CollideGetAABB(Vector *pMins, Vector *pMaxs, const CPhys
 	ConvertPositionToBullet(collideOrigin, transform.getOrigin());
 	transform.getOrigin() += transform.getBasis() * pCollide->GetMassCenter();
 	btVector3 aabbMin, aabbMax;
+	pCollide->EnsureLoaded();
 	pCollide->GetShape()->getAabb(transform, aabbMin, aabbMax);
 	Vector hlAabbMin, hlAabbMax;
 	ConvertPositionToHL(aabbMin, hlAabbMin);
@@ -918,7 +1470,7 @@ void CPhysCollide::SetOrthographicAreas(const btVector3 &areas) {
 
 void CPhysCollide::ComputeOrthographicAreas(btScalar axisEpsilon) {
 	btCollisionShape *shape = GetShape();
-	btCollisionObject *collisionObject = g_pPhysCollision->GetTraceCollisionObject();
+	btCollisionObject *collisionObject = g_pPhysCollision->GetTraceContext().GetTraceCollisionObject();
 	collisionObject->setCollisionShape(shape);
 
 	// Fire rays in the following pattern (centers of the sides are always checked):
@@ -1034,7 +1586,16 @@ int CPhysicsCollision::CollideIndex(const CPhysCollide *pCollide) {
 int CPhysicsCollision::GetConvexesUsedInCollideable(const CPhysCollide *pCollideable,
 		CPhysConvex **pOutputArray, int iOutputArrayLimit) {
 	int convexCount = pCollideable->GetConvexes(pOutputArray, iOutputArrayLimit);
-	return MIN(convexCount, iOutputArrayLimit);
+	int outputCount = MIN(convexCount, iOutputArrayLimit);
+	// The game may modify the convexes, such as with SetConvexGameData.
+	if (CPhysCollide_Compound::IsCompound(pCollideable)) {
+		CPhysCollide_Compound *compound = const_cast<CPhysCollide_Compound *>(
+				static_cast<const CPhysCollide_Compound *>(pCollideable));
+		for (int convexIndex = 0; convexIndex < outputCount; ++convexIndex) {
+			pOutputArray[convexIndex] = compound->UnshareConvex(convexIndex);
+		}
+	}
+	return outputCount;
 }
 
 unsigned int CPhysicsCollision::ReadStat(int statID) {
@@ -1064,84 +1625,502 @@ void CPhysicsCollision::ClearTrace(trace_t *trace) {
 	trace->surface.name = "**empty**";
 }
 
-void CPhysicsCollision::TraceBox(const Ray_t &ray, unsigned int contentsMask,
-		IConvexInfo *pConvexInfo, const CPhysCollide *pCollide,
-		const Vector &collideOrigin, const QAngle &collideAngles, trace_t *ptr) {
-	ClearTrace(ptr);
+CPhysicsTraceContext::CPhysicsTraceContext() :
+		m_TraceBoxShape(btVector3(1.0f, 1.0f, 1.0f)),
+		m_TracePointShape(VPHYSICS_CONVEX_DISTANCE_MARGIN),
+		m_TraceConeShape(1.0f, 1.0f),
+		m_TraceSphereShape(1.0f),
+		m_InContactTest(false) {
+	m_TraceBoxShape.setMargin(VPHYSICS_CONVEX_DISTANCE_MARGIN);
+	m_TraceConeShape.setMargin(VPHYSICS_CONVEX_DISTANCE_MARGIN);
 
-	// Test shape.
-	if (!ray.m_IsRay) {
-		btVector3 halfExtents;
-		ConvertPositionToBullet(ray.m_Extents, halfExtents);
-		m_TraceBoxShape.setImplicitShapeDimensions(halfExtents.absolute());
-	}
+	// A contact test only has a single pair, so not reserving the default pools of 4096 manifolds and algorithms.
+	btDefaultCollisionConstructionInfo contactTestConstructionInfo;
+	contactTestConstructionInfo.m_defaultMaxPersistentManifoldPoolSize = 4;
+	contactTestConstructionInfo.m_defaultMaxCollisionAlgorithmPoolSize = 4;
+	m_ContactTestCollisionConfiguration = VPhysicsNew(btDefaultCollisionConfiguration, contactTestConstructionInfo);
+	m_ContactTestDispatcher = VPhysicsNew(btCollisionDispatcher, m_ContactTestCollisionConfiguration);
+	m_ContactTestBroadphase = VPhysicsNew(btSimpleBroadphase, 2); // 0 is dangerous as it's array size.
+	m_ContactTestCollisionWorld = VPhysicsNew(btCollisionWorld,
+			m_ContactTestDispatcher, m_ContactTestBroadphase, m_ContactTestCollisionConfiguration);
+}
 
-	// Target shape.
-	const btCollisionShape *colObjShape = pCollide->GetShape();
-	m_TraceCollisionObject.setCollisionShape(const_cast<btCollisionShape *>(colObjShape));
-	btTransform colObjWorldTransform;
-	ConvertRotationToBullet(collideAngles, colObjWorldTransform.getBasis());
-	ConvertPositionToBullet(collideOrigin - ray.m_Start, colObjWorldTransform.getOrigin());
-	colObjWorldTransform.getOrigin() += colObjWorldTransform.getBasis() * pCollide->GetMassCenter();
-	TraceContentsFilter contentsFilter(pConvexInfo, contentsMask, colObjShape);
+CPhysicsTraceContext::~CPhysicsTraceContext() {
+	for (int algorithmIndex = 0; algorithmIndex < m_ContactTestAlgorithms.Count(); ++algorithmIndex) {
+		btCollisionAlgorithm *algorithm = m_ContactTestAlgorithms[algorithmIndex].m_Algorithm;
+		algorithm->~btCollisionAlgorithm();
+		m_ContactTestDispatcher->freeCollisionAlgorithm(algorithm);
+	}
+	VPhysicsDelete(btCollisionWorld, m_ContactTestCollisionWorld);
+	VPhysicsDelete(btSimpleBroadphase, m_ContactTestBroadphase);
+	VPhysicsDelete(btCollisionDispatcher, m_ContactTestDispatcher);
+	VPhysicsDelete(btDefaultCollisionConfiguration, m_ContactTestCollisionConfiguration);
+}
 
-	// Ray (for simplicity and precision, starting at zero).
-	btTransform rayToTransform;
-	ConvertPositionToBullet(ray.m_Delta, rayToTransform.getOrigin()); // Basis not needed yet.
-	btScalar rayLength2 = rayToTransform.getOrigin().length2();
-	bool isSwept = (rayLength2 > 1e-6f);
+void CPhysicsCollision::TraceBox(const Ray_t &ray, unsigned int contentsMask,
+		IConvexInfo *pConvexInfo, const CPhysCollide *pCollide,
+		const Vector &collideOrigin, const QAngle &collideAngles, trace_t *ptr) {
+	m_TraceContext.TraceBox(ray, contentsMask, pConvexInfo, pCollide, collideOrigin, collideAngles, ptr);
+}
 
-	// Some defaults, unknown hit normal will be handled later.
-	btVector3 hitNormal(0.0f, 0.0f, 0.0f);
-	btVector3 hitPoint = rayToTransform.getOrigin();
+void CPhysicsCollision::TraceCollide(const Vector &start, const Vector &end,
+		const CPhysCollide *pSweepCollide, const QAngle &sweepAngles, const CPhysCollide *pCollide,
+		const Vector &collideOrigin, const QAngle &collideAngles, trace_t *ptr) {
+	m_TraceContext.TraceCollide(start, end, pSweepCollide, sweepAngles, pCollide, collideOrigin, collideAngles, ptr);
+}
 
-	// First, try contact test because ray and convex tests don't report starting in a solid.
-	if (ray.m_IsRay) {
-		m_ContactTestCollisionObject.setCollisionShape(&m_TracePointShape);
-	} else {
-		m_ContactTestCollisionObject.setCollisionShape(&m_TraceBoxShape);
+bool CPhysicsCollision::IsBoxIntersectingCone(
+		const Vector &boxAbsMins, const Vector &boxAbsMaxs, const truncatedcone_t &cone) {
+	return m_TraceContext.IsBoxIntersectingCone(boxAbsMins, boxAbsMaxs, cone);
+}
+
+static ConVar physics_bullet_trace_analytic("physics_bullet_trace_analytic", "1", 0,
+		"Trace rays against spheres, boxes and small hulls, and boxes against boxes with the same axes, "
+		"without the generic collision tests.");
+
+// Hulls with more faces are traced with the generic tests.
+#define VPHYSICS_ANALYTIC_TRACE_MAX_HULL_PLANES 64
+// Compounds with more children are tested for starting in a solid with the contact test, which culls children.
+#define VPHYSICS_PLANE_START_SOLID_MAX_CHILDREN 16
+
+// Intersections of the segment from start to start + delta with convex shapes centered at the origin.
+// If the segment starts inside, the fraction is 0 and the normal is of the face closest to the start.
+
+static bool ClipSegmentToSlabs(const btVector3 &start, const btVector3 &delta, const btVector3 &halfExtents,
+		btScalar &fraction, btVector3 &normal) {
+	btScalar enter = -BT_LARGE_FLOAT, exit = 1.0f;
+	int enterAxis = -1;
+	for (int axis = 0; axis < 3; ++axis) {
+		btScalar axisStart = start[axis], axisDelta = delta[axis], axisExtent = halfExtents[axis];
+		if (btFabs(axisDelta) < 1e-9f) {
+			if (btFabs(axisStart) > axisExtent) {
+				return false;
+			}
+			continue;
+		}
+		btScalar inverseDelta = 1.0f / axisDelta;
+		btScalar axisEnter = (-axisExtent - axisStart) * inverseDelta;
+		btScalar axisExit = (axisExtent - axisStart) * inverseDelta;
+		if (axisEnter > axisExit) {
+			btSwap(axisEnter, axisExit);
+		}
+		if (axisEnter > enter) {
+			enter = axisEnter;
+			enterAxis = axis;
+		}
+		exit = btMin(exit, axisExit);
+		if (enter > exit) {
+			return false;
+		}
 	}
-	m_ContactTestCollisionObject.setWorldTransform(btTransform::getIdentity());
-	m_TraceCollisionObject.setWorldTransform(colObjWorldTransform);
-	ContactTestResultCallback contactTestResult(&m_ContactTestCollisionObject, &contentsFilter);
-	m_InContactTest = true;
-	m_ContactTestCollisionWorld->contactPairTest(&m_ContactTestCollisionObject, &m_TraceCollisionObject, contactTestResult);
-	m_InContactTest = false;
+	if (exit < 0.0f) {
+		return false;
+	}
+	normal.setZero();
+	if (enter >= 0.0f) {
+		fraction = enter;
+		normal[enterAxis] = (delta[enterAxis] > 0.0f ? -1.0f : 1.0f);
+		return true;
+	}
+	fraction = 0.0f;
+	int closestAxis = 0;
+	btScalar closestDistance = -BT_LARGE_FLOAT;
+	for (int axis = 0; axis < 3; ++axis) {
+		btScalar distance = btFabs(start[axis]) - halfExtents[axis];
+		if (distance > closestDistance) {
+			closestDistance = distance;
+			closestAxis = axis;
+		}
+	}
+	normal[closestAxis] = (start[closestAxis] < 0.0f ? -1.0f : 1.0f);
+	return true;
+}
 
-	if (contactTestResult.m_Hit) {
+static bool ClipSegmentToSphere(const btVector3 &start, const btVector3 &delta, btScalar radius,
+		btScalar &fraction, btVector3 &normal) {
+	btScalar startDistance2 = start.length2();
+	if (startDistance2 <= radius * radius) {
+		fraction = 0.0f;
+		normal = (startDistance2 > 1e-12f ? start / btSqrt(startDistance2) : -delta.normalized());
+		return true;
+	}
+	btScalar b = start.dot(delta);
+	if (b >= 0.0f) {
+		return false;
+	}
+	btScalar a = delta.length2();
+	btScalar discriminant = b * b - a * (startDistance2 - radius * radius);
+	if (discriminant < 0.0f) {
+		return false;
+	}
+	fraction = (-b - btSqrt(discriminant)) / a;
+	if (fraction > 1.0f) {
+		return false;
+	}
+	normal = (start + delta * fraction) / radius;
+	return true;
+}
+
+// The planes are expanded by the margin.
+static bool ClipSegmentToPlanes(const btVector3 &start, const btVector3 &delta,
+		const btVector4 *planes, int planeCount, btScalar margin, btScalar &fraction, btVector3 &normal) {
+	btScalar enter = -BT_LARGE_FLOAT, exit = 1.0f;
+	int enterPlane = -1, closestPlane = 0;
+	btScalar closestDistance = -BT_LARGE_FLOAT;
+	for (int planeIndex = 0; planeIndex < planeCount; ++planeIndex) {
+		const btVector4 &plane = planes[planeIndex];
+		btScalar distance = plane.dot(start) - (plane.getW() + margin);
+		if (distance > closestDistance) {
+			closestDistance = distance;
+			closestPlane = planeIndex;
+		}
+		btScalar planeDelta = plane.dot(delta);
+		if (btFabs(planeDelta) < 1e-9f) {
+			if (distance > 0.0f) {
+				return false;
+			}
+			continue;
+		}
+		btScalar planeFraction = -distance / planeDelta;
+		if (planeDelta < 0.0f) {
+			if (planeFraction > enter) {
+				enter = planeFraction;
+				enterPlane = planeIndex;
+			}
+		} else {
+			exit = btMin(exit, planeFraction);
+		}
+		if (enter > exit) {
+			return false;
+		}
+	}
+	if (exit < 0.0f) {
+		return false;
+	}
+	if (enter >= 0.0f) {
+		fraction = enter;
+		normal = planes[enterPlane];
+	} else {
+		fraction = 0.0f;
+		normal = planes[closestPlane];
+	}
+	normal.setW(0.0f);
+	return true;
+}
+
+bool CPhysicsTraceContext::TraceBoxAnalytic(const Ray_t &ray, const btVector3 &rayDelta, bool isSwept,
+		const btCollisionShape *shape, const btTransform &shapeWorldTransform,
+		const TraceContentsFilter &contentsFilter, btVector3 &hitNormal, btVector3 &hitPoint, trace_t *ptr) {
+	if (!physics_bullet_trace_analytic.GetBool()) {
+		return false;
+	}
+
+	const btCollisionShape *convexShape = shape;
+	btTransform convexTransform = shapeWorldTransform;
+	if (shape->isCompound()) {
+		const btCompoundShape *compoundShape = static_cast<const btCompoundShape *>(shape);
+		if (compoundShape->getNumChildShapes() != 1) {
+			return false;
+		}
+		convexShape = compoundShape->getChildShape(0);
+		convexTransform = shapeWorldTransform * compoundShape->getChildTransform(0);
+	}
+
+	// The ray in the space of the shape.
+	const btMatrix3x3 &basis = convexTransform.getBasis();
+	btVector3 start = -convexTransform.getOrigin() * basis;
+	btVector3 delta = rayDelta * basis;
+
+	// Solid if penetrating by more than 2 margins, like in the contact test.
+	bool solid = false, hit = false;
+	btScalar fraction;
+	btVector3 normal;
+	btVector3 traceHalfExtents(0.0f, 0.0f, 0.0f);
+	switch (convexShape->getShapeType()) {
+	case SPHERE_SHAPE_PROXYTYPE: {
+		if (!ray.m_IsRay) {
+			return false;
+		}
+		btScalar radius = static_cast<const btSphereShape *>(convexShape)->getRadius();
+		btScalar solidRadius = radius - VPHYSICS_CONVEX_DISTANCE_MARGIN;
+		solid = (solidRadius > 0.0f && start.length2() < solidRadius * solidRadius);
+		hit = (!solid && isSwept && ClipSegmentToSphere(start, delta, radius, fraction, normal));
+		break;
+	}
+	case BOX_SHAPE_PROXYTYPE: {
+		const btBoxShape *boxShape = static_cast<const btBoxShape *>(convexShape);
+		btVector3 solidHalfExtents = boxShape->getImplicitShapeDimensions();
+		btVector3 clipHalfExtents = solidHalfExtents + btVector3(1.0f, 1.0f, 1.0f) * boxShape->getMargin();
+		if (!ray.m_IsRay) {
+			// Boxes with the same axes sum into a box.
+			for (int axis = 0; axis < 3; ++axis) {
+				if (btFabs(basis[axis][axis]) < 1.0f - 1e-5f) {
+					return false;
+				}
+			}
+			traceHalfExtents = m_TraceBoxShape.getImplicitShapeDimensions() +
+					btVector3(1.0f, 1.0f, 1.0f) * m_TraceBoxShape.getMargin();
+			solidHalfExtents += m_TraceBoxShape.getImplicitShapeDimensions();
+			clipHalfExtents += traceHalfExtents;
+		}
+		solid = (btFabs(start.getX()) < solidHalfExtents.getX() &&
+				btFabs(start.getY()) < solidHalfExtents.getY() &&
+				btFabs(start.getZ()) < solidHalfExtents.getZ());
+		hit = (!solid && isSwept && ClipSegmentToSlabs(start, delta, clipHalfExtents, fraction, normal));
+		break;
+	}
+	case CONVEX_HULL_SHAPE_PROXYTYPE: {
+		if (!ray.m_IsRay) {
+			return false;
+		}
+		const CPhysConvex_Hull *hull = reinterpret_cast<const CPhysConvex_Hull *>(convexShape->getUserPointer());
+		int planeCount = hull->GetFacePlaneCount();
+		if (planeCount == 0 || planeCount > VPHYSICS_ANALYTIC_TRACE_MAX_HULL_PLANES) {
+			return false;
+		}
+		const btVector4 *planes = hull->GetFacePlanes();
+		solid = true;
+		for (int planeIndex = 0; planeIndex < planeCount; ++planeIndex) {
+			if (planes[planeIndex].dot(start) >= planes[planeIndex].getW()) {
+				solid = false;
+				break;
+			}
+		}
+		hit = (!solid && isSwept && ClipSegmentToPlanes(start, delta, planes, planeCount,
+				convexShape->getMargin(), fraction, normal));
+		break;
+	}
+	default:
+		return false;
+	}
+
+	unsigned int contents = contentsFilter.Hit(0);
+	if (contents == 0) {
+		return true;
+	}
+	if (solid) {
 		ptr->fraction = 0.0f;
 		ptr->startsolid = ptr->allsolid = true;
-		if (ray.m_IsRay) {
-			hitPoint.setZero();
-		} else {
-			hitNormal = contactTestResult.m_ShallowestHitNormal;
-			hitPoint = contactTestResult.m_ShallowestHitPoint;
+		ptr->contents = contents;
+		hitPoint.setZero();
+	} else if (hit) {
+		ptr->fraction = fraction;
+		ptr->contents = contents;
+		hitNormal = basis * normal;
+		// For boxes, the point on the surface of the hit shape rather than the center of the swept box.
+		hitPoint = rayDelta * fraction - hitNormal * normal.absolute().dot(traceHalfExtents);
+	}
+	return true;
+}
+
+CPhysicsTraceContext::StartSolid_t CPhysicsTraceContext::TestStartSolidWithFacePlanes(
+		const btCollisionShape *shape, const btTransform &shapeWorldTransform,
+		const btVector3 &traceHalfExtents, const TraceContentsFilter &contentsFilter,
+		unsigned int &contents, btVector3 &hitNormal, btVector3 &hitPoint) {
+	if (!shape->isCompound()) {
+		return START_SOLID_UNKNOWN;
+	}
+	const btCompoundShape *compoundShape = static_cast<const btCompoundShape *>(shape);
+	int childCount = compoundShape->getNumChildShapes();
+	if (childCount > VPHYSICS_PLANE_START_SOLID_MAX_CHILDREN) {
+		return START_SOLID_UNKNOWN;
+	}
+
+	// Solid if penetrating by more than 2 margins, like in the contact test - if the shapes without margins overlap.
+	// Overlapping for sure if the center of the trace box is inside a child,
+	// not overlapping for sure if the box is in front of a face of every child.
+	// Like the contact test, reporting the child penetrated the least, through the face it's penetrated the least,
+	// so all children must be known to be either overlapping or not.
+	bool solid = false;
+	btScalar shallowestPenetration = BT_LARGE_FLOAT;
+	for (int childIndex = 0; childIndex < childCount; ++childIndex) {
+		unsigned int childContents = contentsFilter.Hit(childIndex);
+		if (childContents == 0) {
+			continue;
 		}
-		ptr->contents = contactTestResult.m_ShallowestHitContents;
-	} else if (isSwept) {
-		// Not starting in a solid and need to cast a ray/convex.
-		rayToTransform.getBasis().setIdentity();
-		if (ray.m_IsRay) {
-			RayTestResultCallback rayTestResult(&contentsFilter, colObjWorldTransform.getBasis());
-			btCollisionWorld::rayTestSingle(btTransform::getIdentity(), rayToTransform,
-					&m_TraceCollisionObject, colObjShape, colObjWorldTransform, rayTestResult);
-			if (rayTestResult.m_collisionObject != nullptr) {
-				ptr->fraction = rayTestResult.m_closestHitFraction;
-				hitNormal = rayTestResult.m_ClosestHitNormal;
-				hitPoint = rayToTransform.getOrigin() * rayTestResult.m_closestHitFraction;
-				ptr->contents = rayTestResult.m_ClosestHitContents;
+		const btCollisionShape *childShape = compoundShape->getChildShape(childIndex);
+		btTransform childTransform = shapeWorldTransform * compoundShape->getChildTransform(childIndex);
+		const btMatrix3x3 &basis = childTransform.getBasis();
+		btVector3 start = -childTransform.getOrigin() * basis;
+
+		bool inside = true, separated = false;
+		// The face penetrated the least while inside, in the child space.
+		btScalar childPenetration = BT_LARGE_FLOAT, childFaceDistance = 0.0f;
+		btVector3 childNormal(0.0f, 0.0f, 0.0f);
+		switch (childShape->getShapeType()) {
+		case BOX_SHAPE_PROXYTYPE: {
+			const btVector3 &halfExtents = static_cast<const btBoxShape *>(childShape)->getImplicitShapeDimensions();
+			for (int axis = 0; axis < 3; ++axis) {
+				btScalar distance = btFabs(start[axis]) - halfExtents[axis];
+				// Trace box radius along the child axis.
+				btScalar projectedHalfExtent = basis.getColumn(axis).absolute().dot(traceHalfExtents);
+				if (distance >= 0.0f) {
+					inside = false;
+					if (distance > projectedHalfExtent) {
+						separated = true;
+						break;
+					}
+				}
+				btScalar penetration = projectedHalfExtent - distance;
+				if (penetration < childPenetration) {
+					childPenetration = penetration;
+					childFaceDistance = distance;
+					childNormal.setZero();
+					childNormal[axis] = (start[axis] < 0.0f ? -1.0f : 1.0f);
+				}
 			}
-		} else {
-			ConvexTestResultCallback convexTestResult(&contentsFilter, colObjWorldTransform.getBasis());
-			btCollisionWorld::objectQuerySingle(
-					&m_TraceBoxShape, btTransform::getIdentity(), rayToTransform,
-					&m_TraceCollisionObject, colObjShape, colObjWorldTransform, convexTestResult,
-					2.0f * VPHYSICS_CONVEX_DISTANCE_MARGIN);
-			if (convexTestResult.m_HitCollisionObject != nullptr) {
-				ptr->fraction = convexTestResult.m_closestHitFraction;
-				hitNormal = convexTestResult.m_ClosestHitNormal;
-				hitPoint = convexTestResult.m_ClosestHitPoint;
-				ptr->contents = convexTestResult.m_ClosestHitContents;
+			break;
+		}
+		case CONVEX_HULL_SHAPE_PROXYTYPE: {
+			const CPhysConvex_Hull *hull = reinterpret_cast<const CPhysConvex_Hull *>(childShape->getUserPointer());
+			int planeCount = hull->GetFacePlaneCount();
+			if (planeCount == 0) {
+				return START_SOLID_UNKNOWN;
+			}
+			const btVector4 *planes = hull->GetFacePlanes();
+			for (int planeIndex = 0; planeIndex < planeCount; ++planeIndex) {
+				const btVector4 &plane = planes[planeIndex];
+				btScalar distance = plane.dot(start) - plane.getW();
+				btScalar projectedHalfExtent = (basis * plane).absolute().dot(traceHalfExtents);
+				if (distance >= 0.0f) {
+					inside = false;
+					if (distance > projectedHalfExtent) {
+						separated = true;
+						break;
+					}
+				}
+				btScalar penetration = projectedHalfExtent - distance;
+				if (penetration < childPenetration) {
+					childPenetration = penetration;
+					childFaceDistance = distance;
+					childNormal.setValue(plane.getX(), plane.getY(), plane.getZ());
+				}
+			}
+			break;
+		}
+		default:
+			return START_SOLID_UNKNOWN;
+		}
+
+		if (separated) {
+			continue;
+		}
+		if (!inside) {
+			// A point is either inside or separated, but a box may be touching an edge.
+			return START_SOLID_UNKNOWN;
+		}
+		if (childPenetration < shallowestPenetration) {
+			solid = true;
+			shallowestPenetration = childPenetration;
+			contents = childContents;
+			hitNormal = basis * childNormal;
+			// On the face expanded by the margin, like the contact points, closest to the center of the trace box.
+			hitPoint = hitNormal * (childShape->getMargin() - childFaceDistance);
+		}
+	}
+	return solid ? START_SOLID_YES : START_SOLID_NO;
+}
+
+void CPhysicsTraceContext::TraceBox(const Ray_t &ray, unsigned int contentsMask,
+		IConvexInfo *pConvexInfo, const CPhysCollide *pCollide,
+		const Vector &collideOrigin, const QAngle &collideAngles, trace_t *ptr) {
+	CPhysicsCollision::ClearTrace(ptr);
+
+	// Test shape.
+	if (!ray.m_IsRay) {
+		btVector3 halfExtents;
+		ConvertPositionToBullet(ray.m_Extents, halfExtents);
+		m_TraceBoxShape.setImplicitShapeDimensions(halfExtents.absolute());
+	}
+
+	// Target shape.
+	pCollide->EnsureLoaded();
+	const btCollisionShape *colObjShape = pCollide->GetShape();
+	m_TraceCollisionObject.setCollisionShape(const_cast<btCollisionShape *>(colObjShape));
+	btTransform colObjWorldTransform;
+	ConvertRotationToBullet(collideAngles, colObjWorldTransform.getBasis());
+	ConvertPositionToBullet(collideOrigin - ray.m_Start, colObjWorldTransform.getOrigin());
+	colObjWorldTransform.getOrigin() += colObjWorldTransform.getBasis() * pCollide->GetMassCenter();
+	TraceContentsFilter contentsFilter(pConvexInfo, contentsMask, colObjShape);
+
+	// Ray (for simplicity and precision, starting at zero).
+	btTransform rayToTransform;
+	ConvertPositionToBullet(ray.m_Delta, rayToTransform.getOrigin()); // Basis not needed yet.
+	btScalar rayLength2 = rayToTransform.getOrigin().length2();
+	bool isSwept = (rayLength2 > 1e-6f);
+
+	// Some defaults, unknown hit normal will be handled later.
+	btVector3 hitNormal(0.0f, 0.0f, 0.0f);
+	btVector3 hitPoint = rayToTransform.getOrigin();
+
+	// Simple shapes are tested directly without the dispatcher, the algorithms and the manifolds.
+	if (!TraceBoxAnalytic(ray, rayToTransform.getOrigin(), isSwept, colObjShape, colObjWorldTransform,
+			contentsFilter, hitNormal, hitPoint, ptr)) {
+		// First, check if starting in a solid because ray and convex tests don't report that.
+		// The face planes of boxes and hulls are enough in most cases, otherwise doing the contact test.
+		m_TraceCollisionObject.setWorldTransform(colObjWorldTransform);
+		btVector3 traceHalfExtents(0.0f, 0.0f, 0.0f);
+		if (!ray.m_IsRay) {
+			traceHalfExtents = m_TraceBoxShape.getImplicitShapeDimensions();
+		}
+		unsigned int startSolidContents = CONTENTS_SOLID;
+		btVector3 startSolidNormal, startSolidPoint;
+		StartSolid_t startSolid = TestStartSolidWithFacePlanes(colObjShape, colObjWorldTransform,
+				traceHalfExtents, contentsFilter, startSolidContents, startSolidNormal, startSolidPoint);
+		ContactTestResultCallback contactTestResult(&m_ContactTestCollisionObject, &contentsFilter);
+		if (startSolid == START_SOLID_UNKNOWN) {
+			if (ray.m_IsRay) {
+				m_ContactTestCollisionObject.setCollisionShape(&m_TracePointShape);
+			} else {
+				m_ContactTestCollisionObject.setCollisionShape(&m_TraceBoxShape);
+			}
+			m_ContactTestCollisionObject.setWorldTransform(btTransform::getIdentity());
+			m_InContactTest = true;
+			ContactTest(contactTestResult);
+			m_InContactTest = false;
+			if (contactTestResult.m_Hit) {
+				startSolid = START_SOLID_YES;
+				startSolidContents = contactTestResult.m_ShallowestHitContents;
+				startSolidNormal = contactTestResult.m_ShallowestHitNormal;
+				startSolidPoint = contactTestResult.m_ShallowestHitPoint;
+			}
+		}
+
+		if (startSolid == START_SOLID_YES) {
+			ptr->fraction = 0.0f;
+			ptr->startsolid = ptr->allsolid = true;
+			if (ray.m_IsRay) {
+				hitPoint.setZero();
+			} else {
+				hitNormal = startSolidNormal;
+				hitPoint = startSolidPoint;
+			}
+			ptr->contents = startSolidContents;
+		} else if (isSwept) {
+			// Not starting in a solid and need to cast a ray/convex.
+			rayToTransform.getBasis().setIdentity();
+			if (ray.m_IsRay) {
+				RayTestResultCallback rayTestResult(&contentsFilter, colObjWorldTransform.getBasis());
+				btCollisionWorld::rayTestSingle(btTransform::getIdentity(), rayToTransform,
+						&m_TraceCollisionObject, colObjShape, colObjWorldTransform, rayTestResult);
+				if (rayTestResult.m_collisionObject != nullptr) {
+					ptr->fraction = rayTestResult.m_closestHitFraction;
+					hitNormal = rayTestResult.m_ClosestHitNormal;
+					hitPoint = rayToTransform.getOrigin() * rayTestResult.m_closestHitFraction;
+					ptr->contents = rayTestResult.m_ClosestHitContents;
+				}
+			} else {
+				ConvexTestResultCallback convexTestResult(&contentsFilter, colObjWorldTransform.getBasis());
+				btCollisionWorld::objectQuerySingle(
+						&m_TraceBoxShape, btTransform::getIdentity(), rayToTransform,
+						&m_TraceCollisionObject, colObjShape, colObjWorldTransform, convexTestResult,
+						2.0f * VPHYSICS_CONVEX_DISTANCE_MARGIN);
+				if (convexTestResult.m_HitCollisionObject != nullptr) {
+					ptr->fraction = convexTestResult.m_closestHitFraction;
+					hitNormal = convexTestResult.m_ClosestHitNormal;
+					hitPoint = convexTestResult.m_ClosestHitPoint;
+					ptr->contents = convexTestResult.m_ClosestHitContents;
+				}
 			}
 		}
 	}
@@ -1177,10 +2156,49 @@ void CPhysicsCollision::TraceBox(const Ray_t &ray, const CPhysCollide *pCollide,
 	TraceBox(ray, MASK_ALL, nullptr, pCollide, collideOrigin, collideAngles, ptr);
 }
 
-void CPhysicsCollision::TraceCollide(const Vector &start, const Vector &end,
+struct CompoundChildCollector : public btDbvt::ICollide {
+	CUtlVector<int> &m_Children;
+
+	CompoundChildCollector(CUtlVector<int> &children) : m_Children(children) {}
+
+	void Process(const btDbvtNode *leaf) {
+		m_Children.AddToTail(leaf->dataAsInt);
+	}
+};
+
+static int CompareCompoundChildIndices(const int *index1, const int *index2) {
+	return *index1 - *index2;
+}
+
+// Gets the children of the compound whose bounds overlap the local AABB, in ascending order.
+static void GetCompoundChildrenInAabb(const btCompoundShape *compoundShape,
+		const btVector3 &aabbMin, const btVector3 &aabbMax, CUtlVector<int> &children) {
+	children.RemoveAll();
+	const btDbvt *tree = compoundShape->getDynamicAabbTree();
+	if (tree != nullptr) {
+		if (tree->m_root != nullptr) {
+			CompoundChildCollector collector(children);
+			tree->collideTV(tree->m_root, btDbvtVolume::FromMM(aabbMin, aabbMax), collector);
+			children.Sort(CompareCompoundChildIndices);
+		}
+		return;
+	}
+	int childCount = compoundShape->getNumChildShapes();
+	for (int childIndex = 0; childIndex < childCount; ++childIndex) {
+		btVector3 childAabbMin, childAabbMax;
+		compoundShape->getChildShape(childIndex)->getAabb(
+				compoundShape->getChildTransform(childIndex), childAabbMin, childAabbMax);
+		if (TestAabbAgainstAabb2(aabbMin, aabbMax, childAabbMin, childAabbMax)) {
+			children.AddToTail(childIndex);
+		}
+	}
+}
+
+void CPhysicsTraceContext::TraceCollide(const Vector &start, const Vector &end,
 		const CPhysCollide *pSweepCollide, const QAngle &sweepAngles, const CPhysCollide *pCollide,
 		const Vector &collideOrigin, const QAngle &collideAngles, trace_t *ptr) {
-	ClearTrace(ptr);
+	CPhysicsCollision::ClearTrace(ptr);
+	pSweepCollide->EnsureLoaded();
 	const btCollisionShape *testShape = pSweepCollide->GetShape();
 	Assert(testShape->isCompound() || testShape->isConvex());
 	if (!testShape->isCompound() && !testShape->isConvex()) {
@@ -1188,6 +2206,7 @@ void CPhysicsCollision::TraceCollide(const Vector &start, const Vector &end,
 	}
 
 	// Target shape.
+	pCollide->EnsureLoaded();
 	const btCollisionShape *colObjShape = pCollide->GetShape();
 	m_TraceCollisionObject.setCollisionShape(const_cast<btCollisionShape *>(colObjShape));
 	btTransform colObjWorldTransform;
@@ -1215,7 +2234,7 @@ void CPhysicsCollision::TraceCollide(const Vector &start, const Vector &end,
 	m_TraceCollisionObject.setWorldTransform(colObjWorldTransform);
 	ContactTestResultCallback contactTestResult(&m_ContactTestCollisionObject, nullptr);
 	m_InContactTest = true;
-	m_ContactTestCollisionWorld->contactPairTest(&m_ContactTestCollisionObject, &m_TraceCollisionObject, contactTestResult);
+	ContactTest(contactTestResult);
 	m_InContactTest = false;
 
 	if (contactTestResult.m_Hit) {
@@ -1230,25 +2249,76 @@ void CPhysicsCollision::TraceCollide(const Vector &start, const Vector &end,
 		btTransform rayToTransform;
 		rayToTransform.setBasis(rayFromTransform.getBasis());
 		if (testShape->isCompound()) {
-			btVector3 childRayDelta = rayDelta;
 			const btCompoundShape *testCompoundShape = static_cast<const btCompoundShape *>(testShape);
-			int childCount = testCompoundShape->getNumChildShapes();
-			for (int childIndex = 0; childIndex < childCount; ++childIndex) {
+
+			// Only sweeping the children whose swept bounds touch the bounds of the target.
+			// In the space of the swept compound, the target moves backwards along the sweep.
+			btVector3 targetAabbMin, targetAabbMax, cullAabbMin, cullAabbMax;
+			colObjShape->getAabb(colObjWorldTransform, targetAabbMin, targetAabbMax);
+			btTransformAabb(targetAabbMin, targetAabbMax, VPHYSICS_CONVEX_DISTANCE_MARGIN,
+					btTransform(rayFromTransform.getBasis(), rayMassCenterOffset).inverse(), cullAabbMin, cullAabbMax);
+			btVector3 localRayDelta = rayDelta * rayFromTransform.getBasis();
+			cullAabbMin.setMin(cullAabbMin - localRayDelta);
+			cullAabbMax.setMax(cullAabbMax - localRayDelta);
+			GetCompoundChildrenInAabb(testCompoundShape, cullAabbMin, cullAabbMax, m_SweptChildren);
+
+			// If the target is a compound too, sweeping each child only against the target children it may touch.
+			const btCompoundShape *targetCompoundShape = nullptr;
+			btTransform colObjWorldTransformInverse;
+			if (colObjShape->isCompound() &&
+					static_cast<const btCompoundShape *>(colObjShape)->getDynamicAabbTree() != nullptr) {
+				targetCompoundShape = static_cast<const btCompoundShape *>(colObjShape);
+				colObjWorldTransformInverse = colObjWorldTransform.inverse();
+			}
+
+			btVector3 childRayDelta = rayDelta;
+			for (int sweptChildIndex = 0; sweptChildIndex < m_SweptChildren.Count(); ++sweptChildIndex) {
+				int childIndex = m_SweptChildren[sweptChildIndex];
+				const btConvexShape *childShape =
+						static_cast<const btConvexShape *>(testCompoundShape->getChildShape(childIndex));
 				rayFromTransform.setOrigin(rayMassCenterOffset + (rayFromTransform.getBasis() *
 						testCompoundShape->getChildTransform(childIndex).getOrigin()));
 				rayToTransform.setOrigin(rayFromTransform.getOrigin() + childRayDelta);
-				convexTestResult.Reset();
-				btCollisionWorld::objectQuerySingle(
-						static_cast<const btConvexShape *>(testCompoundShape->getChildShape(childIndex)),
-						rayFromTransform, rayToTransform,
-						&m_TraceCollisionObject, colObjShape, colObjWorldTransform,
-						convexTestResult, 2.0f * VPHYSICS_CONVEX_DISTANCE_MARGIN);
-				if (convexTestResult.m_HitCollisionObject != nullptr) {
-					ptr->fraction *= convexTestResult.m_closestHitFraction;
-					childRayDelta *= convexTestResult.m_closestHitFraction;
-					hitNormal = convexTestResult.m_ClosestHitNormal;
-					hitPoint = convexTestResult.m_ClosestHitPoint;
-					ptr->contents = CONTENTS_SOLID;
+
+				if (targetCompoundShape == nullptr) {
+					convexTestResult.Reset();
+					btCollisionWorld::objectQuerySingle(childShape, rayFromTransform, rayToTransform,
+							&m_TraceCollisionObject, colObjShape, colObjWorldTransform,
+							convexTestResult, 2.0f * VPHYSICS_CONVEX_DISTANCE_MARGIN);
+					if (convexTestResult.m_HitCollisionObject != nullptr) {
+						ptr->fraction *= convexTestResult.m_closestHitFraction;
+						childRayDelta *= convexTestResult.m_closestHitFraction;
+						hitNormal = convexTestResult.m_ClosestHitNormal;
+						hitPoint = convexTestResult.m_ClosestHitPoint;
+						ptr->contents = CONTENTS_SOLID;
+					}
+					continue;
+				}
+
+				// Swept bounds of the child in the space of the target.
+				btVector3 sweptAabbMin, sweptAabbMax, toAabbMin, toAabbMax;
+				childShape->getAabb(colObjWorldTransformInverse * rayFromTransform, sweptAabbMin, sweptAabbMax);
+				childShape->getAabb(colObjWorldTransformInverse * rayToTransform, toAabbMin, toAabbMax);
+				sweptAabbMin.setMin(toAabbMin);
+				sweptAabbMax.setMax(toAabbMax);
+				GetCompoundChildrenInAabb(targetCompoundShape, sweptAabbMin, sweptAabbMax, m_TouchedChildren);
+				for (int touchedChildIndex = 0; touchedChildIndex < m_TouchedChildren.Count(); ++touchedChildIndex) {
+					int targetChildIndex = m_TouchedChildren[touchedChildIndex];
+					btTransform targetChildWorldTransform =
+							colObjWorldTransform * targetCompoundShape->getChildTransform(targetChildIndex);
+					convexTestResult.m_NormalBasis = targetChildWorldTransform.getBasis();
+					convexTestResult.Reset();
+					btCollisionWorld::objectQuerySingle(childShape, rayFromTransform, rayToTransform,
+							&m_TraceCollisionObject, targetCompoundShape->getChildShape(targetChildIndex),
+							targetChildWorldTransform, convexTestResult, 2.0f * VPHYSICS_CONVEX_DISTANCE_MARGIN);
+					if (convexTestResult.m_HitCollisionObject != nullptr) {
+						ptr->fraction *= convexTestResult.m_closestHitFraction;
+						childRayDelta *= convexTestResult.m_closestHitFraction;
+						rayToTransform.setOrigin(rayFromTransform.getOrigin() + childRayDelta);
+						hitNormal = convexTestResult.m_ClosestHitNormal;
+						hitPoint = convexTestResult.m_ClosestHitPoint;
+						ptr->contents = CONTENTS_SOLID;
+					}
 				}
 			}
 		} else {
@@ -1285,8 +2355,110 @@ void CPhysicsCollision::TraceCollide(const Vector &start, const Vector &end,
 	ptr->plane.dist = DotProduct(hitPointHL + start, ptr->plane.normal);
 }
 
-bool CPhysicsCollision::IsBoxIntersectingCone(
+static ConVar physics_bullet_cone_analytic("physics_bullet_cone_analytic", "1", 0,
+		"Test boxes against cones with separating axes, using the generic collision test only if they can't tell.");
+
+static FORCEINLINE bool IsPointInCone(const Vector &point, const Vector &apex, const Vector &axis,
+		float height, float radius) {
+	Vector offset = point - apex;
+	float axisDistance = DotProduct(offset, axis);
+	if (axisDistance < 0.0f || axisDistance > height) {
+		return false;
+	}
+	float pointRadius = axisDistance * (radius / height);
+	return (offset - axis * axisDistance).LengthSqr() <= pointRadius * pointRadius;
+}
+
+// Tests whether an axis-aligned box (relative to its center) and a solid cone without margins overlap.
+// A cone has infinitely many potential separating axes, so only the most likely ones are tested,
+// and overlap is proven by finding points inside both - if neither works, the result is unknown.
+enum BoxConeOverlap_t {
+	BOX_CONE_OVERLAP_NO,
+	BOX_CONE_OVERLAP_YES,
+	BOX_CONE_OVERLAP_UNKNOWN
+};
+static BoxConeOverlap_t TestBoxConeOverlap(const Vector &boxHalfExtents,
+		const Vector &apex, const Vector &axis, float height, float radius) {
+	// Points inside the cone - its axis, and the nearest points of the box to the axis and to the base center.
+	Vector base = apex + axis * height;
+	btScalar axisFraction;
+	btVector3 axisNormal;
+	if (ClipSegmentToSlabs(btVector3(apex.x, apex.y, apex.z), btVector3(base.x - apex.x, base.y - apex.y, base.z - apex.z),
+			btVector3(boxHalfExtents.x, boxHalfExtents.y, boxHalfExtents.z), axisFraction, axisNormal)) {
+		return BOX_CONE_OVERLAP_YES;
+	}
+	Vector axisNearestPoint = apex + axis * clamp(-DotProduct(apex, axis), 0.0f, height);
+	Vector boxPoint;
+	for (int pointIndex = 0; pointIndex < 2; ++pointIndex) {
+		const Vector &conePoint = (pointIndex != 0 ? base : axisNearestPoint);
+		for (int axisIndex = 0; axisIndex < 3; ++axisIndex) {
+			boxPoint[axisIndex] = clamp(conePoint[axisIndex], -boxHalfExtents[axisIndex], boxHalfExtents[axisIndex]);
+		}
+		if (IsPointInCone(boxPoint, apex, axis, height, radius)) {
+			return BOX_CONE_OVERLAP_YES;
+		}
+	}
+
+	// Separating axes - the box faces, the cone axis, the cone axis crossed with the box edges,
+	// and the normals of the cone side facing the box center and the box corners.
+	Vector separatingAxes[16];
+	int separatingAxisCount = 0;
+	for (int axisIndex = 0; axisIndex < 3; ++axisIndex) {
+		Vector &boxAxis = separatingAxes[separatingAxisCount++];
+		boxAxis.Init();
+		boxAxis[axisIndex] = 1.0f;
+		Vector edgeAxis = CrossProduct(axis, boxAxis);
+		if (edgeAxis.LengthSqr() > 1e-6f) {
+			separatingAxes[separatingAxisCount++] = edgeAxis;
+		}
+	}
+	separatingAxes[separatingAxisCount++] = axis;
+	for (int cornerIndex = 0; cornerIndex < 9; ++cornerIndex) {
+		Vector target(0.0f, 0.0f, 0.0f);
+		if (cornerIndex < 8) {
+			target.Init((cornerIndex & 1) ? boxHalfExtents.x : -boxHalfExtents.x,
+					(cornerIndex & 2) ? boxHalfExtents.y : -boxHalfExtents.y,
+					(cornerIndex & 4) ? boxHalfExtents.z : -boxHalfExtents.z);
+		}
+		Vector sideDirection = target - apex;
+		sideDirection -= axis * DotProduct(sideDirection, axis);
+		float sideDirectionLength = sideDirection.Length();
+		if (sideDirectionLength > 1e-3f) {
+			separatingAxes[separatingAxisCount++] = sideDirection * (height / sideDirectionLength) - axis * radius;
+		}
+	}
+
+	for (int separatingAxisIndex = 0; separatingAxisIndex < separatingAxisCount; ++separatingAxisIndex) {
+		const Vector &separatingAxis = separatingAxes[separatingAxisIndex];
+		float boxExtent = fabsf(separatingAxis.x) * boxHalfExtents.x + fabsf(separatingAxis.y) * boxHalfExtents.y +
+				fabsf(separatingAxis.z) * boxHalfExtents.z;
+		float apexDistance = DotProduct(apex, separatingAxis);
+		float axisDot = DotProduct(axis, separatingAxis);
+		float baseDistance = apexDistance + axisDot * height;
+		float baseExtent = radius * sqrtf(MAX(separatingAxis.LengthSqr() - axisDot * axisDot, 0.0f));
+		if (MIN(apexDistance, baseDistance - baseExtent) > boxExtent ||
+				MAX(apexDistance, baseDistance + baseExtent) < -boxExtent) {
+			return BOX_CONE_OVERLAP_NO;
+		}
+	}
+
+	return BOX_CONE_OVERLAP_UNKNOWN;
+}
+
+bool CPhysicsTraceContext::IsBoxIntersectingCone(
 		const Vector &boxAbsMins, const Vector &boxAbsMaxs, const truncatedcone_t &cone) {
+	if (physics_bullet_cone_analytic.GetBool() && cone.h > 0.0f && cone.theta > 0.0f && cone.theta < 90.0f) {
+		Vector coneAxis = cone.normal;
+		if (VectorNormalize(coneAxis) > 1e-3f) {
+			Vector boxCenter = (boxAbsMins + boxAbsMaxs) * 0.5f;
+			BoxConeOverlap_t overlap = TestBoxConeOverlap((boxAbsMaxs - boxAbsMins) * 0.5f, cone.origin - boxCenter,
+					coneAxis, cone.h, cone.h * tanf(DEG2RAD(cone.theta)));
+			if (overlap != BOX_CONE_OVERLAP_UNKNOWN) {
+				return overlap == BOX_CONE_OVERLAP_YES;
+			}
+		}
+	}
+
 	btVector3 boxHalfExtents;
 	ConvertPositionToBullet((boxAbsMaxs - boxAbsMins) * 0.5f, boxHalfExtents);
 	m_TraceBoxShape.setImplicitShapeDimensions(boxHalfExtents.absolute());
@@ -1307,9 +2479,13 @@ bool CPhysicsCollision::IsBoxIntersectingCone(
 	m_TraceCollisionObject.setCollisionShape(&m_TraceConeShape);
 	m_TraceCollisionObject.setWorldTransform(coneTransform);
 
-	struct ConeContactTestResultCallback : public btCollisionWorld::ContactResultCallback {
+	return IsContactTestObjectPenetrating();
+}
+
+bool CPhysicsTraceContext::IsContactTestObjectPenetrating() {
+	struct PenetrationTestResultCallback : public btCollisionWorld::ContactResultCallback {
 		bool m_Hit;
-		ConeContactTestResultCallback() : m_Hit(false) {}
+		PenetrationTestResultCallback() : m_Hit(false) {}
 		btScalar addSingleResult(btManifoldPoint &cp,
 				const btCollisionObjectWrapper *colObj0Wrap, int partId0, int index0,
 				const btCollisionObjectWrapper *colObj1Wrap, int partId1, int index1) {
@@ -1319,19 +2495,177 @@ bool CPhysicsCollision::IsBoxIntersectingCone(
 			return 0.0f;
 		}
 	};
-	ConeContactTestResultCallback contactTestResult;
+	PenetrationTestResultCallback contactTestResult;
 	m_InContactTest = true;
-	m_ContactTestCollisionWorld->contactPairTest(&m_ContactTestCollisionObject, &m_TraceCollisionObject, contactTestResult);
+	ContactTest(contactTestResult);
 	m_InContactTest = false;
 	return contactTestResult.m_Hit;
 }
 
+// Passes the contacts to a ContactResultCallback like contactPairTest does.
+struct ContactTestManifoldResult : public btManifoldResult {
+	btCollisionWorld::ContactResultCallback &m_ResultCallback;
+
+	ContactTestManifoldResult(const btCollisionObjectWrapper *body0Wrap, const btCollisionObjectWrapper *body1Wrap,
+			btCollisionWorld::ContactResultCallback &resultCallback) :
+			btManifoldResult(body0Wrap, body1Wrap), m_ResultCallback(resultCallback) {}
+
+	virtual void addContactPoint(const btVector3 &normalOnBInWorld, const btVector3 &pointInWorld, btScalar depth) {
+		bool isSwapped = (m_manifoldPtr->getBody0() != m_body0Wrap->getCollisionObject());
+		const btCollisionObjectWrapper *wrapA = (isSwapped ? m_body1Wrap : m_body0Wrap);
+		const btCollisionObjectWrapper *wrapB = (isSwapped ? m_body0Wrap : m_body1Wrap);
+		btVector3 pointA = pointInWorld + normalOnBInWorld * depth;
+		btManifoldPoint point(wrapA->getWorldTransform().invXform(pointA),
+				wrapB->getWorldTransform().invXform(pointInWorld), normalOnBInWorld, depth);
+		point.m_positionWorldOnA = pointA;
+		point.m_positionWorldOnB = pointInWorld;
+		if (isSwapped) {
+			point.m_partId0 = m_partId1;
+			point.m_partId1 = m_partId0;
+			point.m_index0 = m_index1;
+			point.m_index1 = m_index0;
+		} else {
+			point.m_partId0 = m_partId0;
+			point.m_partId1 = m_partId1;
+			point.m_index0 = m_index0;
+			point.m_index1 = m_index1;
+		}
+		m_ResultCallback.addSingleResult(point, wrapA, point.m_partId0, point.m_index0,
+				wrapB, point.m_partId1, point.m_index1);
+	}
+};
+
+void CPhysicsTraceContext::ContactTest(btCollisionWorld::ContactResultCallback &resultCallback) {
+	btCollisionObject *objects[2] = { &m_ContactTestCollisionObject, &m_TraceCollisionObject };
+	btVector3 aabbMins[2], aabbMaxs[2];
+	for (int objectIndex = 0; objectIndex < 2; ++objectIndex) {
+		objects[objectIndex]->getCollisionShape()->getAabb(
+				objects[objectIndex]->getWorldTransform(), aabbMins[objectIndex], aabbMaxs[objectIndex]);
+	}
+	if (!TestAabbAgainstAabb2(aabbMins[0], aabbMaxs[0], aabbMins[1], aabbMaxs[1])) {
+		return;
+	}
+
+	for (int objectIndex = 0; objectIndex < 2; ++objectIndex) {
+		if (!GetContactTestParts(objects[objectIndex], aabbMins[objectIndex ^ 1], aabbMaxs[objectIndex ^ 1],
+				m_ContactTestParts[objectIndex])) {
+			m_ContactTestCollisionWorld->contactPairTest(objects[0], objects[1], resultCallback);
+			return;
+		}
+	}
+
+	const btDispatcherInfo &dispatchInfo = m_ContactTestCollisionWorld->getDispatchInfo();
+	const btAlignedObjectArray<ContactTestPart_t> &parts0 = m_ContactTestParts[0], &parts1 = m_ContactTestParts[1];
+	for (int part0Index = 0; part0Index < parts0.size(); ++part0Index) {
+		const ContactTestPart_t &part0 = parts0[part0Index];
+		btCollisionObjectWrapper body0Wrap(nullptr, part0.m_Shape, objects[0], part0.m_WorldTransform, -1, part0.m_Index);
+		for (int part1Index = 0; part1Index < parts1.size(); ++part1Index) {
+			const ContactTestPart_t &part1 = parts1[part1Index];
+			if (!TestAabbAgainstAabb2(part0.m_AabbMin, part0.m_AabbMax, part1.m_AabbMin, part1.m_AabbMax)) {
+				continue;
+			}
+			btCollisionObjectWrapper body1Wrap(nullptr, part1.m_Shape, objects[1], part1.m_WorldTransform,
+					-1, part1.m_Index);
+			btCollisionAlgorithm *algorithm = GetContactTestAlgorithm(&body0Wrap, &body1Wrap);
+			if (algorithm == nullptr) {
+				continue;
+			}
+			ContactTestManifoldResult result(&body0Wrap, &body1Wrap, resultCallback);
+			result.m_closestPointDistanceThreshold = resultCallback.m_closestDistanceThreshold;
+			result.setShapeIdentifiersA(-1, part0.m_Index);
+			result.setShapeIdentifiersB(-1, part1.m_Index);
+			algorithm->processCollision(&body0Wrap, &body1Wrap, dispatchInfo, &result);
+		}
+	}
+}
+
+btCollisionAlgorithm *CPhysicsTraceContext::GetContactTestAlgorithm(
+		const btCollisionObjectWrapper *body0Wrap, const btCollisionObjectWrapper *body1Wrap) {
+	// The objects are always the same, so the algorithms, and the manifolds they own, can be reused for any shapes.
+	int shapeType0 = body0Wrap->getCollisionShape()->getShapeType();
+	int shapeType1 = body1Wrap->getCollisionShape()->getShapeType();
+	for (int algorithmIndex = 0; algorithmIndex < m_ContactTestAlgorithms.Count(); ++algorithmIndex) {
+		const ContactTestAlgorithm_t &algorithm = m_ContactTestAlgorithms[algorithmIndex];
+		if (algorithm.m_ShapeType0 == shapeType0 && algorithm.m_ShapeType1 == shapeType1) {
+			return algorithm.m_Algorithm;
+		}
+	}
+	btCollisionAlgorithm *algorithm = m_ContactTestDispatcher->findAlgorithm(
+			body0Wrap, body1Wrap, nullptr, BT_CLOSEST_POINT_ALGORITHMS);
+	if (algorithm == nullptr) {
+		return nullptr;
+	}
+	ContactTestAlgorithm_t &pooledAlgorithm = m_ContactTestAlgorithms[m_ContactTestAlgorithms.AddToTail()];
+	pooledAlgorithm.m_ShapeType0 = shapeType0;
+	pooledAlgorithm.m_ShapeType1 = shapeType1;
+	pooledAlgorithm.m_Algorithm = algorithm;
+	return algorithm;
+}
+
+bool CPhysicsTraceContext::GetContactTestParts(const btCollisionObject *object,
+		const btVector3 &otherAabbMin, const btVector3 &otherAabbMax,
+		btAlignedObjectArray<ContactTestPart_t> &parts) {
+	parts.resize(0);
+	const btCollisionShape *shape = object->getCollisionShape();
+	const btTransform &worldTransform = object->getWorldTransform();
+
+	if (shape->isConvex()) {
+		ContactTestPart_t &part = parts.expandNonInitializing();
+		part.m_WorldTransform = worldTransform;
+		shape->getAabb(worldTransform, part.m_AabbMin, part.m_AabbMax);
+		part.m_Shape = shape;
+		part.m_Index = -1;
+		return true;
+	}
+
+	if (!shape->isCompound()) {
+		return false;
+	}
+	const btCompoundShape *compoundShape = static_cast<const btCompoundShape *>(shape);
+	btVector3 localAabbMin, localAabbMax;
+	btTransformAabb(otherAabbMin, otherAabbMax, 0.0f, worldTransform.inverse(), localAabbMin, localAabbMax);
+	GetCompoundChildrenInAabb(compoundShape, localAabbMin, localAabbMax, m_ContactTestChildren);
+	for (int childListIndex = 0; childListIndex < m_ContactTestChildren.Count(); ++childListIndex) {
+		int childIndex = m_ContactTestChildren[childListIndex];
+		const btCollisionShape *childShape = compoundShape->getChildShape(childIndex);
+		if (!childShape->isConvex()) {
+			return false;
+		}
+		ContactTestPart_t &part = parts.expandNonInitializing();
+		part.m_WorldTransform = worldTransform * compoundShape->getChildTransform(childIndex);
+		childShape->getAabb(part.m_WorldTransform, part.m_AabbMin, part.m_AabbMax);
+		part.m_Shape = childShape;
+		part.m_Index = childIndex;
+	}
+	return true;
+}
+
+bool CPhysicsTraceContext::IsBoxIntersectingObject(const btVector3 &center, const btVector3 &halfExtents,
+		const btCollisionObject *object) {
+	m_TraceBoxShape.setImplicitShapeDimensions(halfExtents);
+	m_ContactTestCollisionObject.setCollisionShape(&m_TraceBoxShape);
+	m_ContactTestCollisionObject.setWorldTransform(btTransform(btMatrix3x3::getIdentity(), center));
+	m_TraceCollisionObject.setCollisionShape(const_cast<btCollisionShape *>(object->getCollisionShape()));
+	m_TraceCollisionObject.setWorldTransform(object->getWorldTransform());
+	return IsContactTestObjectPenetrating();
+}
+
+bool CPhysicsTraceContext::IsSphereIntersectingObject(const btVector3 &center, btScalar radius,
+		const btCollisionObject *object) {
+	m_TraceSphereShape.setUnscaledRadius(radius);
+	m_ContactTestCollisionObject.setCollisionShape(&m_TraceSphereShape);
+	m_ContactTestCollisionObject.setWorldTransform(btTransform(btMatrix3x3::getIdentity(), center));
+	m_TraceCollisionObject.setCollisionShape(const_cast<btCollisionShape *>(object->getCollisionShape()));
+	m_TraceCollisionObject.setWorldTransform(object->getWorldTransform());
+	return IsContactTestObjectPenetrating();
+}
+
 /******************
  * Compound shapes
  ******************/
 
 CPhysCollide_Compound::CPhysCollide_Compound(CPhysConvex **pConvex, int convexCount) :
-		m_Shape(false, convexCount) {
+		m_Shape(false, convexCount), m_PendingIVPSurface(nullptr) {
 	Assert(convexCount > 0);
 
 	Initialize();
@@ -1367,6 +2701,8 @@ CPhysCollide_Compound::CPhysCollide_Compound(CPhysConvex **pConvex, int convexCo
 		CPhysConvex *convex = pConvex[convexIndex];
 		if (convex->GetOwner() == CPhysConvex::OWNER_GAME) {
 			convex->SetOwner(CPhysConvex::OWNER_COMPOUND);
+		} else if (convex->GetOwner() == CPhysConvex::OWNER_SHARED) {
+			g_pPhysCollision->AddCachedHullReference(static_cast<CPhysConvex_Hull *>(convex));
 		}
 		transform.setOrigin(convex->GetOriginInCompound() - m_MassCenter);
 		m_Shape.addChildShape(transform, convex->GetShape());
@@ -1378,33 +2714,96 @@ CPhysCollide_Compound::CPhysCollide_Compound(CPhysConvex **pConvex, int convexCo
 	CalculateInertia();
 }
 
-CPhysCollide_Compound::CPhysCollide_Compound(
-		const VCollide_IVP_Compact_Ledgetree_Node *root, CByteswap &byteswap,
+CPhysCollide_Compound::CPhysCollide_Compound(CPhysConvex **pConvex, int convexCount,
+		const btVector3 &massCenter, const btVector3 &inertia,
+		const btVector3 &orthographicAreas) :
+		CPhysCollide(orthographicAreas),
+		m_Shape(false, convexCount), m_PendingIVPSurface(nullptr),
+		m_Volume(-1.0f), m_MassCenter(massCenter), m_Inertia(inertia) {
+	Assert(convexCount > 0);
+	Initialize();
+	for (int convexIndex = 0; convexIndex < convexCount; ++convexIndex) {
+		CPhysConvex *convex = pConvex[convexIndex];
+		if (convex->GetOwner() == CPhysConvex::OWNER_GAME) {
+			convex->SetOwner(CPhysConvex::OWNER_COMPOUND); // Not shared.
+		}
+		m_Shape.addChildShape(btTransform(btMatrix3x3::getIdentity(),
+				convex->GetOriginInCompound() - m_MassCenter), convex->GetShape());
+	}
+	if (convexCount > 1) {
+		m_Shape.createAabbTreeFromChildren();
+	}
+}
+
+CPhysCollide_Compound::CPhysCollide_Compound(const char *ivpSurface, int ivpSurfaceSize, int ivpRootOffset, bool swap,
 		const btVector3 &massCenter, const btVector3 &inertia,
 		const btVector3 &orthographicAreas) :
 		CPhysCollide(orthographicAreas),
 		m_Shape(false),
+		m_PendingIVPRootOffset(ivpRootOffset), m_PendingIVPSwap(swap),
 		m_Volume(-1.0f), m_MassCenter(massCenter), m_Inertia(inertia) {
 	Initialize();
-	g_pPhysCollision->PushIVPNode(root);
-	const VCollide_IVP_Compact_Ledgetree_Node *node;
-	while ((node = g_pPhysCollision->PopIVPNode()) != nullptr) {
-		VCollide_IVP_Compact_Ledgetree_Node swappedNode;
-		byteswap.SwapBufferToTargetEndian(&swappedNode, const_cast<VCollide_IVP_Compact_Ledgetree_Node *>(node));
-		if (swappedNode.offset_right_node == 0) {
-			CPhysConvex_Hull *convex = g_pPhysCollision->CreateConvexHullFromIVPCompactLedge(
-					reinterpret_cast<const VCollide_IVP_Compact_Ledge *>(
-							reinterpret_cast<const byte *>(node) + swappedNode.offset_compact_ledge), byteswap);
-			convex->SetOwner(CPhysConvex::OWNER_COMPOUND);
-			m_Shape.addChildShape(btTransform(btMatrix3x3::getIdentity(),
-					convex->GetOriginInCompound() - m_MassCenter), convex->GetShape());
-		} else {
-			g_pPhysCollision->PushIVPNode(node + 1);
-			g_pPhysCollision->PushIVPNode(reinterpret_cast<const VCollide_IVP_Compact_Ledgetree_Node *>(
-					reinterpret_cast<const byte *>(node) + swappedNode.offset_right_node));
+	// Aligned for reading the floats directly.
+	m_PendingIVPSurface = reinterpret_cast<char *>(MemAlloc_AllocAligned(ivpSurfaceSize, 16));
+	memcpy(m_PendingIVPSurface, ivpSurface, ivpSurfaceSize);
+	m_LoadPending = true;
+}
+
+// Only locked while loading, which is done once per collideable.
+static CThreadFastMutex s_PendingCompoundLoadMutex;
+
+void CPhysCollide_Compound::LoadPending() const {
+	AUTO_LOCK(s_PendingCompoundLoadMutex);
+	if (!m_LoadPending) {
+		return; // Loaded on another thread while waiting.
+	}
+	CPhysCollide_Compound *compound = const_cast<CPhysCollide_Compound *>(this);
+	CByteswap byteswap;
+	byteswap.ActivateByteSwapping(m_PendingIVPSwap);
+	CPhysicsCollision::IVPLedgeScratch_t scratch;
+	CUtlVector<const VCollide_IVP_Compact_Ledge *> ledges;
+	CPhysicsCollision::GetIVPCompactSurfaceLedges(GetIVPLedgetreeRoot(m_PendingIVPSurface, m_PendingIVPRootOffset),
+			byteswap, scratch, ledges);
+	for (int ledgeIndex = 0; ledgeIndex < ledges.Count(); ++ledgeIndex) {
+		CPhysConvex_Hull *convex = CPhysicsCollision::CreateConvexHullFromIVPCompactLedge(
+				ledges[ledgeIndex], byteswap, scratch);
+		if (convex == nullptr) {
+			continue;
 		}
+		if (convex->GetOwner() == CPhysConvex::OWNER_GAME) {
+			convex->SetOwner(CPhysConvex::OWNER_COMPOUND); // Not shared.
+		}
+		compound->m_Shape.addChildShape(btTransform(btMatrix3x3::getIdentity(),
+				convex->GetOriginInCompound() - m_MassCenter), convex->GetShape());
 	}
+	// VCollideLoad doesn't create lazy compounds for surfaces without convertible ledges.
+	Assert(m_Shape.getNumChildShapes() > 0);
 	if (m_Shape.getNumChildShapes() > 1) {
+		compound->m_Shape.createAabbTreeFromChildren();
+	}
+	MemAlloc_FreeAligned(m_PendingIVPSurface);
+	compound->m_PendingIVPSurface = nullptr;
+	// The shape must be complete before other threads see that it's loaded.
+	ThreadMemoryBarrier();
+	compound->m_LoadPending = false;
+}
+
+CPhysCollide_Compound::CPhysCollide_Compound(CPhysConvex **pConvex, const btVector3 *childOrigins, int convexCount,
+		btScalar volume, const btVector3 &massCenter, const btVector3 &inertia,
+		const btVector3 &orthographicAreas) :
+		CPhysCollide(orthographicAreas),
+		m_Shape(false, convexCount), m_PendingIVPSurface(nullptr),
+		m_Volume(volume), m_MassCenter(massCenter), m_Inertia(inertia) {
+	Assert(convexCount > 0);
+	Initialize();
+	btTransform transform(btMatrix3x3::getIdentity());
+	for (int convexIndex = 0; convexIndex < convexCount; ++convexIndex) {
+		CPhysConvex *convex = pConvex[convexIndex];
+		convex->SetOwner(CPhysConvex::OWNER_COMPOUND);
+		transform.setOrigin(childOrigins[convexIndex]);
+		m_Shape.addChildShape(transform, convex->GetShape());
+	}
+	if (convexCount > 1) {
 		m_Shape.createAabbTreeFromChildren();
 	}
 }
@@ -1479,6 +2878,7 @@ CPhysCollide *CPhysicsCollision::ConvertPolysoupToCollide(CPhysPolysoup *pSoup,
 
 btScalar CPhysCollide_Compound::GetVolume() const {
 	if (m_Volume < 0.0f) {
+		EnsureLoaded();
 		btScalar &volume = const_cast<CPhysCollide_Compound *>(this)->m_Volume;
 		volume = 0.0f;
 		int childCount = m_Shape.getNumChildShapes();
@@ -1491,6 +2891,7 @@ btScalar CPhysCollide_Compound::GetVolume() const {
 }
 
 btScalar CPhysCollide_Compound::GetSurfaceArea() const {
+	EnsureLoaded();
 	btScalar area = 0.0f;
 	int childCount = m_Shape.getNumChildShapes();
 	for (int childIndex = 0; childIndex < childCount; ++childIndex) {
@@ -1502,6 +2903,7 @@ btScalar CPhysCollide_Compound::GetSurfaceArea() const {
 
 btVector3 CPhysCollide_Compound::GetExtent(const btVector3 &origin, const btMatrix3x3 &rotation,
 		const btVector3 &direction) const {
+	EnsureLoaded();
 	btVector3 localDirection = direction * rotation;
 	btVector3 extent = origin;
 	btScalar maxDot = -BT_LARGE_FLOAT;
@@ -1526,6 +2928,7 @@ void CPhysCollide_Compound::SetMassCenter(const btVector3 &massCenter) {
 		DevMsg("Changed collide mass center while in use!!!\n");
 		return;
 	}
+	EnsureLoaded();
 	btVector3 oldMassCenter = m_MassCenter;
 	m_MassCenter = massCenter;
 	int childCount = m_Shape.getNumChildShapes();
@@ -1561,6 +2964,7 @@ void CPhysCollide_Compound::CalculateInertia() {
 }
 
 btScalar CPhysCollide_Compound::GetSubmergedVolume(const btVector4 &plane, btVector3 &buoyancyCenter) const {
+	EnsureLoaded();
 	btScalar volume = 0.0f;
 	btVector3 volumeWeightedBuoyancyCenter;
 	buoyancyCenter.setZero();
@@ -1578,6 +2982,7 @@ btScalar CPhysCollide_Compound::GetSubmergedVolume(const btVector4 &plane, btVec
 }
 
 int CPhysCollide_Compound::GetConvexes(CPhysConvex **output, int limit) const {
+	EnsureLoaded();
 	int childCount = m_Shape.getNumChildShapes();
 	if (childCount < limit) {
 		limit = childCount;
@@ -1589,10 +2994,27 @@ int CPhysCollide_Compound::GetConvexes(CPhysConvex **output, int limit) const {
 	return childCount;
 }
 
+CPhysConvex *CPhysCollide_Compound::UnshareConvex(int childIndex) {
+	btCompoundShapeChild &child = m_Shape.getChildList()[childIndex];
+	CPhysConvex *convex = reinterpret_cast<CPhysConvex *>(child.m_childShape->getUserPointer());
+	if (convex->GetOwner() != CPhysConvex::OWNER_SHARED) {
+		return convex;
+	}
+	CPhysConvex_Hull *copy = VPhysicsNew(CPhysConvex_Hull, *static_cast<const CPhysConvex_Hull *>(convex));
+	copy->SetOwner(CPhysConvex::OWNER_COMPOUND);
+	// Same type and bounds, so the AABB tree and the collision algorithms stay valid.
+	child.m_childShape = copy->GetShape();
+	g_pPhysCollision->AddCompoundConvexToDeleteQueue(convex);
+	return copy;
+}
+
 CCollisionQuery::CCollisionQuery(CPhysCollide *collide) {
+	collide->EnsureLoaded();
 	if (CPhysCollide_Compound::IsCompound(collide)) {
-		m_CompoundShape = static_cast<CPhysCollide_Compound *>(collide)->GetCompoundShape();
+		m_Compound = static_cast<CPhysCollide_Compound *>(collide);
+		m_CompoundShape = m_Compound->GetCompoundShape();
 	} else {
+		m_Compound = nullptr;
 		m_CompoundShape = nullptr;
 	}
 }
@@ -1652,6 +3074,7 @@ void CCollisionQuery::SetTriangleMaterialIndex(int convexIndex, int triangleInde
 	if (convex == nullptr || triangleIndex < 0 || triangleIndex >= convex->GetTriangleCount()) {
 		return;
 	}
+	convex = m_Compound->UnshareConvex(convexIndex);
 	convex->SetTriangleMaterialIndex(triangleIndex, index7bits);
 }
 
@@ -1664,6 +3087,9 @@ void CPhysicsCollision::DestroyQueryModel(ICollisionQuery *pQuery) {
 }
 
 CPhysCollide_Compound::~CPhysCollide_Compound() {
+	if (m_PendingIVPSurface != nullptr) {
+		MemAlloc_FreeAligned(m_PendingIVPSurface);
+	}
 	int childCount = m_Shape.getNumChildShapes();
 	for (int childIndex = 0; childIndex < childCount; ++childIndex) {
 		g_pPhysCollision->AddCompoundConvexToDeleteQueue(
@@ -1671,6 +3097,45 @@ CPhysCollide_Compound::~CPhysCollide_Compound() {
 	}
 }
 
+int CPhysCollide_Compound::Serialize(char *dest, CByteswap &byteswap) const {
+	EnsureLoaded();
+	VCollide_Bullet_Compound compound;
+	for (int axis = 0; axis < 3; ++axis) {
+		compound.massCenter[axis] = m_MassCenter[axis];
+		compound.inertia[axis] = m_Inertia[axis];
+	}
+	compound.volume = GetVolume();
+	compound.childCount = m_Shape.getNumChildShapes();
+	int position = 0;
+	WriteBulletCollideStruct(dest, position, byteswap, compound);
+
+	for (int childIndex = 0; childIndex < compound.childCount; ++childIndex) {
+		const btCollisionShape *childShape = m_Shape.getChildShape(childIndex);
+		const CPhysConvex *convex = reinterpret_cast<const CPhysConvex *>(childShape->getUserPointer());
+		VCollide_Bullet_Convex convexHeader;
+		if (CPhysConvex_Hull::IsHull(convex)) {
+			convexHeader.convexType = VCOLLIDE_BULLET_CONVEX_HULL;
+		} else if (CPhysConvex_Box::IsBox(convex)) {
+			convexHeader.convexType = VCOLLIDE_BULLET_CONVEX_BOX;
+		} else {
+			return 0;
+		}
+		convexHeader.userIndex = childShape->getUserIndex();
+		const btVector3 &origin = m_Shape.getChildTransform(childIndex).getOrigin();
+		for (int axis = 0; axis < 3; ++axis) {
+			convexHeader.origin[axis] = origin[axis];
+		}
+		// The header is written after the data to store the size.
+		int headerPosition = position;
+		position += sizeof(convexHeader);
+		convexHeader.size = convex->Serialize(dest != nullptr ? dest + position : nullptr, byteswap);
+		position += convexHeader.size;
+		WriteBulletCollideStruct(dest, headerPosition, byteswap, convexHeader);
+	}
+
+	return position;
+}
+
 void CPhysCollide_Compound::Release() {
 	VPhysicsDelete(CPhysCollide_Compound, this);
 }
@@ -1678,6 +3143,8 @@ void CPhysCollide_Compound::Release() {
 void CPhysicsCollision::AddCompoundConvexToDeleteQueue(CPhysConvex *convex) {
 	if (convex->GetOwner() == CPhysConvex::OWNER_COMPOUND) {
 		m_CompoundConvexDeleteQueue.AddToTail(convex);
+	} else if (convex->GetOwner() == CPhysConvex::OWNER_SHARED) {
+		ReleaseCachedHull(static_cast<CPhysConvex_Hull *>(convex));
 	}
 }
 
@@ -1693,31 +3160,84 @@ void CPhysicsCollision::CleanupCompoundConvexDeleteQueue() {
  **********/
 
 CPhysCollide_Sphere *CPhysicsCollision::CreateCachedSphereCollide(btScalar radius) {
-	const btScalar radiusThreshold = HL2BULLET(0.1f);
-	CPhysCollide_Sphere *collide = nullptr, *freeCollide = nullptr;
-	for (int cacheIndex = m_SphereCache.Count() - 1; cacheIndex >= 0; --cacheIndex) {
-		CPhysCollide_Sphere *cacheCollide = m_SphereCache[cacheIndex];
-		if (btFabs(cacheCollide->GetRadius() - radius) < radiusThreshold) {
-			collide = cacheCollide;
-			break;
-		}
-		if (freeCollide == nullptr && cacheCollide->GetObjectReferenceList() == nullptr) {
-			freeCollide = cacheCollide;
+	int key = QuantizeCachedCollideSize(radius);
+	// A sphere within the tolerance may be in a neighboring bucket if the radius is near the bucket boundary.
+	static const int keyOffsets[3] = { 0, -1, 1 };
+	for (int offsetIndex = 0; offsetIndex < ARRAYSIZE(keyOffsets); ++offsetIndex) {
+		CPhysCollide_Sphere **cacheCollide = m_SphereCache.find(key + keyOffsets[offsetIndex]);
+		if (cacheCollide != nullptr && btFabs((*cacheCollide)->GetRadius() - radius) < COLLIDE_CACHE_QUANTUM) {
+			++m_SphereCacheHits;
+			return *cacheCollide;
 		}
 	}
-	if (collide == nullptr) {
-		if (freeCollide != nullptr) {
-			freeCollide->SetRadius(radius);
+	++m_SphereCacheMisses;
+
+	// Resizing a sphere that is not used anymore.
+	CPhysCollide_Sphere *collide = nullptr;
+	while (m_FreeSphereCache.Count() > 0) {
+		CPhysCollide_Sphere *freeCollide = m_FreeSphereCache.Tail();
+		m_FreeSphereCache.RemoveMultipleFromTail(1);
+		freeCollide->SetInFreeSphereCache(false);
+		if (freeCollide->GetObjectReferenceList() == nullptr) {
 			collide = freeCollide;
-		} else {
-			collide = VPhysicsNew(CPhysCollide_Sphere, radius);
-			collide->SetOwner(CPhysCollide::OWNER_INTERNAL);
-			m_SphereCache.AddToTail(collide);
+			break;
 		}
 	}
+	if (collide != nullptr) {
+		m_SphereCache.remove(collide->GetSphereCacheKey());
+		collide->SetRadius(radius);
+	} else {
+		collide = VPhysicsNew(CPhysCollide_Sphere, radius);
+		collide->SetOwner(CPhysCollide::OWNER_INTERNAL);
+	}
+	collide->SetSphereCacheKey(key);
+	m_SphereCache.insert(key, collide);
 	return collide;
 }
 
+void CPhysicsCollision::AddFreeCachedSphere(CPhysCollide_Sphere *sphere) {
+	if (!sphere->IsInFreeSphereCache()) {
+		sphere->SetInFreeSphereCache(true);
+		m_FreeSphereCache.AddToTail(sphere);
+	}
+}
+
+void CPhysicsCollision::PrintShapeCacheStats() {
+	int sphereCount = m_SphereCache.size(), freeSphereCount = 0;
+	for (int sphereIndex = 0; sphereIndex < sphereCount; ++sphereIndex) {
+		if ((*m_SphereCache.getAtIndex(sphereIndex))->GetObjectReferenceList() == nullptr) {
+			++freeSphereCount;
+		}
+	}
+	unsigned int sphereLookupCount = m_SphereCacheHits + m_SphereCacheMisses;
+	Msg("Sphere cache: %d spheres (%d unused), %d bytes, %u hits, %u misses, %.1f%% hit rate.\n",
+			sphereCount, freeSphereCount, sphereCount * (int) sizeof(CPhysCollide_Sphere),
+			m_SphereCacheHits, m_SphereCacheMisses,
+			sphereLookupCount != 0 ? 100.0f * (float) m_SphereCacheHits / (float) sphereLookupCount : 0.0f);
+	int bboxSize, bboxCount;
+	GetBBoxCacheSize(&bboxSize, &bboxCount);
+	unsigned int bboxLookupCount = m_BBoxCacheHits + m_BBoxCacheMisses;
+	Msg("Bounding box cache: %d boxes, %d bytes, %u hits, %u misses, %.1f%% hit rate.\n",
+			bboxCount, bboxSize, m_BBoxCacheHits, m_BBoxCacheMisses,
+			bboxLookupCount != 0 ? 100.0f * (float) m_BBoxCacheHits / (float) bboxLookupCount : 0.0f);
+}
+
+void CPhysicsCollision::ResetShapeCacheStats() {
+	m_SphereCacheHits = 0;
+	m_SphereCacheMisses = 0;
+	m_BBoxCacheHits = 0;
+	m_BBoxCacheMisses = 0;
+}
+
+CON_COMMAND(physics_bullet_shapecache, "Print the sizes and the hit rates of the cached sphere and bounding box "
+		"collision models. Use \"physics_bullet_shapecache reset\" to clear the hit rates.") {
+	if (args.ArgC() >= 2 && V_stricmp(args[1], "reset") == 0) {
+		g_pPhysCollision->ResetShapeCacheStats();
+	} else {
+		g_pPhysCollision->PrintShapeCacheStats();
+	}
+}
+
 btScalar CPhysCollide_Sphere::GetVolume() const {
 	btScalar radius = GetRadius();
 	return ((4.0f / 3.0f) * SIMD_PI) * radius * radius * radius;
@@ -1764,6 +3284,14 @@ void CPhysCollide_Sphere::ComputeOrthographicAreas(btScalar axisEpsilon) {
 	SetOrthographicAreas(btVector3(0.25f * SIMD_PI, 0.25f * SIMD_PI, 0.25f * SIMD_PI));
 }
 
+int CPhysCollide_Sphere::Serialize(char *dest, CByteswap &byteswap) const {
+	VCollide_Bullet_Sphere sphere;
+	sphere.radius = GetRadius();
+	int position = 0;
+	WriteBulletCollideStruct(dest, position, byteswap, sphere);
+	return position;
+}
+
 void CPhysCollide_Sphere::Release() {
 	VPhysicsDelete(CPhysCollide_Sphere, this);
 }
@@ -1844,51 +3372,223 @@ bool CPhysicsCollision::SupportsVirtualMesh() {
  * Collideable serialization
  ****************************/
 
-CPhysCollide *CPhysicsCollision::UnserializeIVPCompactSurface(
-		const VCollide_IVP_Compact_Surface *surface, CByteswap &byteswap,
-		const btVector3 &orthographicAreas) {
+const VCollide_IVP_Compact_Surface *CPhysicsCollision::GetIVPCompactSurface(const char *pBuffer,
+		CByteswap &byteswap, int &rootOffset, btVector3 &massCenter, btVector3 &inertia, btVector3 &orthographicAreas) {
+	VCollide_SurfaceHeader swappedHeader;
+	byteswap.SwapBufferToTargetEndian(&swappedHeader, const_cast<VCollide_SurfaceHeader *>(
+			reinterpret_cast<const VCollide_SurfaceHeader *>(pBuffer)));
+	const VCollide_IVP_Compact_Surface *surface;
+	if (swappedHeader.vphysicsID == VCOLLIDE_VPHYSICS_ID) {
+		if (swappedHeader.version != VCOLLIDE_VERSION_IVP ||
+				swappedHeader.modelType != VCOLLIDE_MODEL_TYPE_IVP_COMPACT_SURFACE) {
+			return nullptr;
+		}
+		ConvertAbsoluteDirectionToBullet(swappedHeader.dragAxisAreas, orthographicAreas);
+		surface = reinterpret_cast<const VCollide_IVP_Compact_Surface *>(pBuffer + sizeof(VCollide_SurfaceHeader));
+	} else {
+		DevMsg("Old format .PHY file loaded!!!\n");
+		orthographicAreas.setValue(1.0f, 1.0f, 1.0f);
+		surface = reinterpret_cast<const VCollide_IVP_Compact_Surface *>(pBuffer);
+	}
 	VCollide_IVP_Compact_Surface swappedSurface;
 	byteswap.SwapBufferToTargetEndian(&swappedSurface, const_cast<VCollide_IVP_Compact_Surface *>(surface));
 	if (swappedSurface.dummy[2] != VCOLLIDE_IVP_COMPACT_SURFACE_ID) {
 		return nullptr;
 	}
-	return VPhysicsNew(CPhysCollide_Compound,
-			reinterpret_cast<const VCollide_IVP_Compact_Ledgetree_Node *>(
-					reinterpret_cast<const byte *>(surface) + swappedSurface.offset_ledgetree_root),
-			byteswap,
-			btVector3(swappedSurface.mass_center[0], -swappedSurface.mass_center[1], -swappedSurface.mass_center[2]),
-			btVector3(swappedSurface.rotation_inertia[0], swappedSurface.rotation_inertia[1], swappedSurface.rotation_inertia[2]),
-			orthographicAreas);
+	massCenter.setValue(swappedSurface.mass_center[0], -swappedSurface.mass_center[1], -swappedSurface.mass_center[2]);
+	inertia.setValue(swappedSurface.rotation_inertia[0], swappedSurface.rotation_inertia[1], swappedSurface.rotation_inertia[2]);
+	rootOffset = swappedSurface.offset_ledgetree_root;
+	return surface;
 }
 
-CPhysCollide *CPhysicsCollision::UnserializeCollideFromBuffer(
-		const char *pBuffer, int size, int index, bool swap) {
+void CPhysicsCollision::GetIVPCompactSurfaceLedges(const VCollide_IVP_Compact_Ledgetree_Node *root,
+		CByteswap &byteswap, IVPLedgeScratch_t &scratch, CUtlVector<const VCollide_IVP_Compact_Ledge *> &ledges) {
+	CUtlVector<const VCollide_IVP_Compact_Ledgetree_Node *> &nodeStack = scratch.m_NodeStack;
+	nodeStack.AddToTail(root);
+	while (nodeStack.Count() != 0) {
+		const VCollide_IVP_Compact_Ledgetree_Node *node = nodeStack.Tail();
+		nodeStack.RemoveMultipleFromTail(1);
+		VCollide_IVP_Compact_Ledgetree_Node swappedNode;
+		byteswap.SwapBufferToTargetEndian(&swappedNode, const_cast<VCollide_IVP_Compact_Ledgetree_Node *>(node));
+		if (swappedNode.offset_right_node == 0) {
+			ledges.AddToTail(reinterpret_cast<const VCollide_IVP_Compact_Ledge *>(
+					reinterpret_cast<const byte *>(node) + swappedNode.offset_compact_ledge));
+		} else {
+			nodeStack.AddToTail(node + 1);
+			nodeStack.AddToTail(reinterpret_cast<const VCollide_IVP_Compact_Ledgetree_Node *>(
+					reinterpret_cast<const byte *>(node) + swappedNode.offset_right_node));
+		}
+	}
+}
+
+CPhysCollide *CPhysicsCollision::CreateCompoundFromIVPLedgeHulls(CPhysConvex **hulls, int hullCount,
+		const btVector3 &massCenter, const btVector3 &inertia, const btVector3 &orthographicAreas) {
+	int convexCount = 0;
+	for (int hullIndex = 0; hullIndex < hullCount; ++hullIndex) {
+		if (hulls[hullIndex] != nullptr) {
+			hulls[convexCount++] = hulls[hullIndex];
+		}
+	}
+	if (convexCount == 0) {
+		return nullptr;
+	}
+	return VPhysicsNew(CPhysCollide_Compound, hulls, convexCount, massCenter, inertia, orthographicAreas);
+}
+
+void CPhysicsCollision::ConvertIVPLedges(void *context, int begin, int end) {
+	const VCollideLoadJob_t *job = reinterpret_cast<const VCollideLoadJob_t *>(context);
 	CByteswap byteswap;
-	byteswap.ActivateByteSwapping(swap);
+	byteswap.ActivateByteSwapping(job->m_Swap);
+	// Only the thread owning the index uses its scratch. A thread with the index out of range, which can only be the
+	// one calling VCollideLoad, as the pool's workers are limited to BT_MAX_THREAD_COUNT, uses a temporary one.
+	unsigned int threadIndex = btGetCurrentThreadIndex();
+	IVPLedgeScratch_t temporaryScratch;
+	IVPLedgeScratch_t &scratch = (threadIndex < BT_MAX_THREAD_COUNT ?
+			job->m_ThreadScratch[threadIndex] : temporaryScratch);
+	for (int ledgeIndex = begin; ledgeIndex < end; ++ledgeIndex) {
+		job->m_Hulls[ledgeIndex] = CreateConvexHullFromIVPCompactLedge(job->m_Ledges[ledgeIndex], byteswap, scratch);
+	}
+}
+
+CPhysConvex *CPhysicsCollision::UnserializeBulletConvex(
+		int convexType, const char *data, int size, CByteswap &byteswap) {
+	switch (convexType) {
+	case VCOLLIDE_BULLET_CONVEX_HULL: {
+		if (size < (int) sizeof(VCollide_Bullet_Hull)) {
+			return nullptr;
+		}
+		VCollide_Bullet_Hull swappedHull;
+		byteswap.SwapFieldsToTargetEndian(&swappedHull, const_cast<char *>(data));
+		// Every count is at most the size, so the 64-bit sizes calculated from them can't overflow.
+		if (swappedHull.pointCount <= 0 || swappedHull.pointCount > size ||
+				swappedHull.triangleCount <= 0 || swappedHull.triangleCount > size ||
+				swappedHull.facePlaneCount < 0 || swappedHull.facePlaneCount > size) {
+			return nullptr;
+		}
+		int64 pointsSize = (int64) swappedHull.pointCount * 4 * sizeof(float);
+		int64 arraysSize = (int64) size - (int64) sizeof(swappedHull) - pointsSize;
+		if (arraysSize != CPhysConvex_Hull::GetSerializedArraysSize(swappedHull)) {
+			return nullptr;
+		}
+		data += sizeof(swappedHull);
+		btAlignedObjectArray<btVector3> &points = GetHullCreationPointArray();
+		points.resizeNoInitialize(swappedHull.pointCount);
+		data = ReadBulletCollideVectors(data, byteswap, &points[0], swappedHull.pointCount);
+		return CPhysConvex_Hull::CreateFromSerialized(&points[0], swappedHull, data, (int) arraysSize, byteswap);
+	}
+	case VCOLLIDE_BULLET_CONVEX_BOX: {
+		if (size != (int) sizeof(VCollide_Bullet_Box)) {
+			return nullptr;
+		}
+		VCollide_Bullet_Box swappedBox;
+		byteswap.SwapFieldsToTargetEndian(&swappedBox, const_cast<char *>(data));
+		return VPhysicsNew(CPhysConvex_Box,
+				btVector3(swappedBox.halfExtents[0], swappedBox.halfExtents[1], swappedBox.halfExtents[2]),
+				btVector3(swappedBox.originInCompound[0], swappedBox.originInCompound[1], swappedBox.originInCompound[2]));
+	}
+	}
+	return nullptr;
+}
+
+CPhysCollide *CPhysicsCollision::UnserializeBulletCompound(const char *data, const char *dataEnd,
+		CByteswap &byteswap, const btVector3 &orthographicAreas) {
+	if (dataEnd - data < (int) sizeof(VCollide_Bullet_Compound)) {
+		return nullptr;
+	}
+	VCollide_Bullet_Compound swappedCompound;
+	byteswap.SwapFieldsToTargetEndian(&swappedCompound, const_cast<char *>(data));
+	data += sizeof(swappedCompound);
+	int childCount = swappedCompound.childCount;
+	if (childCount <= 0) {
+		return nullptr;
+	}
+
+	m_UnserializedBulletConvexes.RemoveAll();
+	m_UnserializedBulletChildOrigins.resizeNoInitialize(0);
+	for (int childIndex = 0; childIndex < childCount; ++childIndex) {
+		CPhysConvex *convex = nullptr;
+		VCollide_Bullet_Convex swappedConvex;
+		if (dataEnd - data >= (int) sizeof(swappedConvex)) {
+			byteswap.SwapFieldsToTargetEndian(&swappedConvex, const_cast<char *>(data));
+			data += sizeof(swappedConvex);
+			if (swappedConvex.size >= 0 && swappedConvex.size <= dataEnd - data) {
+				convex = UnserializeBulletConvex(swappedConvex.convexType, data, swappedConvex.size, byteswap);
+				data += swappedConvex.size;
+			}
+		}
+		if (convex == nullptr) {
+			for (int convexIndex = 0; convexIndex < m_UnserializedBulletConvexes.Count(); ++convexIndex) {
+				m_UnserializedBulletConvexes[convexIndex]->Release();
+			}
+			m_UnserializedBulletConvexes.RemoveAll();
+			return nullptr;
+		}
+		convex->GetShape()->setUserIndex(swappedConvex.userIndex);
+		m_UnserializedBulletConvexes.AddToTail(convex);
+		m_UnserializedBulletChildOrigins.push_back(
+				btVector3(swappedConvex.origin[0], swappedConvex.origin[1], swappedConvex.origin[2]));
+	}
+
+	CPhysCollide *collide = VPhysicsNew(CPhysCollide_Compound,
+			&m_UnserializedBulletConvexes[0], &m_UnserializedBulletChildOrigins[0], childCount,
+			swappedCompound.volume,
+			btVector3(swappedCompound.massCenter[0], swappedCompound.massCenter[1], swappedCompound.massCenter[2]),
+			btVector3(swappedCompound.inertia[0], swappedCompound.inertia[1], swappedCompound.inertia[2]),
+			orthographicAreas);
+	m_UnserializedBulletConvexes.RemoveAll();
+	return collide;
+}
+
+CPhysCollide *CPhysicsCollision::UnserializeBulletCollide(const char *pBuffer, int size, CByteswap &byteswap) {
 	VCollide_SurfaceHeader swappedHeader;
 	byteswap.SwapBufferToTargetEndian(&swappedHeader, const_cast<VCollide_SurfaceHeader *>(
 			reinterpret_cast<const VCollide_SurfaceHeader *>(pBuffer)));
-	CPhysCollide *collide = nullptr;
-	if (swappedHeader.vphysicsID == VCOLLIDE_VPHYSICS_ID) {
-		if (swappedHeader.version != VCOLLIDE_VERSION_IVP &&
-				swappedHeader.version != VCOLLIDE_VERSION_BULLET) {
-			return nullptr;
+	if (swappedHeader.vphysicsID != VCOLLIDE_VPHYSICS_ID || swappedHeader.version != VCOLLIDE_VERSION_BULLET) {
+		return nullptr;
+	}
+	btVector3 orthographicAreas;
+	ConvertAbsoluteDirectionToBullet(swappedHeader.dragAxisAreas, orthographicAreas);
+	const char *collideBuffer = pBuffer + sizeof(VCollide_SurfaceHeader);
+	switch (swappedHeader.modelType) {
+	case VCOLLIDE_MODEL_TYPE_BULLET_COMPOUND:
+		return UnserializeBulletCompound(collideBuffer, pBuffer + size, byteswap, orthographicAreas);
+	case VCOLLIDE_MODEL_TYPE_BULLET_SPHERE:
+		if (size >= (int) (sizeof(VCollide_SurfaceHeader) + sizeof(VCollide_Bullet_Sphere))) {
+			VCollide_Bullet_Sphere swappedSphere;
+			byteswap.SwapFieldsToTargetEndian(&swappedSphere, const_cast<char *>(collideBuffer));
+			CPhysCollide *collide = VPhysicsNew(CPhysCollide_Sphere, swappedSphere.radius);
+			collide->SetOrthographicAreas(orthographicAreas);
+			return collide;
 		}
-		btVector3 orthographicAreas;
-		ConvertAbsoluteDirectionToBullet(swappedHeader.dragAxisAreas, orthographicAreas);
-		const char *collideBuffer = pBuffer + sizeof(VCollide_SurfaceHeader);
-		switch (swappedHeader.modelType) {
-		case VCOLLIDE_MODEL_TYPE_IVP_COMPACT_SURFACE:
-			collide = UnserializeIVPCompactSurface(
-					reinterpret_cast<const VCollide_IVP_Compact_Surface *>(collideBuffer),
-					byteswap, orthographicAreas);
-			break;
+		break;
+	}
+	return nullptr;
+}
+
+CPhysCollide *CPhysicsCollision::UnserializeCollideFromBuffer(
+		const char *pBuffer, int size, int index, bool swap) {
+	CByteswap byteswap;
+	byteswap.ActivateByteSwapping(swap);
+	CPhysCollide *collide;
+	int ivpRootOffset;
+	btVector3 massCenter, inertia, orthographicAreas;
+	const VCollide_IVP_Compact_Surface *ivpSurface =
+			GetIVPCompactSurface(pBuffer, byteswap, ivpRootOffset, massCenter, inertia, orthographicAreas);
+	if (ivpSurface != nullptr) {
+		m_IVPLedges.RemoveAll();
+		GetIVPCompactSurfaceLedges(GetIVPLedgetreeRoot(ivpSurface, ivpRootOffset),
+				byteswap, m_IVPLedgeScratch, m_IVPLedges);
+		int ledgeCount = m_IVPLedges.Count();
+		m_IVPLedgeHulls.SetCount(ledgeCount);
+		for (int ledgeIndex = 0; ledgeIndex < ledgeCount; ++ledgeIndex) {
+			m_IVPLedgeHulls[ledgeIndex] = CreateConvexHullFromIVPCompactLedge(
+					m_IVPLedges[ledgeIndex], byteswap, m_IVPLedgeScratch);
 		}
+		collide = CreateCompoundFromIVPLedgeHulls(m_IVPLedgeHulls.Base(), ledgeCount,
+				massCenter, inertia, orthographicAreas);
+		m_IVPLedgeHulls.RemoveAll();
 	} else {
-		DevMsg("Old format .PHY file loaded!!!\n");
-		collide = UnserializeIVPCompactSurface(
-				reinterpret_cast<const VCollide_IVP_Compact_Surface *>(pBuffer),
-				byteswap, btVector3(1.0f, 1.0f, 1.0f));
+		collide = UnserializeBulletCollide(pBuffer, size, byteswap);
 	}
 	if (collide != nullptr) {
 		collide->GetShape()->setUserIndex(index);
@@ -1898,15 +3598,60 @@ CPhysCollide *CPhysicsCollision::UnserializeCollideFromBuffer(
 	return collide;
 }
 
+int CPhysicsCollision::CollideSize(CPhysCollide *pCollide) {
+	return CollideWrite(nullptr, pCollide, false);
+}
+
+int CPhysicsCollision::CollideWrite(char *pDest, CPhysCollide *pCollide, bool bSwap) {
+	// Only the Bullet format is written, the IVP format can't represent all the shapes.
+	short modelType;
+	if (CPhysCollide_Compound::IsCompound(pCollide)) {
+		modelType = VCOLLIDE_MODEL_TYPE_BULLET_COMPOUND;
+	} else if (CPhysCollide_Sphere::IsSphere(pCollide)) {
+		modelType = VCOLLIDE_MODEL_TYPE_BULLET_SPHERE;
+	} else {
+		return 0;
+	}
+	CByteswap byteswap;
+	byteswap.ActivateByteSwapping(bSwap);
+	int surfaceSize = pCollide->Serialize(pDest != nullptr ? pDest + sizeof(VCollide_SurfaceHeader) : nullptr, byteswap);
+	if (surfaceSize <= 0) {
+		return 0;
+	}
+	if (pDest != nullptr) {
+		VCollide_SurfaceHeader header;
+		header.vphysicsID = VCOLLIDE_VPHYSICS_ID;
+		header.version = VCOLLIDE_VERSION_BULLET;
+		header.modelType = modelType;
+		header.surfaceSize = surfaceSize;
+		ConvertAbsoluteDirectionToHL(pCollide->GetOrthographicAreas(), header.dragAxisAreas);
+		header.axisMapSize = 0;
+		byteswap.SwapFieldsToTargetEndian(reinterpret_cast<VCollide_SurfaceHeader *>(pDest), &header);
+	}
+	return sizeof(VCollide_SurfaceHeader) + surfaceSize;
+}
+
 CPhysCollide *CPhysicsCollision::UnserializeCollide(char *pBuffer, int size, int index) {
 	return UnserializeCollideFromBuffer(pBuffer, size, index, false);
 }
 
+static ConVar physics_bullet_parallelvcollideload("physics_bullet_parallelvcollideload", "1", 0,
+		"Convert the ledges of IVP collision models on all physics threads when loading them.");
+
+static ConVar physics_bullet_lazyvcollideload("physics_bullet_lazyvcollideload", "0", 0,
+		"Keep IVP collision models loaded by VCollideLoad in the original format until they're used "
+		"for an object, a trace or the bounds.");
+
 void CPhysicsCollision::VCollideLoad(vcollide_t *pOutput,
 			int solidCount, const char *pBuffer, int size, bool swap) {
 	memset(pOutput, 0, sizeof(*pOutput));
 	pOutput->solidCount = solidCount;
 	pOutput->solids = new CPhysCollide *[solidCount]; // Safe.
+	CByteswap byteswap;
+	byteswap.ActivateByteSwapping(swap);
+	m_VCollideLoadSurfaces.RemoveAll();
+	m_IVPLedges.RemoveAll();
+	bool lazy = physics_bullet_lazyvcollideload.GetBool();
 	int position = 0;
 	for (int solidIndex = 0; solidIndex < solidCount; ++solidIndex) {
 		union {
@@ -1921,10 +3666,82 @@ void CPhysicsCollision::VCollideLoad(vcollide_t *pOutput,
 			memcpy(&solidSize, pBuffer + position, sizeof(int));
 		}
 		position += sizeof(int);
-		pOutput->solids[solidIndex] = UnserializeCollideFromBuffer(
-				pBuffer + position, solidSize, solidIndex, swap);
+		const char *solidBuffer = pBuffer + position;
 		position += solidSize;
+		CPhysCollide *solid = nullptr;
+		int ivpRootOffset;
+		btVector3 massCenter, inertia, orthographicAreas;
+		const VCollide_IVP_Compact_Surface *ivpSurface =
+				GetIVPCompactSurface(solidBuffer, byteswap, ivpRootOffset, massCenter, inertia, orthographicAreas);
+		if (ivpSurface != nullptr && lazy) {
+			// Null if no ledges can be converted, like when loading immediately, rather than an empty compound.
+			// The ledge array is only used for immediate loading, so it's borrowed and restored here.
+			int firstLedge = m_IVPLedges.Count();
+			GetIVPCompactSurfaceLedges(GetIVPLedgetreeRoot(ivpSurface, ivpRootOffset),
+					byteswap, m_IVPLedgeScratch, m_IVPLedges);
+			bool convertible = false;
+			for (int ledgeIndex = firstLedge; ledgeIndex < m_IVPLedges.Count(); ++ledgeIndex) {
+				if (IsIVPCompactLedgeConvertible(m_IVPLedges[ledgeIndex], byteswap)) {
+					convertible = true;
+					break;
+				}
+			}
+			m_IVPLedges.RemoveMultipleFromTail(m_IVPLedges.Count() - firstLedge);
+			if (convertible) {
+				const char *ivpSurfaceData = reinterpret_cast<const char *>(ivpSurface);
+				solid = VPhysicsNew(CPhysCollide_Compound, ivpSurfaceData,
+						solidSize - (int) (ivpSurfaceData - solidBuffer), ivpRootOffset, swap,
+						massCenter, inertia, orthographicAreas);
+				solid->GetShape()->setUserIndex(solidIndex);
+			} else {
+				DevMsg("Null physics model\n");
+			}
+		} else if (ivpSurface != nullptr) {
+			// Created after converting the ledges.
+			VCollideLoadSurface_t &surface = m_VCollideLoadSurfaces[m_VCollideLoadSurfaces.AddToTail()];
+			surface.m_SolidIndex = solidIndex;
+			surface.m_FirstLedge = m_IVPLedges.Count();
+			GetIVPCompactSurfaceLedges(GetIVPLedgetreeRoot(ivpSurface, ivpRootOffset),
+					byteswap, m_IVPLedgeScratch, m_IVPLedges);
+			surface.m_LedgeCount = m_IVPLedges.Count() - surface.m_FirstLedge;
+			surface.m_MassCenter = massCenter;
+			surface.m_Inertia = inertia;
+			surface.m_OrthographicAreas = orthographicAreas;
+		} else {
+			solid = UnserializeBulletCollide(solidBuffer, solidSize, byteswap);
+			if (solid != nullptr) {
+				solid->GetShape()->setUserIndex(solidIndex);
+			} else {
+				DevMsg("Null physics model\n");
+			}
+		}
+		pOutput->solids[solidIndex] = solid;
+	}
+
+	// Converting the ledges of all solids at once, as models often consist of one solid with many ledges.
+	int ledgeCount = m_IVPLedges.Count();
+	m_IVPLedgeHulls.SetCount(ledgeCount);
+	VCollideLoadJob_t job = { m_IVPLedges.Base(), m_IVPLedgeHulls.Base(), m_ThreadIVPLedgeScratch, swap };
+	if (physics_bullet_parallelvcollideload.GetBool()) {
+		g_PhysicsThreadPool.ParallelFor(ledgeCount, 16, ConvertIVPLedges, &job);
+	} else {
+		ConvertIVPLedges(&job, 0, ledgeCount);
+	}
+
+	// Assembling serially in the original order, so the result doesn't depend on the threads.
+	for (int surfaceIndex = 0; surfaceIndex < m_VCollideLoadSurfaces.Count(); ++surfaceIndex) {
+		const VCollideLoadSurface_t &surface = m_VCollideLoadSurfaces[surfaceIndex];
+		CPhysCollide *solid = CreateCompoundFromIVPLedgeHulls(
+				m_IVPLedgeHulls.Base() + surface.m_FirstLedge, surface.m_LedgeCount,
+				surface.m_MassCenter, surface.m_Inertia, surface.m_OrthographicAreas);
+		if (solid != nullptr) {
+			solid->GetShape()->setUserIndex(surface.m_SolidIndex);
+		} else {
+			DevMsg("Null physics model\n");
+		}
+		pOutput->solids[surface.m_SolidIndex] = solid;
 	}
+	m_IVPLedgeHulls.RemoveAll();
 	int keySize = size - position;
 	pOutput->pKeyValues = new char[keySize]; // Safe.
 	memcpy(pOutput->pKeyValues, pBuffer + position, keySize);
@@ -7,6 +7,8 @@
 #include "physics_internal.h"
 #include "vphysics/virtualmesh.h"
 #include <LinearMath/btConvexHull.h>
+#include <LinearMath/btHashMap.h>
+#include <LinearMath/btThreads.h>
 #include "cmodel.h"
 #include "tier1/byteswap.h"
 #include "tier1/utlvector.h"
@@ -106,6 +108,51 @@ struct VCollide_IVP_Compact_Surface {
 #pragma bitfield_order(pop)
 #endif
 
+// Bullet collideables (VCOLLIDE_VERSION_BULLET), in Bullet units and axes.
+// Everything calculated on creation is stored, so loading mostly copies the data.
+// Vectors are stored as 4 floats, like btVector3 and btVector4, with 0 as W of positions.
+
+struct VCollide_Bullet_Compound {
+	DECLARE_BYTESWAP_DATADESC()
+	float massCenter[3];
+	float inertia[3];
+	float volume;
+	int childCount;
+	// Followed by childCount VCollide_Bullet_Convex.
+};
+
+struct VCollide_Bullet_Convex {
+	DECLARE_BYTESWAP_DATADESC()
+	int convexType;
+	int userIndex;
+	float origin[3]; // Of the child transform in the compound, the basis is identity.
+	int size; // Of the shape-specific data following this.
+};
+
+struct VCollide_Bullet_Hull {
+	DECLARE_BYTESWAP_DATADESC()
+	float massCenter[3];
+	float inertia[3];
+	float volume;
+	int pointCount;
+	int triangleCount;
+	int facePlaneCount;
+	int hasTriangleMaterials;
+	// Followed by the points, the triangle indices (3 unsigned ints per triangle) and the face planes.
+	// With materials, then the triangle planes and the materials (1 byte per triangle, padded to 4 bytes).
+};
+
+struct VCollide_Bullet_Box {
+	DECLARE_BYTESWAP_DATADESC()
+	float halfExtents[3];
+	float originInCompound[3];
+};
+
+struct VCollide_Bullet_Sphere {
+	DECLARE_BYTESWAP_DATADESC()
+	float radius;
+};
+
 /************************
  * Convex shape wrappers
  ************************/
@@ -117,7 +164,8 @@ public:
 	enum Owner {
 		OWNER_GAME, // Created and by the game, not added to a compound collideable yet.
 		OWNER_COMPOUND, // Part of a compound created by the game, destroyed with the compound.
-		OWNER_INTERNAL // Managed internally by physics.
+		OWNER_INTERNAL, // Managed internally by physics.
+		OWNER_SHARED // In the hull cache, may be a part of multiple compounds, destroyed with the last one.
 	};
 
 	FORCEINLINE Owner GetOwner() const { return m_Owner; }
@@ -148,6 +196,9 @@ public:
 
 	virtual btVector3 GetOriginInCompound() const { return btVector3(0.0f, 0.0f, 0.0f); }
 
+	// Writes the shape-specific data in the Bullet collideable format, or only returns the size if dest is null.
+	virtual int Serialize(char *dest, CByteswap &byteswap) const = 0;
+
 	virtual void Release() = 0;
 
 protected:
@@ -167,6 +218,15 @@ public:
 	CPhysConvex_Hull(
 			const VCollide_IVP_Compact_Triangle *swappedAndRemappedTriangles, int triangleCount,
 			const btVector3 *ledgePoints, int ledgePointCount, int userIndex);
+	// From a Bullet collideable - the arrays following the points are read from the serialized data.
+	// The data must be validated first, use CreateFromSerialized instead.
+	CPhysConvex_Hull(const btVector3 *points, const VCollide_Bullet_Hull &swappedHull,
+			const char *serializedArrays, CByteswap &byteswap);
+	// Returns nullptr if the size of the arrays doesn't match the counts or the triangle indices are out of range.
+	static CPhysConvex_Hull *CreateFromSerialized(const btVector3 *points, const VCollide_Bullet_Hull &swappedHull,
+			const char *serializedArrays, int serializedArraysSize, CByteswap &byteswap);
+	// Private copy of a shared hull, with the same game data and materials.
+	explicit CPhysConvex_Hull(const CPhysConvex_Hull &other);
 	static CPhysConvex_Hull *CreateFromBulletPoints(
 			HullLibrary &hullLibrary, const btVector3 *points, int pointCount);
 
@@ -197,6 +257,30 @@ public:
 	int GetTriangleMaterialIndexAtPoint(const btVector3 &point) const;
 	virtual void SetTriangleMaterialIndex(int triangleIndex, int index7bits);
 
+	// Outward planes of the faces without the margin, (normal, distance), with coplanar triangles merged.
+	// Calculated on first use since only some traces need them.
+	FORCEINLINE int GetFacePlaneCount() const {
+		EnsureFacePlanes();
+		return m_FacePlanes.size();
+	}
+	FORCEINLINE const btVector4 *GetFacePlanes() const {
+		EnsureFacePlanes();
+		return &m_FacePlanes[0];
+	}
+
+	FORCEINLINE const unsigned int *GetTriangleIndices() const { return &m_TriangleIndices[0]; }
+	// Approximate, including the arrays, for the hull cache statistics.
+	int GetMemorySize() const;
+
+	// Index of the entry in the hull cache if the owner is OWNER_SHARED.
+	FORCEINLINE int GetHullCacheEntry() const { return m_HullCacheEntry; }
+	FORCEINLINE void SetHullCacheEntry(int entryIndex) { m_HullCacheEntry = entryIndex; }
+
+	virtual int Serialize(char *dest, CByteswap &byteswap) const;
+	// Size of the arrays following the points in the serialized data.
+	// 64-bit so the sizes calculated from untrusted counts don't overflow.
+	static int64 GetSerializedArraysSize(const VCollide_Bullet_Hull &swappedHull);
+
 	virtual void Release();
 
 protected:
@@ -213,10 +297,23 @@ private:
 	// These are not remapped, as material table may be loaded after the collide.
 	btAlignedObjectArray<unsigned char> m_TriangleMaterials;
 
+	// Traces may be done from multiple threads, so the calculation is locked, and the planes are complete
+	// before m_FacePlanesCalculated is set.
+	FORCEINLINE void EnsureFacePlanes() const {
+		if (!m_FacePlanesCalculated) {
+			CalculateFacePlanes();
+		}
+	}
+	void CalculateFacePlanes() const;
+	btAlignedObjectArray<btVector4> m_FacePlanes;
+	volatile bool m_FacePlanesCalculated;
+
 	void CalculateVolumeProperties();
 	btScalar m_Volume;
 	btVector3 m_MassCenter;
 	btVector3 m_Inertia;
+
+	int m_HullCacheEntry;
 };
 
 class CPhysConvex_Box : public CPhysConvex {
@@ -241,6 +338,8 @@ public:
 
 	virtual btVector3 GetOriginInCompound() const { return m_Origin; }
 
+	virtual int Serialize(char *dest, CByteswap &byteswap) const;
+
 	virtual void Release();
 
 	// These are correctly oriented for the ---, --+, -+-... sequence.
@@ -270,6 +369,14 @@ public:
 	virtual btCollisionShape *GetShape() = 0;
 	virtual const btCollisionShape *GetShape() const = 0;
 
+	// Lazily loaded collideables have no child shapes until this is called. It must be called before using
+	// the shape for anything other than the type and the user index - the mass properties are always available.
+	FORCEINLINE void EnsureLoaded() const {
+		if (m_LoadPending) {
+			LoadPending();
+		}
+	}
+
 	virtual btScalar GetVolume() const { return 0.0f; }
 	virtual btScalar GetSurfaceArea() const { return 0.0f; }
 	virtual btVector3 GetExtent(const btVector3 &origin, const btMatrix3x3 &rotation,
@@ -291,6 +398,10 @@ public:
 	// Returns the true number of convexes, not clamped, for possibility of multiple calls.
 	virtual int GetConvexes(CPhysConvex **output, int limit) const { return 0; }
 
+	// Writes the data following the surface header in the Bullet collideable format,
+	// or only returns the size if dest is null. Returns 0 if the collideable can't be serialized.
+	virtual int Serialize(char *dest, CByteswap &byteswap) const { return 0; }
+
 	FORCEINLINE IPhysicsObject *GetObjectReferenceList() const {
 		return m_ObjectReferenceList;
 	}
@@ -307,6 +418,7 @@ public:
 
 protected:
 	CPhysCollide(const btVector3 &orthographicAreas = btVector3(1.0f, 1.0f, 1.0f)) :
+			m_LoadPending(false),
 			m_Owner(OWNER_GAME),
 			m_OrthographicAreas(orthographicAreas),
 			m_ObjectReferenceList(nullptr) {}
@@ -317,6 +429,10 @@ protected:
 		shape->setUserIndex(0);
 	}
 
+	// Must be thread-safe, as traces may be done on multiple threads.
+	virtual void LoadPending() const {}
+	volatile bool m_LoadPending;
+
 private:
 	Owner m_Owner;
 
@@ -328,10 +444,20 @@ private:
 class CPhysCollide_Compound : public CPhysCollide {
 public:
 	CPhysCollide_Compound(CPhysConvex **pConvex, int convexCount);
-	CPhysCollide_Compound(
-			const VCollide_IVP_Compact_Ledgetree_Node *root, CByteswap &byteswap,
+	// From IVP ledges, with the mass properties of the surface, and the volume calculated on first use.
+	CPhysCollide_Compound(CPhysConvex **pConvex, int convexCount,
 			const btVector3 &massCenter, const btVector3 &inertia,
 			const btVector3 &orthographicAreas);
+	// IVP surface copied to be loaded on first use, with the mass properties of the surface.
+	// The surface must have at least one convertible ledge, so the loaded compound is never empty - VCollideLoad
+	// returns a null solid for surfaces without any, like when the ledges are converted immediately.
+	CPhysCollide_Compound(const char *ivpSurface, int ivpSurfaceSize, int ivpRootOffset, bool swap,
+			const btVector3 &massCenter, const btVector3 &inertia,
+			const btVector3 &orthographicAreas);
+	// From a Bullet collideable, with the values calculated when it was written.
+	CPhysCollide_Compound(CPhysConvex **pConvex, const btVector3 *childOrigins, int convexCount,
+			btScalar volume, const btVector3 &massCenter, const btVector3 &inertia,
+			const btVector3 &orthographicAreas);
 	virtual ~CPhysCollide_Compound();
 	btCollisionShape *GetShape() { return &m_Shape; }
 	const btCollisionShape *GetShape() const { return &m_Shape; }
@@ -353,12 +479,25 @@ public:
 	virtual btScalar GetSubmergedVolume(const btVector4 &plane, btVector3 &buoyancyCenter) const;
 
 	virtual int GetConvexes(CPhysConvex **output, int limit) const;
+	// Replaces a hull shared with other collideables with a copy owned by this compound,
+	// must be done before the game data or the materials of the convex are modified.
+	CPhysConvex *UnshareConvex(int childIndex);
+
+	virtual int Serialize(char *dest, CByteswap &byteswap) const;
 
 	virtual void Release();
 
+protected:
+	virtual void LoadPending() const;
+
 private:
 	btCompoundShape m_Shape;
 
+	// Copy of the IVP surface until it's loaded.
+	char *m_PendingIVPSurface;
+	int m_PendingIVPRootOffset;
+	bool m_PendingIVPSwap;
+
 	void CalculateInertia();
 	btScalar m_Volume;
 	btVector3 m_MassCenter;
@@ -378,7 +517,8 @@ private:
 class CPhysCollide_Sphere : public CPhysCollide {
 public:
 	// The ortographic area fraction should be pi/4, but let's assume the engine assumes 1.
-	CPhysCollide_Sphere(btScalar radius) : m_Shape(radius + VPHYSICS_CONVEX_DISTANCE_MARGIN) {
+	CPhysCollide_Sphere(btScalar radius) :
+			m_Shape(radius + VPHYSICS_CONVEX_DISTANCE_MARGIN), m_SphereCacheKey(0), m_InFreeSphereCache(false) {
 		Initialize();
 	}
 	btCollisionShape *GetShape() { return &m_Shape; }
@@ -407,10 +547,22 @@ public:
 
 	virtual void ComputeOrthographicAreas(btScalar axisEpsilon);
 
+	virtual int Serialize(char *dest, CByteswap &byteswap) const;
+
 	virtual void Release();
 
+	// Quantized radius the sphere is stored with in the cache. Not recalculated from the radius
+	// when the sphere is reused, because rounding the stored radius may give a different key.
+	FORCEINLINE int GetSphereCacheKey() const { return m_SphereCacheKey; }
+	FORCEINLINE void SetSphereCacheKey(int key) { m_SphereCacheKey = key; }
+	FORCEINLINE bool IsInFreeSphereCache() const { return m_InFreeSphereCache; }
+	FORCEINLINE void SetInFreeSphereCache(bool inCache) { m_InFreeSphereCache = inCache; }
+
 private:
 	btSphereShape m_Shape;
+
+	int m_SphereCacheKey;
+	bool m_InFreeSphereCache;
 };
 
 class CPhysCollide_TriangleMesh : public CPhysCollide {
@@ -458,175 +610,35 @@ private:
 	int m_SurfacePropsIndex; // Doesn't need remapping.
 };
 
-/************
- * Interface
- ************/
+/*********
+ * Traces
+ *********/
 
-class CPhysicsCollision : public IPhysicsCollision {
+// Scratch objects for tests against collideables, so traces can be done from multiple threads with separate contexts.
+class CPhysicsTraceContext {
 public:
-	CPhysicsCollision();
-	virtual ~CPhysicsCollision();
-
-	// IPhysicsCollision methods.
+	CPhysicsTraceContext();
+	~CPhysicsTraceContext();
 
-	virtual CPhysConvex *ConvexFromVerts(Vector **pVerts, int vertCount);
-	virtual CPhysConvex *ConvexFromPlanes(float *pPlanes, int planeCount, float mergeDistance);
-	virtual float ConvexVolume(CPhysConvex *pConvex);
-	virtual float ConvexSurfaceArea(CPhysConvex *pConvex);
-	virtual void SetConvexGameData(CPhysConvex *pConvex, unsigned int gameData);
-	virtual void ConvexFree(CPhysConvex *pConvex);
-	virtual CPhysConvex *BBoxToConvex(const Vector &mins, const Vector &maxs);
-	virtual CPhysConvex *ConvexFromConvexPolyhedron(const CPolyhedron &ConvexPolyhedron);
-	/* DUMMY */ virtual void ConvexesFromConvexPolygon(
-			const Vector &vPolyNormal, const Vector *pPoints, int iPointCount, CPhysConvex **pOutput) {
-		*pOutput = nullptr;
-	}
-	virtual CPhysPolysoup *PolysoupCreate();
-	virtual void PolysoupDestroy(CPhysPolysoup *pSoup);
-	virtual void PolysoupAddTriangle(CPhysPolysoup *pSoup,
-			const Vector &a, const Vector &b, const Vector &c, int materialIndex7bits);
-	virtual CPhysCollide *ConvertPolysoupToCollide(CPhysPolysoup *pSoup, bool useMOPP);
-	virtual CPhysCollide *ConvertConvexToCollide(CPhysConvex **pConvex, int convexCount);
-	virtual CPhysCollide *ConvertConvexToCollideParams(CPhysConvex **pConvex, int convexCount,
-			const convertconvexparams_t &convertParams);
-	virtual void DestroyCollide(CPhysCollide *pCollide);
-	/* DUMMY */ virtual int CollideSize(CPhysCollide *pCollide) { return 0; }
-	/* DUMMY */ virtual int CollideWrite(char *pDest, CPhysCollide *pCollide, bool bSwap) { return 0; }
-	virtual CPhysCollide *UnserializeCollide(char *pBuffer, int size, int index);
-	virtual float CollideVolume(CPhysCollide *pCollide);
-	virtual float CollideSurfaceArea(CPhysCollide *pCollide);
-	virtual Vector CollideGetExtent(const CPhysCollide *pCollide,
-			const Vector &collideOrigin, const QAngle &collideAngles, const Vector &direction);
-	virtual void CollideGetAABB(Vector *pMins, Vector *pMaxs, const CPhysCollide *pCollide,
-			const Vector &collideOrigin, const QAngle &collideAngles);
-	virtual void CollideGetMassCenter(CPhysCollide *pCollide, Vector *pOutMassCenter);
-	virtual void CollideSetMassCenter(CPhysCollide *pCollide, const Vector &massCenter);
-	virtual Vector CollideGetOrthographicAreas(const CPhysCollide *pCollide);
-	virtual void CollideSetOrthographicAreas(CPhysCollide *pCollide, const Vector &areas);
-	virtual int CollideIndex(const CPhysCollide *pCollide);
-	virtual CPhysCollide *BBoxToCollide(const Vector &mins, const Vector &maxs);
-	virtual int GetConvexesUsedInCollideable(const CPhysCollide *pCollideable,
-			CPhysConvex **pOutputArray, int iOutputArrayLimit);
-	virtual void TraceBox(const Vector &start, const Vector &end,
-			const Vector &mins, const Vector &maxs, const CPhysCollide *pCollide,
-			const Vector &collideOrigin, const QAngle &collideAngles, trace_t *ptr);
-	virtual void TraceBox(const Ray_t &ray, const CPhysCollide *pCollide,
-			const Vector &collideOrigin, const QAngle &collideAngles, trace_t *ptr);
-	virtual void TraceBox(const Ray_t &ray, unsigned int contentsMask,
+	void TraceBox(const Ray_t &ray, unsigned int contentsMask,
 			IConvexInfo *pConvexInfo, const CPhysCollide *pCollide,
 			const Vector &collideOrigin, const QAngle &collideAngles, trace_t *ptr);
-	virtual void TraceCollide(const Vector &start, const Vector &end,
+	void TraceCollide(const Vector &start, const Vector &end,
 			const CPhysCollide *pSweepCollide, const QAngle &sweepAngles, const CPhysCollide *pCollide,
 			const Vector &collideOrigin, const QAngle &collideAngles, trace_t *ptr);
-	virtual bool IsBoxIntersectingCone(
-			const Vector &boxAbsMins, const Vector &boxAbsMaxs, const truncatedcone_t &cone);
-	virtual void VCollideLoad(vcollide_t *pOutput,
-			int solidCount, const char *pBuffer, int size, bool swap);
-	virtual void VCollideUnload(vcollide_t *pVCollide);
-	virtual IVPhysicsKeyParser *VPhysicsKeyParserCreate(const char *pKeyData);
-	virtual void VPhysicsKeyParserDestroy(IVPhysicsKeyParser *pParser);
-	/* DUMMY */ virtual int CreateDebugMesh(CPhysCollide const *pCollisionModel, Vector **outVerts) {
-		*outVerts = nullptr;
-		return 0;
-	}
-	/* DUMMY */ virtual void DestroyDebugMesh(int vertCount, Vector *outVerts) {}
-	virtual ICollisionQuery *CreateQueryModel(CPhysCollide *pCollide);
-	virtual void DestroyQueryModel(ICollisionQuery *pQuery);
-	virtual IPhysicsCollision *ThreadContextCreate();
-	virtual void ThreadContextDestroy(IPhysicsCollision *pThreadContext);
-	virtual CPhysCollide *CreateVirtualMesh(const virtualmeshparams_t &params);
-	virtual bool SupportsVirtualMesh();
-	/* DUMMY */ virtual bool GetBBoxCacheSize(int *pCachedSize, int *pCachedCount) {
-		*pCachedSize = 0;
-		*pCachedCount = m_BBoxCache.Count();
-		return true;
-	}
-	/* DUMMY */ virtual CPolyhedron *PolyhedronFromConvex(CPhysConvex * const pConvex, bool bUseTempPolyhedron) { return nullptr; }
-	/* DUMMY */ virtual void OutputDebugInfo(const CPhysCollide *pCollide) {}
-	virtual unsigned int ReadStat(int statID);
-
-	// Internal methods.
-
-	// To reduce the number of memory allocations.
-	FORCEINLINE btAlignedObjectArray<btVector3> &GetHullCreationPointArray() { return m_HullCreationPoints; }
-
-	CPhysConvex_Hull *CreateConvexHullFromIVPCompactLedge(const VCollide_IVP_Compact_Ledge *ledge, CByteswap &byteswap);
-
-	CPhysCollide *UnserializeCollideFromBuffer(
-			const char *pBuffer, int size, int index, bool swap);
+	bool IsBoxIntersectingCone(const Vector &boxAbsMins, const Vector &boxAbsMaxs, const truncatedcone_t &cone);
 
-	FORCEINLINE void PushIVPNode(const VCollide_IVP_Compact_Ledgetree_Node *node) {
-		m_IVPNodeStack.AddToTail(node);
-	}
-	inline const VCollide_IVP_Compact_Ledgetree_Node *PopIVPNode() {
-		int stackDepth = m_IVPNodeStack.Count();
-		if (stackDepth == 0) {
-			return nullptr;
-		}
-		const VCollide_IVP_Compact_Ledgetree_Node *node = m_IVPNodeStack[stackDepth - 1];
-		m_IVPNodeStack.Remove(stackDepth - 1);
-		return node;
-	}
-
-	static btVector3 BoxInertia(const btVector3 &extents);
-	static btVector3 OffsetInertia(
-			const btVector3 &inertia, const btVector3 &origin, bool absolute = true);
+	// Overlap tests in Bullet space for queries of objects in an environment.
+	bool IsBoxIntersectingObject(const btVector3 &center, const btVector3 &halfExtents,
+			const btCollisionObject *object);
+	bool IsSphereIntersectingObject(const btVector3 &center, btScalar radius, const btCollisionObject *object);
 
 	FORCEINLINE btCollisionObject *GetTraceCollisionObject() { return &m_TraceCollisionObject; }
 	FORCEINLINE bool IsInContactTest() const { return m_InContactTest; } // To suppress callbacks.
 
-	CPhysCollide_Sphere *CreateCachedSphereCollide(btScalar radius);
-
-	// Destruction of convexes owned by compound collideables
-	// (can't delete child shapes until CPhysCollide_Compound destructor is finished).
-	void AddCompoundConvexToDeleteQueue(CPhysConvex *convex);
-	void CleanupCompoundConvexDeleteQueue();
-
 private:
-	/***************
-	 * Convex hulls
-	 ***************/
-
-	btAlignedObjectArray<btVector3> m_HullCreationPoints;
-
-	HullLibrary m_HullLibrary;
-
-	// Reducing the number of allocations during IVP surface unserialization.
-	CUtlVector<VCollide_IVP_Compact_Triangle> m_SwappedAndRemappedIVPTriangles;
-	CUtlVector<int> m_IVPPointMap;
-
-	/*****************
-	 * Bounding boxes
-	 *****************/
-
-	CPhysCollide_Compound *CreateBBox(const Vector &mins, const Vector &maxs);
-	CUtlVector<CPhysCollide_Compound *> m_BBoxCache;
-
-	/******************
-	 * Compound shapes
-	 ******************/
-
-	CPhysCollide *UnserializeIVPCompactSurface(
-			const VCollide_IVP_Compact_Surface *surface, CByteswap &byteswap,
-			const btVector3 &orthographicAreas);
-	CUtlVector<const VCollide_IVP_Compact_Ledgetree_Node *> m_IVPNodeStack;
-
-	CUtlVector<CPhysConvex *> m_CompoundConvexDeleteQueue;
-
-	/**********
-	 * Spheres
-	 **********/
-
-	CUtlVector<CPhysCollide_Sphere *> m_SphereCache;
-
-	/*********
-	 * Traces
-	 *********/
-
 	// Common.
 
-	static void ClearTrace(trace_t *trace);
-
 	btCollisionObject m_TraceCollisionObject;
 
 	struct TraceContentsFilter {
@@ -666,6 +678,7 @@ private:
 	btBoxShape m_TraceBoxShape;
 	btSphereShape m_TracePointShape; // For contact test if only testing a single point.
 	btConeShapeX m_TraceConeShape;
+	btSphereShape m_TraceSphereShape;
 
 	// Contact tests (in place - for startsolid and non-swept Ray_t).
 
@@ -676,6 +689,36 @@ private:
 	btCollisionObject m_ContactTestCollisionObject;
 	bool m_InContactTest;
 
+	// Whether m_ContactTestCollisionObject penetrates m_TraceCollisionObject.
+	bool IsContactTestObjectPenetrating();
+
+	// Replacement for contactPairTest of m_ContactTestCollisionObject and m_TraceCollisionObject.
+	// Goes through the children of compounds directly and reuses one algorithm (with its manifold) for each pair
+	// of convex shape types, so steady queries don't allocate memory. Other shapes use contactPairTest.
+	void ContactTest(btCollisionWorld::ContactResultCallback &resultCallback);
+
+	struct ContactTestAlgorithm_t {
+		int m_ShapeType0, m_ShapeType1;
+		btCollisionAlgorithm *m_Algorithm;
+	};
+	CUtlVector<ContactTestAlgorithm_t> m_ContactTestAlgorithms;
+	btCollisionAlgorithm *GetContactTestAlgorithm(
+			const btCollisionObjectWrapper *body0Wrap, const btCollisionObjectWrapper *body1Wrap);
+
+	// Convex shape or compound child that may touch the other object.
+	struct ContactTestPart_t {
+		btTransform m_WorldTransform;
+		btVector3 m_AabbMin, m_AabbMax;
+		const btCollisionShape *m_Shape;
+		int m_Index;
+	};
+	btAlignedObjectArray<ContactTestPart_t> m_ContactTestParts[2];
+	CUtlVector<int> m_ContactTestChildren;
+	// Returns false if the shape is not convex or a compound of convex shapes.
+	bool GetContactTestParts(const btCollisionObject *object,
+			const btVector3 &otherAabbMin, const btVector3 &otherAabbMax,
+			btAlignedObjectArray<ContactTestPart_t> &parts);
+
 	struct ContactTestResultCallback : public btCollisionWorld::ContactResultCallback {
 		const btCollisionObject *m_TestObject;
 		const TraceContentsFilter *m_ContentsFilter;
@@ -732,7 +775,7 @@ private:
 			m_ShallowestHitDistance = distance;
 			m_ShallowestHitNormal = hitNormal;
 			m_ShallowestHitPoint = hitPoint;
-			m_ShallowestHitContents = hitChildIndex;
+			m_ShallowestHitContents = contents;
 			return 0.0f;
 		}
 
@@ -821,6 +864,456 @@ private:
 			m_HitCollisionObject = nullptr;
 		}
 	};
+
+	// Traces rays against spheres, boxes and small hulls, and boxes against boxes with the same axes,
+	// without the generic tests. Returns false if the generic tests are needed.
+	bool TraceBoxAnalytic(const Ray_t &ray, const btVector3 &rayDelta, bool isSwept,
+			const btCollisionShape *shape, const btTransform &shapeWorldTransform,
+			const TraceContentsFilter &contentsFilter, btVector3 &hitNormal, btVector3 &hitPoint, trace_t *ptr);
+
+	// Whether the start of a trace of a point or an axis-aligned box is solid, using the face planes of
+	// box and hull children instead of the contact test. Unknown if the planes can't tell or for other shapes.
+	// If solid, gives the contents, the normal and the point of the least penetrated child like the contact test.
+	enum StartSolid_t {
+		START_SOLID_NO,
+		START_SOLID_YES,
+		START_SOLID_UNKNOWN
+	};
+	StartSolid_t TestStartSolidWithFacePlanes(const btCollisionShape *shape, const btTransform &shapeWorldTransform,
+			const btVector3 &traceHalfExtents, const TraceContentsFilter &contentsFilter,
+			unsigned int &contents, btVector3 &hitNormal, btVector3 &hitPoint);
+
+	// Compound sweeps.
+
+	// Children of the swept compound that may touch the target, and of the target compound that may touch one of them.
+	CUtlVector<int> m_SweptChildren, m_TouchedChildren;
+};
+
+/************
+ * Interface
+ ************/
+
+class CPhysicsCollision : public IPhysicsCollision {
+public:
+	CPhysicsCollision();
+	virtual ~CPhysicsCollision();
+
+	// IPhysicsCollision methods.
+
+	virtual CPhysConvex *ConvexFromVerts(Vector **pVerts, int vertCount);
+	virtual CPhysConvex *ConvexFromPlanes(float *pPlanes, int planeCount, float mergeDistance);
+	virtual float ConvexVolume(CPhysConvex *pConvex);
+	virtual float ConvexSurfaceArea(CPhysConvex *pConvex);
+	virtual void SetConvexGameData(CPhysConvex *pConvex, unsigned int gameData);
+	virtual void ConvexFree(CPhysConvex *pConvex);
+	virtual CPhysConvex *BBoxToConvex(const Vector &mins, const Vector &maxs);
+	virtual CPhysConvex *ConvexFromConvexPolyhedron(const CPolyhedron &ConvexPolyhedron);
+	/* DUMMY */ virtual void ConvexesFromConvexPolygon(
+			const Vector &vPolyNormal, const Vector *pPoints, int iPointCount, CPhysConvex **pOutput) {
+		*pOutput = nullptr;
+	}
+	virtual CPhysPolysoup *PolysoupCreate();
+	virtual void PolysoupDestroy(CPhysPolysoup *pSoup);
+	virtual void PolysoupAddTriangle(CPhysPolysoup *pSoup,
+			const Vector &a, const Vector &b, const Vector &c, int materialIndex7bits);
+	virtual CPhysCollide *ConvertPolysoupToCollide(CPhysPolysoup *pSoup, bool useMOPP);
+	virtual CPhysCollide *ConvertConvexToCollide(CPhysConvex **pConvex, int convexCount);
+	virtual CPhysCollide *ConvertConvexToCollideParams(CPhysConvex **pConvex, int convexCount,
+			const convertconvexparams_t &convertParams);
+	virtual void DestroyCollide(CPhysCollide *pCollide);
+	virtual int CollideSize(CPhysCollide *pCollide);
+	virtual int CollideWrite(char *pDest, CPhysCollide *pCollide, bool bSwap);
+	virtual CPhysCollide *UnserializeCollide(char *pBuffer, int size, int index);
+	virtual float CollideVolume(CPhysCollide *pCollide);
+	virtual float CollideSurfaceArea(CPhysCollide *pCollide);
+	virtual Vector CollideGetExtent(const CPhysCollide *pCollide,
+			const Vector &collideOrigin, const QAngle &collideAngles, const Vector &direction);
+	virtual void CollideGetAABB(Vector *pMins, Vector *pMaxs, const CPhysCollide *pCollide,
+			const Vector &collideOrigin, const QAngle &collideAngles);
+	virtual void CollideGetMassCenter(CPhysCollide *pCollide, Vector *pOutMassCenter);
+	virtual void CollideSetMassCenter(CPhysCollide *pCollide, const Vector &massCenter);
+	virtual Vector CollideGetOrthographicAreas(const CPhysCollide *pCollide);
+	virtual void CollideSetOrthographicAreas(CPhysCollide *pCollide, const Vector &areas);
+	virtual int CollideIndex(const CPhysCollide *pCollide);
+	virtual CPhysCollide *BBoxToCollide(const Vector &mins, const Vector &maxs);
+	virtual int GetConvexesUsedInCollideable(const CPhysCollide *pCollideable,
+			CPhysConvex **pOutputArray, int iOutputArrayLimit);
+	virtual void TraceBox(const Vector &start, const Vector &end,
+			const Vector &mins, const Vector &maxs, const CPhysCollide *pCollide,
+			const Vector &collideOrigin, const QAngle &collideAngles, trace_t *ptr);
+	virtual void TraceBox(const Ray_t &ray, const CPhysCollide *pCollide,
+			const Vector &collideOrigin, const QAngle &collideAngles, trace_t *ptr);
+	virtual void TraceBox(const Ray_t &ray, unsigned int contentsMask,
+			IConvexInfo *pConvexInfo, const CPhysCollide *pCollide,
+			const Vector &collideOrigin, const QAngle &collideAngles, trace_t *ptr);
+	virtual void TraceCollide(const Vector &start, const Vector &end,
+			const CPhysCollide *pSweepCollide, const QAngle &sweepAngles, const CPhysCollide *pCollide,
+			const Vector &collideOrigin, const QAngle &collideAngles, trace_t *ptr);
+	virtual bool IsBoxIntersectingCone(
+			const Vector &boxAbsMins, const Vector &boxAbsMaxs, const truncatedcone_t &cone);
+	virtual void VCollideLoad(vcollide_t *pOutput,
+			int solidCount, const char *pBuffer, int size, bool swap);
+	virtual void VCollideUnload(vcollide_t *pVCollide);
+	virtual IVPhysicsKeyParser *VPhysicsKeyParserCreate(const char *pKeyData);
+	virtual void VPhysicsKeyParserDestroy(IVPhysicsKeyParser *pParser);
+	/* DUMMY */ virtual int CreateDebugMesh(CPhysCollide const *pCollisionModel, Vector **outVerts) {
+		*outVerts = nullptr;
+		return 0;
+	}
+	/* DUMMY */ virtual void DestroyDebugMesh(int vertCount, Vector *outVerts) {}
+	virtual ICollisionQuery *CreateQueryModel(CPhysCollide *pCollide);
+	virtual void DestroyQueryModel(ICollisionQuery *pQuery);
+	virtual IPhysicsCollision *ThreadContextCreate();
+	virtual void ThreadContextDestroy(IPhysicsCollision *pThreadContext);
+	virtual CPhysCollide *CreateVirtualMesh(const virtualmeshparams_t &params);
+	virtual bool SupportsVirtualMesh();
+	virtual bool GetBBoxCacheSize(int *pCachedSize, int *pCachedCount);
+	/* DUMMY */ virtual CPolyhedron *PolyhedronFromConvex(CPhysConvex * const pConvex, bool bUseTempPolyhedron) { return nullptr; }
+	/* DUMMY */ virtual void OutputDebugInfo(const CPhysCollide *pCollide) {}
+	virtual unsigned int ReadStat(int statID);
+
+	// Internal methods.
+
+	// To reduce the number of memory allocations.
+	FORCEINLINE btAlignedObjectArray<btVector3> &GetHullCreationPointArray() { return m_HullCreationPoints; }
+
+	// Reusable arrays for converting IVP ledges, one per job converting them.
+	struct IVPLedgeScratch_t {
+		CUtlVector<const VCollide_IVP_Compact_Ledgetree_Node *> m_NodeStack;
+		CUtlVector<VCollide_IVP_Compact_Triangle> m_SwappedAndRemappedTriangles;
+		CUtlVector<int> m_PointMap;
+		btAlignedObjectArray<btVector3> m_Points;
+	};
+	// Whether CreateConvexHullFromIVPCompactLedge can create a hull from the ledge (it has triangles).
+	static bool IsIVPCompactLedgeConvertible(const VCollide_IVP_Compact_Ledge *ledge, CByteswap &byteswap);
+	// Only accesses the hull cache of the interface, so it can be called on any thread.
+	// Identical ledges share one hull, so CPhysCollide_Compound::UnshareConvex must be called before modifying it.
+	static CPhysConvex_Hull *CreateConvexHullFromIVPCompactLedge(const VCollide_IVP_Compact_Ledge *ledge,
+			CByteswap &byteswap, IVPLedgeScratch_t &scratch);
+	// Appends the ledges in the order they're added to the compound.
+	static void GetIVPCompactSurfaceLedges(const VCollide_IVP_Compact_Ledgetree_Node *root, CByteswap &byteswap,
+			IVPLedgeScratch_t &scratch, CUtlVector<const VCollide_IVP_Compact_Ledge *> &ledges);
+
+	CPhysCollide *UnserializeCollideFromBuffer(
+			const char *pBuffer, int size, int index, bool swap);
+
+	static btVector3 BoxInertia(const btVector3 &extents);
+	static btVector3 OffsetInertia(
+			const btVector3 &inertia, const btVector3 &origin, bool absolute = true);
+
+	static void ClearTrace(trace_t *trace);
+
+	// Context of the thread that created the interface, the others must use ThreadContextCreate.
+	FORCEINLINE CPhysicsTraceContext &GetTraceContext() { return m_TraceContext; }
+	// Context of the calling thread for queries done internally on any thread, such as environment overlaps,
+	// or nullptr if the thread's Bullet index is out of range - use CPhysicsThreadTraceContextScope instead.
+	CPhysicsTraceContext *GetThreadTraceContext();
+
+	CPhysCollide_Sphere *CreateCachedSphereCollide(btScalar radius);
+	// Called when the last object using a cached sphere is destroyed.
+	void AddFreeCachedSphere(CPhysCollide_Sphere *sphere);
+
+	// Sphere and bounding box caches.
+	void PrintShapeCacheStats();
+	void ResetShapeCacheStats();
+
+	// Destruction of convexes owned by compound collideables
+	// (can't delete child shapes until CPhysCollide_Compound destructor is finished).
+	void AddCompoundConvexToDeleteQueue(CPhysConvex *convex);
+	void CleanupCompoundConvexDeleteQueue();
+
+	// Deduplication of hulls converted from IVP ledges, thread-safe.
+	// The key is the converted ledge - points, triangles with materials, and the game data.
+	struct HullCacheKey_t {
+		const btVector3 *m_Points;
+		int m_PointCount;
+		const VCollide_IVP_Compact_Triangle *m_Triangles; // Swapped and remapped.
+		int m_TriangleCount;
+		int m_UserIndex;
+		unsigned int m_Hash;
+	};
+	static unsigned int HashHullCacheKey(const HullCacheKey_t &key);
+	// Returns an identical hull with a new reference, or null if there's none.
+	CPhysConvex_Hull *FindCachedHull(const HullCacheKey_t &key);
+	// Adds a new hull with one reference, or if another thread has added an identical one meanwhile,
+	// releases the new hull and returns that one.
+	CPhysConvex_Hull *AddCachedHull(CPhysConvex_Hull *hull, const HullCacheKey_t &key);
+	// For adding a shared hull to another compound.
+	void AddCachedHullReference(CPhysConvex_Hull *hull);
+	void PrintHullCacheStats();
+	void ResetHullCacheStats();
+
+private:
+	/***************
+	 * Convex hulls
+	 ***************/
+
+	btAlignedObjectArray<btVector3> m_HullCreationPoints;
+
+	HullLibrary m_HullLibrary;
+
+	// For unserialization of individual IVP surfaces and for gathering the ledges in VCollideLoad.
+	IVPLedgeScratch_t m_IVPLedgeScratch;
+	// For converting the ledges in VCollideLoad, indexed by btGetCurrentThreadIndex like the narrowphase thread data,
+	// reused across the chunks and the loads.
+	IVPLedgeScratch_t m_ThreadIVPLedgeScratch[BT_MAX_THREAD_COUNT];
+
+	/*****************
+	 * Bounding boxes
+	 *****************/
+
+	CPhysCollide_Compound *CreateBBox(const Vector &mins, const Vector &maxs);
+	// Half extents and origin, quantized.
+	struct BBoxCacheKey_t {
+		int m_Values[6];
+		// For btHashMap.
+		unsigned int getHash() const;
+		FORCEINLINE bool equals(const BBoxCacheKey_t &other) const {
+			return memcmp(m_Values, other.m_Values, sizeof(m_Values)) == 0;
+		}
+	};
+	btHashMap<BBoxCacheKey_t, CPhysCollide_Compound *> m_BBoxCache;
+	unsigned int m_BBoxCacheHits, m_BBoxCacheMisses;
+
+	/******************
+	 * Compound shapes
+	 ******************/
+
+	// Returns the IVP compact surface in the buffer and the offset of its ledgetree root, or null if it's not one.
+	const VCollide_IVP_Compact_Surface *GetIVPCompactSurface(const char *pBuffer, CByteswap &byteswap,
+			int &rootOffset, btVector3 &massCenter, btVector3 &inertia, btVector3 &orthographicAreas);
+	// Takes the ownership of the hulls, skipping null ones (ledges without triangles).
+	static CPhysCollide *CreateCompoundFromIVPLedgeHulls(CPhysConvex **hulls, int hullCount,
+			const btVector3 &massCenter, const btVector3 &inertia, const btVector3 &orthographicAreas);
+	CUtlVector<const VCollide_IVP_Compact_Ledge *> m_IVPLedges;
+	CUtlVector<CPhysConvex *> m_IVPLedgeHulls;
+
+	// VCollideLoad gathers the ledges of all IVP solids first to convert them in parallel.
+	struct VCollideLoadSurface_t {
+		int m_SolidIndex;
+		int m_FirstLedge, m_LedgeCount;
+		btVector3 m_MassCenter, m_Inertia, m_OrthographicAreas;
+	};
+	CUtlVector<VCollideLoadSurface_t> m_VCollideLoadSurfaces;
+	struct VCollideLoadJob_t {
+		const VCollide_IVP_Compact_Ledge * const *m_Ledges;
+		CPhysConvex **m_Hulls;
+		IVPLedgeScratch_t *m_ThreadScratch; // BT_MAX_THREAD_COUNT.
+		bool m_Swap;
+	};
+	static void ConvertIVPLedges(void *context, int begin, int end);
+
+	CPhysCollide *UnserializeBulletCollide(const char *pBuffer, int size, CByteswap &byteswap);
+
+	CPhysCollide *UnserializeBulletCompound(const char *data, const char *dataEnd, CByteswap &byteswap,
+			const btVector3 &orthographicAreas);
+	CPhysConvex *UnserializeBulletConvex(int convexType, const char *data, int size, CByteswap &byteswap);
+	CUtlVector<CPhysConvex *> m_UnserializedBulletConvexes;
+	btAlignedObjectArray<btVector3> m_UnserializedBulletChildOrigins;
+
+	CUtlVector<CPhysConvex *> m_CompoundConvexDeleteQueue;
+
+	/*************
+	 * Hull cache
+	 *************/
+
+	struct HullCacheEntry_t {
+		CPhysConvex_Hull *m_Hull; // Null if free.
+		unsigned int m_Hash;
+		int m_References;
+		int m_Next; // In the bucket, or in the free list if free.
+	};
+	CUtlVector<HullCacheEntry_t> m_HullCacheEntries;
+	int m_FirstFreeHullCacheEntry; // Using a free list to keep the indices in the hulls valid.
+	btHashMap<btHashInt, int> m_HullCacheBuckets; // First entry with each hash.
+	CThreadFastMutex m_HullCacheMutex;
+	static bool HullMatchesCacheKey(const CPhysConvex_Hull *hull, const HullCacheKey_t &key);
+	int FindHullCacheEntry(const HullCacheKey_t &key) const;
+	void ReleaseCachedHull(CPhysConvex_Hull *hull);
+	unsigned int m_HullCacheHits, m_HullCacheMisses;
+
+	/**********
+	 * Spheres
+	 **********/
+
+	// Keyed by the quantized radius.
+	btHashMap<btHashInt, CPhysCollide_Sphere *> m_SphereCache;
+	// Spheres not used by any object that can be resized, may contain ones that have been used again since.
+	CUtlVector<CPhysCollide_Sphere *> m_FreeSphereCache;
+	unsigned int m_SphereCacheHits, m_SphereCacheMisses;
+
+	/*********
+	 * Traces
+	 *********/
+
+	CPhysicsTraceContext m_TraceContext;
+	// Indexed by btGetCurrentThreadIndex, created on first use by each thread.
+	CPhysicsTraceContext *m_ThreadTraceContexts[BT_MAX_THREAD_COUNT];
+};
+
+// The trace context of the calling thread, or a temporary one owned by the scope if the thread's Bullet index is
+// beyond BT_MAX_THREAD_COUNT (Bullet gives every new thread a new index, and only asserts the limit).
+class CPhysicsThreadTraceContextScope {
+public:
+	CPhysicsThreadTraceContextScope(CPhysicsCollision &collision);
+	~CPhysicsThreadTraceContextScope();
+	FORCEINLINE CPhysicsTraceContext &Get() const { return *m_Context; }
+
+private:
+	CPhysicsTraceContext *m_Context;
+	bool m_Temporary;
+};
+
+// Returned by ThreadContextCreate - traces with own scratch objects, everything else done by the shared interface.
+// Creation and destruction of collideables are still not thread-safe because of the caches and object references.
+class CPhysicsCollisionThreadContext : public IPhysicsCollision {
+public:
+	CPhysicsCollisionThreadContext(CPhysicsCollision *collision) : m_Collision(collision) {}
+
+	virtual CPhysConvex *ConvexFromVerts(Vector **pVerts, int vertCount) {
+		return m_Collision->ConvexFromVerts(pVerts, vertCount);
+	}
+	virtual CPhysConvex *ConvexFromPlanes(float *pPlanes, int planeCount, float mergeDistance) {
+		return m_Collision->ConvexFromPlanes(pPlanes, planeCount, mergeDistance);
+	}
+	virtual float ConvexVolume(CPhysConvex *pConvex) { return m_Collision->ConvexVolume(pConvex); }
+	virtual float ConvexSurfaceArea(CPhysConvex *pConvex) { return m_Collision->ConvexSurfaceArea(pConvex); }
+	virtual void SetConvexGameData(CPhysConvex *pConvex, unsigned int gameData) {
+		m_Collision->SetConvexGameData(pConvex, gameData);
+	}
+	virtual void ConvexFree(CPhysConvex *pConvex) { m_Collision->ConvexFree(pConvex); }
+	virtual CPhysConvex *BBoxToConvex(const Vector &mins, const Vector &maxs) {
+		return m_Collision->BBoxToConvex(mins, maxs);
+	}
+	virtual CPhysConvex *ConvexFromConvexPolyhedron(const CPolyhedron &ConvexPolyhedron) {
+		return m_Collision->ConvexFromConvexPolyhedron(ConvexPolyhedron);
+	}
+	virtual void ConvexesFromConvexPolygon(
+			const Vector &vPolyNormal, const Vector *pPoints, int iPointCount, CPhysConvex **pOutput) {
+		m_Collision->ConvexesFromConvexPolygon(vPolyNormal, pPoints, iPointCount, pOutput);
+	}
+	virtual CPhysPolysoup *PolysoupCreate() { return m_Collision->PolysoupCreate(); }
+	virtual void PolysoupDestroy(CPhysPolysoup *pSoup) { m_Collision->PolysoupDestroy(pSoup); }
+	virtual void PolysoupAddTriangle(CPhysPolysoup *pSoup,
+			const Vector &a, const Vector &b, const Vector &c, int materialIndex7bits) {
+		m_Collision->PolysoupAddTriangle(pSoup, a, b, c, materialIndex7bits);
+	}
+	virtual CPhysCollide *ConvertPolysoupToCollide(CPhysPolysoup *pSoup, bool useMOPP) {
+		return m_Collision->ConvertPolysoupToCollide(pSoup, useMOPP);
+	}
+	virtual CPhysCollide *ConvertConvexToCollide(CPhysConvex **pConvex, int convexCount) {
+		return m_Collision->ConvertConvexToCollide(pConvex, convexCount);
+	}
+	virtual CPhysCollide *ConvertConvexToCollideParams(CPhysConvex **pConvex, int convexCount,
+			const convertconvexparams_t &convertParams) {
+		return m_Collision->ConvertConvexToCollideParams(pConvex, convexCount, convertParams);
+	}
+	virtual void DestroyCollide(CPhysCollide *pCollide) { m_Collision->DestroyCollide(pCollide); }
+	virtual int CollideSize(CPhysCollide *pCollide) { return m_Collision->CollideSize(pCollide); }
+	virtual int CollideWrite(char *pDest, CPhysCollide *pCollide, bool bSwap) {
+		return m_Collision->CollideWrite(pDest, pCollide, bSwap);
+	}
+	virtual CPhysCollide *UnserializeCollide(char *pBuffer, int size, int index) {
+		return m_Collision->UnserializeCollide(pBuffer, size, index);
+	}
+	virtual float CollideVolume(CPhysCollide *pCollide) { return m_Collision->CollideVolume(pCollide); }
+	virtual float CollideSurfaceArea(CPhysCollide *pCollide) { return m_Collision->CollideSurfaceArea(pCollide); }
+	virtual Vector CollideGetExtent(const CPhysCollide *pCollide,
+			const Vector &collideOrigin, const QAngle &collideAngles, const Vector &direction) {
+		return m_Collision->CollideGetExtent(pCollide, collideOrigin, collideAngles, direction);
+	}
+	virtual void CollideGetAABB(Vector *pMins, Vector *pMaxs, const CPhysCollide *pCollide,
+			const Vector &collideOrigin, const QAngle &collideAngles) {
+		m_Collision->CollideGetAABB(pMins, pMaxs, pCollide, collideOrigin, collideAngles);
+	}
+	virtual void CollideGetMassCenter(CPhysCollide *pCollide, Vector *pOutMassCenter) {
+		m_Collision->CollideGetMassCenter(pCollide, pOutMassCenter);
+	}
+	virtual void CollideSetMassCenter(CPhysCollide *pCollide, const Vector &massCenter) {
+		m_Collision->CollideSetMassCenter(pCollide, massCenter);
+	}
+	virtual Vector CollideGetOrthographicAreas(const CPhysCollide *pCollide) {
+		return m_Collision->CollideGetOrthographicAreas(pCollide);
+	}
+	virtual void CollideSetOrthographicAreas(CPhysCollide *pCollide, const Vector &areas) {
+		m_Collision->CollideSetOrthographicAreas(pCollide, areas);
+	}
+	virtual int CollideIndex(const CPhysCollide *pCollide) { return m_Collision->CollideIndex(pCollide); }
+	virtual CPhysCollide *BBoxToCollide(const Vector &mins, const Vector &maxs) {
+		return m_Collision->BBoxToCollide(mins, maxs);
+	}
+	virtual int GetConvexesUsedInCollideable(const CPhysCollide *pCollideable,
+			CPhysConvex **pOutputArray, int iOutputArrayLimit) {
+		return m_Collision->GetConvexesUsedInCollideable(pCollideable, pOutputArray, iOutputArrayLimit);
+	}
+	virtual void TraceBox(const Vector &start, const Vector &end,
+			const Vector &mins, const Vector &maxs, const CPhysCollide *pCollide,
+			const Vector &collideOrigin, const QAngle &collideAngles, trace_t *ptr) {
+		Ray_t ray;
+		ray.Init(start, end, mins, maxs);
+		m_TraceContext.TraceBox(ray, MASK_ALL, nullptr, pCollide, collideOrigin, collideAngles, ptr);
+	}
+	virtual void TraceBox(const Ray_t &ray, const CPhysCollide *pCollide,
+			const Vector &collideOrigin, const QAngle &collideAngles, trace_t *ptr) {
+		m_TraceContext.TraceBox(ray, MASK_ALL, nullptr, pCollide, collideOrigin, collideAngles, ptr);
+	}
+	virtual void TraceBox(const Ray_t &ray, unsigned int contentsMask,
+			IConvexInfo *pConvexInfo, const CPhysCollide *pCollide,
+			const Vector &collideOrigin, const QAngle &collideAngles, trace_t *ptr) {
+		m_TraceContext.TraceBox(ray, contentsMask, pConvexInfo, pCollide, collideOrigin, collideAngles, ptr);
+	}
+	virtual void TraceCollide(const Vector &start, const Vector &end,
+			const CPhysCollide *pSweepCollide, const QAngle &sweepAngles, const CPhysCollide *pCollide,
+			const Vector &collideOrigin, const QAngle &collideAngles, trace_t *ptr) {
+		m_TraceContext.TraceCollide(start, end, pSweepCollide, sweepAngles, pCollide, collideOrigin, collideAngles, ptr);
+	}
+	virtual bool IsBoxIntersectingCone(
+			const Vector &boxAbsMins, const Vector &boxAbsMaxs, const truncatedcone_t &cone) {
+		return m_TraceContext.IsBoxIntersectingCone(boxAbsMins, boxAbsMaxs, cone);
+	}
+	virtual void VCollideLoad(vcollide_t *pOutput,
+			int solidCount, const char *pBuffer, int size, bool swap) {
+		m_Collision->VCollideLoad(pOutput, solidCount, pBuffer, size, swap);
+	}
+	virtual void VCollideUnload(vcollide_t *pVCollide) { m_Collision->VCollideUnload(pVCollide); }
+	virtual IVPhysicsKeyParser *VPhysicsKeyParserCreate(const char *pKeyData) {
+		return m_Collision->VPhysicsKeyParserCreate(pKeyData);
+	}
+	virtual void VPhysicsKeyParserDestroy(IVPhysicsKeyParser *pParser) {
+		m_Collision->VPhysicsKeyParserDestroy(pParser);
+	}
+	virtual int CreateDebugMesh(CPhysCollide const *pCollisionModel, Vector **outVerts) {
+		return m_Collision->CreateDebugMesh(pCollisionModel, outVerts);
+	}
+	virtual void DestroyDebugMesh(int vertCount, Vector *outVerts) {
+		m_Collision->DestroyDebugMesh(vertCount, outVerts);
+	}
+	virtual ICollisionQuery *CreateQueryModel(CPhysCollide *pCollide) {
+		return m_Collision->CreateQueryModel(pCollide);
+	}
+	virtual void DestroyQueryModel(ICollisionQuery *pQuery) { m_Collision->DestroyQueryModel(pQuery); }
+	virtual IPhysicsCollision *ThreadContextCreate() { return m_Collision->ThreadContextCreate(); }
+	virtual void ThreadContextDestroy(IPhysicsCollision *pThreadContext) {
+		m_Collision->ThreadContextDestroy(pThreadContext);
+	}
+	virtual CPhysCollide *CreateVirtualMesh(const virtualmeshparams_t &params) {
+		return m_Collision->CreateVirtualMesh(params);
+	}
+	virtual bool SupportsVirtualMesh() { return m_Collision->SupportsVirtualMesh(); }
+	virtual bool GetBBoxCacheSize(int *pCachedSize, int *pCachedCount) {
+		return m_Collision->GetBBoxCacheSize(pCachedSize, pCachedCount);
+	}
+	virtual CPolyhedron *PolyhedronFromConvex(CPhysConvex * const pConvex, bool bUseTempPolyhedron) {
+		return m_Collision->PolyhedronFromConvex(pConvex, bUseTempPolyhedron);
+	}
+	virtual void OutputDebugInfo(const CPhysCollide *pCollide) { m_Collision->OutputDebugInfo(pCollide); }
+	virtual unsigned int ReadStat(int statID) { return m_Collision->ReadStat(statID); }
+
+	FORCEINLINE CPhysicsTraceContext &GetTraceContext() { return m_TraceContext; }
+
+private:
+	CPhysicsCollision *m_Collision;
+	CPhysicsTraceContext m_TraceContext;
 };
 
 class CCollisionQuery : public ICollisionQuery {
@@ -835,6 +1328,7 @@ public:
 	virtual void SetTriangleMaterialIndex(int convexIndex, int triangleIndex, int index7bits);
 
 private:
+	CPhysCollide_Compound *m_Compound;
 	btCompoundShape *m_CompoundShape;	
 
 	inline CPhysConvex *GetConvex(int convexIndex) {
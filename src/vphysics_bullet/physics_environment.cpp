@@ -10,17 +10,27 @@
 #include "physics_object.h"
 #include "physics_shadow.h"
 #include "physics_spring.h"
+#include "physics_threads.h"
 #include "physics_vehicle.h"
 #include "vphysics/stats.h"
 #include "const.h"
 #include "tier1/convar.h"
+#include <BulletCollision/CollisionDispatch/btManifoldResult.h>
+#include <BulletCollision/CollisionDispatch/btSimulationIslandManager.h>
+#include <LinearMath/btAabbUtil2.h>
 
 #ifdef WIN32
 #pragma warning(push)
 #pragma warning(disable : 4355) // 'this' : used in base member initializer list
 #endif
 
+static ConVar physics_bullet_mtworld("physics_bullet_mtworld", "0", 0,
+		"Use the multithreaded Bullet world, dispatcher and solver pool in new environments. "
+		"Parallel work runs on physics_bullet_threads worker threads.");
+
 CPhysicsEnvironment::CPhysicsEnvironment() :
+		m_SortingObjectManifolds(false),
+		m_Multithreaded(physics_bullet_mtworld.GetBool()),
 		m_Gravity(0.0f, 0.0f, 0.0f),
 		m_AirDensity(2.0f),
 		m_ObjectEvents(nullptr),
@@ -29,19 +39,36 @@ CPhysicsEnvironment::CPhysicsEnvironment() :
 		m_SimulationInvTimeStep(1.0f / btScalar(DEFAULT_TICK_INTERVAL)),
 		m_InSimulation(false),
 		m_LastPSITime(0.0f), m_TimeSinceLastPSI(0.0f),
-		m_CollisionSolver(nullptr), m_OverlapFilterCallback(this),
+		m_CollisionSolver(nullptr), m_OverlapFilterCallback(this), m_OverlappingPairCallback(this),
 		m_CollisionEvents(nullptr),
 		m_HighestActiveFrictionSnapshot(-1),
-		m_QuickDelete(false) {
+		m_QuickDelete(false),
+		m_LimitingCollisionChecks(false), m_LimitingCollisionsPerObject(false),
+		m_CollisionChecksLeft(INT_MAX), m_AdditionalCollisionChecksRequested(false),
+		m_CollisionChecksPreselected(false), m_CheckedPairSerial(0) {
 	m_PerformanceSettings.Defaults();
+	memset(&m_Stats, 0, sizeof(m_Stats));
 
 	m_CollisionConfiguration = VPhysicsNew(btDefaultCollisionConfiguration);
 	// TODO: Do this per-overlap for small or fast-moving objects, has a huge post-load performance hit.
 	m_CollisionConfiguration->setConvexConvexMultipointIterations();
-	m_Dispatcher = VPhysicsNew(btCollisionDispatcher, m_CollisionConfiguration);
 	m_Broadphase = VPhysicsNew(btDbvtBroadphase);
-	m_Solver = VPhysicsNew(btSequentialImpulseConstraintSolver);
-	m_DynamicsWorld = VPhysicsNew(btDiscreteDynamicsWorld, m_Dispatcher, m_Broadphase, m_Solver, m_CollisionConfiguration);
+	if (m_Multithreaded) {
+		// The scheduler must be set before creating the dispatcher, which allocates per-thread arrays.
+		g_PhysicsTaskScheduler.Install();
+		m_Dispatcher = VPhysicsNew(CollisionDispatcherMt, this, m_CollisionConfiguration);
+		m_Dispatcher->setNearCallback(NearCallback<CollisionDispatcherMt>);
+		// Islands are solved by whichever solver in the pool isn't locked by another thread.
+		m_Solver = VPhysicsNew(btConstraintSolverPoolMt, MAX(GetCPUInformation()->m_nLogicalProcessors, 1));
+		m_DynamicsWorld = VPhysicsNew(DynamicsWorld<btDiscreteDynamicsWorldMt>, this, m_Dispatcher, m_Broadphase,
+				static_cast<btConstraintSolverPoolMt *>(m_Solver), nullptr, m_CollisionConfiguration);
+	} else {
+		m_Dispatcher = VPhysicsNew(CollisionDispatcher, this, m_CollisionConfiguration);
+		m_Dispatcher->setNearCallback(NearCallback<CollisionDispatcher>);
+		m_Solver = VPhysicsNew(btSequentialImpulseConstraintSolver);
+		m_DynamicsWorld = VPhysicsNew(DynamicsWorld<btDiscreteDynamicsWorld>, this,
+				m_Dispatcher, m_Broadphase, m_Solver, m_CollisionConfiguration);
+	}
 	m_DynamicsWorld->setWorldUserInfo(this);
 
 	m_DynamicsWorld->setDebugDrawer(&m_DebugDrawer);
@@ -50,6 +77,7 @@ CPhysicsEnvironment::CPhysicsEnvironment() :
 	m_DynamicsWorld->setGravity(btVector3(0.0f, 0.0f, 0.0f));
 
 	m_Broadphase->getOverlappingPairCache()->setOverlapFilterCallback(&m_OverlapFilterCallback);
+	m_Broadphase->getOverlappingPairCache()->setInternalGhostPairCallback(&m_OverlappingPairCallback);
 
 	m_DynamicsWorld->getDispatchInfo().m_allowedCcdPenetration = VPHYSICS_CONVEX_DISTANCE_MARGIN;
 	btContactSolverInfo &solverInfo = m_DynamicsWorld->getSolverInfo();
@@ -76,10 +104,16 @@ CPhysicsEnvironment::~CPhysicsEnvironment() {
 		VPhysicsDelete(CPhysicsFrictionSnapshot, m_FrictionSnapshots[snapshotIndex]);
 	}
 
-	VPhysicsDelete(btDiscreteDynamicsWorld, m_DynamicsWorld);
-	VPhysicsDelete(btSequentialImpulseConstraintSolver, m_Solver);
+	if (m_Multithreaded) {
+		VPhysicsDelete(DynamicsWorld<btDiscreteDynamicsWorldMt>, m_DynamicsWorld);
+		VPhysicsDelete(btConstraintSolverPoolMt, m_Solver);
+		VPhysicsDelete(CollisionDispatcherMt, m_Dispatcher);
+	} else {
+		VPhysicsDelete(DynamicsWorld<btDiscreteDynamicsWorld>, m_DynamicsWorld);
+		VPhysicsDelete(btSequentialImpulseConstraintSolver, m_Solver);
+		VPhysicsDelete(CollisionDispatcher, m_Dispatcher);
+	}
 	VPhysicsDelete(btDbvtBroadphase, m_Broadphase);
-	VPhysicsDelete(btCollisionDispatcher, m_Dispatcher);
 	VPhysicsDelete(btDefaultCollisionConfiguration, m_CollisionConfiguration);
 }
 
@@ -166,14 +200,103 @@ IVPhysicsDebugOverlay *CPhysicsEnvironment::GetDebugOverlay() {
 
 void CPhysicsEnvironment::AddObject(IPhysicsObject *object) {
 	CPhysicsObject *physicsObject = static_cast<CPhysicsObject *>(object);
+	bool isStatic = object->IsStatic();
 	m_DynamicsWorld->addRigidBody(physicsObject->GetRigidBody());
 	m_Objects.AddToTail(object);
-	if (!object->IsStatic()) {
+	if (!isStatic) {
+		physicsObject->SetAwakeObjectIndex(CPhysicsObject::AWAKE_OBJECT_INDEX_NONE);
 		m_NonStaticObjects.AddToTail(object);
 		if (!physicsObject->WasAsleep()) {
 			m_ActiveNonStaticObjects.AddToTail(object);
 		}
+		if (!physicsObject->IsAsleep() || physicsObject->IsAffectedByPreTickCallbacks()) {
+			AddAwakeObject(physicsObject);
+		}
+	}
+}
+
+void CPhysicsEnvironment::AddAwakeObject(CPhysicsObject *object) {
+	if (object->GetAwakeObjectIndex() != CPhysicsObject::AWAKE_OBJECT_INDEX_NONE) {
+		return;
 	}
+	object->SetAwakeObjectIndex(m_AwakeObjects.AddToTail(object));
+}
+
+void CPhysicsEnvironment::RemoveAwakeObject(CPhysicsObject *object) {
+	int index = object->GetAwakeObjectIndex();
+	if (index < 0) {
+		return;
+	}
+	Assert(m_AwakeObjects[index] == object);
+	int lastIndex = m_AwakeObjects.Count() - 1;
+	if (index != lastIndex) {
+		CPhysicsObject *lastObject = m_AwakeObjects[lastIndex];
+		m_AwakeObjects[index] = lastObject;
+		lastObject->SetAwakeObjectIndex(index);
+	}
+	m_AwakeObjects.RemoveMultipleFromTail(1);
+	object->SetAwakeObjectIndex(CPhysicsObject::AWAKE_OBJECT_INDEX_NONE);
+}
+
+void CPhysicsEnvironment::AddObjectsWokenByIslands(btScalar timeStep) {
+	// Bullet has united the objects linked by overlapping pairs and enabled constraints into islands, and will wake
+	// every object in an island with an active one when building the islands for solving. Doing the same here
+	// with a single pass over the union-find elements, which only contain non-static objects.
+	btUnionFind &unionFind = m_DynamicsWorld->getSimulationIslandManager()->getUnionFind();
+	int elementCount = unionFind.getNumElements();
+	if (elementCount == 0) {
+		return;
+	}
+	m_IslandsWithActiveObjects.SetCount(elementCount);
+	memset(m_IslandsWithActiveObjects.Base(), 0, elementCount * sizeof(bool));
+	bool anyIslandsWithActiveObjects = false;
+	int awakeObjectCount = m_AwakeObjects.Count();
+	for (int objectIndex = 0; objectIndex < awakeObjectCount; ++objectIndex) {
+		const btRigidBody *body = m_AwakeObjects[objectIndex]->GetRigidBody();
+		// The same condition as in btSimulationIslandManager::buildIslands.
+		int activationState = body->getActivationState();
+		if (activationState != ACTIVE_TAG && activationState != DISABLE_DEACTIVATION) {
+			continue;
+		}
+		int islandTag = body->getIslandTag();
+		if (islandTag >= 0 && islandTag < elementCount) {
+			m_IslandsWithActiveObjects[islandTag] = true;
+			anyIslandsWithActiveObjects = true;
+		}
+	}
+	if (!anyIslandsWithActiveObjects) {
+		return;
+	}
+
+	const btCollisionObjectArray &collisionObjects = m_DynamicsWorld->getCollisionObjectArray();
+	int firstWokenObject = m_AwakeObjects.Count();
+	for (int elementIndex = 0; elementIndex < elementCount; ++elementIndex) {
+		if (!m_IslandsWithActiveObjects[unionFind.find(elementIndex)]) {
+			continue;
+		}
+#ifdef STATIC_SIMULATION_ISLAND_OPTIMIZATION
+		// Set to the index in the collision object array by storeIslandActivationState.
+		btCollisionObject *collisionObject = collisionObjects[unionFind.getElement(elementIndex).m_sz];
+#else
+		btCollisionObject *collisionObject = collisionObjects[elementIndex];
+#endif
+		// Objects put to sleep by the game (DISABLE_SIMULATION) link islands, but aren't woken up by Bullet.
+		if (collisionObject->getActivationState() != ISLAND_SLEEPING) {
+			continue;
+		}
+		CPhysicsObject *object = static_cast<CPhysicsObject *>(
+				reinterpret_cast<IPhysicsObject *>(collisionObject->getUserPointer()));
+		if (object == nullptr) {
+			continue;
+		}
+		// What buildIslands would do.
+		collisionObject->setActivationState(WANTS_DEACTIVATION);
+		collisionObject->setDeactivationTime(0.0f);
+		AddAwakeObject(object);
+	}
+
+	// Not simulated by PreTickCallback since they were sleeping then.
+	PreTickObjects(firstWokenObject, timeStep);
 }
 
 IPhysicsObject *CPhysicsEnvironment::CreatePolyObject(
@@ -218,9 +341,10 @@ void CPhysicsEnvironment::UpdateActiveObjects() {
 			}
 		}
 	}
-	int nonStaticObjectCount = m_NonStaticObjects.Count();
-	for (int objectIndex = 0; objectIndex < nonStaticObjectCount; ++objectIndex) {
-		CPhysicsObject *object = static_cast<CPhysicsObject *>(m_NonStaticObjects[objectIndex]);
+	// Objects not in the awake list are asleep and were asleep in the previous PSI too.
+	int awakeObjectCount = m_AwakeObjects.Count();
+	for (int objectIndex = 0; objectIndex < awakeObjectCount; ++objectIndex) {
+		CPhysicsObject *object = m_AwakeObjects[objectIndex];
 		if (object->UpdateEventSleepState() != object->IsAsleep()) {
 			Assert(!object->IsAsleep());
 			m_ActiveNonStaticObjects.AddToTail(object);
@@ -248,9 +372,15 @@ const IPhysicsObject **CPhysicsEnvironment::GetObjectList(int *pOutputObjectCoun
 }
 
 void CPhysicsEnvironment::UpdateNonStaticObjectsAfterPSI() {
-	int objectCount = m_NonStaticObjects.Count();
-	for (int objectIndex = 0; objectIndex < objectCount; ++objectIndex) {
-		static_cast<CPhysicsObject *>(m_NonStaticObjects[objectIndex])->UpdateAfterPSI();
+	// Backwards because removal moves the last object to the removed one's place.
+	for (int objectIndex = m_AwakeObjects.Count() - 1; objectIndex >= 0; --objectIndex) {
+		CPhysicsObject *object = m_AwakeObjects[objectIndex];
+		// Still updating objects that have just fallen asleep to store their final state.
+		object->UpdateAfterPSI();
+		m_Stats.totalEnergyDestroyed += object->TakeEnergyDestroyedBySolver();
+		if (object->IsAsleep() && !object->IsAffectedByPreTickCallbacks()) {
+			RemoveAwakeObject(object);
+		}
 	}
 }
 
@@ -262,22 +392,16 @@ void CPhysicsEnvironment::WakeContactingObjects(IPhysicsObject *object) {
 	if (!object->IsCollisionEnabled() || object->IsTrigger()) {
 		return;
 	}
-	const btCollisionObject *body = static_cast<const CPhysicsObject *>(object)->GetRigidBody();
-	int manifoldCount = m_Dispatcher->getNumManifolds();
+	const CPhysicsObject *physicsObject = static_cast<const CPhysicsObject *>(object);
+	const btCollisionObject *body = physicsObject->GetRigidBody();
+	int manifoldCount = physicsObject->GetManifoldCount();
 	for (int manifoldIndex = 0; manifoldIndex < manifoldCount; ++manifoldIndex) {
-		const btPersistentManifold *manifold = m_Dispatcher->getManifoldByIndexInternal(manifoldIndex);
-		int contactCount = manifold->getNumContacts();
-		if (contactCount == 0) {
-			continue;
-		}
-		const btCollisionObject *otherBody;
-		if (body == manifold->getBody0()) {
-			otherBody = manifold->getBody1();
-		} else if (body == manifold->getBody1()) {
-			otherBody = manifold->getBody0();
-		} else {
+		const btPersistentManifold *manifold = physicsObject->GetManifold(manifoldIndex);
+		if (manifold->getNumContacts() == 0) {
 			continue;
 		}
+		const btCollisionObject *otherBody = (manifold->getBody0() == body ?
+				manifold->getBody1() : manifold->getBody0());
 		IPhysicsObject *otherObject = reinterpret_cast<IPhysicsObject *>(otherBody->getUserPointer());
 		if (otherObject != nullptr && !otherObject->IsTrigger()) {
 			otherObject->Wake();
@@ -387,16 +511,18 @@ void CPhysicsEnvironment::NotifyObjectRemoving(IPhysicsObject *object) {
 	}
 	UpdateHighestActiveFrictionSnapshot();
 
-	if (!object->IsStatic()) {
+	if (physicsObject->IsAwakeStateTracked()) {
 		if (!physicsObject->WasAsleep()) {
 			m_ActiveNonStaticObjects.FindAndFastRemove(object);
 		}
 		m_NonStaticObjects.FindAndFastRemove(object);
+		RemoveAwakeObject(physicsObject);
 	}
 
 	// Already removed from m_Objects by the method which requested removal.
 
 	m_DynamicsWorld->removeRigidBody(physicsObject->GetRigidBody());
+	physicsObject->SetAwakeObjectIndex(CPhysicsObject::AWAKE_OBJECT_INDEX_UNTRACKED);
 }
 
 /****************
@@ -708,60 +834,121 @@ float CPhysicsEnvironment::GetNextFrameTime() const {
 	return m_LastPSITime + m_SimulationTimeStep;
 }
 
-void CPhysicsEnvironment::PreTickCallback(btDynamicsWorld *world, btScalar timeStep) {
-	CPhysicsEnvironment *environment = reinterpret_cast<CPhysicsEnvironment *>(world->getWorldUserInfo());
+static ConVar physics_bullet_parallelpretick("physics_bullet_parallelpretick", "0", 0,
+		"Apply damping, gravity and drag to objects not controlled by the game on physics_bullet_threads worker threads.");
 
-	if (!environment->m_QueueDeleteObject) {
-		environment->CleanupDeleteList();
-	}
+void CPhysicsEnvironment::PreTickObject(CPhysicsObject *object, btScalar timeStep) {
+	// Async force fields.
+	object->SimulateMotionControllers(IPhysicsMotionController::HIGH_PRIORITY, timeStep);
 
-	environment->m_InSimulation = true;
+	// Gravity.
+	object->ApplyDamping(timeStep);
+	object->ApplyForcesAndSpeedLimit(timeStep);
+	object->ApplyGravity(timeStep);
 
-	IPhysicsObject * const *objects = environment->m_NonStaticObjects.Base();
-	int objectCount = environment->m_NonStaticObjects.Count();
-	for (int objectIndex = 0; objectIndex < objectCount; ++objectIndex) {
-		CPhysicsObject *object = static_cast<CPhysicsObject *>(objects[objectIndex]);
+	// Shadows.
+	object->SimulateShadowAndPlayer(timeStep);
+
+	// Unconstrained motion.
+	object->ApplyDrag(timeStep);
+	object->SimulateMotionControllers(IPhysicsMotionController::MEDIUM_PRIORITY, timeStep);
+
+	// Vehicle.
+	object->SimulateVehicle(timeStep);
+
+	object->CheckAndClearBulletForces();
 
-		// Async force fields.
-		object->SimulateMotionControllers(IPhysicsMotionController::HIGH_PRIORITY, timeStep);
+	object->StoreEnergyBeforeSolver();
+}
 
-		// Gravity.
+void CPhysicsEnvironment::PreTickIndependentObjects(void *context, int begin, int end) {
+	const PreTickJob_t *job = reinterpret_cast<const PreTickJob_t *>(context);
+	CPhysicsObject * const *objects = job->m_Objects;
+	btScalar timeStep = job->m_TimeStep;
+	for (int objectIndex = begin; objectIndex < end; ++objectIndex) {
+		// Same as PreTickObject without the parts that do nothing for independent objects.
+		CPhysicsObject *object = objects[objectIndex];
 		object->ApplyDamping(timeStep);
 		object->ApplyForcesAndSpeedLimit(timeStep);
 		object->ApplyGravity(timeStep);
+		object->ApplyDrag(timeStep);
+		object->CheckAndClearBulletForces();
+		object->StoreEnergyBeforeSolver();
+	}
+}
 
-		// Shadows.
-		object->SimulateShadowAndPlayer(timeStep);
+void CPhysicsEnvironment::PreTickCallback(btDynamicsWorld *world, btScalar timeStep) {
+	CPhysicsEnvironment *environment = reinterpret_cast<CPhysicsEnvironment *>(world->getWorldUserInfo());
+	environment->m_Profile.BeginPSI();
+	PHYSICS_PROFILE_SCOPE(environment->m_Profile, PHYSICS_PROFILE_PRETICK, "CPhysicsEnvironment::PreTick");
 
-		// Unconstrained motion.
-		object->ApplyDrag(timeStep);
-		object->SimulateMotionControllers(IPhysicsMotionController::MEDIUM_PRIORITY, timeStep);
+	if (!environment->m_QueueDeleteObject) {
+		environment->CleanupDeleteList();
+	}
 
-		// Vehicle.
-		object->SimulateVehicle(timeStep);
+	environment->m_InSimulation = true;
 
-		object->CheckAndClearBulletForces();
+	environment->PreTickObjects(0, timeStep);
+}
+
+void CPhysicsEnvironment::PreTickObjects(int firstObject, btScalar timeStep) {
+	// Callbacks may wake objects up, adding them to the awake list, so not caching its base and count.
+	CUtlVector<CPhysicsObject *> &objects = m_AwakeObjects;
+
+	if (!physics_bullet_parallelpretick.GetBool()) {
+		for (int objectIndex = firstObject; objectIndex < objects.Count(); ++objectIndex) {
+			PreTickObject(objects[objectIndex], timeStep);
+		}
+		return;
 	}
+
+	// Objects calling back into the game or affecting other objects are simulated serially, in the same order.
+	// The rest only modify their own state, so they give the same result on any thread in any order.
+	// The runs of independent objects between them are finished before the next callback,
+	// so the game sees every object in the same state as with the serial loop.
+	int firstIndependentObject = firstObject;
+	for (int objectIndex = firstObject; objectIndex < objects.Count(); ++objectIndex) {
+		CPhysicsObject *object = objects[objectIndex];
+		if (!object->IsAffectedByPreTickCallbacks()) {
+			continue;
+		}
+		PreTickJob_t job = { objects.Base() + firstIndependentObject, timeStep };
+		g_PhysicsThreadPool.ParallelFor(objectIndex - firstIndependentObject, 64, PreTickIndependentObjects, &job);
+		PreTickObject(object, timeStep);
+		firstIndependentObject = objectIndex + 1;
+	}
+	PreTickJob_t job = { objects.Base() + firstIndependentObject, timeStep };
+	g_PhysicsThreadPool.ParallelFor(objects.Count() - firstIndependentObject, 64, PreTickIndependentObjects, &job);
 }
 
 void CPhysicsEnvironment::TickActionInterface::updateAction(
 		btCollisionWorld *collisionWorld, btScalar deltaTimeStep) {
 	CPhysicsEnvironment *environment = reinterpret_cast<CPhysicsEnvironment *>(
 			static_cast<btDynamicsWorld *>(collisionWorld)->getWorldUserInfo());
-	IPhysicsObject * const *objects = environment->m_NonStaticObjects.Base();
-	int objectCount = environment->m_NonStaticObjects.Count();
-	for (int objectIndex = 0; objectIndex < objectCount; ++objectIndex) {
-		CPhysicsObject *object = static_cast<CPhysicsObject *>(objects[objectIndex]);
-		object->SimulateMotionControllers(IPhysicsMotionController::LOW_PRIORITY, deltaTimeStep);
+	CUtlVector<CPhysicsObject *> &objects = environment->m_AwakeObjects;
+	for (int objectIndex = 0; objectIndex < objects.Count(); ++objectIndex) {
+		objects[objectIndex]->SimulateMotionControllers(IPhysicsMotionController::LOW_PRIORITY, deltaTimeStep);
 	}
 }
 
 void CPhysicsEnvironment::TickCallback(btDynamicsWorld *world, btScalar timeStep) {
 	CPhysicsEnvironment *environment = reinterpret_cast<CPhysicsEnvironment *>(world->getWorldUserInfo());
-	environment->CheckTriggerTouches();
+	environment->UnfreezeObjects();
+	{
+		PHYSICS_PROFILE_SCOPE(environment->m_Profile, PHYSICS_PROFILE_TRIGGERS, "CPhysicsEnvironment::CheckTriggerTouches");
+		environment->CheckTriggerTouches();
+	}
 	environment->UpdateActiveObjects();
 	environment->UpdateNonStaticObjectsAfterPSI();
 	environment->m_InSimulation = false;
+	if (CPhysicsProfile::IsEnabled()) {
+		CPhysicsProfile::PSICounts_t counts;
+		counts.m_Objects = environment->m_Objects.Count();
+		counts.m_AwakeObjects = environment->m_AwakeObjects.Count();
+		counts.m_Manifolds = environment->m_Dispatcher->getNumManifolds();
+		counts.m_Constraints = environment->m_DynamicsWorld->getNumConstraints();
+		environment->m_Profile.EndPSI(counts);
+	}
 }
 
 /************
@@ -896,6 +1083,250 @@ void CPhysicsEnvironment::DestroyFrictionSnapshot(IPhysicsFrictionSnapshot *snap
 	UpdateHighestActiveFrictionSnapshot();
 }
 
+void CPhysicsEnvironment::LinkManifoldToObjects(btPersistentManifold *manifold) {
+	ManifoldLink_t link;
+	for (int bodyIndex = 0; bodyIndex < 2; ++bodyIndex) {
+		const btCollisionObject *body = (bodyIndex != 0 ? manifold->getBody1() : manifold->getBody0());
+		CPhysicsObject *object = static_cast<CPhysicsObject *>(
+				reinterpret_cast<IPhysicsObject *>(body->getUserPointer()));
+		if (object == nullptr) {
+			link.m_ObjectManifoldIndices[bodyIndex] = -1;
+			continue;
+		}
+		link.m_ObjectManifoldIndices[bodyIndex] = object->NotifyManifoldCreated(manifold);
+		if (m_SortingObjectManifolds && object->MarkManifoldsUnsorted()) {
+			m_ObjectsWithUnsortedManifolds.AddToTail(object);
+		}
+	}
+	m_ManifoldLinks.insert(manifold, link);
+}
+
+void CPhysicsEnvironment::UnlinkManifoldFromObjects(btPersistentManifold *manifold) {
+	const ManifoldLink_t *link = m_ManifoldLinks.find(manifold);
+	Assert(link != nullptr);
+	if (link == nullptr) {
+		return;
+	}
+	for (int bodyIndex = 0; bodyIndex < 2; ++bodyIndex) {
+		int manifoldIndex = link->m_ObjectManifoldIndices[bodyIndex];
+		if (manifoldIndex < 0) {
+			continue;
+		}
+		const btCollisionObject *body = (bodyIndex != 0 ? manifold->getBody1() : manifold->getBody0());
+		CPhysicsObject *object = static_cast<CPhysicsObject *>(
+				reinterpret_cast<IPhysicsObject *>(body->getUserPointer()));
+		// The last manifold of the object takes the place of the released one.
+		btPersistentManifold *movedManifold = object->NotifyManifoldReleased(manifoldIndex);
+		if (movedManifold != nullptr) {
+			ManifoldLink_t *movedLink = m_ManifoldLinks.find(movedManifold);
+			movedLink->m_ObjectManifoldIndices[movedManifold->getBody0() == body ? 0 : 1] = manifoldIndex;
+		}
+		if (m_SortingObjectManifolds && object->MarkManifoldsUnsorted()) {
+			m_ObjectsWithUnsortedManifolds.AddToTail(object);
+		}
+	}
+	m_ManifoldLinks.remove(manifold);
+}
+
+int __cdecl CPhysicsEnvironment::CompareManifoldSortKeys(
+		const ManifoldSortKey_t *key1, const ManifoldSortKey_t *key2) {
+	if (key1->m_OtherObject != key2->m_OtherObject) {
+		return (key1->m_OtherObject < key2->m_OtherObject ? -1 : 1);
+	}
+	for (int index = 0; index < ARRAYSIZE(key1->m_FirstContact); ++index) {
+		if (key1->m_FirstContact[index] != key2->m_FirstContact[index]) {
+			return (key1->m_FirstContact[index] < key2->m_FirstContact[index] ? -1 : 1);
+		}
+	}
+	// Only manifolds without contacts of the same pair may be ordered arbitrarily.
+	return 0;
+}
+
+void CPhysicsEnvironment::SortObjectManifolds() {
+	m_SortingObjectManifolds = false;
+	CUtlVector<ManifoldSortKey_t> &keys = m_ManifoldSortKeys;
+	for (int objectIndex = 0; objectIndex < m_ObjectsWithUnsortedManifolds.Count(); ++objectIndex) {
+		CPhysicsObject *object = m_ObjectsWithUnsortedManifolds[objectIndex];
+		object->ClearManifoldsUnsorted();
+		const btCollisionObject *body = object->GetRigidBody();
+		int manifoldCount = object->GetManifoldCount();
+		keys.SetCount(manifoldCount);
+		for (int manifoldIndex = 0; manifoldIndex < manifoldCount; ++manifoldIndex) {
+			ManifoldSortKey_t &key = keys[manifoldIndex];
+			btPersistentManifold *manifold = object->GetManifold(manifoldIndex);
+			key.m_Manifold = manifold;
+			const btCollisionObject *otherBody = (manifold->getBody0() == body ?
+					manifold->getBody1() : manifold->getBody0());
+			key.m_OtherObject = otherBody->getBroadphaseHandle()->m_uniqueId;
+			if (manifold->getNumContacts() != 0) {
+				const btManifoldPoint &point = manifold->getContactPoint(0);
+				key.m_FirstContact[0] = point.m_partId0;
+				key.m_FirstContact[1] = point.m_index0;
+				key.m_FirstContact[2] = point.m_partId1;
+				key.m_FirstContact[3] = point.m_index1;
+			} else {
+				key.m_FirstContact[0] = key.m_FirstContact[1] = key.m_FirstContact[2] = key.m_FirstContact[3] = -1;
+			}
+		}
+		keys.Sort(CompareManifoldSortKeys);
+		for (int manifoldIndex = 0; manifoldIndex < manifoldCount; ++manifoldIndex) {
+			btPersistentManifold *manifold = keys[manifoldIndex].m_Manifold;
+			object->SetManifold(manifoldIndex, manifold);
+			m_ManifoldLinks.find(manifold)->m_ObjectManifoldIndices[manifold->getBody0() == body ? 0 : 1] =
+					manifoldIndex;
+		}
+	}
+	m_ObjectsWithUnsortedManifolds.RemoveAll();
+}
+
+bool CPhysicsEnvironment::IsPairInContact(const btBroadphasePair &pair, btManifoldArray &manifolds) {
+	if (pair.m_algorithm == nullptr) {
+		return false;
+	}
+	// Compound algorithms have a manifold for every child pair.
+	manifolds.resize(0);
+	pair.m_algorithm->getAllContactManifolds(manifolds);
+	for (int manifoldIndex = 0; manifoldIndex < manifolds.size(); ++manifoldIndex) {
+		if (manifolds[manifoldIndex]->getNumContacts() != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+template<typename Dispatcher>
+void CPhysicsEnvironment::NearCallback(btBroadphasePair &pair,
+		btCollisionDispatcher &dispatcher, const btDispatcherInfo &dispatchInfo) {
+	const btCollisionObject *body0 = reinterpret_cast<const btCollisionObject *>(pair.m_pProxy0->m_clientObject);
+	const btCollisionObject *body1 = reinterpret_cast<const btCollisionObject *>(pair.m_pProxy1->m_clientObject);
+	if (!dispatcher.needsCollision(body0, body1)) {
+		return;
+	}
+
+	Dispatcher &environmentDispatcher = static_cast<Dispatcher &>(dispatcher);
+	NarrowphaseThreadData_t &threadData = environmentDispatcher.GetThreadData();
+	const CPhysicsEnvironment *environment = environmentDispatcher.m_Environment;
+	// Pairs already in contact are always checked, like IVP's friction systems.
+	bool wasInContact = true;
+	if (environment->m_LimitingCollisionChecks || environment->m_LimitingCollisionsPerObject) {
+		wasInContact = IsPairInContact(pair, threadData.m_PairManifolds);
+		if (!wasInContact && !environmentDispatcher.TakeNewPairCheck(pair)) {
+			// Objects may penetrate, but the pair will be checked again in the next PSI.
+			++threadData.m_Delayed;
+			return;
+		}
+	}
+	if (body0->isStaticObject() || body1->isStaticObject()) {
+		++threadData.m_ObjectVsWorld;
+	} else {
+		++threadData.m_ObjectVsObject;
+	}
+
+	btCollisionObjectWrapper wrapper0(nullptr, body0->getCollisionShape(), body0, body0->getWorldTransform(), -1, -1);
+	btCollisionObjectWrapper wrapper1(nullptr, body1->getCollisionShape(), body1, body1->getWorldTransform(), -1, -1);
+	if (pair.m_algorithm == nullptr) {
+		pair.m_algorithm = dispatcher.findAlgorithm(&wrapper0, &wrapper1, nullptr, BT_CONTACT_POINT_ALGORITHMS);
+		if (pair.m_algorithm == nullptr) {
+			return;
+		}
+	}
+	btManifoldResult contactPointResult(&wrapper0, &wrapper1);
+	if (dispatchInfo.m_dispatchFunc == btDispatcherInfo::DISPATCH_DISCRETE) {
+		pair.m_algorithm->processCollision(&wrapper0, &wrapper1, dispatchInfo, &contactPointResult);
+	} else {
+		// Continuous collision detection query, same as in defaultNearCallback.
+		btScalar timeOfImpact = pair.m_algorithm->calculateTimeOfImpact(const_cast<btCollisionObject *>(body0),
+				const_cast<btCollisionObject *>(body1), dispatchInfo, &contactPointResult);
+		if (dispatchInfo.m_timeOfImpact > timeOfImpact) {
+			const_cast<btDispatcherInfo &>(dispatchInfo).m_timeOfImpact = timeOfImpact;
+		}
+		return;
+	}
+
+	if (!wasInContact && environment->m_LimitingCollisionsPerObject &&
+			IsPairInContact(pair, threadData.m_PairManifolds)) {
+		CPhysicsObject *object0 = static_cast<CPhysicsObject *>(
+				reinterpret_cast<IPhysicsObject *>(body0->getUserPointer()));
+		CPhysicsObject *object1 = static_cast<CPhysicsObject *>(
+				reinterpret_cast<IPhysicsObject *>(body1->getUserPointer()));
+		if (object0 != nullptr && object1 != nullptr && !object0->IsTrigger() && !object1->IsTrigger()) {
+			threadData.m_NewCollisionObjects.AddToTail(object0);
+			threadData.m_NewCollisionObjects.AddToTail(object1);
+		}
+	}
+}
+
+CPhysicsEnvironment::NarrowphaseThreadData_t *CPhysicsEnvironment::CreateNarrowphaseThreadData(int threadCount) {
+	NarrowphaseThreadData_t *threadData = reinterpret_cast<NarrowphaseThreadData_t *>(
+			MemAlloc_AllocAligned(threadCount * sizeof(NarrowphaseThreadData_t), 64));
+	for (int threadIndex = 0; threadIndex < threadCount; ++threadIndex) {
+		NarrowphaseThreadData_t *thread = new(&threadData[threadIndex]) NarrowphaseThreadData_t;
+		thread->m_ObjectVsObject = thread->m_ObjectVsWorld = thread->m_Delayed = 0;
+	}
+	return threadData;
+}
+
+void CPhysicsEnvironment::DestroyNarrowphaseThreadData(NarrowphaseThreadData_t *threadData, int threadCount) {
+	for (int threadIndex = 0; threadIndex < threadCount; ++threadIndex) {
+		threadData[threadIndex].~NarrowphaseThreadData_t();
+	}
+	MemAlloc_FreeAligned(threadData);
+}
+
+CPhysicsEnvironment::NarrowphaseThreadData_t *CPhysicsEnvironment::GetNarrowphaseThreadData(int &threadCount) const {
+	if (m_Multithreaded) {
+		threadCount = BT_MAX_THREAD_COUNT;
+		return static_cast<const CollisionDispatcherMt *>(m_Dispatcher)->m_ThreadData;
+	}
+	threadCount = 1;
+	return static_cast<const CollisionDispatcher *>(m_Dispatcher)->m_ThreadData;
+}
+
+btPersistentManifold *CPhysicsEnvironment::CollisionDispatcher::getNewManifold(
+		const btCollisionObject *body0, const btCollisionObject *body1) {
+	btPersistentManifold *manifold = btCollisionDispatcher::getNewManifold(body0, body1);
+	m_Environment->LinkManifoldToObjects(manifold);
+	return manifold;
+}
+
+void CPhysicsEnvironment::CollisionDispatcher::releaseManifold(btPersistentManifold *manifold) {
+	m_Environment->UnlinkManifoldFromObjects(manifold);
+	btCollisionDispatcher::releaseManifold(manifold);
+}
+
+btPersistentManifold *CPhysicsEnvironment::CollisionDispatcherMt::getNewManifold(
+		const btCollisionObject *body0, const btCollisionObject *body1) {
+	btPersistentManifold *manifold = btCollisionDispatcherMt::getNewManifold(body0, body1);
+	AUTO_LOCK(m_ManifoldLinkMutex);
+	m_Environment->LinkManifoldToObjects(manifold);
+	return manifold;
+}
+
+void CPhysicsEnvironment::CollisionDispatcherMt::releaseManifold(btPersistentManifold *manifold) {
+	{
+		AUTO_LOCK(m_ManifoldLinkMutex);
+		m_Environment->UnlinkManifoldFromObjects(manifold);
+	}
+	btCollisionDispatcherMt::releaseManifold(manifold);
+}
+
+btBroadphasePair *CPhysicsEnvironment::OverlappingPairCallback::addOverlappingPair(
+		btBroadphaseProxy *proxy0, btBroadphaseProxy *proxy1) {
+	++m_Environment->m_Stats.collisionPairsCreated;
+	return nullptr;
+}
+
+void *CPhysicsEnvironment::OverlappingPairCallback::removeOverlappingPair(
+		btBroadphaseProxy *proxy0, btBroadphaseProxy *proxy1, btDispatcher *dispatcher) {
+	++m_Environment->m_Stats.collisionPairsDestroyed;
+	return nullptr;
+}
+
+void CPhysicsEnvironment::OverlappingPairCallback::removeOverlappingPairsContainingProxy(
+		btBroadphaseProxy *proxy0, btDispatcher *dispatcher) {
+	// The hashed pair cache calls removeOverlappingPair for every pair instead.
+}
+
 void CPhysicsEnvironment::CheckTriggerTouches() {
 	int manifoldCount = m_Dispatcher->getNumManifolds();
 	for (int manifoldIndex = 0; manifoldIndex < manifoldCount; ++manifoldIndex) {
@@ -924,6 +1355,10 @@ void CPhysicsEnvironment::CheckTriggerTouches() {
 			trigger = object1;
 			object = object0;
 		} else {
+			// Already going through all manifolds, so counting solved contacts here.
+			if (manifold->getBody0()->isActive() || manifold->getBody1()->isActive()) {
+				m_Stats.frictionEventsProcessed += contactCount;
+			}
 			continue;
 		}
 		if (object->IsStatic()) {
@@ -990,18 +1425,424 @@ void CPhysicsEnvironment::NotifyTriggerRemoved(IPhysicsObject *trigger) {
 	}
 }
 
-/******************
- * Traces (unused)
- ******************/
+/*********
+ * Traces
+ *********/
+
+bool CPhysicsEnvironment::ShouldTraceHitObject(IPhysicsObject *object,
+		unsigned int contentsMask, IPhysicsTraceFilter *traceFilter) {
+	if ((object->GetCallbackFlags() & CALLBACK_MARKED_FOR_DELETE) || !(object->GetContents() & contentsMask)) {
+		return false;
+	}
+	if (traceFilter == nullptr) {
+		return true;
+	}
+	switch (traceFilter->GetTraceType()) {
+	case VPHYSICS_TRACE_STATIC_ONLY:
+		if (!object->IsStatic() || object->IsTrigger()) {
+			return false;
+		}
+		break;
+	case VPHYSICS_TRACE_MOVING_ONLY:
+		if (object->IsStatic() || object->IsTrigger()) {
+			return false;
+		}
+		break;
+	case VPHYSICS_TRACE_TRIGGERS_ONLY:
+		if (!object->IsTrigger()) {
+			return false;
+		}
+		break;
+	case VPHYSICS_TRACE_STATIC_AND_MOVING:
+		if (object->IsTrigger()) {
+			return false;
+		}
+		break;
+	}
+	return traceFilter->ShouldHitObject(object, contentsMask);
+}
+
+void CPhysicsEnvironment::TraceBroadphaseCallback::SetRay(const btVector3 &from, const btVector3 &to) {
+	btVector3 direction = (to - from).normalized();
+	for (int axis = 0; axis < 3; ++axis) {
+		m_rayDirectionInverse[axis] = (direction[axis] == 0.0f ? BT_LARGE_FLOAT : 1.0f / direction[axis]);
+		m_signs[axis] = (m_rayDirectionInverse[axis] < 0.0f);
+	}
+	m_lambda_max = direction.dot(to - from);
+	m_RayLength = m_lambda_max;
+}
+
+btScalar CPhysicsEnvironment::TraceBroadphaseCallback::GetMaxHitFraction() const {
+	const btScalar margin = VPHYSICS_CONVEX_DISTANCE_MARGIN;
+	if (m_ClosestProxyID < 0 || m_RayLength <= margin) {
+		return 1.0f;
+	}
+	return MIN(m_Trace->fraction + margin / m_RayLength, 1.0f);
+}
+
+bool CPhysicsEnvironment::IsCloserTraceHit(const trace_t &trace, int proxyID,
+		const trace_t &closestTrace, int closestProxyID) {
+	if (trace.fraction >= 1.0f && !trace.startsolid) {
+		return false;
+	}
+	if (closestProxyID < 0) {
+		return true;
+	}
+	if (trace.fraction != closestTrace.fraction) {
+		return trace.fraction < closestTrace.fraction;
+	}
+	if (trace.startsolid != closestTrace.startsolid) {
+		return trace.startsolid;
+	}
+	return proxyID < closestProxyID;
+}
+
+bool CPhysicsEnvironment::TraceBroadphaseCallback::process(const btBroadphaseProxy *proxy) {
+	IPhysicsObject *object = reinterpret_cast<IPhysicsObject *>(
+			reinterpret_cast<const btCollisionObject *>(proxy->m_clientObject)->getUserPointer());
+	if (object == nullptr || !ShouldTraceHitObject(object, m_ContentsMask, m_TraceFilter)) {
+		return true;
+	}
+
+	// Broadphase bounds are from the last PSI, so tracing against the objects there too.
+	Vector objectOrigin;
+	QAngle objectAngles;
+	static_cast<const CPhysicsObject *>(object)->GetPositionAtPSI(&objectOrigin, &objectAngles);
+	trace_t objectTrace;
+	if (m_SweepCollide != nullptr) {
+		g_pPhysCollision->TraceCollide(*m_SweepStart, *m_SweepEnd, m_SweepCollide, *m_SweepAngles,
+				object->GetCollide(), objectOrigin, objectAngles, &objectTrace);
+	} else {
+		g_pPhysCollision->TraceBox(*m_Ray, m_ContentsMask, nullptr,
+				object->GetCollide(), objectOrigin, objectAngles, &objectTrace);
+	}
+	if (IsCloserTraceHit(objectTrace, proxy->m_uniqueId, *m_Trace, m_ClosestProxyID)) {
+		m_ClosestProxyID = proxy->m_uniqueId;
+		*m_Trace = objectTrace;
+		m_Trace->contents = object->GetContents();
+		m_Trace->surface.surfaceProps = object->GetMaterialIndex();
+		// Same as what the game uses for PhysGetEntity and ragdoll bones.
+		m_Trace->m_pEnt = reinterpret_cast<CBaseEntity *>(object->GetGameData());
+		m_Trace->physicsbone = object->GetGameIndex();
+		if (m_RayLength > 0.0f) {
+			m_lambda_max = GetMaxHitFraction() * m_RayLength;
+		}
+	}
+	return true;
+}
+
+void CPhysicsEnvironment::TraceBroadphase(TraceBroadphaseCallback &callback,
+		const btVector3 &start, const btVector3 &end, const btVector3 &aabbMin, const btVector3 &aabbMax) {
+	if ((end - start).length2() > 1e-6f) {
+		callback.SetRay(start, end);
+		for (int setIndex = 0; setIndex < 2; ++setIndex) {
+			TraceRayTree(m_Broadphase->m_sets[setIndex].m_root, callback, start, aabbMin, aabbMax);
+		}
+	} else {
+		m_Broadphase->aabbTest(start + aabbMin, start + aabbMax, callback);
+	}
+}
+
+void CPhysicsEnvironment::TraceRayTree(const btDbvtNode *root, TraceBroadphaseCallback &callback,
+		const btVector3 &start, const btVector3 &aabbMin, const btVector3 &aabbMax) {
+	if (root == nullptr) {
+		return;
+	}
+	CUtlVector<const btDbvtNode *> &stack = m_TraceStack;
+	stack.AddToTail(root);
+	while (stack.Count() != 0) {
+		const btDbvtNode *node = stack.Tail();
+		stack.RemoveMultipleFromTail(1);
+		// Node bounds expanded by the traced bounds, as in btDbvt::rayTestInternal.
+		btVector3 bounds[2] = { node->volume.Mins() - aabbMax, node->volume.Maxs() - aabbMin };
+		btScalar nodeLambda;
+		if (!btRayAabb2(start, callback.m_rayDirectionInverse, callback.m_signs, bounds,
+				nodeLambda, 0.0f, callback.m_lambda_max)) {
+			continue;
+		}
+		if (node->isinternal()) {
+			stack.AddToTail(node->childs[0]);
+			stack.AddToTail(node->childs[1]);
+			continue;
+		}
+		callback.process(reinterpret_cast<const btBroadphaseProxy *>(node->data));
+	}
+}
+
+void CPhysicsEnvironment::BeginRayTrace(TraceBroadphaseCallback &callback, const Ray_t &ray,
+		unsigned int contentsMask, IPhysicsTraceFilter *traceFilter, trace_t *trace) {
+	CPhysicsCollision::ClearTrace(trace);
+	VectorAdd(ray.m_Start, ray.m_StartOffset, trace->startpos);
+	VectorAdd(trace->startpos, ray.m_Delta, trace->endpos);
+	callback.m_Ray = &ray;
+	callback.m_SweepCollide = nullptr;
+	callback.m_ContentsMask = contentsMask;
+	callback.m_TraceFilter = traceFilter;
+	callback.m_Trace = trace;
+	callback.m_ClosestProxyID = -1;
+	callback.m_RayLength = 0.0f;
+}
 
 void CPhysicsEnvironment::TraceRay(const Ray_t &ray, unsigned int fMask, IPhysicsTraceFilter *pTraceFilter, trace_t *pTrace) {
-	// Not implemented in IVP VPhysics, can be implemented using rayTest.
+	TraceBroadphaseCallback callback;
+	BeginRayTrace(callback, ray, fMask, pTraceFilter, pTrace);
+	btVector3 start, end, halfExtents;
+	ConvertPositionToBullet(ray.m_Start, start);
+	ConvertPositionToBullet(ray.m_Start + ray.m_Delta, end);
+	ConvertPositionToBullet(ray.m_Extents, halfExtents);
+	halfExtents = halfExtents.absolute();
+	TraceBroadphase(callback, start, end, -halfExtents, halfExtents);
+}
+
+void CPhysicsEnvironment::TraceRays(const Ray_t *rays, int rayCount, unsigned int contentsMask,
+		IPhysicsTraceFilter *traceFilter, trace_t *traces) {
+	// Expanding the nodes slightly so rounding doesn't make packets skip objects found by single ray traces.
+	// The exact tests are the same as in TraceRay, and the closest hit doesn't depend on the order of objects.
+	const btScalar nodeMargin = 0.001f;
+
+	for (int packetStart = 0; packetStart < rayCount; packetStart += 4) {
+		int packetSize = MIN(rayCount - packetStart, 4);
+		TraceBroadphaseCallback callbacks[4];
+		FourVectors starts, inverseDeltas, halfExtents;
+		for (int lane = 0; lane < 4; ++lane) {
+			// Unused lanes repeat the last ray, but they're masked out.
+			const Ray_t &ray = rays[packetStart + MIN(lane, packetSize - 1)];
+			btVector3 start, end, rayHalfExtents;
+			ConvertPositionToBullet(ray.m_Start, start);
+			ConvertPositionToBullet(ray.m_Start + ray.m_Delta, end);
+			ConvertPositionToBullet(ray.m_Extents, rayHalfExtents);
+			btVector3 delta = end - start;
+			for (int axis = 0; axis < 3; ++axis) {
+				SubFloat(starts[axis], lane) = start[axis];
+				SubFloat(inverseDeltas[axis], lane) = (delta[axis] != 0.0f ? 1.0f / delta[axis] : BT_LARGE_FLOAT);
+				SubFloat(halfExtents[axis], lane) = btFabs(rayHalfExtents[axis]) + nodeMargin;
+			}
+			if (lane < packetSize) {
+				BeginRayTrace(callbacks[lane], rays[packetStart + lane],
+						contentsMask, traceFilter, &traces[packetStart + lane]);
+				// Only used for the fraction limit, the packet test doesn't use m_lambda_max.
+				callbacks[lane].m_RayLength = delta.length();
+			}
+		}
+		int laneMask = (1 << packetSize) - 1;
+		for (int setIndex = 0; setIndex < 2; ++setIndex) {
+			TraceRayPacket(m_Broadphase->m_sets[setIndex].m_root, laneMask,
+					starts, inverseDeltas, halfExtents, callbacks);
+		}
+	}
+}
+
+void CPhysicsEnvironment::TraceRayPacket(const btDbvtNode *root, int laneMask, const FourVectors &starts,
+		const FourVectors &inverseDeltas, const FourVectors &halfExtents, TraceBroadphaseCallback *callbacks) {
+	if (root == nullptr) {
+		return;
+	}
+	// Nodes beyond the closest hit of each ray so far are skipped.
+	fltx4 maxFractions = Four_Ones;
+	for (int lane = 0; lane < 4; ++lane) {
+		if (laneMask & (1 << lane)) {
+			SubFloat(maxFractions, lane) = callbacks[lane].GetMaxHitFraction();
+		}
+	}
+	CUtlVector<const btDbvtNode *> &stack = m_TraceStack;
+	stack.AddToTail(root);
+	while (stack.Count() != 0) {
+		const btDbvtNode *node = stack.Tail();
+		stack.RemoveMultipleFromTail(1);
+
+		// Slab test of the node bounds expanded by the box extents.
+		const btVector3 &nodeMins = node->volume.Mins(), &nodeMaxs = node->volume.Maxs();
+		fltx4 nearT = Four_Zeros, farT = maxFractions;
+		for (int axis = 0; axis < 3; ++axis) {
+			fltx4 t0 = MulSIMD(SubSIMD(SubSIMD(ReplicateX4(nodeMins[axis]), halfExtents[axis]), starts[axis]),
+					inverseDeltas[axis]);
+			fltx4 t1 = MulSIMD(SubSIMD(AddSIMD(ReplicateX4(nodeMaxs[axis]), halfExtents[axis]), starts[axis]),
+					inverseDeltas[axis]);
+			nearT = MaxSIMD(nearT, MinSIMD(t0, t1));
+			farT = MinSIMD(farT, MaxSIMD(t0, t1));
+		}
+		int hitMask = TestSignSIMD(CmpLeSIMD(nearT, farT)) & laneMask;
+		if (hitMask == 0) {
+			continue;
+		}
+
+		if (node->isinternal()) {
+			stack.AddToTail(node->childs[0]);
+			stack.AddToTail(node->childs[1]);
+			continue;
+		}
+		const btBroadphaseProxy *proxy = reinterpret_cast<const btBroadphaseProxy *>(node->data);
+		for (int lane = 0; lane < 4; ++lane) {
+			if (hitMask & (1 << lane)) {
+				callbacks[lane].process(proxy);
+				SubFloat(maxFractions, lane) = callbacks[lane].GetMaxHitFraction();
+			}
+		}
+	}
 }
 
 void CPhysicsEnvironment::SweepCollideable(const CPhysCollide *pCollide, const Vector &vecAbsStart, const Vector &vecAbsEnd,
 		const QAngle &vecAngles, unsigned int fMask, IPhysicsTraceFilter *pTraceFilter, trace_t *pTrace) {
-	// Not implemented in IVP VPhysics.
-	// For compound objects, possibly the closest hit of every child can be returned.
+	CPhysicsCollision::ClearTrace(pTrace);
+	pTrace->startpos = vecAbsStart;
+	pTrace->endpos = vecAbsEnd;
+
+	TraceBroadphaseCallback callback;
+	callback.m_Ray = nullptr;
+	callback.m_SweepCollide = pCollide;
+	callback.m_SweepStart = &vecAbsStart;
+	callback.m_SweepEnd = &vecAbsEnd;
+	callback.m_SweepAngles = &vecAngles;
+	callback.m_ContentsMask = fMask;
+	callback.m_TraceFilter = pTraceFilter;
+	callback.m_Trace = pTrace;
+	callback.m_ClosestProxyID = -1;
+	callback.m_RayLength = 0.0f;
+	btVector3 start, end;
+	ConvertPositionToBullet(vecAbsStart, start);
+	ConvertPositionToBullet(vecAbsEnd, end);
+	// Conversion may flip axes, so reordering the bounds.
+	Vector mins, maxs;
+	g_pPhysCollision->CollideGetAABB(&mins, &maxs, pCollide, vec3_origin, vecAngles);
+	btVector3 bound0, bound1;
+	ConvertPositionToBullet(mins, bound0);
+	ConvertPositionToBullet(maxs, bound1);
+	btVector3 aabbMin = bound0, aabbMax = bound1;
+	aabbMin.setMin(bound1);
+	aabbMax.setMax(bound0);
+	TraceBroadphase(callback, start, end, aabbMin, aabbMax);
+}
+
+/***********
+ * Overlaps
+ ***********/
+
+bool CPhysicsEnvironment::OverlapBroadphaseCallback::process(const btBroadphaseProxy *proxy) {
+	const btCollisionObject *collisionObject = reinterpret_cast<const btCollisionObject *>(proxy->m_clientObject);
+	IPhysicsObject *object = reinterpret_cast<IPhysicsObject *>(collisionObject->getUserPointer());
+	if (object == nullptr || (object->GetCallbackFlags() & CALLBACK_MARKED_FOR_DELETE)) {
+		return true;
+	}
+	if (m_Radius >= 0.0f) {
+		btVector3 closest = m_Center;
+		closest.setMax(proxy->m_aabbMin);
+		closest.setMin(proxy->m_aabbMax);
+		if (closest.distance2(m_Center) > m_Radius * m_Radius) {
+			return true;
+		}
+	}
+	if (m_Exact) {
+		// Broadphase bounds and world transforms are both from the last PSI.
+		bool intersecting;
+		if (m_Radius >= 0.0f) {
+			intersecting = m_TraceContext->IsSphereIntersectingObject(
+					m_Center, m_Radius, collisionObject);
+		} else {
+			intersecting = m_TraceContext->IsBoxIntersectingObject(
+					m_Center, m_HalfExtents, collisionObject);
+		}
+		if (!intersecting) {
+			return true;
+		}
+	}
+	m_Objects->AddToTail(object);
+	return true;
+}
+
+void CPhysicsEnvironment::GetObjectsInBox(const Vector &mins, const Vector &maxs, bool exact,
+		CUtlVector<IPhysicsObject *> &objects) {
+	objects.RemoveAll();
+	// Conversion may flip axes, so reordering the bounds.
+	btVector3 bound0, bound1;
+	ConvertPositionToBullet(mins, bound0);
+	ConvertPositionToBullet(maxs, bound1);
+	btVector3 aabbMin = bound0, aabbMax = bound1;
+	aabbMin.setMin(bound1);
+	aabbMax.setMax(bound0);
+	OverlapBroadphaseCallback callback;
+	callback.m_Center = 0.5f * (aabbMin + aabbMax);
+	callback.m_HalfExtents = 0.5f * (aabbMax - aabbMin);
+	callback.m_Radius = -1.0f;
+	callback.m_Exact = exact;
+	CPhysicsThreadTraceContextScope traceContext(*g_pPhysCollision);
+	callback.m_TraceContext = &traceContext.Get();
+	callback.m_Objects = &objects;
+	m_Broadphase->aabbTest(aabbMin, aabbMax, callback);
+}
+
+void CPhysicsEnvironment::GetObjectsInSphere(const Vector &center, float radius, bool exact,
+		CUtlVector<IPhysicsObject *> &objects) {
+	objects.RemoveAll();
+	OverlapBroadphaseCallback callback;
+	ConvertPositionToBullet(center, callback.m_Center);
+	callback.m_Radius = HL2BULLET(MAX(radius, 0.0f));
+	callback.m_HalfExtents.setValue(callback.m_Radius, callback.m_Radius, callback.m_Radius);
+	callback.m_Exact = exact;
+	CPhysicsThreadTraceContextScope traceContext(*g_pPhysCollision);
+	callback.m_TraceContext = &traceContext.Get();
+	callback.m_Objects = &objects;
+	m_Broadphase->aabbTest(callback.m_Center - callback.m_HalfExtents,
+			callback.m_Center + callback.m_HalfExtents, callback);
+}
+
+class CPhysicsStaticOnlyTraceFilter : public IPhysicsTraceFilter {
+public:
+	virtual bool ShouldHitObject(IPhysicsObject *pObject, int contentsMask) { return true; }
+	virtual PhysicsTraceType_t GetTraceType() const { return VPHYSICS_TRACE_STATIC_ONLY; }
+};
+
+int CPhysicsEnvironment::ApplyRadialImpulse(const Vector &center, float radius, float impulse,
+		int flags, unsigned int occlusionMask) {
+	if (radius <= 0.0f) {
+		return 0;
+	}
+	GetObjectsInSphere(center, radius, false, m_RadialImpulseObjects);
+	int objectCount = m_RadialImpulseObjects.Count();
+	// Waking all the objects without growing the list multiple times.
+	m_AwakeObjects.EnsureCapacity(m_AwakeObjects.Count() + objectCount);
+
+	btVector3 bulletCenter;
+	ConvertPositionToBullet(center, bulletCenter);
+	btScalar bulletRadius = HL2BULLET(radius), bulletImpulse = HL2BULLET(impulse);
+	CPhysicsStaticOnlyTraceFilter occlusionFilter;
+	int pushedCount = 0;
+	for (int objectIndex = 0; objectIndex < objectCount; ++objectIndex) {
+		CPhysicsObject *object = static_cast<CPhysicsObject *>(m_RadialImpulseObjects[objectIndex]);
+		if (!object->IsMoveable() || object->IsTrigger()) {
+			continue;
+		}
+		const btTransform &worldTransform = object->GetRigidBody()->getWorldTransform();
+		btVector3 direction = worldTransform.getOrigin() - bulletCenter;
+		btScalar distance = direction.length();
+		if (distance >= bulletRadius) {
+			continue;
+		}
+		if (flags & RADIAL_IMPULSE_OCCLUDED_BY_STATIC) {
+			Vector massCenter;
+			ConvertPositionToHL(worldTransform.getOrigin(), massCenter);
+			Ray_t ray;
+			ray.Init(center, massCenter);
+			trace_t trace;
+			TraceRay(ray, occlusionMask, &occlusionFilter, &trace);
+			if (trace.fraction < 1.0f || trace.startsolid) {
+				continue;
+			}
+		}
+		// Pushing up if exactly at the center.
+		if (distance > 1e-3f) {
+			direction /= distance;
+		} else {
+			direction.setValue(0.0f, 1.0f, 0.0f);
+		}
+		btScalar speedChange = bulletImpulse * (1.0f - distance / bulletRadius);
+		if (!(flags & RADIAL_IMPULSE_SCALE_BY_MASS)) {
+			speedChange *= object->GetRigidBody()->getInvMass();
+		}
+		object->SetLinearVelocityChange(object->GetLinearVelocityChange() + direction * speedChange);
+		object->Wake();
+		++pushedCount;
+	}
+	return pushedCount;
 }
 
 /**************
@@ -1016,8 +1857,135 @@ void CPhysicsEnvironment::SetPerformanceSettings(const physics_performanceparams
 	m_PerformanceSettings = *pSettings;
 }
 
-/* DUMMY */ void CPhysicsEnvironment::ReadStats(physics_stats_t *pOutput) {
-	if (pOutput != nullptr) {
-		memset(pOutput, 0, sizeof(*pOutput));
+void CPhysicsEnvironment::BeginCollisionChecks() {
+	int checkLimit = m_PerformanceSettings.maxCollisionChecksPerTimestep;
+	m_LimitingCollisionChecks = (checkLimit > 0);
+	m_LimitingCollisionsPerObject = (m_PerformanceSettings.maxCollisionsPerObjectPerTimestep > 0);
+	m_CollisionChecksLeft = INT_MAX;
+	m_AdditionalCollisionChecksRequested = false;
+	m_CollisionChecksPreselected = false;
+	m_SortingObjectManifolds = m_Multithreaded;
+	btOverlappingPairCache *pairCache = m_Broadphase->getOverlappingPairCache();
+	if (!m_LimitingCollisionChecks || pairCache->getNumOverlappingPairs() <= checkLimit) {
+		return;
+	}
+	m_CollisionChecksLeft = checkLimit;
+	if (!m_Multithreaded) {
+		// Counted by the near callback.
+		return;
+	}
+
+	// The order in which the narrowphase threads take the pairs depends on timing,
+	// so the pairs that can be checked are chosen in advance.
+	m_CollisionChecksPreselected = true;
+	if (++m_CheckedPairSerial == 0) {
+		// New pairs have zero m_internalTmpValue.
+		m_CheckedPairSerial = 1;
+	}
+	int threadCount;
+	btManifoldArray &manifolds = GetNarrowphaseThreadData(threadCount)->m_PairManifolds;
+	btBroadphasePairArray &pairs = pairCache->getOverlappingPairArray();
+	for (int pairIndex = 0; pairIndex < pairs.size(); ++pairIndex) {
+		btBroadphasePair &pair = pairs[pairIndex];
+		if (!m_Dispatcher->needsCollision(reinterpret_cast<const btCollisionObject *>(pair.m_pProxy0->m_clientObject),
+				reinterpret_cast<const btCollisionObject *>(pair.m_pProxy1->m_clientObject)) ||
+				IsPairInContact(pair, manifolds)) {
+			continue;
+		}
+		if (!TakeCollisionCheck()) {
+			break;
+		}
+		pair.m_internalTmpValue = m_CheckedPairSerial;
+	}
+}
+
+bool CPhysicsEnvironment::TakeCollisionCheck() {
+	if (m_CollisionChecksLeft <= 0) {
+		// Ask the game once whether it allows more checks.
+		if (m_AdditionalCollisionChecksRequested || m_CollisionEvents == nullptr) {
+			return false;
+		}
+		m_AdditionalCollisionChecksRequested = true;
+		m_CollisionChecksLeft = MAX(m_CollisionEvents->AdditionalCollisionChecksThisTick(
+				m_PerformanceSettings.maxCollisionChecksPerTimestep), 0);
+		if (m_CollisionChecksLeft <= 0) {
+			return false;
+		}
+	}
+	--m_CollisionChecksLeft;
+	return true;
+}
+
+void CPhysicsEnvironment::FreezeObjectsWithTooManyCollisions() {
+	if (!m_LimitingCollisionsPerObject) {
+		return;
+	}
+	int collisionLimit = m_PerformanceSettings.maxCollisionsPerObjectPerTimestep;
+
+	// Pairs that weren't in contact before the narrowphase, but are now, collected by the near callback.
+	int threadCount;
+	NarrowphaseThreadData_t *threadData = GetNarrowphaseThreadData(threadCount);
+	for (int threadIndex = 0; threadIndex < threadCount; ++threadIndex) {
+		CUtlVector<CPhysicsObject *> &newCollisionObjects = threadData[threadIndex].m_NewCollisionObjects;
+		for (int objectIndex = 0; objectIndex < newCollisionObjects.Count(); objectIndex += 2) {
+			++m_Stats.impactCounter;
+			CPhysicsObject *object0 = newCollisionObjects[objectIndex];
+			CPhysicsObject *object1 = newCollisionObjects[objectIndex + 1];
+			if (object0->IsMoveable() && object0->AddPSICollision() == 1) {
+				m_CollidingObjects.AddToTail(object0);
+			}
+			if (object1->IsMoveable() && object1->AddPSICollision() == 1) {
+				m_CollidingObjects.AddToTail(object1);
+			}
+		}
+		newCollisionObjects.RemoveAll();
+	}
+
+	int collidingObjectCount = m_CollidingObjects.Count();
+	for (int objectIndex = 0; objectIndex < collidingObjectCount; ++objectIndex) {
+		CPhysicsObject *object = m_CollidingObjects[objectIndex];
+		if (object->GetPSICollisionCount() > collisionLimit) {
+			object->FreezeForPSI();
+			m_FrozenObjects.AddToTail(object);
+		}
+		object->ResetPSICollisionCount();
+	}
+	m_CollidingObjects.RemoveAll();
+}
+
+void CPhysicsEnvironment::UnfreezeObjects() {
+	// Objects can't be deleted during the PSI, so the list is still valid.
+	int frozenObjectCount = m_FrozenObjects.Count();
+	for (int objectIndex = 0; objectIndex < frozenObjectCount; ++objectIndex) {
+		m_FrozenObjects[objectIndex]->UnfreezeAfterPSI();
+	}
+	m_FrozenObjects.RemoveAll();
+}
+
+void CPhysicsEnvironment::ReadStats(physics_stats_t *pOutput) {
+	if (pOutput == nullptr) {
+		return;
+	}
+	*pOutput = m_Stats;
+	pOutput->collisionPairsTotal = m_Broadphase->getOverlappingPairCache()->getNumOverlappingPairs();
+	int threadCount;
+	const NarrowphaseThreadData_t *threadData = GetNarrowphaseThreadData(threadCount);
+	for (int threadIndex = 0; threadIndex < threadCount; ++threadIndex) {
+		const NarrowphaseThreadData_t &thread = threadData[threadIndex];
+		pOutput->potentialCollisionsObjectVsObject += thread.m_ObjectVsObject;
+		pOutput->potentialCollisionsObjectVsWorld += thread.m_ObjectVsWorld;
+		pOutput->impactDelayedCount += thread.m_Delayed;
+	}
+	pOutput->impactCollisionChecks =
+			pOutput->potentialCollisionsObjectVsObject + pOutput->potentialCollisionsObjectVsWorld;
+}
+
+void CPhysicsEnvironment::ClearStats() {
+	memset(&m_Stats, 0, sizeof(m_Stats));
+	int threadCount;
+	NarrowphaseThreadData_t *threadData = GetNarrowphaseThreadData(threadCount);
+	for (int threadIndex = 0; threadIndex < threadCount; ++threadIndex) {
+		NarrowphaseThreadData_t &thread = threadData[threadIndex];
+		thread.m_ObjectVsObject = thread.m_ObjectVsWorld = thread.m_Delayed = 0;
 	}
 }
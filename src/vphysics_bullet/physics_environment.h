@@ -5,12 +5,22 @@
 #define PHYSICS_ENVIRONMENT_H
 
 #include "physics_internal.h"
+#include "physics_profile.h"
+#include <BulletCollision/CollisionDispatch/btCollisionDispatcherMt.h>
+#include <BulletDynamics/Dynamics/btDiscreteDynamicsWorldMt.h>
+#include <LinearMath/btHashMap.h>
+#include "bspflags.h"
 #include "vphysics/friction.h"
 #include "vphysics/performance.h"
+#include "vphysics/stats.h"
 #include "vphysics/vehicles.h"
+#include "mathlib/ssemath.h"
+#include "tier0/threadtools.h"
 #include "tier1/utlrbtree.h"
 #include "tier1/utlvector.h"
 
+class CPhysicsObject;
+
 class CPhysicsEnvironment : public IPhysicsEnvironment {
 public:
 	CPhysicsEnvironment();
@@ -119,8 +129,8 @@ public:
 	virtual void GetPerformanceSettings(physics_performanceparams_t *pOutput) const;
 	virtual void SetPerformanceSettings(const physics_performanceparams_t *pSettings);
 
-	/* DUMMY */ virtual void ReadStats(physics_stats_t *pOutput);
-	/* DUMMY */ virtual void ClearStats() {}
+	virtual void ReadStats(physics_stats_t *pOutput);
+	virtual void ClearStats();
 
 	/* DUMMY */ virtual unsigned int GetObjectSerializeSize(IPhysicsObject *pObject) const { return 0; }
 	/* DUMMY */ virtual void SerializeObjectToBuffer(IPhysicsObject *pObject, unsigned char *pBuffer, unsigned int bufferSize) {}
@@ -143,6 +153,10 @@ public:
 
 	void NotifyObjectRemoving(IPhysicsObject *object);
 
+	// Adds a non-static object to the list of objects processed every PSI if it's not there yet.
+	// Must be called when an object is woken up or gets a controller that needs to be simulated.
+	void AddAwakeObject(CPhysicsObject *object);
+
 	void NotifyPlayerControllerAttached(IPhysicsPlayerController *controller);
 	void NotifyPlayerControllerDetached(IPhysicsPlayerController *controller);
 
@@ -174,12 +188,161 @@ public:
 	// Destruction permitting calling back through virtual functions.
 	void Release();
 
+	FORCEINLINE CPhysicsProfile &GetProfile() { return m_Profile; }
+
+	// Same results as TraceRay for every ray, but traversing the broadphase once for every 4 rays.
+	void TraceRays(const Ray_t *rays, int rayCount, unsigned int contentsMask,
+			IPhysicsTraceFilter *traceFilter, trace_t *traces);
+
+	// Replace the contents of objects with the objects touching the box or the sphere.
+	// Without exact, only the broadphase bounds are tested.
+	void GetObjectsInBox(const Vector &mins, const Vector &maxs, bool exact,
+			CUtlVector<IPhysicsObject *> &objects);
+	void GetObjectsInSphere(const Vector &center, float radius, bool exact,
+			CUtlVector<IPhysicsObject *> &objects);
+
+	enum {
+		// The impulse is per kilogram, giving every object the same speed change.
+		RADIAL_IMPULSE_SCALE_BY_MASS = 1 << 0,
+		// Objects whose mass center is behind static objects with occlusionMask contents aren't pushed.
+		RADIAL_IMPULSE_OCCLUDED_BY_STATIC = 1 << 1
+	};
+	// Pushes moveable objects away from the center with the impulse falling off linearly to zero at the radius,
+	// and wakes them. Returns the number of objects pushed.
+	int ApplyRadialImpulse(const Vector &center, float radius, float impulse,
+			int flags = 0, unsigned int occlusionMask = MASK_SOLID);
+
 private:
 	btDefaultCollisionConfiguration *m_CollisionConfiguration;
+	// Per-thread narrowphase state. In the multithreaded dispatcher, the threads must not share cache lines.
+	struct DECL_ALIGN(64) NarrowphaseThreadData_t {
+		// Narrowphase pairs that have passed needsCollision, for physics_stats_t.
+		int m_ObjectVsObject, m_ObjectVsWorld;
+		// Checks skipped because of maxCollisionChecksPerTimestep.
+		int m_Delayed;
+		// Manifolds of the pair being checked, to find whether it's in contact.
+		btManifoldArray m_PairManifolds;
+		// Object pairs that weren't in contact before the narrowphase, but are now.
+		CUtlVector<CPhysicsObject *> m_NewCollisionObjects;
+	};
+	// Allocated separately as VPhysicsNew only aligns to 16 bytes.
+	static NarrowphaseThreadData_t *CreateNarrowphaseThreadData(int threadCount);
+	static void DestroyNarrowphaseThreadData(NarrowphaseThreadData_t *threadData, int threadCount);
+	NarrowphaseThreadData_t *GetNarrowphaseThreadData(int &threadCount) const;
+	// Links manifolds to the objects they're created for, so per-object contact queries
+	// don't need to go through every manifold in the world.
+	class CollisionDispatcher : public btCollisionDispatcher {
+	public:
+		CollisionDispatcher(CPhysicsEnvironment *environment, btCollisionConfiguration *collisionConfiguration) :
+				btCollisionDispatcher(collisionConfiguration), m_Environment(environment),
+				m_ThreadData(CreateNarrowphaseThreadData(1)) {}
+		virtual ~CollisionDispatcher() { DestroyNarrowphaseThreadData(m_ThreadData, 1); }
+		virtual btPersistentManifold *getNewManifold(const btCollisionObject *body0, const btCollisionObject *body1);
+		virtual void releaseManifold(btPersistentManifold *manifold);
+		FORCEINLINE NarrowphaseThreadData_t &GetThreadData() { return *m_ThreadData; }
+		// Whether a pair that isn't in contact can be checked within maxCollisionChecksPerTimestep.
+		FORCEINLINE bool TakeNewPairCheck(const btBroadphasePair &pair) { return m_Environment->TakeCollisionCheck(); }
+		CPhysicsEnvironment *m_Environment;
+		NarrowphaseThreadData_t *m_ThreadData;
+	};
+	// Same for the multithreaded world, where manifolds are created and released by multiple narrowphase threads.
+	class CollisionDispatcherMt : public btCollisionDispatcherMt {
+	public:
+		CollisionDispatcherMt(CPhysicsEnvironment *environment, btCollisionConfiguration *collisionConfiguration) :
+				btCollisionDispatcherMt(collisionConfiguration), m_Environment(environment),
+				m_ThreadData(CreateNarrowphaseThreadData(BT_MAX_THREAD_COUNT)) {}
+		virtual ~CollisionDispatcherMt() { DestroyNarrowphaseThreadData(m_ThreadData, BT_MAX_THREAD_COUNT); }
+		virtual btPersistentManifold *getNewManifold(const btCollisionObject *body0, const btCollisionObject *body1);
+		virtual void releaseManifold(btPersistentManifold *manifold);
+		FORCEINLINE NarrowphaseThreadData_t &GetThreadData() { return m_ThreadData[btGetCurrentThreadIndex()]; }
+		// The pairs to check are selected before the narrowphase, so the result doesn't depend on thread timing.
+		FORCEINLINE bool TakeNewPairCheck(const btBroadphasePair &pair) {
+			return !m_Environment->m_CollisionChecksPreselected ||
+					pair.m_internalTmpValue == m_Environment->m_CheckedPairSerial;
+		}
+		CPhysicsEnvironment *m_Environment;
+		NarrowphaseThreadData_t *m_ThreadData;
+	private:
+		CThreadFastMutex m_ManifoldLinkMutex;
+	};
+	// Same as btCollisionDispatcher::defaultNearCallback, but counting checks and limiting them.
+	template<typename Dispatcher> static void NearCallback(btBroadphasePair &pair,
+			btCollisionDispatcher &dispatcher, const btDispatcherInfo &dispatchInfo);
+	static bool IsPairInContact(const btBroadphasePair &pair, btManifoldArray &manifolds);
+	void LinkManifoldToObjects(btPersistentManifold *manifold);
+	void UnlinkManifoldFromObjects(btPersistentManifold *manifold);
+	// Indices of each manifold in the lists of its two objects, for removing it in constant time.
+	struct ManifoldLink_t {
+		int m_ObjectManifoldIndices[2];
+	};
+	btHashMap<btHashPtr, ManifoldLink_t> m_ManifoldLinks;
+	// The multithreaded narrowphase creates and releases manifolds in an order depending on thread timing,
+	// so the lists it has changed are sorted after it.
+	bool m_SortingObjectManifolds;
+	CUtlVector<CPhysicsObject *> m_ObjectsWithUnsortedManifolds;
+	struct ManifoldSortKey_t {
+		int m_OtherObject;
+		// Parts and child indices of the first contact, to order the manifolds of compound pairs.
+		int m_FirstContact[4];
+		btPersistentManifold *m_Manifold;
+	};
+	static int __cdecl CompareManifoldSortKeys(const ManifoldSortKey_t *key1, const ManifoldSortKey_t *key2);
+	CUtlVector<ManifoldSortKey_t> m_ManifoldSortKeys;
+	void SortObjectManifolds();
+	// Whether the world, the dispatcher and the solver are the multithreaded versions.
+	bool m_Multithreaded;
 	btCollisionDispatcher *m_Dispatcher;
 	btDbvtBroadphase *m_Broadphase;
-	btSequentialImpulseConstraintSolver *m_Solver;
+	btConstraintSolver *m_Solver;
+	// Times the phases of the simulation step for physics_bullet_profile.
+	template<typename BaseDynamicsWorld> class DynamicsWorld : public BaseDynamicsWorld {
+	public:
+		template<typename... Arguments> DynamicsWorld(CPhysicsEnvironment *environment, Arguments&&... arguments) :
+				BaseDynamicsWorld(std::forward<Arguments>(arguments)...), m_Environment(environment) {}
+		// Same as in btCollisionWorld, but split into broadphase and narrowphase.
+		virtual void performDiscreteCollisionDetection() {
+			{
+				PHYSICS_PROFILE_SCOPE(m_Environment->m_Profile, PHYSICS_PROFILE_BROADPHASE,
+						"CPhysicsEnvironment::Broadphase");
+				this->updateAabbs();
+				this->computeOverlappingPairs();
+			}
+			{
+				PHYSICS_PROFILE_SCOPE(m_Environment->m_Profile, PHYSICS_PROFILE_NARROWPHASE,
+						"CPhysicsEnvironment::Narrowphase");
+				m_Environment->BeginCollisionChecks();
+				btDispatcher *dispatcher = this->getDispatcher();
+				dispatcher->dispatchAllCollisionPairs(this->getBroadphase()->getOverlappingPairCache(),
+						this->getDispatchInfo(), dispatcher);
+				m_Environment->SortObjectManifolds();
+				m_Environment->FreezeObjectsWithTooManyCollisions();
+			}
+		}
+		virtual void solveConstraints(btContactSolverInfo &solverInfo) {
+			PHYSICS_PROFILE_SCOPE(m_Environment->m_Profile, PHYSICS_PROFILE_SOLVER, "CPhysicsEnvironment::Solver");
+			BaseDynamicsWorld::solveConstraints(solverInfo);
+		}
+	protected:
+		virtual void calculateSimulationIslands() {
+			PHYSICS_PROFILE_SCOPE(m_Environment->m_Profile, PHYSICS_PROFILE_SOLVER, "CPhysicsEnvironment::Islands");
+			BaseDynamicsWorld::calculateSimulationIslands();
+			m_Environment->AddObjectsWokenByIslands(this->getDispatchInfo().m_timeStep);
+		}
+		virtual void predictUnconstraintMotion(btScalar timeStep) {
+			PHYSICS_PROFILE_SCOPE(m_Environment->m_Profile, PHYSICS_PROFILE_INTEGRATION,
+					"CPhysicsEnvironment::Integration");
+			BaseDynamicsWorld::predictUnconstraintMotion(timeStep);
+		}
+		virtual void integrateTransforms(btScalar timeStep) {
+			PHYSICS_PROFILE_SCOPE(m_Environment->m_Profile, PHYSICS_PROFILE_INTEGRATION,
+					"CPhysicsEnvironment::Integration");
+			BaseDynamicsWorld::integrateTransforms(timeStep);
+		}
+	private:
+		CPhysicsEnvironment *m_Environment;
+	};
 	btDiscreteDynamicsWorld *m_DynamicsWorld;
+	CPhysicsProfile m_Profile;
 
 	class DebugDrawer : public btIDebugDraw {
 	public:
@@ -209,6 +372,16 @@ private:
 	CUtlVector<IPhysicsObject *> m_Objects; // Doesn't include objects in the deletion queue!
 	CUtlVector<IPhysicsObject *> m_NonStaticObjects;
 	CUtlVector<IPhysicsObject *> m_ActiveNonStaticObjects;
+	// Non-static objects active in Bullet, ones that have fallen asleep during the last PSI,
+	// and ones with controllers simulated even while sleeping.
+	CUtlVector<CPhysicsObject *> m_AwakeObjects;
+	void RemoveAwakeObject(CPhysicsObject *object);
+	// Bullet wakes up whole simulation islands (objects linked by overlapping pairs or constraints)
+	// containing active objects. Called once the islands are calculated, before solving, to wake those objects
+	// and run the pre-tick for them, so they're simulated in the same PSI as when Bullet wakes them.
+	void AddObjectsWokenByIslands(btScalar timeStep);
+	// Whether the island with the root at the union-find element index has objects that wake it up.
+	CUtlVector<bool> m_IslandsWithActiveObjects;
 	IPhysicsObjectEvent *m_ObjectEvents;
 	bool m_QueueDeleteObject;
 	CUtlVector<IPhysicsObject *> m_DeadObjects;
@@ -219,6 +392,14 @@ private:
 	bool m_InSimulation;
 	btScalar m_LastPSITime, m_TimeSinceLastPSI;
 	static void PreTickCallback(btDynamicsWorld *world, btScalar timeStep);
+	// Simulates the awake objects starting from the index before solving.
+	void PreTickObjects(int firstObject, btScalar timeStep);
+	static void PreTickObject(CPhysicsObject *object, btScalar timeStep);
+	struct PreTickJob_t {
+		CPhysicsObject * const *m_Objects;
+		btScalar m_TimeStep;
+	};
+	static void PreTickIndependentObjects(void *context, int begin, int end);
 	static void TickCallback(btDynamicsWorld *world, btScalar timeStep);
 	class TickActionInterface : public btActionInterface {
 		virtual void updateAction(btCollisionWorld *collisionWorld, btScalar deltaTimeStep);
@@ -234,6 +415,20 @@ private:
 		CPhysicsEnvironment *m_Environment;
 	};
 	OverlapFilterCallback m_OverlapFilterCallback;
+	// Counts the pairs for the stats.
+	struct OverlappingPairCallback : public btOverlappingPairCallback {
+		OverlappingPairCallback(CPhysicsEnvironment *environment) : m_Environment(environment) {}
+		virtual btBroadphasePair *addOverlappingPair(btBroadphaseProxy *proxy0, btBroadphaseProxy *proxy1);
+		virtual void *removeOverlappingPair(btBroadphaseProxy *proxy0, btBroadphaseProxy *proxy1,
+				btDispatcher *dispatcher);
+		virtual void removeOverlappingPairsContainingProxy(btBroadphaseProxy *proxy0, btDispatcher *dispatcher);
+	private:
+		CPhysicsEnvironment *m_Environment;
+	};
+	OverlappingPairCallback m_OverlappingPairCallback;
+
+	// Only counters updated by the environment itself, the rest is gathered in ReadStats.
+	physics_stats_t m_Stats;
 
 	IPhysicsCollisionEvent *m_CollisionEvents;
 
@@ -268,6 +463,61 @@ private:
 	CUtlRBTree<TriggerTouch_t> m_TriggerTouches;
 	void CheckTriggerTouches();
 
+	// Traces against every object whose broadphase bounds are touched, keeping the closest hit.
+	struct TraceBroadphaseCallback : public btBroadphaseRayCallback {
+		// Ray for TraceRay, or collideable for SweepCollideable.
+		const Ray_t *m_Ray;
+		const CPhysCollide *m_SweepCollide;
+		const Vector *m_SweepStart, *m_SweepEnd;
+		const QAngle *m_SweepAngles;
+		unsigned int m_ContentsMask;
+		IPhysicsTraceFilter *m_TraceFilter;
+		trace_t *m_Trace;
+		// Unique ID of the proxy of the closest object hit, or -1.
+		int m_ClosestProxyID;
+		// Length of the ray or the sweep in Bullet units, 0 for tests of the bounds at the start.
+		btScalar m_RayLength;
+
+		// Sets up the ray for the tree walk like btCollisionWorld::rayTest does for btBroadphaseInterface::rayTest.
+		void SetRay(const btVector3 &from, const btVector3 &to);
+		// Fraction of the ray beyond which objects can't be hit closer than the closest hit so far,
+		// with some margin for the fraction being pulled back and for ties.
+		btScalar GetMaxHitFraction() const;
+		// Also shortens the ray (m_lambda_max) after hits so TraceRayTree skips farther nodes.
+		virtual bool process(const btBroadphaseProxy *proxy);
+	};
+	// Order of hits not depending on the order the objects are visited in, for the same results in batched traces.
+	static bool IsCloserTraceHit(const trace_t &trace, int proxyID, const trace_t &closestTrace, int closestProxyID);
+	static bool ShouldTraceHitObject(IPhysicsObject *object, unsigned int contentsMask, IPhysicsTraceFilter *traceFilter);
+	static void BeginRayTrace(TraceBroadphaseCallback &callback, const Ray_t &ray,
+			unsigned int contentsMask, IPhysicsTraceFilter *traceFilter, trace_t *trace);
+	// The bounds are relative to the start and the end.
+	void TraceBroadphase(TraceBroadphaseCallback &callback, const btVector3 &start, const btVector3 &end,
+			const btVector3 &aabbMin, const btVector3 &aabbMax);
+	// Like btDbvt::rayTestInternal, but re-reading m_lambda_max at each node, as btDbvtBroadphase::rayTest
+	// passes it by value to the walk of the dynamic tree, so the ray shortened after hits wouldn't prune it.
+	void TraceRayTree(const btDbvtNode *root, TraceBroadphaseCallback &callback,
+			const btVector3 &start, const btVector3 &aabbMin, const btVector3 &aabbMax);
+	// Tests 4 rays against every node at once, the ray parameter being from 0 at the start to 1 at the end.
+	// Lanes not in laneMask are ignored.
+	void TraceRayPacket(const btDbvtNode *root, int laneMask, const FourVectors &starts,
+			const FourVectors &inverseDeltas, const FourVectors &halfExtents, TraceBroadphaseCallback *callbacks);
+	// Nodes to visit in TraceRayTree and TraceRayPacket.
+	CUtlVector<const btDbvtNode *> m_TraceStack;
+
+	// Gathers objects whose broadphase bounds touch the query box, and optionally the sphere inside it.
+	struct OverlapBroadphaseCallback : public btBroadphaseAabbCallback {
+		btVector3 m_Center, m_HalfExtents;
+		// Negative for boxes.
+		btScalar m_Radius;
+		bool m_Exact;
+		CPhysicsTraceContext *m_TraceContext; // For exact tests.
+		CUtlVector<IPhysicsObject *> *m_Objects;
+
+		virtual bool process(const btBroadphaseProxy *proxy);
+	};
+	CUtlVector<IPhysicsObject *> m_RadialImpulseObjects;
+
 	void AddConstraint(IPhysicsConstraint *constraint);
 	void DeleteConstraint(IPhysicsConstraint *constraint, bool removeFromList = true);
 	CUtlVector<IPhysicsConstraint *> m_ConstraintObjects; // Both valid and invalid.
@@ -276,6 +526,24 @@ private:
 	bool m_QuickDelete;
 
 	physics_performanceparams_t m_PerformanceSettings;
+
+	// IVP-like collision budgets from the performance settings.
+	// Pairs already in contact are always checked, like IVP's friction systems,
+	// only the checks for new collisions are limited, and the objects getting too many new collisions are frozen.
+	void BeginCollisionChecks();
+	bool TakeCollisionCheck();
+	void FreezeObjectsWithTooManyCollisions();
+	void UnfreezeObjects();
+	// Whether the narrowphase needs to know which pairs were in contact before it.
+	bool m_LimitingCollisionChecks, m_LimitingCollisionsPerObject;
+	// Checks of pairs that aren't in contact left in this PSI.
+	int m_CollisionChecksLeft;
+	bool m_AdditionalCollisionChecksRequested;
+	// In the multithreaded world, if the limit is exceeded, the pairs with m_internalTmpValue
+	// (unused by the hashed pair cache) equal to the serial are the ones allowed to be checked.
+	bool m_CollisionChecksPreselected;
+	int m_CheckedPairSerial;
+	CUtlVector<CPhysicsObject *> m_CollidingObjects, m_FrozenObjects;
 };
 
 #endif
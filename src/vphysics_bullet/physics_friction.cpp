@@ -18,12 +18,14 @@ void CPhysicsFrictionSnapshot::Reset(IPhysicsObject *object) {
 	if (object == nullptr) {
 		return;
 	}
-	m_Dispatcher = static_cast<CPhysicsEnvironment *>(static_cast<CPhysicsObject *>(
-			object)->GetEnvironment())->GetCollisionDispatcher();
 	m_ManifoldIndex = -1;
 	NextFrictionData();
 }
 
+btPersistentManifold *CPhysicsFrictionSnapshot::GetCurrentManifold() const {
+	return static_cast<const CPhysicsObject *>(m_Object)->GetManifold(m_ManifoldIndex);
+}
+
 void CPhysicsFrictionSnapshot::NextFrictionData() {
 	if (!IsValid()) {
 		return;
@@ -31,40 +33,38 @@ void CPhysicsFrictionSnapshot::NextFrictionData() {
 
 	// Try the next contact in the current manifold.
 	if (m_ManifoldIndex >= 0) { // Initially the index is -1.
-		if (++m_ContactIndex < m_Dispatcher->getManifoldByIndexInternal(m_ManifoldIndex)->getNumContacts()) {
+		if (++m_ContactIndex < GetCurrentManifold()->getNumContacts()) {
 			return;
 		}
 	}
 
 	// Try to find the next manifold.
-	const btCollisionObject *collisionObject = static_cast<CPhysicsObject *>(m_Object)->GetRigidBody();
-	int manifoldCount = m_Dispatcher->getNumManifolds();
+	const CPhysicsObject *object = static_cast<const CPhysicsObject *>(m_Object);
+	const btCollisionObject *collisionObject = object->GetRigidBody();
+	int manifoldCount = object->GetManifoldCount();
 	for (++m_ManifoldIndex; m_ManifoldIndex < manifoldCount; ++m_ManifoldIndex) {
-		const btPersistentManifold *manifold = m_Dispatcher->getManifoldByIndexInternal(m_ManifoldIndex);
+		const btPersistentManifold *manifold = object->GetManifold(m_ManifoldIndex);
 		if (manifold->getNumContacts() == 0) {
 			continue;
 		}
-		if (manifold->getBody0() == collisionObject) {
-			m_ObjectIsB = false;
-		} else if (manifold->getBody1() == collisionObject) {
-			m_ObjectIsB = true;
-		} else {
-			continue;
-		}
+		m_ObjectIsB = (manifold->getBody1() == collisionObject);
 		m_ContactIndex = 0;
 		return;
 	}
 }
 
 bool CPhysicsFrictionSnapshot::IsValid() {
-	return m_ManifoldIndex < m_Dispatcher->getNumManifolds();
+	if (m_Object == nullptr) {
+		return false;
+	}
+	return m_ManifoldIndex < static_cast<const CPhysicsObject *>(m_Object)->GetManifoldCount();
 }
 
 IPhysicsObject *CPhysicsFrictionSnapshot::GetObject(int index) {
 	if (index == 0) {
 		return m_Object;
 	}
-	const btPersistentManifold *manifold = m_Dispatcher->getManifoldByIndexInternal(m_ManifoldIndex);
+	const btPersistentManifold *manifold = GetCurrentManifold();
 	const btCollisionObject *collisionObject = (m_ObjectIsB ? manifold->getBody0() : manifold->getBody1());
 	return reinterpret_cast<IPhysicsObject *>(collisionObject->getUserPointer());
 }
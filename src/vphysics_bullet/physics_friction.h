@@ -34,13 +34,13 @@ public:
 
 private:
 	IPhysicsObject *m_Object;
-	btCollisionDispatcher *m_Dispatcher;
-	int m_ManifoldIndex;
+	int m_ManifoldIndex; // In the object's own manifold list.
 	bool m_ObjectIsB;
 	int m_ContactIndex;
 
+	btPersistentManifold *GetCurrentManifold() const;
 	inline btManifoldPoint &GetCurrentContact() const {
-		return m_Dispatcher->getManifoldByIndexInternal(m_ManifoldIndex)->getContactPoint(m_ContactIndex);
+		return GetCurrentManifold()->getContactPoint(m_ContactIndex);
 	}
 };
 
@@ -3,6 +3,9 @@
 
 #include "physics_internal.h"
 
+bool g_PhysicsCountAllocations = false;
+CInterlockedInt g_PhysicsAllocationCount;
+
 void ConvertMatrixToBullet(const matrix3x4_t &matrix, btTransform &transform) {
 	transform.getBasis().setValue(
 			matrix[0][0], matrix[0][2], -matrix[0][1],
@@ -8,13 +8,28 @@
 #include <btBulletDynamicsCommon.h>
 #include "mathlib/mathlib.h"
 #include "tier0/memalloc.h"
+#include "tier0/threadtools.h"
 #include <utility>
 
+// Number of VPhysicsNew and Bullet allocations done while counting is enabled, for benchmarks.
+// Not counted normally, so allocations don't pay for an atomic increment.
+// Allocations done directly through the tier0 allocator, such as CUtlVector and MemAlloc_Alloc growth of scratch
+// buffers, are not counted, as g_pMemAlloc is shared by the whole process and can't be hooked by VPhysics alone.
+extern bool g_PhysicsCountAllocations;
+extern CInterlockedInt g_PhysicsAllocationCount;
+// Counting is enabled between the outermost pair of calls. Also switches the Bullet allocation hooks,
+// so must be called only while no physics work is being done on other threads.
+void BeginPhysicsAllocationCounting();
+void EndPhysicsAllocationCounting();
+
 // Bullet types assume 16-byte alignment. While it's the default for Source 2013, things may become messy in Source 2007.
 // memdbgon is not really recommended from this point (at least not tested).
 template<typename Type, typename... Arguments> FORCEINLINE Type *VPhysicsNewImplementation(
 		const char *fileName, int fileLine, Arguments&&... arguments) {
 	void *memblock = MemAlloc_AllocAligned(sizeof(Type), 16, fileName, fileLine);
+	if (g_PhysicsCountAllocations) {
+		++g_PhysicsAllocationCount;
+	}
 	return new(memblock) Type(std::forward<Arguments>(arguments)...);
 }
 #define VPhysicsNew(Type, ...) VPhysicsNewImplementation<Type>(__FILE__, __LINE__, __VA_ARGS__)
@@ -5,7 +5,11 @@
 #include "physics_collide.h"
 #include "physics_environment.h"
 #include "physics_objecthash.h"
+#include "physics_threads.h"
 #include "vphysics/collision_set.h"
+#include "filesystem.h"
+#include "tier1/convar.h"
+#include "tier1/strtools.h"
 #include "tier1/tier1.h"
 #include "tier1/utlvector.h"
 #ifdef WIN32
@@ -13,6 +17,9 @@
 #include <Windows.h>
 #endif
 
+// Optional, only used for debugging and benchmark files.
+IFileSystem *g_pFullFileSystem = nullptr;
+
 static void *VPhysicsBulletAlloc(size_t size) {
 	return MemAlloc_Alloc(size);
 }
@@ -21,10 +28,39 @@ static void *VPhysicsBulletAlignedAlloc(size_t size, int alignment) {
 	return MemAlloc_AllocAligned(size, alignment);
 }
 
+static void *VPhysicsBulletCountedAlloc(size_t size) {
+	++g_PhysicsAllocationCount;
+	return MemAlloc_Alloc(size);
+}
+
+static void *VPhysicsBulletCountedAlignedAlloc(size_t size, int alignment) {
+	++g_PhysicsAllocationCount;
+	return MemAlloc_AllocAligned(size, alignment);
+}
+
 static void VPhysicsBulletFree(void *memblock) {
 	MemAlloc_FreeAligned(memblock);
 }
 
+static int s_PhysicsAllocationCountingDepth = 0;
+
+void BeginPhysicsAllocationCounting() {
+	if (s_PhysicsAllocationCountingDepth++ == 0) {
+		g_PhysicsCountAllocations = true;
+		btAlignedAllocSetCustom(VPhysicsBulletCountedAlloc, VPhysicsBulletFree);
+		btAlignedAllocSetCustomAligned(VPhysicsBulletCountedAlignedAlloc, VPhysicsBulletFree);
+	}
+}
+
+void EndPhysicsAllocationCounting() {
+	Assert(s_PhysicsAllocationCountingDepth > 0);
+	if (--s_PhysicsAllocationCountingDepth == 0) {
+		g_PhysicsCountAllocations = false;
+		btAlignedAllocSetCustom(VPhysicsBulletAlloc, VPhysicsBulletFree);
+		btAlignedAllocSetCustomAligned(VPhysicsBulletAlignedAlloc, VPhysicsBulletFree);
+	}
+}
+
 #ifdef POSIX
 __attribute__((constructor))
 #endif
@@ -76,6 +112,10 @@ bool CPhysicsCollisionSet::ShouldCollide(int index0, int index1) {
 
 class CPhysicsInterface : public CTier1AppSystem<IPhysics> {
 public:
+	virtual bool Connect(CreateInterfaceFn factory);
+	virtual void Disconnect();
+	virtual void Shutdown();
+
 	virtual void *QueryInterface(const char *pInterfaceName);
 
 	virtual IPhysicsEnvironment *CreateEnvironment();
@@ -96,10 +136,80 @@ static CPhysicsInterface s_MainDLLInterface;
 EXPOSE_SINGLE_INTERFACE_GLOBALVAR(CPhysicsInterface, IPhysics,
 		VPHYSICS_INTERFACE_VERSION, s_MainDLLInterface);
 
+bool CPhysicsInterface::Connect(CreateInterfaceFn factory) {
+	if (!CTier1AppSystem<IPhysics>::Connect(factory)) {
+		return false;
+	}
+	g_pFullFileSystem = reinterpret_cast<IFileSystem *>(factory(FILESYSTEM_INTERFACE_VERSION, nullptr));
+	return true;
+}
+
+void CPhysicsInterface::Disconnect() {
+	g_pFullFileSystem = nullptr;
+	CTier1AppSystem<IPhysics>::Disconnect();
+}
+
+void CPhysicsInterface::Shutdown() {
+	g_PhysicsTaskScheduler.Uninstall();
+	g_PhysicsThreadPool.Shutdown();
+	CTier1AppSystem<IPhysics>::Shutdown();
+}
+
 void *CPhysicsInterface::QueryInterface(const char *pInterfaceName) {
 	return Sys_GetFactoryThis()(pInterfaceName, nullptr);
 }
 
+CON_COMMAND(physics_bullet_profile, "Print the timings of the phases of the recent PSIs recorded with "
+		"physics_bullet_profile_enable. Use \"physics_bullet_profile reset\" to clear them.") {
+	bool reset = (args.ArgC() >= 2 && V_stricmp(args[1], "reset") == 0);
+	IPhysicsEnvironment *environment;
+	for (int environmentIndex = 0;
+			(environment = s_MainDLLInterface.GetActiveEnvironmentByIndex(environmentIndex)) != nullptr;
+			++environmentIndex) {
+		CPhysicsProfile &profile = static_cast<CPhysicsEnvironment *>(environment)->GetProfile();
+		if (reset) {
+			profile.Reset();
+		} else {
+			Msg("Environment %d:\n", environmentIndex);
+			profile.Print();
+		}
+	}
+	if (!CPhysicsProfile::IsEnabled()) {
+		Msg("physics_bullet_profile_enable is off, not recording.\n");
+	}
+}
+
+CON_COMMAND(physics_bullet_trace_write, "Write the PSIs recorded with physics_bullet_trace to a Chrome trace JSON file "
+		"(physics_trace.json by default) and clear them.") {
+	const char *fileName = (args.ArgC() >= 2 ? args[1] : "physics_trace.json");
+	if (g_pFullFileSystem == nullptr) {
+		Warning("Couldn't write %s without the file system.\n", fileName);
+		return;
+	}
+	CUtlBuffer buffer(0, 0, CUtlBuffer::TEXT_BUFFER);
+	buffer.PutString("{\"traceEvents\":[");
+	int eventCount = 0;
+	IPhysicsEnvironment *environment;
+	for (int environmentIndex = 0;
+			(environment = s_MainDLLInterface.GetActiveEnvironmentByIndex(environmentIndex)) != nullptr;
+			++environmentIndex) {
+		CPhysicsProfile &profile = static_cast<CPhysicsEnvironment *>(environment)->GetProfile();
+		// Environments are separate processes in the trace.
+		eventCount += profile.WriteTrace(buffer, environmentIndex, eventCount != 0);
+	}
+	buffer.PutString("\n],\"displayTimeUnit\":\"ms\"}\n");
+	if (!g_pFullFileSystem->WriteFile(fileName, nullptr, buffer)) {
+		Warning("Couldn't write %s.\n", fileName);
+		return;
+	}
+	for (int environmentIndex = 0;
+			(environment = s_MainDLLInterface.GetActiveEnvironmentByIndex(environmentIndex)) != nullptr;
+			++environmentIndex) {
+		static_cast<CPhysicsEnvironment *>(environment)->GetProfile().ResetTrace();
+	}
+	Msg("Wrote %d physics trace events to %s.\n", eventCount, fileName);
+}
+
 IPhysicsEnvironment *CPhysicsInterface::CreateEnvironment() {
 	IPhysicsEnvironment *environment = VPhysicsNew(CPhysicsEnvironment);
 	m_Environments.AddToTail(environment);
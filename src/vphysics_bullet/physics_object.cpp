@@ -21,7 +21,7 @@ CPhysicsObject::CPhysicsObject(IPhysicsEnvironment *environment,
 		m_MassCenterOverride(0.0f, 0.0f, 0.0f),
 		m_Mass((!isStatic && !collide->GetShape()->isNonMoving()) ? params->mass : 0.0f),
 		m_HingeHLAxis(-1),
-		m_MotionEnabled(true),
+		m_MotionEnabled(true), m_FrozenForPSI(false),
 		m_ShadowTempGravityDisable(false),
 		m_LinearDamping(params->damping), m_AngularDamping(params->rotdamping),
 		m_MaterialIndex(materialIndex), m_RealMaterialIndex(-1),
@@ -38,6 +38,10 @@ CPhysicsObject::CPhysicsObject(IPhysicsEnvironment *environment,
 		m_LinearVelocityChange(0.0f, 0.0f, 0.0f),
 		m_LocalAngularVelocityChange(0.0f, 0.0f, 0.0f),
 		m_TouchingTriggers(0),
+		m_ManifoldsUnsorted(false),
+		m_AwakeObjectIndex(AWAKE_OBJECT_INDEX_UNTRACKED),
+		m_EnergyBeforeSolver(0.0f),
+		m_PSICollisionCount(0), m_WasFrozen(false),
 		m_InterPSILinearVelocity(0.0f, 0.0f, 0.0f),
 		m_InterPSIAngularVelocity(0.0f, 0.0f, 0.0f) {
 	if (params->pName != nullptr) {
@@ -46,6 +50,7 @@ CPhysicsObject::CPhysicsObject(IPhysicsEnvironment *environment,
 		m_Name[0] = '\0';
 	}
 
+	collide->EnsureLoaded();
 	btCollisionShape *shape = const_cast<CPhysCollide *>(collide)->GetShape();
 
 	btRigidBody::btRigidBodyConstructionInfo constructionInfo(m_Mass, nullptr, shape,
@@ -202,7 +207,7 @@ void CPhysicsObject::SetMass(float mass) {
 
 float CPhysicsObject::GetMass() const {
 	// Must handle all the overrides here because UpdateMassProps calls this.
-	if (!m_MotionEnabled || (m_Shadow != nullptr && !m_Shadow->AllowsTranslation())) {
+	if (!m_MotionEnabled || m_FrozenForPSI || (m_Shadow != nullptr && !m_Shadow->AllowsTranslation())) {
 		return BT_LARGE_FLOAT;
 	}
 	return m_Mass;
@@ -214,7 +219,7 @@ float CPhysicsObject::GetInvMass() const {
 
 Vector CPhysicsObject::GetInertia() const {
 	// Must handle all the overrides here because UpdateMassProps calls this.
-	if (!m_MotionEnabled || (m_Shadow != nullptr && !m_Shadow->AllowsRotation())) {
+	if (!m_MotionEnabled || m_FrozenForPSI || (m_Shadow != nullptr && !m_Shadow->AllowsRotation())) {
 		return Vector(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
 	}
 	Vector inertia = m_Inertia;
@@ -305,6 +310,7 @@ void CPhysicsObject::Wake() {
 		// Also waking up from DISABLE_SIMULATION, which is not possible with setActivationState.
 		m_RigidBody->forceActivationState(ACTIVE_TAG);
 		m_RigidBody->setDeactivationTime(0.0f);
+		static_cast<CPhysicsEnvironment *>(m_Environment)->AddAwakeObject(this);
 	}
 }
 
@@ -633,7 +639,12 @@ void CPhysicsObject::ProceedToTransform(const btTransform &transform) {
 		if (!m_Environment->IsInSimulation()) {
 			m_InterPSIAngularVelocity = transform.getBasis() *
 					(m_InterPSIAngularVelocity * oldTransform.getBasis());
-			InterpolateBetweenPSIs();
+			if (m_InterPSILinearVelocity.isZero() && m_InterPSIAngularVelocity.isZero()) {
+				// Sleeping objects aren't updated after PSIs, so don't wait for the next one.
+				m_InterPSIWorldTransform = m_RigidBody->getWorldTransform();
+			} else {
+				InterpolateBetweenPSIs();
+			}
 		}
 	}
 
@@ -733,6 +744,40 @@ void CPhysicsObject::UpdateAfterPSI() {
 	m_InterPSIAngularVelocity = m_RigidBody->getAngularVelocity();
 }
 
+float CPhysicsObject::TakeEnergyDestroyedBySolver() {
+	// Objects woken up during the PSI haven't stored the energy, so reset it for the next time.
+	float energyDestroyed = MAX(m_EnergyBeforeSolver - GetEnergy(), 0.0f);
+	m_EnergyBeforeSolver = 0.0f;
+	return energyDestroyed;
+}
+
+void CPhysicsObject::FreezeForPSI() {
+	Assert(!m_FrozenForPSI && IsMoveable());
+	m_FrozenForPSI = true;
+	m_WasFrozen = true;
+	btVector3 zero(0.0f, 0.0f, 0.0f);
+	m_RigidBody->setLinearVelocity(zero);
+	m_RigidBody->setAngularVelocity(zero);
+	UpdateMassProps();
+}
+
+void CPhysicsObject::UnfreezeAfterPSI() {
+	Assert(m_FrozenForPSI);
+	m_FrozenForPSI = false;
+	UpdateMassProps();
+	// Not restoring the velocity from before the freeze - it would send the object into the same pile at the same
+	// speed in the next PSI. Like IVP's temporarily unmovable cores, the object is stopped to let the pile settle.
+	btVector3 zero(0.0f, 0.0f, 0.0f);
+	m_RigidBody->setLinearVelocity(zero);
+	m_RigidBody->setAngularVelocity(zero);
+}
+
+bool CPhysicsObject::TakeWasFrozen() {
+	bool wasFrozen = m_WasFrozen;
+	m_WasFrozen = false;
+	return wasFrozen;
+}
+
 void CPhysicsObject::InterpolateBetweenPSIs() {
 	// For non-moving objects, the transform was already updated at the end of the PSI.
 	if (!m_InterPSILinearVelocity.isZero() || !m_InterPSIAngularVelocity.isZero()) {
@@ -954,6 +999,8 @@ void CPhysicsObject::CalculateVelocityOffset(const Vector &forceVector, const Ve
 
 void CPhysicsObject::NotifyAttachedToMotionController(IPhysicsMotionController *controller) {
 	m_MotionControllers.AddToTail(controller);
+	// Controllers are simulated even for sleeping objects.
+	static_cast<CPhysicsEnvironment *>(m_Environment)->AddAwakeObject(this);
 }
 
 void CPhysicsObject::NotifyDetachedFromMotionController(IPhysicsMotionController *controller) {
@@ -1090,6 +1137,7 @@ void CPhysicsObject::NotifyAttachedToShadowController(IPhysicsShadowController *
 	m_Shadow = shadow;
 	UpdateMassProps();
 	UpdateMaterial();
+	static_cast<CPhysicsEnvironment *>(m_Environment)->AddAwakeObject(this);
 }
 
 void CPhysicsObject::NotifyAttachedToPlayerController(
@@ -1110,6 +1158,7 @@ void CPhysicsObject::NotifyAttachedToPlayerController(
 	if (notifyEnvironment && m_Player != nullptr) {
 		environment->NotifyPlayerControllerAttached(m_Player);
 	}
+	environment->AddAwakeObject(this);
 }
 
 btScalar CPhysicsObject::ComputeBulletShadowControl(ShadowControlBulletParameters_t &params,
@@ -1187,6 +1236,7 @@ void CPhysicsObject::NotifyAttachedToVehicleController(IPhysicsVehicleController
 	} else {
 		m_BodyOfVehicle = vehicle;
 	}
+	static_cast<CPhysicsEnvironment *>(m_Environment)->AddAwakeObject(this);
 }
 
 bool CPhysicsObject::IsPartOfSameVehicle(const IPhysicsObject *otherObject) const {
@@ -1239,11 +1289,9 @@ void CPhysicsObject::RecheckContactPoints() {
 }
 
 bool CPhysicsObject::GetContactPoint(Vector *contactPoint, IPhysicsObject **contactObject) const {
-	const btCollisionDispatcher *dispatcher =
-			static_cast<CPhysicsEnvironment *>(m_Environment)->GetCollisionDispatcher();
-	int manifoldCount = dispatcher->getNumManifolds();
+	int manifoldCount = m_Manifolds.Count();
 	for (int manifoldIndex = 0; manifoldIndex < manifoldCount; ++manifoldIndex) {
-		const btPersistentManifold *manifold = dispatcher->getManifoldByIndexInternal(manifoldIndex);
+		const btPersistentManifold *manifold = m_Manifolds[manifoldIndex];
 		if (manifold->getNumContacts() == 0) {
 			continue;
 		}
@@ -1262,18 +1310,17 @@ bool CPhysicsObject::GetContactPoint(Vector *contactPoint, IPhysicsObject **cont
 			}
 			return true;
 		}
-		if (body1 == m_RigidBody) {
-			if (!body0->hasContactResponse()) {
-				continue;
-			}
-			if (contactPoint != nullptr) {
-				ConvertPositionToHL(manifoldPoint.getPositionWorldOnB(), *contactPoint);
-			}
-			if (contactObject != nullptr) {
-				*contactObject = reinterpret_cast<IPhysicsObject *>(body0->getUserPointer());
-			}
-			return true;
+		Assert(body1 == m_RigidBody);
+		if (!body0->hasContactResponse()) {
+			continue;
 		}
+		if (contactPoint != nullptr) {
+			ConvertPositionToHL(manifoldPoint.getPositionWorldOnB(), *contactPoint);
+		}
+		if (contactObject != nullptr) {
+			*contactObject = reinterpret_cast<IPhysicsObject *>(body0->getUserPointer());
+		}
+		return true;
 	}
 	return false;
 }
@@ -203,6 +203,12 @@ public:
 	void SimulateShadowAndPlayer(btScalar timeStep);
 	void RemovePlayerController();
 
+	// Whether the pre-PSI simulation of this object calls back into the game or touches other objects.
+	inline bool IsAffectedByPreTickCallbacks() const {
+		return m_MotionControllers.Count() != 0 || m_Shadow != nullptr || m_Player != nullptr ||
+				m_BodyOfVehicle != nullptr || m_WheelOfVehicle != nullptr;
+	}
+
 	void NotifyAttachedToVehicleController(IPhysicsVehicleController *vehicle, bool isWheel);
 	bool IsPartOfSameVehicle(const IPhysicsObject *otherObject) const;
 	void SimulateVehicle(btScalar timeStep);
@@ -211,6 +217,45 @@ public:
 		return m_CollideObjectNext;
 	}
 
+	// Position in the environment's awake object list.
+	enum {
+		AWAKE_OBJECT_INDEX_UNTRACKED = -2, // Not added to the environment or static.
+		AWAKE_OBJECT_INDEX_NONE = -1
+	};
+	FORCEINLINE int GetAwakeObjectIndex() const { return m_AwakeObjectIndex; }
+	FORCEINLINE void SetAwakeObjectIndex(int index) { m_AwakeObjectIndex = index; }
+	FORCEINLINE bool IsAwakeStateTracked() const { return m_AwakeObjectIndex != AWAKE_OBJECT_INDEX_UNTRACKED; }
+
+	// Contact manifolds involving this object, maintained by the environment's dispatcher.
+	// May include manifolds with no contact points.
+	FORCEINLINE int GetManifoldCount() const {
+		return m_Manifolds.Count();
+	}
+	FORCEINLINE btPersistentManifold *GetManifold(int index) const {
+		return m_Manifolds[index];
+	}
+	// Returns the index of the new manifold in the list.
+	FORCEINLINE int NotifyManifoldCreated(btPersistentManifold *manifold) {
+		return m_Manifolds.AddToTail(manifold);
+	}
+	// Returns the manifold moved to the index of the released one, or nullptr if it was the last.
+	FORCEINLINE btPersistentManifold *NotifyManifoldReleased(int index) {
+		m_Manifolds.FastRemove(index);
+		return (index < m_Manifolds.Count() ? m_Manifolds[index] : nullptr);
+	}
+	FORCEINLINE void SetManifold(int index, btPersistentManifold *manifold) {
+		m_Manifolds[index] = manifold;
+	}
+	// Returns whether the object needs to be added to the list of objects to sort the manifolds of.
+	FORCEINLINE bool MarkManifoldsUnsorted() {
+		bool wasSorted = !m_ManifoldsUnsorted;
+		m_ManifoldsUnsorted = true;
+		return wasSorted;
+	}
+	FORCEINLINE void ClearManifoldsUnsorted() {
+		m_ManifoldsUnsorted = false;
+	}
+
 	FORCEINLINE void AddTriggerTouchReference() {
 		++m_TouchingTriggers;
 	}
@@ -245,6 +290,21 @@ public:
 
 	void UpdateAfterPSI(); // Only called for non-static objects.
 
+	// Energy removed by collisions, friction and constraints within a PSI, for physics_stats_t.
+	// Energy added by the solver (such as by a wakening impact) isn't subtracted.
+	FORCEINLINE void StoreEnergyBeforeSolver() { m_EnergyBeforeSolver = GetEnergy(); }
+	float TakeEnergyDestroyedBySolver();
+
+	// New collisions within the current PSI, for physics_performanceparams_t::maxCollisionsPerObjectPerTimestep.
+	FORCEINLINE int AddPSICollision() { return ++m_PSICollisionCount; }
+	FORCEINLINE int GetPSICollisionCount() const { return m_PSICollisionCount; }
+	FORCEINLINE void ResetPSICollisionCount() { m_PSICollisionCount = 0; }
+	// Makes the object immovable for the rest of the PSI, like IVP's temporarily unmovable cores.
+	void FreezeForPSI();
+	void UnfreezeAfterPSI();
+	// Whether the object has been frozen since the last call.
+	bool TakeWasFrozen();
+
 	void InterpolateBetweenPSIs();
 	inline const btTransform &GetInterPSIWorldTransform() const {
 		return ((IsStatic() || m_Environment->IsInSimulation()) ?
@@ -280,6 +340,7 @@ private:
 	Vector m_Inertia;
 	int m_HingeHLAxis;
 	bool m_MotionEnabled;
+	bool m_FrozenForPSI;
 	void UpdateMassProps();
 
 	bool m_GravityEnabled;
@@ -326,6 +387,16 @@ private:
 
 	int m_TouchingTriggers;
 
+	CUtlVector<btPersistentManifold *> m_Manifolds;
+	bool m_ManifoldsUnsorted;
+
+	int m_AwakeObjectIndex;
+
+	float m_EnergyBeforeSolver;
+
+	int m_PSICollisionCount;
+	bool m_WasFrozen;
+
 	btTransform m_InterPSIWorldTransform;
 	btVector3 m_InterPSILinearVelocity, m_InterPSIAngularVelocity;
 };
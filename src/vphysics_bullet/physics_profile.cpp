@@ -0,0 +1,175 @@
+// Copyright Valve Corporation, All rights reserved.
+// Bullet integration by Triang3l, derivative work, in public domain if detached from Valve's work.
+
+#include "physics_profile.h"
+#include "tier1/strtools.h"
+
+bool CPhysicsProfile::s_Enabled = false;
+bool CPhysicsProfile::s_TimingEnabled = false;
+bool CPhysicsProfile::s_TraceEnabled = false;
+unsigned int CPhysicsProfile::s_TraceSession = 0;
+
+static ConVar physics_bullet_profile_enable("physics_bullet_profile_enable", "0", 0,
+		"Record how long the phases of every PSI take, for physics_bullet_profile.",
+		CPhysicsProfile::EnableChanged);
+
+static ConVar physics_bullet_trace("physics_bullet_trace", "0", 0,
+		"Record the phases of the recent PSIs as trace events, for physics_bullet_trace_write.",
+		CPhysicsProfile::EnableChanged);
+
+static const char * const s_PhysicsProfilePhaseNames[PHYSICS_PROFILE_PHASE_COUNT] = {
+	"Pre-tick",
+	"Broadphase",
+	"Narrowphase",
+	"Solver",
+	"Integration",
+	"Triggers"
+};
+
+CPhysicsProfile::CPhysicsProfile() :
+		m_TraceEvents(nullptr), m_TraceNext(0), m_TraceCount(0),
+		m_TracePSIBegin(0), m_TracePSISession(0) {
+	Reset();
+}
+
+CPhysicsProfile::~CPhysicsProfile() {
+	if (m_TraceEvents != nullptr) {
+		MemAlloc_Free(m_TraceEvents);
+	}
+}
+
+void CPhysicsProfile::EnableChanged(IConVar *var, const char *oldValue, float oldFloatValue) {
+	s_TimingEnabled = physics_bullet_profile_enable.GetBool();
+	bool traceEnabled = physics_bullet_trace.GetBool();
+	if (traceEnabled && !s_TraceEnabled) {
+		++s_TraceSession;
+	}
+	s_TraceEnabled = traceEnabled;
+	s_Enabled = s_TimingEnabled || s_TraceEnabled;
+}
+
+void CPhysicsProfile::BeginPSI() {
+	if (!s_TraceEnabled) {
+		m_TracePSIBegin = 0;
+		return;
+	}
+	if (m_TraceEvents == nullptr) {
+		m_TraceEvents = reinterpret_cast<TraceEvent_t *>(MemAlloc_Alloc(TRACE_SIZE * sizeof(TraceEvent_t)));
+	}
+	m_TracePSIBegin = CCycleCount::GetTimestamp();
+	m_TracePSISession = s_TraceSession;
+}
+
+bool CPhysicsProfile::IsTracingPSI() const {
+	// Tracing may have been stopped and restarted since the PSI began.
+	return s_TraceEnabled && m_TracePSIBegin != 0 && m_TracePSISession == s_TraceSession;
+}
+
+CPhysicsProfile::TraceEvent_t &CPhysicsProfile::AddTraceEvent(int phase, uint64 begin, uint64 end) {
+	TraceEvent_t &event = m_TraceEvents[m_TraceNext];
+	event.m_Begin = begin;
+	event.m_End = end;
+	event.m_Phase = phase;
+	m_TraceNext = (m_TraceNext + 1) % TRACE_SIZE;
+	m_TraceCount = MIN(m_TraceCount + 1, (int) TRACE_SIZE);
+	return event;
+}
+
+void CPhysicsProfile::AddPhase(PhysicsProfilePhase_t phase, const CCycleCount &begin, const CCycleCount &end) {
+	if (s_TimingEnabled) {
+		CCycleCount time;
+		CCycleCount::Sub(end, begin, time);
+		m_PSITimes[phase] += time;
+	}
+	// Not recording phases of the PSI during which tracing was enabled, as the PSI beginning is unknown.
+	if (IsTracingPSI()) {
+		AddTraceEvent(phase, begin.GetLongCycles(), end.GetLongCycles());
+	}
+}
+
+void CPhysicsProfile::EndPSI(const PSICounts_t &counts) {
+	if (s_TimingEnabled) {
+		for (int phase = 0; phase < PHYSICS_PROFILE_PHASE_COUNT; ++phase) {
+			m_History[phase][m_HistoryNext] = (float) m_PSITimes[phase].GetMicrosecondsF();
+			m_PSITimes[phase].Init();
+		}
+		m_HistoryNext = (m_HistoryNext + 1) % HISTORY_SIZE;
+		m_HistoryCount = MIN(m_HistoryCount + 1, (int) HISTORY_SIZE);
+	}
+	if (IsTracingPSI()) {
+		AddTraceEvent(PHYSICS_PROFILE_PHASE_COUNT, m_TracePSIBegin, CCycleCount::GetTimestamp()).m_Counts = counts;
+	}
+	m_TracePSIBegin = 0;
+}
+
+void CPhysicsProfile::Reset() {
+	for (int phase = 0; phase < PHYSICS_PROFILE_PHASE_COUNT; ++phase) {
+		m_PSITimes[phase].Init();
+	}
+	m_HistoryNext = 0;
+	m_HistoryCount = 0;
+}
+
+void CPhysicsProfile::Print() const {
+	if (m_HistoryCount == 0) {
+		Msg("  No PSIs recorded.\n");
+		return;
+	}
+
+	Msg("  Last %d PSIs, milliseconds, histogram buckets are below %d, %d, ... microseconds:\n",
+			m_HistoryCount, HISTOGRAM_FIRST_BUCKET_MICROSECONDS, HISTOGRAM_FIRST_BUCKET_MICROSECONDS * 2);
+	Msg("  %-12s %8s %8s %8s  histogram\n", "Phase", "Min", "Avg", "Max");
+	for (int phase = 0; phase < PHYSICS_PROFILE_PHASE_COUNT; ++phase) {
+		const float *history = m_History[phase];
+		float minTime = history[0], maxTime = history[0], totalTime = 0.0f;
+		int histogram[HISTOGRAM_BUCKET_COUNT] = {};
+		for (int sampleIndex = 0; sampleIndex < m_HistoryCount; ++sampleIndex) {
+			float time = history[sampleIndex];
+			minTime = MIN(minTime, time);
+			maxTime = MAX(maxTime, time);
+			totalTime += time;
+			int bucket = 0;
+			float bucketEnd = (float) HISTOGRAM_FIRST_BUCKET_MICROSECONDS;
+			while (bucket < HISTOGRAM_BUCKET_COUNT - 1 && time >= bucketEnd) {
+				++bucket;
+				bucketEnd *= 2.0f;
+			}
+			++histogram[bucket];
+		}
+
+		char histogramText[HISTOGRAM_BUCKET_COUNT * 6 + 1];
+		histogramText[0] = '\0';
+		for (int bucket = 0; bucket < HISTOGRAM_BUCKET_COUNT; ++bucket) {
+			V_snprintf(histogramText + V_strlen(histogramText), sizeof(histogramText) - V_strlen(histogramText),
+					" %5d", histogram[bucket]);
+		}
+
+		Msg("  %-12s %8.3f %8.3f %8.3f %s\n", s_PhysicsProfilePhaseNames[phase],
+				minTime * 0.001f, (totalTime / (float) m_HistoryCount) * 0.001f, maxTime * 0.001f, histogramText);
+	}
+}
+
+void CPhysicsProfile::ResetTrace() {
+	m_TraceNext = 0;
+	m_TraceCount = 0;
+}
+
+int CPhysicsProfile::WriteTrace(CUtlBuffer &buffer, int processID, bool separatorNeeded) const {
+	int firstEventIndex = (m_TraceNext - m_TraceCount + TRACE_SIZE) % TRACE_SIZE;
+	for (int eventNumber = 0; eventNumber < m_TraceCount; ++eventNumber) {
+		const TraceEvent_t &event = m_TraceEvents[(firstEventIndex + eventNumber) % TRACE_SIZE];
+		buffer.Printf("%s\n{\"name\":\"%s\",\"cat\":\"physics\",\"ph\":\"X\",\"pid\":%d,\"tid\":0,"
+				"\"ts\":%.3f,\"dur\":%.3f",
+				(separatorNeeded || eventNumber != 0) ? "," : "",
+				event.m_Phase < PHYSICS_PROFILE_PHASE_COUNT ? s_PhysicsProfilePhaseNames[event.m_Phase] : "PSI",
+				processID, CCycleCount(event.m_Begin).GetMicrosecondsF(),
+				CCycleCount(event.m_End - event.m_Begin).GetMicrosecondsF());
+		if (event.m_Phase >= PHYSICS_PROFILE_PHASE_COUNT) {
+			buffer.Printf(",\"args\":{\"objects\":%d,\"awakeObjects\":%d,\"manifolds\":%d,\"constraints\":%d}",
+					event.m_Counts.m_Objects, event.m_Counts.m_AwakeObjects,
+					event.m_Counts.m_Manifolds, event.m_Counts.m_Constraints);
+		}
+		buffer.PutChar('}');
+	}
+	return m_TraceCount;
+}
@@ -0,0 +1,118 @@
+// Copyright Valve Corporation, All rights reserved.
+// Bullet integration by Triang3l, derivative work, in public domain if detached from Valve's work.
+
+#ifndef PHYSICS_PROFILE_H
+#define PHYSICS_PROFILE_H
+
+#include "physics_internal.h"
+#include "tier0/fasttimer.h"
+#include "tier0/vprof.h"
+#include "tier1/convar.h"
+#include "tier1/utlbuffer.h"
+
+enum PhysicsProfilePhase_t {
+	PHYSICS_PROFILE_PRETICK, // PreTickCallback, including game callbacks from controllers.
+	PHYSICS_PROFILE_BROADPHASE,
+	PHYSICS_PROFILE_NARROWPHASE,
+	PHYSICS_PROFILE_SOLVER, // Including building simulation islands.
+	PHYSICS_PROFILE_INTEGRATION,
+	PHYSICS_PROFILE_TRIGGERS, // CheckTriggerTouches.
+
+	PHYSICS_PROFILE_PHASE_COUNT
+};
+
+// Rolling history of how long every phase of the recent PSIs of an environment took.
+// Gathered only while physics_bullet_profile_enable is on, and printed by physics_bullet_profile.
+// While physics_bullet_trace is on, also records every phase of every PSI as a trace event,
+// which physics_bullet_trace_write exports in the Chrome trace format.
+class CPhysicsProfile {
+public:
+	CPhysicsProfile();
+	~CPhysicsProfile();
+
+	static FORCEINLINE bool IsEnabled() { return s_Enabled; }
+	static FORCEINLINE bool IsTimingEnabled() { return s_TimingEnabled; }
+	static FORCEINLINE bool IsTraceEnabled() { return s_TraceEnabled; }
+	// physics_bullet_profile_enable and physics_bullet_trace change callback.
+	static void EnableChanged(IConVar *var, const char *oldValue, float oldFloatValue);
+
+	// What the environment was simulating during the PSI, written to the trace.
+	struct PSICounts_t {
+		int m_Objects, m_AwakeObjects;
+		int m_Manifolds, m_Constraints;
+	};
+
+	void BeginPSI();
+	void AddPhase(PhysicsProfilePhase_t phase, const CCycleCount &begin, const CCycleCount &end);
+	// Moves the times of the phases of the current PSI to the history.
+	void EndPSI(const PSICounts_t &counts);
+
+	void Reset();
+	void Print() const;
+
+	void ResetTrace();
+	// Writes the recorded events as elements of the traceEvents JSON array, returns the number of them.
+	int WriteTrace(CUtlBuffer &buffer, int processID, bool separatorNeeded) const;
+
+private:
+	static bool s_Enabled, s_TimingEnabled, s_TraceEnabled;
+	// Incremented whenever physics_bullet_trace is turned on, so a PSI begun in an earlier tracing session
+	// isn't recorded as if it started long before tracing was restarted.
+	static unsigned int s_TraceSession;
+
+	CCycleCount m_PSITimes[PHYSICS_PROFILE_PHASE_COUNT];
+
+	enum {
+		HISTORY_SIZE = 1024,
+		// Buckets for times below 16, 32, ..., 16384 microseconds, and for longer ones.
+		HISTOGRAM_FIRST_BUCKET_MICROSECONDS = 16,
+		HISTOGRAM_BUCKET_COUNT = 12
+	};
+	// Microseconds per phase, HISTORY_SIZE last PSIs.
+	float m_History[PHYSICS_PROFILE_PHASE_COUNT][HISTORY_SIZE];
+	int m_HistoryNext, m_HistoryCount;
+
+	struct TraceEvent_t {
+		uint64 m_Begin, m_End; // Cycles.
+		int m_Phase; // PHYSICS_PROFILE_PHASE_COUNT for the whole PSI.
+		PSICounts_t m_Counts; // Only for the whole PSI.
+	};
+	enum { TRACE_SIZE = 32768 };
+	// Allocated once when tracing starts, the oldest events are overwritten when it's full.
+	TraceEvent_t *m_TraceEvents;
+	int m_TraceNext, m_TraceCount;
+	uint64 m_TracePSIBegin; // 0 if the current PSI is not being traced.
+	unsigned int m_TracePSISession;
+	bool IsTracingPSI() const;
+	TraceEvent_t &AddTraceEvent(int phase, uint64 begin, uint64 end);
+};
+
+class CPhysicsProfileScope {
+public:
+	FORCEINLINE CPhysicsProfileScope(CPhysicsProfile &profile, PhysicsProfilePhase_t phase) : m_Profile(nullptr) {
+		if (CPhysicsProfile::IsEnabled()) {
+			m_Profile = &profile;
+			m_Phase = phase;
+			m_Begin.Sample();
+		}
+	}
+	FORCEINLINE ~CPhysicsProfileScope() {
+		if (m_Profile != nullptr) {
+			CCycleCount end;
+			end.Sample();
+			m_Profile->AddPhase(m_Phase, m_Begin, end);
+		}
+	}
+
+private:
+	CPhysicsProfile *m_Profile;
+	PhysicsProfilePhase_t m_Phase;
+	CCycleCount m_Begin;
+};
+
+// Times the rest of the scope both for physics_bullet_profile and for the engine's VProf.
+#define PHYSICS_PROFILE_SCOPE(profile, phase, vprofName) \
+	VPROF_BUDGET(vprofName, VPROF_BUDGETGROUP_PHYSICS); \
+	CPhysicsProfileScope physicsProfileScope(profile, phase)
+
+#endif
@@ -215,22 +215,14 @@ void CPhysicsPlayerController::SetEventHandler(IPhysicsPlayerControllerEvent *ha
 bool CPhysicsPlayerController::IsInContact() {
 	const CPhysicsObject *object = static_cast<const CPhysicsObject *>(m_Object);
 	const btCollisionObject *collisionObject = object->GetRigidBody();
-	const btCollisionDispatcher *dispatcher = static_cast<const CPhysicsEnvironment *>(
-			object->GetEnvironment())->GetCollisionDispatcher();
-	int manifoldCount = dispatcher->getNumManifolds();
+	int manifoldCount = object->GetManifoldCount();
 	for (int manifoldIndex = 0; manifoldIndex < manifoldCount; ++manifoldIndex) {
-		const btPersistentManifold *manifold = dispatcher->getManifoldByIndexInternal(manifoldIndex);
+		const btPersistentManifold *manifold = object->GetManifold(manifoldIndex);
 		if (manifold->getNumContacts() == 0) {
 			continue;
 		}
-		const btCollisionObject *otherCollisionObject;
-		if (manifold->getBody0() == collisionObject) {
-			otherCollisionObject = manifold->getBody1();
-		} else if (manifold->getBody1() == collisionObject) {
-			otherCollisionObject = manifold->getBody0();
-		} else {
-			continue;
-		}
+		const btCollisionObject *otherCollisionObject = (manifold->getBody0() == collisionObject ?
+				manifold->getBody1() : manifold->getBody0());
 		if (!otherCollisionObject->hasContactResponse()) {
 			continue;
 		}
@@ -346,9 +338,8 @@ float CPhysicsPlayerController::GetPushSpeedLimit() {
 }
 
 bool CPhysicsPlayerController::WasFrozen() {
-	// Not freezing anything.
-	// TODO: If freezing is ever added somehow, make this do the correct check.
-	return false;
+	// Frozen by the environment for exceeding maxCollisionsPerObjectPerTimestep.
+	return static_cast<CPhysicsObject *>(m_Object)->TakeWasFrozen();
 }
 
 void CPhysicsPlayerController::Simulate(btScalar timeStep) {
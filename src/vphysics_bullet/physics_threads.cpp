@@ -0,0 +1,240 @@
+// Copyright Valve Corporation, All rights reserved.
+// Bullet integration by Triang3l, derivative work, in public domain if detached from Valve's work.
+
+#include "physics_threads.h"
+#include "tier0/platform.h"
+#include "tier1/convar.h"
+
+static ConVar physics_bullet_threads("physics_bullet_threads", "0", 0,
+		"Number of worker threads used for parallel physics work in addition to the main thread. "
+		"0 disables threading, -1 uses one worker per logical processor other than the main one's.",
+		true, -1.0f, true, 31.0f);
+
+CPhysicsThreadPool g_PhysicsThreadPool;
+
+CPhysicsThreadPool::CPhysicsThreadPool() : m_Exiting(false) {}
+
+CPhysicsThreadPool::~CPhysicsThreadPool() {
+	Shutdown();
+}
+
+void CPhysicsThreadPool::Shutdown() {
+	StopThreads();
+}
+
+void CPhysicsThreadPool::UpdateThreadCount() {
+	int threadCount = physics_bullet_threads.GetInt();
+	if (threadCount < 0) {
+		threadCount = GetCPUInformation()->m_nLogicalProcessors - 1;
+	}
+	// Bullet thread indices, including the main thread's, must be below BT_MAX_THREAD_COUNT.
+	threadCount = clamp(threadCount, 0, BT_MAX_THREAD_COUNT - 1);
+	if (threadCount != MAX(m_Slots.Count() - 1, 0)) {
+		StopThreads();
+		StartThreads(threadCount);
+	}
+}
+
+void CPhysicsThreadPool::StartThreads(int threadCount) {
+	Assert(m_Slots.Count() == 0);
+	if (threadCount <= 0) {
+		return;
+	}
+	m_Exiting = false;
+	// Slot 0 is the thread calling ParallelFor.
+	for (int slotIndex = 0; slotIndex <= threadCount; ++slotIndex) {
+		Slot_t *slot = VPhysicsNew(Slot_t);
+		slot->m_Pool = this;
+		slot->m_Index = slotIndex;
+		slot->m_Thread = nullptr;
+		slot->m_EndChunk = 0;
+		m_Slots.AddToTail(slot);
+	}
+	for (int slotIndex = 1; slotIndex <= threadCount; ++slotIndex) {
+		Slot_t *slot = m_Slots[slotIndex];
+		slot->m_Thread = CreateSimpleThread(WorkerThread, slot);
+	}
+}
+
+void CPhysicsThreadPool::StopThreads() {
+	int slotCount = m_Slots.Count();
+	if (slotCount == 0) {
+		return;
+	}
+	m_Exiting = true;
+	for (int slotIndex = 1; slotIndex < slotCount; ++slotIndex) {
+		m_Slots[slotIndex]->m_WakeEvent.Set();
+	}
+	for (int slotIndex = 0; slotIndex < slotCount; ++slotIndex) {
+		Slot_t *slot = m_Slots[slotIndex];
+		if (slot->m_Thread != nullptr) {
+			ThreadJoin(slot->m_Thread);
+			ReleaseThreadHandle(slot->m_Thread);
+		}
+		VPhysicsDelete(Slot_t, slot);
+	}
+	m_Slots.RemoveAll();
+	m_Exiting = false;
+	// Let new threads reuse the Bullet thread indices, which are limited to BT_MAX_THREAD_COUNT.
+	btResetThreadIndexCounter();
+}
+
+unsigned CPhysicsThreadPool::WorkerThread(void *parameter) {
+	Slot_t *slot = reinterpret_cast<Slot_t *>(parameter);
+	CPhysicsThreadPool *pool = slot->m_Pool;
+	ThreadSetDebugName("VPhysics worker");
+	for (;;) {
+		slot->m_WakeEvent.Wait();
+		if (pool->m_Exiting) {
+			break;
+		}
+		pool->RunChunks(slot->m_Index);
+		if (--pool->m_PendingThreads == 0) {
+			pool->m_DoneEvent.Set();
+		}
+	}
+	return 0;
+}
+
+void CPhysicsThreadPool::RunChunks(int slotIndex) {
+	int slotCount = m_Slots.Count();
+	// Own chunks first, then steal from the next slots.
+	for (int slotOffset = 0; slotOffset < slotCount; ++slotOffset) {
+		Slot_t *slot = m_Slots[(slotIndex + slotOffset) % slotCount];
+		for (;;) {
+			int chunk = ++slot->m_NextChunk - 1;
+			if (chunk >= slot->m_EndChunk) {
+				break;
+			}
+			int begin = chunk * m_JobGrainSize;
+			m_JobFunction(m_JobContext, begin, MIN(begin + m_JobGrainSize, m_JobCount));
+		}
+	}
+}
+
+void CPhysicsThreadPool::ParallelFor(int count, int grainSize, RangeFunction_t function, void *context) {
+	if (count <= 0) {
+		return;
+	}
+	grainSize = MAX(grainSize, 1);
+
+	if (!m_Busy.AssignIf(0, 1)) {
+		function(context, 0, count);
+		return;
+	}
+
+	UpdateThreadCount();
+	int slotCount = m_Slots.Count();
+	int chunkCount = (count + grainSize - 1) / grainSize;
+	if (slotCount <= 1 || chunkCount <= 1) {
+		function(context, 0, count);
+		m_Busy = 0;
+		return;
+	}
+
+	m_JobFunction = function;
+	m_JobContext = context;
+	m_JobCount = count;
+	m_JobGrainSize = grainSize;
+	int chunksPerSlot = chunkCount / slotCount, extraChunks = chunkCount % slotCount;
+	int firstChunk = 0;
+	for (int slotIndex = 0; slotIndex < slotCount; ++slotIndex) {
+		Slot_t *slot = m_Slots[slotIndex];
+		int slotChunkCount = chunksPerSlot + (slotIndex < extraChunks ? 1 : 0);
+		slot->m_NextChunk = firstChunk;
+		slot->m_EndChunk = firstChunk + slotChunkCount;
+		firstChunk += slotChunkCount;
+	}
+
+	m_PendingThreads = slotCount - 1;
+	ThreadMemoryBarrier();
+	for (int slotIndex = 1; slotIndex < slotCount; ++slotIndex) {
+		m_Slots[slotIndex]->m_WakeEvent.Set();
+	}
+	RunChunks(0);
+	// All chunks are claimed at this point, only waiting for the ones still being processed.
+	// There's at least one worker thread, and the last one always sets the event, so it's never left set.
+	m_DoneEvent.Wait();
+
+	m_Busy = 0;
+}
+
+/****
+ * Bullet task scheduler
+ ****/
+
+CPhysicsTaskScheduler g_PhysicsTaskScheduler;
+
+void CPhysicsTaskScheduler::Install() {
+	if (btGetTaskScheduler() != this) {
+		btSetTaskScheduler(this);
+	}
+}
+
+void CPhysicsTaskScheduler::Uninstall() {
+	if (btGetTaskScheduler() == this) {
+		btSetTaskScheduler(btGetSequentialTaskScheduler());
+	}
+}
+
+int CPhysicsTaskScheduler::getMaxNumThreads() const {
+	return BT_MAX_THREAD_COUNT;
+}
+
+int CPhysicsTaskScheduler::getNumThreads() const {
+	// Bullet sizes per-thread arrays with this and indexes them with btGetCurrentThreadIndex,
+	// which may be above the current pool size if the pool has been restarted with more threads.
+	return BT_MAX_THREAD_COUNT;
+}
+
+void CPhysicsTaskScheduler::ForRange(void *context, int begin, int end) {
+	const ForJob_t *job = reinterpret_cast<const ForJob_t *>(context);
+	job->m_Body->forLoop(job->m_Begin + begin, job->m_Begin + end);
+}
+
+void CPhysicsTaskScheduler::parallelFor(int iBegin, int iEnd, int grainSize, const btIParallelForBody &body) {
+	ForJob_t job;
+	job.m_Body = &body;
+	job.m_Begin = iBegin;
+	g_PhysicsThreadPool.ParallelFor(iEnd - iBegin, grainSize, ForRange, &job);
+}
+
+void CPhysicsTaskScheduler::SumRange(void *context, int begin, int end) {
+	const SumJob_t *job = reinterpret_cast<const SumJob_t *>(context);
+	job->m_ChunkSums[begin / job->m_GrainSize] = job->m_Body->sumLoop(job->m_Begin + begin, job->m_Begin + end);
+}
+
+btScalar CPhysicsTaskScheduler::parallelSum(int iBegin, int iEnd, int grainSize, const btIParallelSumBody &body) {
+	int count = iEnd - iBegin;
+	if (count <= 0) {
+		return btScalar(0.0f);
+	}
+	grainSize = MAX(grainSize, 1);
+	int chunkCount = (count + grainSize - 1) / grainSize;
+	btScalar sum = btScalar(0.0f);
+	if (!m_ChunkSumsBusy.AssignIf(0, 1)) {
+		// Same chunks in the same order as in parallel, for the same result.
+		for (int chunkBegin = iBegin; chunkBegin < iEnd; chunkBegin += grainSize) {
+			sum += body.sumLoop(chunkBegin, MIN(chunkBegin + grainSize, iEnd));
+		}
+		return sum;
+	}
+	if (m_ChunkSums.Count() < chunkCount) {
+		m_ChunkSums.SetCount(chunkCount);
+	}
+	// Chunks not written to separately if the job has been run serially.
+	for (int chunkIndex = 0; chunkIndex < chunkCount; ++chunkIndex) {
+		m_ChunkSums[chunkIndex] = btScalar(0.0f);
+	}
+	SumJob_t job;
+	job.m_Body = &body;
+	job.m_Begin = iBegin;
+	job.m_GrainSize = grainSize;
+	job.m_ChunkSums = m_ChunkSums.Base();
+	g_PhysicsThreadPool.ParallelFor(count, grainSize, SumRange, &job);
+	for (int chunkIndex = 0; chunkIndex < chunkCount; ++chunkIndex) {
+		sum += m_ChunkSums[chunkIndex];
+	}
+	m_ChunkSumsBusy = 0;
+	return sum;
+}
@@ -0,0 +1,99 @@
+// Copyright Valve Corporation, All rights reserved.
+// Bullet integration by Triang3l, derivative work, in public domain if detached from Valve's work.
+
+#ifndef PHYSICS_THREADS_H
+#define PHYSICS_THREADS_H
+
+#include "physics_internal.h"
+#include "tier0/threadtools.h"
+#include "tier1/utlvector.h"
+#include <LinearMath/btThreads.h>
+
+// Pool of worker threads for splitting independent per-element work.
+// Each thread owns a contiguous range of chunks and, after finishing it, steals chunks from the others.
+class CPhysicsThreadPool {
+public:
+	typedef void (*RangeFunction_t)(void *context, int begin, int end);
+
+	CPhysicsThreadPool();
+	~CPhysicsThreadPool();
+
+	// Number of threads that ParallelFor may use, including the calling one.
+	FORCEINLINE int GetThreadCount() const { return MAX(m_Slots.Count(), 1); }
+
+	// Calls function for all elements in [0, count) in chunks of up to grainSize elements, and waits for completion.
+	// If the pool is disabled or already running a job (nested or from another thread), runs serially instead.
+	void ParallelFor(int count, int grainSize, RangeFunction_t function, void *context);
+
+	void Shutdown();
+
+private:
+	struct Slot_t {
+		CPhysicsThreadPool *m_Pool;
+		int m_Index;
+		ThreadHandle_t m_Thread; // Null for the calling thread.
+		CThreadEvent m_WakeEvent;
+		// Chunks [m_NextChunk, m_EndChunk) of the current job initially belonging to this slot.
+		CInterlockedInt m_NextChunk;
+		int m_EndChunk;
+	};
+	CUtlVector<Slot_t *> m_Slots;
+	static unsigned WorkerThread(void *parameter);
+	void UpdateThreadCount();
+	void StartThreads(int threadCount);
+	void StopThreads();
+
+	CInterlockedInt m_Busy;
+	volatile bool m_Exiting;
+
+	// Current job.
+	RangeFunction_t m_JobFunction;
+	void *m_JobContext;
+	int m_JobCount, m_JobGrainSize;
+	CInterlockedInt m_PendingThreads;
+	// Set by the last worker thread to finish the job.
+	CThreadEvent m_DoneEvent;
+	void RunChunks(int slotIndex);
+};
+
+extern CPhysicsThreadPool g_PhysicsThreadPool;
+
+// Runs parallel loops of the multithreaded Bullet world on g_PhysicsThreadPool.
+// The thread count is controlled by physics_bullet_threads rather than setNumThreads.
+class CPhysicsTaskScheduler : public btITaskScheduler {
+public:
+	CPhysicsTaskScheduler() : btITaskScheduler("VPhysics") {}
+
+	// Makes this the Bullet task scheduler, must be called from the main thread.
+	void Install();
+	void Uninstall();
+
+	virtual int getMaxNumThreads() const;
+	virtual int getNumThreads() const;
+	virtual void setNumThreads(int numThreads) {}
+	virtual void parallelFor(int iBegin, int iEnd, int grainSize, const btIParallelForBody &body);
+	virtual btScalar parallelSum(int iBegin, int iEnd, int grainSize, const btIParallelSumBody &body);
+
+private:
+	struct ForJob_t {
+		const btIParallelForBody *m_Body;
+		int m_Begin;
+	};
+	static void ForRange(void *context, int begin, int end);
+
+	struct SumJob_t {
+		const btIParallelSumBody *m_Body;
+		int m_Begin, m_GrainSize;
+		// Per-chunk sums, added in order afterwards for the result not to depend on thread timing.
+		btScalar *m_ChunkSums;
+	};
+	static void SumRange(void *context, int begin, int end);
+	// Reused by parallelSum, which the MT solver calls several times per iteration, only grows.
+	CUtlVector<btScalar> m_ChunkSums;
+	// Owning m_ChunkSums, parallelSum calls from other threads meanwhile add the chunks serially instead.
+	CInterlockedInt m_ChunkSumsBusy;
+};
+
+extern CPhysicsTaskScheduler g_PhysicsTaskScheduler;
+
+#endif